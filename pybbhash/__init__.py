@@ -8,6 +8,8 @@ Modules:
 - bitvector: bit array with rank support
 - hashfunctors: simple hash functors used by boophf
 - boophf: single-threaded MPH builder (BooPHF-like)
+- fileformat: v2 file layout (header, table of contents, aligned sections)
+- _native: optional compiled backend wrapping the C++ BooPHF (used automatically when built)
 
 Usage example:
     from pybbhash import boophf
@@ -22,13 +24,25 @@ __author__ = "pybbhash contributors"
 __license__ = "MIT"
 
 from .bitvector import bitvector
-from .boophf import mphf
-from .hashfunctors import XorshiftHashFunctors, SingleHashFunctor
+from .boophf import mphf, mphf_builder, native_available, overlay_mphf, packed_keys, sharded_mphf, static_map
+from .hashfunctors import (HASHERS, Crc32cHashFunctor, Key128HashFunctor, SingleHashFunctor, WyMixHashFunctor,
+                           XorshiftHashFunctors, murmur3_128)
 
 __all__ = [
     "bitvector",
     "mphf",
+    "mphf_builder",
+    "native_available",
+    "sharded_mphf",
+    "overlay_mphf",
+    "static_map",
+    "packed_keys",
     "XorshiftHashFunctors",
     "SingleHashFunctor",
+    "WyMixHashFunctor",
+    "Crc32cHashFunctor",
+    "Key128HashFunctor",
+    "murmur3_128",
+    "HASHERS",
     "__version__",
 ]
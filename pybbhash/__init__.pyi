@@ -1,11 +1,15 @@
 ﻿# Python type stub file for pybbhash
-from typing import Iterable, Dict, List, Optional, Union
+from typing import Any, Callable, Iterable, Dict, List, Optional, Tuple, Union
+from concurrent.futures import Future
 from pathlib import Path
 
 __version__: str
 __author__: str
 __license__: str
 
+# receives {done, total, level, seconds, finished}
+ProgressCallback = Callable[[Dict[str, Any]], None]
+
 class bitvector:
     def __init__(self, size: int) -> None: ...
     def get(self, i: int) -> bool: ...
@@ -18,6 +22,31 @@ class SingleHashFunctor:
     def __init__(self) -> None: ...
     def __call__(self, key: int) -> int: ...
 
+class WyMixHashFunctor:
+    def __init__(self) -> None: ...
+    def __call__(self, key: int, seed: int = ...) -> int: ...
+
+class Crc32cHashFunctor:
+    def __init__(self) -> None: ...
+    def __call__(self, key: int, seed: int = ...) -> int: ...
+
+class Key128HashFunctor:
+    def __init__(self) -> None: ...
+    def __call__(self, key: int, seed: int = ...) -> int: ...
+
+def murmur3_128(data: bytes, seed: int = 0) -> Tuple[int, int]: ...
+
+HASHERS: tuple
+
+class packed_keys:
+    offsets: Any
+    data: Any
+    def __init__(self, offsets: Any, data: Any) -> None: ...
+    @classmethod
+    def from_keys(cls, keys: Iterable[Union[str, bytes]]) -> packed_keys: ...
+    def __len__(self) -> int: ...
+    def __iter__(self) -> Any: ...
+
 class XorshiftHashFunctors:
     def __init__(self, base: SingleHashFunctor) -> None: ...
     def h0(self, state: List[int], key: int) -> int: ...
@@ -35,17 +64,149 @@ class mphf:
     def __init__(
         self,
         n: int = 0,
-        input_range: Optional[Iterable[int]] = None,
+        input_range: Optional[Union[Iterable[int], List[Union[str, bytes]], packed_keys]] = None,
         num_thread: int = 1,
         gamma: float = 2.0,
         writeEach: bool = False,
-        progress: bool = False,
+        progress: Union[bool, ProgressCallback] = False,
         perc_elem_loaded: float = 0.03,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+        tmp_dir: Optional[Union[str, Path]] = None,
+        hasher: str = "hash64",
+        fingerprint_bits: int = 0,
+        progress_interval: float = 1.0,
+        gamma_schedule: Optional[Iterable[float]] = None,
+        min_level_keys: int = 0,
+        max_levels: int = 25,
     ) -> None: ...
+    @property
+    def level_domains(self) -> List[int]: ...
+    @property
+    def fingerprint_bits(self) -> int: ...
+    def lookup(self, elem: Union[int, str, bytes]) -> int: ...
+    def lookup_many(self, keys: Any, out: Any = None, num_thread: Optional[int] = None, numa_replicas: bool = False) -> Any: ...
+    def nbKeys(self) -> int: ...
+    def totalBitSize(self) -> int: ...
+    def build_stats(self) -> Dict[str, Any]: ...
+    @property
+    def rank_layout(self) -> str: ...
+    def set_rank_layout(self, layout: str) -> None: ...
+    def build_hot_cache(self, sample: Any, slots: int = 4096, min_level: int = 2) -> None: ...
+    def clear_hot_cache(self) -> None: ...
+    def hot_cache_stats(self) -> Dict[str, int]: ...
+    def save_hot_cache(self, fpath: Union[str, Path]) -> None: ...
+    def save(self, path: Union[str, Path], version: int = 1, checksum: bool = True, num_thread: int = 1) -> None: ...
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None, num_thread: int = 1) -> mphf: ...
+    @staticmethod
+    def mmap(fpath: Union[str, Path], backend: Optional[str] = None, verify: bool = False) -> mphf: ...
+
+class mphf_builder:
+    def __init__(
+        self,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        progress: Union[bool, ProgressCallback] = False,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+        spool: str = "memory",
+        tmp_dir: Optional[Union[str, Path]] = None,
+        hasher: str = "hash64",
+        fingerprint_bits: int = 0,
+        progress_interval: float = 1.0,
+    ) -> None: ...
+    def __len__(self) -> int: ...
+    def add_batch(self, keys: Any) -> None: ...
+    def finalize(self) -> mphf: ...
+
+class sharded_mphf:
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        nb_shards: Optional[int] = None,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        perc_elem_loaded: float = 1.0,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ) -> None: ...
+    @staticmethod
+    def shard_of(key: int, nb_shards: int) -> int: ...
+    @property
+    def nb_shards(self) -> int: ...
+    def lookup(self, elem: int) -> int: ...
+    def lookup_many(self, keys: Any, out: Any = None) -> Any: ...
+    def nbKeys(self) -> int: ...
+    def totalBitSize(self) -> int: ...
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None: ...
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> sharded_mphf: ...
+    @staticmethod
+    def merge(shard_paths: List[Optional[Union[str, Path]]], fpath: Union[str, Path]) -> None: ...
+
+class overlay_mphf:
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        fingerprint_bits: int = 8,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ) -> None: ...
+    def append(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> None: ...
+    def compact(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> overlay_mphf: ...
+    def compact_async(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> Future[overlay_mphf]: ...
+    def should_compact(self, max_deltas: int = 8, max_delta_fraction: float = 0.25) -> bool: ...
+    @property
+    def nb_segments(self) -> int: ...
+    @property
+    def nb_overrides(self) -> int: ...
+    @property
+    def base_keys(self) -> int: ...
+    @property
+    def fingerprint_bits(self) -> int: ...
     def lookup(self, elem: int) -> int: ...
+    def lookup_many(self, keys: Any, out: Any = None) -> Any: ...
     def nbKeys(self) -> int: ...
-    def save(self, path: Union[str, Path]) -> None: ...
+    def totalBitSize(self) -> int: ...
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None: ...
     @staticmethod
-    def load(fpath: Union[str, Path]) -> mphf: ...
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> overlay_mphf: ...
+
+def native_available() -> bool: ...
 
 __all__: List[str]
+
+class static_map:
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        values: Optional[Iterable[int]] = None,
+        value_bits: Optional[int] = None,
+        fingerprint_bits: int = 0,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ) -> None: ...
+    def get(self, key: int, default: Optional[int] = None) -> Optional[int]: ...
+    def __getitem__(self, key: int) -> int: ...
+    def __contains__(self, key: int) -> bool: ...
+    def __len__(self) -> int: ...
+    def get_many(self, keys: Any, out: Any = None, default: int = 0) -> Any: ...
+    @property
+    def value_bits(self) -> int: ...
+    @property
+    def fingerprint_bits(self) -> int: ...
+    def nbKeys(self) -> int: ...
+    def totalBitSize(self) -> int: ...
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None: ...
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> static_map: ...
+    @staticmethod
+    def mmap(fpath: Union[str, Path], backend: Optional[str] = None, verify: bool = False) -> static_map: ...
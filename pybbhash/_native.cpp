@@ -0,0 +1,2607 @@
+﻿// Native backend for pybbhash.
+// Thin CPython wrapper around boomphf::mphf<uint64_t, SingleHasher_t> (one instantiation per MPHF_HASHER_* id)
+// and boomphf::sharded_mphf / overlay_mphf / static_map over uint64_t keys with SingleHashFunctor<uint64_t>
+// from BooPHF.h, used automatically by pybbhash.boophf.mphf / sharded_mphf / overlay_mphf / static_map when the extension is built.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "BooPHF.h"
+
+// one boomphf::mphf instantiation per hasher, behind a common interface
+// string mphf (MPHF_HASHER_KEY128) take the lookupBytes / lookupPacked lookups, the others the uint64 ones
+class native_mphf
+{
+  public:
+	virtual ~native_mphf() = default;
+	virtual uint32_t hasherId() const = 0;
+	virtual bool stringKeys() const = 0;
+	virtual uint64_t lookup(uint64_t key) const = 0;
+	virtual void lookup(const uint64_t* keys, size_t nkeys, uint64_t* out) const = 0;
+	// on a lookup_pool kept until the thread count or numa_replicas change (or the mphf does)
+	virtual void lookup(const uint64_t* keys, size_t nkeys, uint64_t* out, int num_thread, bool numa_replicas) = 0;
+	virtual uint64_t lookupBytes(const char* data, size_t len) const = 0;
+	// key ii is data[offsets[ii], offsets[ii + 1])
+	virtual void lookupPacked(const uint64_t* offsets, const char* data, size_t nkeys, uint64_t* out) const = 0;
+	virtual uint64_t nbKeys() const = 0;
+	virtual uint64_t totalBitSize() = 0;
+	virtual boomphf::mphf_build_stats buildStats() const = 0;
+	virtual const boomphf::final_table<uint64_t>& finalHash() const = 0;
+	virtual void save(std::ostream& os, uint32_t version, bool checksum) const = 0;
+	virtual void load(std::istream& is) = 0;
+	virtual void saveFile(const std::string& path, uint32_t version, bool checksum, int num_thread) const = 0;
+	virtual void loadFile(const std::string& path, int num_thread) = 0;
+	virtual void map(const std::string& path, bool verify) = 0;
+	virtual double gamma() const = 0;
+	virtual uint32_t nbLevels() const = 0;
+	virtual uint64_t levelDomain(uint32_t ii) const = 0;
+	virtual bool scheduled() const = 0;
+	virtual uint64_t lastBitsetRank() const = 0;
+	virtual bool built() const = 0;
+	virtual boomphf::mphf_reduction reduction() const = 0;
+	virtual rank_layout rankLayout() const = 0;
+	virtual void setRankLayout(rank_layout layout) = 0;
+	virtual uint32_t fingerprintBits() const = 0;
+	// fingerprints from the build keys, of the key kind of this mphf
+	virtual void addFingerprints(const std::vector<uint64_t>& keys, uint32_t bits, int num_thread) = 0;
+	virtual void addFingerprints(const boomphf::file_binary<uint64_t>& keys, uint32_t bits, int num_thread) = 0;
+	virtual void addFingerprints(const std::vector<boomphf::hash_pair_t>& keys, uint32_t bits, int num_thread) = 0;
+	// hot key cache, built from keys of the kind of stringKeys()
+	virtual void buildHotCache(const uint64_t* keys, size_t nkeys, uint64_t nslots, uint32_t min_level) = 0;
+	virtual void buildHotCachePacked(const uint64_t* offsets, const char* data, size_t nkeys, uint64_t nslots, uint32_t min_level) = 0;
+	virtual void saveHotCache(std::ostream& os) const = 0;
+	virtual bool loadHotCache(std::istream& is) = 0;
+	virtual void clearHotCache() = 0;
+	virtual uint64_t hotCacheSlots() const = 0;
+	virtual uint64_t hotCacheFilled() const = 0;
+	virtual uint32_t hotCacheMinLevel() const = 0;
+};
+
+template <typename SingleHasher_t, typename elem_t = uint64_t>
+class native_mphf_impl final : public native_mphf
+{
+  public:
+	// forwards to the boomphf::mphf constructors
+	template <typename... Args>
+	explicit native_mphf_impl(Args&&... args) : _m(std::forward<Args>(args)...)
+	{
+	}
+
+	uint32_t hasherId() const override { return boomphf::mphf_hasher_id<SingleHasher_t>::value; }
+	bool stringKeys() const override { return std::is_same<elem_t, boomphf::hash_pair_t>::value; }
+
+	// the lookups of the other key kind are never called (stringKeys() is checked first).
+	// Lookups run without the GIL : they hold _rw shared, the calls that change the levels or the hot cache hold it exclusive
+	uint64_t lookup(uint64_t key) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+			return _m.lookup(key);
+		return ULLONG_MAX;
+	}
+
+	void lookup(const uint64_t* keys, size_t nkeys, uint64_t* out) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+			_m.lookup(keys, nkeys, out);
+	}
+
+	void lookup(const uint64_t* keys, size_t nkeys, uint64_t* out, int num_thread, bool numa_replicas) override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+		{
+			if (num_thread <= 1 && !numa_replicas)
+			{
+				_m.lookup(keys, nkeys, out);
+				return;
+			}
+			std::lock_guard<std::mutex> lock(_pool_mutex);
+			if (!_pool || _pool->nbThreads() != num_thread || _pool_numa != numa_replicas)
+			{
+				_pool.reset();
+				_pool.reset(new boomphf::lookup_pool<mphf_t>(_m, num_thread, numa_replicas));
+				_pool_numa = numa_replicas;
+			}
+			_pool->lookup(keys, nkeys, out);
+		}
+	}
+
+	uint64_t lookupBytes(const char* data, size_t len) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		if constexpr (std::is_same<elem_t, boomphf::hash_pair_t>::value)
+			return _m.lookup(boomphf::murmur3_128(data, len));
+		return ULLONG_MAX;
+	}
+
+	// hashed by blocks, batched lookup of each block
+	void lookupPacked(const uint64_t* offsets, const char* data, size_t nkeys, uint64_t* out) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		if constexpr (std::is_same<elem_t, boomphf::hash_pair_t>::value)
+		{
+			boomphf::hash_pair_t hashed[256];
+			for (size_t start = 0; start < nkeys; start += 256)
+			{
+				size_t nb = std::min<size_t>(256, nkeys - start);
+				for (size_t ii = 0; ii < nb; ii++)
+					hashed[ii] = boomphf::murmur3_128(data + offsets[start + ii], offsets[start + ii + 1] - offsets[start + ii]);
+				_m.lookup(hashed, nb, out + start);
+			}
+		}
+	}
+	uint64_t nbKeys() const override { return _m.nbKeys(); }
+	uint64_t totalBitSize() override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		return _m.totalBitSize();
+	}
+	boomphf::mphf_build_stats buildStats() const override { return _m.build_stats(); }
+	const boomphf::final_table<uint64_t>& finalHash() const override { return _m.finalHash(); }
+	void save(std::ostream& os, uint32_t version, bool checksum) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		_m.save(os, version, checksum);
+	}
+	void load(std::istream& is) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		_m.load(is);
+	}
+	void saveFile(const std::string& path, uint32_t version, bool checksum, int num_thread) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		_m.save(path, version, checksum, num_thread);
+	}
+	void loadFile(const std::string& path, int num_thread) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		_m.load(path, num_thread);
+	}
+	void map(const std::string& path, bool verify) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		_m.map(path, verify);
+	}
+	double gamma() const override { return _m.gamma(); }
+	uint32_t nbLevels() const override { return _m.nbLevels(); }
+	uint64_t levelDomain(uint32_t ii) const override { return _m.levelDomain(ii); }
+	bool scheduled() const override { return _m.scheduled(); }
+	uint64_t lastBitsetRank() const override { return _m.lastBitsetRank(); }
+	bool built() const override { return _m.built(); }
+	boomphf::mphf_reduction reduction() const override { return _m.reduction(); }
+	rank_layout rankLayout() const override { return _m.rankLayout(); }
+	void setRankLayout(rank_layout layout) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		_m.setRankLayout(layout);
+	}
+	uint32_t fingerprintBits() const override { return _m.fingerprintBits(); }
+
+	void addFingerprints(const std::vector<uint64_t>& keys, uint32_t bits, int num_thread) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+			_m.addFingerprints(keys, bits, num_thread);
+	}
+
+	void addFingerprints(const boomphf::file_binary<uint64_t>& keys, uint32_t bits, int num_thread) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+			_m.addFingerprints(keys, bits, num_thread);
+	}
+
+	void addFingerprints(const std::vector<boomphf::hash_pair_t>& keys, uint32_t bits, int num_thread) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		if constexpr (std::is_same<elem_t, boomphf::hash_pair_t>::value)
+			_m.addFingerprints(keys, bits, num_thread);
+	}
+
+	void buildHotCache(const uint64_t* keys, size_t nkeys, uint64_t nslots, uint32_t min_level) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		if constexpr (std::is_same<elem_t, uint64_t>::value)
+			_m.buildHotCache(keys, nkeys, nslots, min_level);
+	}
+
+	void buildHotCachePacked(const uint64_t* offsets, const char* data, size_t nkeys, uint64_t nslots, uint32_t min_level) override
+	{
+		if constexpr (std::is_same<elem_t, boomphf::hash_pair_t>::value)
+		{
+			std::vector<boomphf::hash_pair_t> hashed(nkeys);
+			for (size_t ii = 0; ii < nkeys; ii++)
+				hashed[ii] = boomphf::murmur3_128(data + offsets[ii], offsets[ii + 1] - offsets[ii]);
+			std::unique_lock<std::shared_mutex> guard(_rw);
+			resetPool();
+			_m.buildHotCache(hashed.data(), nkeys, nslots, min_level);
+		}
+	}
+
+	void saveHotCache(std::ostream& os) const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		_m.saveHotCache(os);
+	}
+
+	bool loadHotCache(std::istream& is) override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		return _m.loadHotCache(is);
+	}
+
+	void clearHotCache() override
+	{
+		std::unique_lock<std::shared_mutex> guard(_rw);
+		resetPool();
+		_m.clearHotCache();
+	}
+
+	uint64_t hotCacheSlots() const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		return _m.hotCache().size();
+	}
+	uint64_t hotCacheFilled() const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		return _m.hotCache().filled();
+	}
+	uint32_t hotCacheMinLevel() const override
+	{
+		std::shared_lock<std::shared_mutex> guard(_rw);
+		return _m.hotCache().minLevel();
+	}
+
+  private:
+	typedef boomphf::mphf<elem_t, SingleHasher_t> mphf_t;
+
+	// replicas are copies of _m, the pool is rebuilt after _m changes (called with _rw held exclusive)
+	void resetPool()
+	{
+		std::lock_guard<std::mutex> lock(_pool_mutex);
+		_pool.reset();
+	}
+
+	mphf_t _m;
+	mutable std::shared_mutex _rw; // taken before _pool_mutex
+	std::mutex _pool_mutex;
+	std::unique_ptr<boomphf::lookup_pool<mphf_t>> _pool;
+	bool _pool_numa = false;
+};
+
+typedef native_mphf_impl<boomphf::Key128HashFunctor, boomphf::hash_pair_t> native_string_mphf;
+
+// mphf hashing with hasher_id (MPHF_HASHER_*) constructed from args, nullptr for an unknown id
+// (string mphf are only built from hashed keys by from_packed, here they are only default constructed for loads)
+template <typename... Args>
+static native_mphf* make_native_mphf(uint32_t hasher_id, Args&&... args)
+{
+	switch (hasher_id)
+	{
+	case MPHF_HASHER_KEY128:
+		if constexpr (sizeof...(Args) == 0)
+			return new native_string_mphf();
+		break;
+	case MPHF_HASHER_XORSHIFT:
+		return new native_mphf_impl<boomphf::SingleHashFunctor<uint64_t>>(std::forward<Args>(args)...);
+	case MPHF_HASHER_WYMIX:
+		return new native_mphf_impl<boomphf::WyMixHashFunctor<uint64_t>>(std::forward<Args>(args)...);
+	case MPHF_HASHER_CRC32C:
+		return new native_mphf_impl<boomphf::Crc32cHashFunctor<uint64_t>>(std::forward<Args>(args)...);
+	}
+	return nullptr;
+}
+
+// 0 (no fingerprints) to MPHF_FINGERPRINT_BITS_MAX, ValueError otherwise
+static bool valid_fingerprint_bits(unsigned int bits)
+{
+	if (bits <= MPHF_FINGERPRINT_BITS_MAX)
+		return true;
+	PyErr_Format(PyExc_ValueError, "fingerprint_bits must be 0 to %d", MPHF_FINGERPRINT_BITS_MAX);
+	return false;
+}
+
+// progress argument of the builds : a callable receives progress_info dicts from the reporter thread
+// (it takes the GIL, exceptions are reported as unraisable), any other object selects the console bar when true
+static bool progress_arg(PyObject* obj, double interval, bool* console, progress_callback* callback)
+{
+	*console = false;
+	if (!(interval > 0.0))
+	{
+		PyErr_SetString(PyExc_ValueError, "progress_interval must be > 0");
+		return false;
+	}
+	if (obj == nullptr || obj == Py_None)
+		return true;
+	if (PyCallable_Check(obj))
+	{
+		Py_INCREF(obj);
+		// released with the GIL, the last copy of the callback may go away in a thread without it
+		std::shared_ptr<PyObject> fn(obj, [](PyObject* o) {
+			PyGILState_STATE gil = PyGILState_Ensure();
+			Py_DECREF(o);
+			PyGILState_Release(gil);
+		});
+		*callback = [fn](const progress_info& info) {
+			PyGILState_STATE gil = PyGILState_Ensure();
+			PyObject* res = PyObject_CallFunction(fn.get(), "N",
+			                                      Py_BuildValue("{s:K,s:K,s:i,s:d,s:O}", "done", static_cast<unsigned long long>(info.done),
+			                                                    "total", static_cast<unsigned long long>(info.total), "level", info.level,
+			                                                    "seconds", info.seconds, "finished", info.finished ? Py_True : Py_False));
+			if (res == nullptr)
+				PyErr_WriteUnraisable(fn.get());
+			Py_XDECREF(res);
+			PyGILState_Release(gil);
+		};
+		return true;
+	}
+	int truth = PyObject_IsTrue(obj);
+	if (truth < 0)
+		return false;
+	*console = truth != 0;
+	return true;
+}
+
+// level schedule of the builds : gamma_schedule None or a sequence of gammas > 0, max_levels 0 (MPHF_NB_LEVELS) or >= 2
+static bool schedule_arg(PyObject* gammas, unsigned long long min_keys, unsigned int max_levels, boomphf::mphf_level_schedule* schedule)
+{
+	schedule->min_keys = min_keys;
+	schedule->max_levels = max_levels;
+	if (max_levels == 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_levels must be >= 2");
+		return false;
+	}
+	if (gammas == nullptr || gammas == Py_None)
+		return true;
+	PyObject* seq = PySequence_Fast(gammas, "gamma_schedule must be a sequence of floats");
+	if (seq == nullptr)
+		return false;
+	Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	for (Py_ssize_t ii = 0; ii < n; ii++)
+	{
+		double gamma = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, ii));
+		if (gamma == -1.0 && PyErr_Occurred())
+		{
+			Py_DECREF(seq);
+			return false;
+		}
+		if (!(gamma > 0.0 && gamma < HUGE_VAL))
+		{
+			Py_DECREF(seq);
+			PyErr_SetString(PyExc_ValueError, "gamma_schedule gammas must be > 0");
+			return false;
+		}
+		schedule->gammas.push_back(gamma);
+	}
+	Py_DECREF(seq);
+	return true;
+}
+
+static bool known_hasher(unsigned int hasher_id)
+{
+	if (hasher_id == MPHF_HASHER_XORSHIFT || hasher_id == MPHF_HASHER_WYMIX || hasher_id == MPHF_HASHER_CRC32C)
+		return true;
+	PyErr_Format(PyExc_ValueError, "unsupported mphf hasher id %u", hasher_id);
+	return false;
+}
+
+// hasher id recorded in a v2 file, MPHF_HASHER_XORSHIFT for v1 files
+// (and unreadable ones, the load that follows reports the error)
+static uint32_t file_hasher_id(const std::string& path)
+{
+	boomphf::mphf_file_header header = {};
+	std::ifstream is(path, std::ios::binary);
+	is.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!is || memcmp(header.magic, boomphf::mphf_file_magic, sizeof(header.magic)) != 0)
+		return MPHF_HASHER_XORSHIFT;
+	return header.hasher_id;
+}
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark helpers
+////////////////////////////////////////////////////////////////
+
+// 1-d contiguous buffer of 64-bit integers (array('Q'), numpy uint64 / int64, memoryview ...)
+static bool get_u64_buffer(PyObject* obj, Py_buffer* view, bool writable)
+{
+	int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+	if (PyObject_GetBuffer(obj, view, flags) < 0)
+		return false;
+
+	const char* fmt = view->format != nullptr ? view->format : "B";
+	if (*fmt == '@' || *fmt == '=' || (PY_LITTLE_ENDIAN && *fmt == '<'))
+		fmt++;
+	bool ok = view->ndim <= 1 && view->itemsize == 8 && strlen(fmt) == 1 && strchr("QqLl", *fmt) != nullptr;
+	if (!ok)
+	{
+		PyBuffer_Release(view);
+		PyErr_SetString(PyExc_TypeError, "expected a contiguous 1-d buffer of native 64-bit integers");
+		return false;
+	}
+	return true;
+}
+
+// keys are masked to 64 bits, same as the pure-Python hash functors
+static bool collect_keys(PyObject* iterable, std::vector<uint64_t>& keys)
+{
+	// uint64 buffers (array('Q'), numpy) are copied in one go
+	if (PyObject_CheckBuffer(iterable))
+	{
+		Py_buffer view;
+		if (get_u64_buffer(iterable, &view, false))
+		{
+			const uint64_t* words = static_cast<const uint64_t*>(view.buf);
+			keys.assign(words, words + view.len / 8);
+			PyBuffer_Release(&view);
+			return true;
+		}
+		PyErr_Clear(); // other buffers go through the iterator below
+	}
+
+	Py_ssize_t hint = PyObject_LengthHint(iterable, 0);
+	if (hint < 0)
+		return false;
+	keys.reserve(static_cast<size_t>(hint));
+
+	PyObject* it = PyObject_GetIter(iterable);
+	if (it == nullptr)
+		return false;
+
+	PyObject* item;
+	while ((item = PyIter_Next(it)) != nullptr)
+	{
+		unsigned long long key = PyLong_AsUnsignedLongLongMask(item);
+		Py_DECREF(item);
+		if (key == (unsigned long long)-1 && PyErr_Occurred())
+		{
+			Py_DECREF(it);
+			return false;
+		}
+		keys.push_back(static_cast<uint64_t>(key));
+	}
+	Py_DECREF(it);
+	return !PyErr_Occurred();
+}
+
+// packed string keys : n + 1 uint64 offsets into a bytes-like blob, key ii is data[offsets[ii], offsets[ii + 1])
+// both buffers are released by the caller on success
+static bool get_packed_keys(PyObject* offsets_obj, PyObject* data_obj, Py_buffer* offsets, Py_buffer* data)
+{
+	if (!get_u64_buffer(offsets_obj, offsets, false))
+		return false;
+	if (PyObject_GetBuffer(data_obj, data, PyBUF_SIMPLE) < 0)
+	{
+		PyBuffer_Release(offsets);
+		return false;
+	}
+	const uint64_t* off = static_cast<const uint64_t*>(offsets->buf);
+	size_t nb = static_cast<size_t>(offsets->len / 8);
+	bool ok = nb > 0 && off[nb - 1] <= static_cast<uint64_t>(data->len);
+	for (size_t ii = 1; ok && ii < nb; ii++)
+		ok = off[ii - 1] <= off[ii];
+	if (!ok)
+	{
+		PyBuffer_Release(offsets);
+		PyBuffer_Release(data);
+		PyErr_SetString(PyExc_ValueError, "offsets must be n + 1 non-decreasing positions within data");
+		return false;
+	}
+	return true;
+}
+
+static PyObject* lookup_result(uint64_t idx)
+{
+	// ULLONG_MAX means "not in set", reported as -1 like the pure-Python lookup
+	if (idx == ULLONG_MAX)
+		return PyLong_FromLong(-1);
+	return PyLong_FromUnsignedLongLong(idx);
+}
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark mphf type
+////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	PyObject_HEAD
+	native_mphf* bphf;
+} NativeMphf;
+
+static void NativeMphf_dealloc(NativeMphf* self)
+{
+	delete self->bphf;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject* NativeMphf_new(PyTypeObject* type, PyObject*, PyObject*)
+{
+	NativeMphf* self = reinterpret_cast<NativeMphf*>(type->tp_alloc(type, 0));
+	if (self == nullptr)
+		return nullptr;
+	try
+	{
+		self->bphf = make_native_mphf(MPHF_HASHER_XORSHIFT);
+	}
+	catch (const std::bad_alloc&)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return reinterpret_cast<PyObject*>(self);
+}
+
+static int NativeMphf_init(NativeMphf* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"n", "input_range", "num_thread", "gamma", "writeEach", "progress", "perc_elem_loaded", "reduction", "tmp_dir", "hasher", "fingerprint_bits", "progress_interval",
+	                               "gamma_schedule", "min_level_keys", "max_levels", nullptr};
+	unsigned long long n = 0;
+	PyObject* input_range = nullptr;
+	int num_thread = 1;
+	double gamma = 2.0;
+	int writeEach = 0;
+	PyObject* progress_obj = nullptr;
+	double progress_interval = 1.0;
+	float perc_elem_loaded = 0.03f;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+	PyObject* tmp_dir_bytes = nullptr;
+	unsigned int hasher = MPHF_HASHER_XORSHIFT;
+	unsigned int fingerprint_bits = 0;
+	PyObject* gammas_obj = nullptr;
+	unsigned long long min_level_keys = 0;
+	unsigned int max_levels = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOidpOfIO&IIdOKI", const_cast<char**>(kwlist),
+	                                 &n, &input_range, &num_thread, &gamma, &writeEach, &progress_obj, &perc_elem_loaded, &reduction,
+	                                 PyUnicode_FSConverter, &tmp_dir_bytes, &hasher, &fingerprint_bits, &progress_interval,
+	                                 &gammas_obj, &min_level_keys, &max_levels))
+		return -1;
+	std::string tmp_dir = ".";
+	if (tmp_dir_bytes != nullptr)
+	{
+		tmp_dir = PyBytes_AS_STRING(tmp_dir_bytes);
+		Py_DECREF(tmp_dir_bytes);
+	}
+
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return -1;
+	}
+	if (!known_hasher(hasher) || !valid_fingerprint_bits(fingerprint_bits))
+		return -1;
+	boomphf::mphf_level_schedule schedule;
+	if (!schedule_arg(gammas_obj, min_level_keys, max_levels, &schedule))
+		return -1;
+	bool progress = false;
+	progress_callback on_progress;
+	if (!progress_arg(progress_obj, progress_interval, &progress, &on_progress))
+		return -1;
+
+	if (n == 0 || input_range == nullptr || input_range == Py_None)
+		return 0;
+
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return -1;
+	}
+
+	std::vector<uint64_t> keys;
+	if (!collect_keys(input_range, keys))
+		return -1;
+
+	native_mphf* built = nullptr;
+	bool oom = false;
+	std::string error, invalid;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		std::unique_ptr<native_mphf> m(make_native_mphf(hasher, n, keys, num_thread, gamma, writeEach != 0, progress, perc_elem_loaded, static_cast<boomphf::mphf_reduction>(reduction), tmp_dir,
+		                                                on_progress, progress_interval, schedule));
+		if (fingerprint_bits > 0)
+			m->addFingerprints(keys, fingerprint_bits, num_thread);
+		built = m.release();
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::invalid_argument& e)
+	{
+		invalid = e.what(); // duplicate keys
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what(); // writeEach level files could not be created or written
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	if (!invalid.empty())
+	{
+		PyErr_SetString(PyExc_ValueError, invalid.c_str());
+		return -1;
+	}
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_OSError, error.c_str());
+		return -1;
+	}
+
+	delete self->bphf;
+	self->bphf = built;
+	return 0;
+}
+
+// integer or string lookups on an mphf of the other key kind raise TypeError
+static bool check_key_kind(NativeMphf* self, bool strings)
+{
+	if (self->bphf->stringKeys() == strings)
+		return true;
+	PyErr_SetString(PyExc_TypeError, strings ? "this mphf has integer keys" : "this mphf has string keys");
+	return false;
+}
+
+static PyObject* NativeMphf_lookup(NativeMphf* self, PyObject* arg)
+{
+	if (self->bphf->stringKeys())
+	{
+		Py_buffer key;
+		if (PyObject_GetBuffer(arg, &key, PyBUF_SIMPLE) < 0)
+			return nullptr;
+		uint64_t idx = self->bphf->lookupBytes(static_cast<const char*>(key.buf), static_cast<size_t>(key.len));
+		PyBuffer_Release(&key);
+		return lookup_result(idx);
+	}
+	unsigned long long key = PyLong_AsUnsignedLongLongMask(arg);
+	if (key == (unsigned long long)-1 && PyErr_Occurred())
+		return nullptr;
+	return lookup_result(self->bphf->lookup(static_cast<uint64_t>(key)));
+}
+
+static PyObject* NativeMphf_lookup_many(NativeMphf* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"keys", "out", "num_thread", "numa_replicas", nullptr};
+	PyObject *keys_obj, *out_obj;
+	int num_thread = 1;
+	int numa_replicas = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|ip", const_cast<char**>(kwlist), &keys_obj, &out_obj, &num_thread, &numa_replicas))
+		return nullptr;
+	if (!check_key_kind(self, false))
+		return nullptr;
+
+	Py_buffer keys, out;
+	if (!get_u64_buffer(keys_obj, &keys, false))
+		return nullptr;
+	if (!get_u64_buffer(out_obj, &out, true))
+	{
+		PyBuffer_Release(&keys);
+		return nullptr;
+	}
+	if (out.len != keys.len)
+	{
+		PyBuffer_Release(&keys);
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "out must have the same length as keys");
+		return nullptr;
+	}
+
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		self->bphf->lookup(static_cast<const uint64_t*>(keys.buf), static_cast<size_t>(keys.len / 8), static_cast<uint64_t*>(out.buf), num_thread,
+		                   numa_replicas != 0);
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&keys);
+	PyBuffer_Release(&out);
+	if (oom)
+		return PyErr_NoMemory();
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_RuntimeError, error.c_str());
+		return nullptr;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeMphf_lookup_packed(NativeMphf* self, PyObject* args)
+{
+	PyObject *offsets_obj, *data_obj, *out_obj;
+	if (!PyArg_ParseTuple(args, "OOO", &offsets_obj, &data_obj, &out_obj))
+		return nullptr;
+	if (!check_key_kind(self, true))
+		return nullptr;
+
+	Py_buffer offsets, data, out;
+	if (!get_packed_keys(offsets_obj, data_obj, &offsets, &data))
+		return nullptr;
+	if (!get_u64_buffer(out_obj, &out, true))
+	{
+		PyBuffer_Release(&offsets);
+		PyBuffer_Release(&data);
+		return nullptr;
+	}
+	size_t nkeys = static_cast<size_t>(offsets.len / 8) - 1;
+	if (static_cast<size_t>(out.len / 8) != nkeys)
+	{
+		PyBuffer_Release(&offsets);
+		PyBuffer_Release(&data);
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "out must hold one entry per key");
+		return nullptr;
+	}
+
+	Py_BEGIN_ALLOW_THREADS;
+	self->bphf->lookupPacked(static_cast<const uint64_t*>(offsets.buf), static_cast<const char*>(data.buf), nkeys, static_cast<uint64_t*>(out.buf));
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&offsets);
+	PyBuffer_Release(&data);
+	PyBuffer_Release(&out);
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeMphf_nbKeys(NativeMphf* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->bphf->nbKeys());
+}
+
+static PyObject* NativeMphf_totalBitSize(NativeMphf* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->bphf->totalBitSize());
+}
+
+// same keys as the pure Python mphf.build_stats()
+static PyObject* NativeMphf_build_stats(NativeMphf* self, PyObject*)
+{
+	boomphf::mphf_build_stats stats = self->bphf->buildStats();
+	PyObject* levels = PyList_New(stats.levels.size());
+	if (levels == nullptr)
+		return nullptr;
+	for (size_t ii = 0; ii < stats.levels.size(); ii++)
+	{
+		const boomphf::mphf_level_stats& ls = stats.levels[ii];
+		PyObject* d = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:d}",
+		                            "keys_in", (unsigned long long)ls.keys_in, "keys_read", (unsigned long long)ls.keys_read,
+		                            "keys_placed", (unsigned long long)ls.keys_placed, "collisions", (unsigned long long)ls.collisions,
+		                            "bitset_bytes", (unsigned long long)ls.bitset_bytes, "rank_bytes", (unsigned long long)ls.rank_bytes,
+		                            "spill_bytes_written", (unsigned long long)ls.spill_bytes_written,
+		                            "spill_bytes_read", (unsigned long long)ls.spill_bytes_read, "seconds", ls.seconds);
+		if (d == nullptr)
+		{
+			Py_DECREF(levels);
+			return nullptr;
+		}
+		PyList_SET_ITEM(levels, ii, d);
+	}
+	return Py_BuildValue("{s:N,s:i,s:K,s:K,s:K,s:K,s:d}", "levels", levels, "fast_mode_level", stats.fast_mode_level,
+	                     "final_keys", (unsigned long long)stats.final_keys, "final_bytes", (unsigned long long)stats.final_bytes,
+	                     "fingerprint_bytes", (unsigned long long)stats.fingerprint_bytes,
+	                     "total_bits", (unsigned long long)stats.total_bits, "seconds", stats.seconds);
+}
+
+static PyObject* NativeMphf_final_hash(NativeMphf* self, PyObject*)
+{
+	PyObject* d = PyDict_New();
+	if (d == nullptr)
+		return nullptr;
+	const auto& table = self->bphf->finalHash();
+	for (uint64_t ii = 0; ii < table.size(); ii++)
+	{
+		PyObject* k = PyLong_FromUnsignedLongLong(table.keys()[ii]);
+		PyObject* v = PyLong_FromUnsignedLongLong(table.values()[ii]);
+		int rc = (k && v) ? PyDict_SetItem(d, k, v) : -1;
+		Py_XDECREF(k);
+		Py_XDECREF(v);
+		if (rc < 0)
+		{
+			Py_DECREF(d);
+			return nullptr;
+		}
+	}
+	return d;
+}
+
+static PyObject* NativeMphf_save(NativeMphf* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "version", "checksum", "num_thread", nullptr};
+	PyObject* path_bytes = nullptr;
+	unsigned int version = MPHF_FORMAT_V1;
+	int checksum = 1;
+	int num_thread = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Ipi", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &version, &checksum, &num_thread))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+	if (version != MPHF_FORMAT_V1 && version != MPHF_FORMAT_V2)
+	{
+		PyErr_Format(PyExc_ValueError, "unsupported mphf format version %u", version);
+		return nullptr;
+	}
+	if (version == MPHF_FORMAT_V1 && self->bphf->reduction() != boomphf::MPHF_REDUCE_MODULO)
+	{
+		PyErr_SetString(PyExc_ValueError, "the v1 mphf format only stores modulo reduction, save as v2");
+		return nullptr;
+	}
+	if (version == MPHF_FORMAT_V1 && self->bphf->hasherId() != MPHF_HASHER_XORSHIFT)
+	{
+		PyErr_SetString(PyExc_ValueError, "the v1 mphf format does not record the hasher, save as v2");
+		return nullptr;
+	}
+	if (version == MPHF_FORMAT_V1 && self->bphf->fingerprintBits() > 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "the v1 mphf format has no fingerprints, save as v2");
+		return nullptr;
+	}
+
+	bool ok = true;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		self->bphf->saveFile(path, version, checksum != 0, num_thread);
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::system_error& e)
+	{
+		errno = e.code().value();
+		ok = false;
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		return PyErr_NoMemory();
+	if (!ok)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeMphf_load(PyObject* cls, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "num_thread", nullptr};
+	PyObject* path_bytes = nullptr;
+	int num_thread = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|i", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &num_thread))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeMphf* self = reinterpret_cast<NativeMphf*>(obj);
+
+	bool ok = true;
+	bool oom = false;
+	std::string error;
+	std::unique_ptr<native_mphf> loaded;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		// the file's hasher picks the instantiation
+		uint32_t hasher = file_hasher_id(path);
+		loaded.reset(make_native_mphf(hasher));
+		if (!loaded)
+			throw std::runtime_error("Unsupported mphf hasher id " + std::to_string(hasher));
+		loaded->loadFile(path, num_thread);
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::system_error& e)
+	{
+		errno = e.code().value();
+		ok = false;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	if (!ok)
+	{
+		Py_DECREF(obj);
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	}
+	delete self->bphf;
+	self->bphf = loaded.release();
+	return obj;
+}
+
+// build from a raw file of n native uint64 keys (e.g. mphf_builder's spool) : the file is read for levels 0 and 1,
+// later levels read writeEach level files in tmp_dir, so the keys are never all in memory
+static PyObject* NativeMphf_from_file(PyObject* cls, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "n", "num_thread", "gamma", "progress", "reduction", "tmp_dir", "hasher", "fingerprint_bits", "progress_interval", nullptr};
+	PyObject* path_bytes = nullptr;
+	unsigned long long n = 0;
+	int num_thread = 1;
+	double gamma = 2.0;
+	PyObject* progress_obj = nullptr;
+	double progress_interval = 1.0;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+	PyObject* tmp_dir_bytes = nullptr;
+	unsigned int hasher = MPHF_HASHER_XORSHIFT;
+	unsigned int fingerprint_bits = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&K|idOIO&IId", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes,
+	                                 &n, &num_thread, &gamma, &progress_obj, &reduction, PyUnicode_FSConverter, &tmp_dir_bytes, &hasher, &fingerprint_bits,
+	                                 &progress_interval))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+	std::string tmp_dir = ".";
+	if (tmp_dir_bytes != nullptr)
+	{
+		tmp_dir = PyBytes_AS_STRING(tmp_dir_bytes);
+		Py_DECREF(tmp_dir_bytes);
+	}
+
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return nullptr;
+	}
+	if (!known_hasher(hasher) || !valid_fingerprint_bits(fingerprint_bits))
+		return nullptr;
+	bool progress = false;
+	progress_callback on_progress;
+	if (!progress_arg(progress_obj, progress_interval, &progress, &on_progress))
+		return nullptr;
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return nullptr;
+	}
+
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeMphf* self = reinterpret_cast<NativeMphf*>(obj);
+	if (n == 0)
+		return obj;
+
+	native_mphf* built = nullptr;
+	std::string error, invalid;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		boomphf::file_binary<uint64_t> input(path);
+		std::unique_ptr<native_mphf> m(make_native_mphf(hasher, n, input, num_thread, gamma, true, progress, 0.0f, static_cast<boomphf::mphf_reduction>(reduction), tmp_dir,
+		                                                on_progress, progress_interval));
+		if (fingerprint_bits > 0)
+			m->addFingerprints(input, fingerprint_bits, num_thread);
+		built = m.release();
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::invalid_argument& e)
+	{
+		invalid = e.what(); // duplicate keys
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (!invalid.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, invalid.c_str());
+		return nullptr;
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_OSError, error.c_str());
+		return nullptr;
+	}
+	delete self->bphf;
+	self->bphf = built;
+	return obj;
+}
+
+// build over string keys : each key is hashed once with murmur3_128 (GIL released), the mphf is built over the hashes
+static PyObject* NativeMphf_from_packed(PyObject* cls, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"offsets", "data", "num_thread", "gamma", "writeEach", "progress", "perc_elem_loaded", "reduction", "tmp_dir", "fingerprint_bits", "progress_interval",
+	                               "gamma_schedule", "min_level_keys", "max_levels", nullptr};
+	PyObject *offsets_obj, *data_obj;
+	int num_thread = 1;
+	double gamma = 2.0;
+	int writeEach = 0;
+	PyObject* progress_obj = nullptr;
+	double progress_interval = 1.0;
+	float perc_elem_loaded = 0.03f;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+	PyObject* tmp_dir_bytes = nullptr;
+	unsigned int fingerprint_bits = 0;
+	PyObject* gammas_obj = nullptr;
+	unsigned long long min_level_keys = 0;
+	unsigned int max_levels = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|idpOfIO&IdOKI", const_cast<char**>(kwlist), &offsets_obj, &data_obj,
+	                                 &num_thread, &gamma, &writeEach, &progress_obj, &perc_elem_loaded, &reduction, PyUnicode_FSConverter, &tmp_dir_bytes,
+	                                 &fingerprint_bits, &progress_interval, &gammas_obj, &min_level_keys, &max_levels))
+		return nullptr;
+	std::string tmp_dir = ".";
+	if (tmp_dir_bytes != nullptr)
+	{
+		tmp_dir = PyBytes_AS_STRING(tmp_dir_bytes);
+		Py_DECREF(tmp_dir_bytes);
+	}
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return nullptr;
+	}
+	if (!valid_fingerprint_bits(fingerprint_bits))
+		return nullptr;
+	boomphf::mphf_level_schedule schedule;
+	if (!schedule_arg(gammas_obj, min_level_keys, max_levels, &schedule))
+		return nullptr;
+	bool progress = false;
+	progress_callback on_progress;
+	if (!progress_arg(progress_obj, progress_interval, &progress, &on_progress))
+		return nullptr;
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return nullptr;
+	}
+
+	Py_buffer offsets, data;
+	if (!get_packed_keys(offsets_obj, data_obj, &offsets, &data))
+		return nullptr;
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+	{
+		PyBuffer_Release(&offsets);
+		PyBuffer_Release(&data);
+		return nullptr;
+	}
+	NativeMphf* self = reinterpret_cast<NativeMphf*>(obj);
+
+	size_t nkeys = static_cast<size_t>(offsets.len / 8) - 1;
+	native_mphf* built = nullptr;
+	std::string error;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		const uint64_t* off = static_cast<const uint64_t*>(offsets.buf);
+		const char* bytes = static_cast<const char*>(data.buf);
+		std::vector<boomphf::hash_pair_t> keys(nkeys);
+		for (size_t ii = 0; ii < nkeys; ii++)
+			keys[ii] = boomphf::murmur3_128(bytes + off[ii], off[ii + 1] - off[ii]);
+		std::unique_ptr<native_mphf> m(nkeys == 0 ? new native_string_mphf()
+		                                          : new native_string_mphf(nkeys, keys, num_thread, gamma, writeEach != 0, progress, perc_elem_loaded,
+		                                                                   static_cast<boomphf::mphf_reduction>(reduction), tmp_dir, on_progress, progress_interval, schedule));
+		if (nkeys > 0 && fingerprint_bits > 0)
+			m->addFingerprints(keys, fingerprint_bits, num_thread);
+		built = m.release();
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what(); // duplicate keys, writeEach level files
+	}
+	Py_END_ALLOW_THREADS;
+	PyBuffer_Release(&offsets);
+	PyBuffer_Release(&data);
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	delete self->bphf;
+	self->bphf = built;
+	return obj;
+}
+
+static PyObject* NativeMphf_mmap(PyObject* cls, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "verify", nullptr};
+	PyObject* path_bytes = nullptr;
+	int verify = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &verify))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeMphf* self = reinterpret_cast<NativeMphf*>(obj);
+
+	std::string error;
+	bool os_error = false;
+	bool oom = false;
+	std::unique_ptr<native_mphf> mapped;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		uint32_t hasher = file_hasher_id(path);
+		mapped.reset(make_native_mphf(hasher));
+		if (!mapped)
+			throw std::runtime_error("Unsupported mphf hasher id " + std::to_string(hasher));
+		mapped->map(path, verify != 0);
+	}
+	catch (const std::invalid_argument&)
+	{
+		os_error = true;
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (os_error)
+	{
+		Py_DECREF(obj);
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	delete self->bphf;
+	self->bphf = mapped.release();
+	return obj;
+}
+
+static PyObject* NativeMphf_get_gamma(NativeMphf* self, void*)
+{
+	return PyFloat_FromDouble(self->bphf->gamma());
+}
+
+static PyObject* NativeMphf_get_nb_levels(NativeMphf* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->bphf->nbLevels());
+}
+
+static PyObject* NativeMphf_get_level_domains(NativeMphf* self, void*)
+{
+	uint32_t nb_levels = self->bphf->nbLevels();
+	PyObject* domains = PyList_New(nb_levels);
+	if (domains == nullptr)
+		return nullptr;
+	for (uint32_t ii = 0; ii < nb_levels; ii++)
+	{
+		PyObject* domain = PyLong_FromUnsignedLongLong(self->bphf->levelDomain(ii));
+		if (domain == nullptr)
+		{
+			Py_DECREF(domains);
+			return nullptr;
+		}
+		PyList_SET_ITEM(domains, ii, domain);
+	}
+	return domains;
+}
+
+static PyObject* NativeMphf_get_scheduled(NativeMphf* self, void*)
+{
+	return PyBool_FromLong(self->bphf->scheduled());
+}
+
+static PyObject* NativeMphf_get_lastbitsetrank(NativeMphf* self, void*)
+{
+	return PyLong_FromUnsignedLongLong(self->bphf->lastBitsetRank());
+}
+
+static PyObject* NativeMphf_get_built(NativeMphf* self, void*)
+{
+	return PyBool_FromLong(self->bphf->built());
+}
+
+static PyObject* NativeMphf_get_reduction(NativeMphf* self, void*)
+{
+	return PyLong_FromLong(self->bphf->reduction());
+}
+
+static PyObject* NativeMphf_get_hasher(NativeMphf* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->bphf->hasherId());
+}
+
+static PyObject* NativeMphf_get_fingerprint_bits(NativeMphf* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->bphf->fingerprintBits());
+}
+
+static PyObject* NativeMphf_get_rank_layout(NativeMphf* self, void*)
+{
+	return PyLong_FromLong(self->bphf->rankLayout());
+}
+
+static PyObject* NativeMphf_set_rank_layout(NativeMphf* self, PyObject* arg)
+{
+	long layout = PyLong_AsLong(arg);
+	if (layout == -1 && PyErr_Occurred())
+		return nullptr;
+	if (layout != RANK_LAYOUT_FLAT && layout != RANK_LAYOUT_INTERLEAVED)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown rank layout %ld", layout);
+		return nullptr;
+	}
+	// waits for the lookups running without the GIL, then rebuilds the level bitsets
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		self->bphf->setRankLayout(static_cast<rank_layout>(layout));
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	Py_END_ALLOW_THREADS;
+	if (oom)
+		return PyErr_NoMemory();
+	Py_RETURN_NONE;
+}
+
+// build_hot_cache(sample, slots, min_level) : uint64 buffer for integer mphf, (offsets, data) packed keys for string mphf
+static PyObject* NativeMphf_build_hot_cache(NativeMphf* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"sample", "slots", "min_level", "data", nullptr};
+	PyObject* sample_obj;
+	unsigned long long slots = MPHF_HOT_SLOTS;
+	unsigned int min_level = MPHF_HOT_MIN_LEVEL;
+	PyObject* data_obj = nullptr;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|KIO", const_cast<char**>(kwlist), &sample_obj, &slots, &min_level, &data_obj))
+		return nullptr;
+	bool strings = data_obj != nullptr && data_obj != Py_None;
+	if (!check_key_kind(self, strings))
+		return nullptr;
+
+	Py_buffer sample, data;
+	if (strings ? !get_packed_keys(sample_obj, data_obj, &sample, &data) : !get_u64_buffer(sample_obj, &sample, false))
+		return nullptr;
+
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		if (strings)
+			self->bphf->buildHotCachePacked(static_cast<const uint64_t*>(sample.buf), static_cast<const char*>(data.buf), static_cast<size_t>(sample.len / 8) - 1, slots, min_level);
+		else
+			self->bphf->buildHotCache(static_cast<const uint64_t*>(sample.buf), static_cast<size_t>(sample.len / 8), slots, min_level);
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&sample);
+	if (strings)
+		PyBuffer_Release(&data);
+	if (oom)
+		return PyErr_NoMemory();
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeMphf_hot_cache_bytes(NativeMphf* self, PyObject*)
+{
+	std::ostringstream os;
+	try
+	{
+		self->bphf->saveHotCache(os);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return PyErr_NoMemory();
+	}
+	const std::string bytes = os.str();
+	return PyBytes_FromStringAndSize(bytes.data(), (Py_ssize_t)bytes.size());
+}
+
+static PyObject* NativeMphf_load_hot_cache(NativeMphf* self, PyObject* arg)
+{
+	Py_buffer view;
+	if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0)
+		return nullptr;
+	std::istringstream is(std::string(static_cast<const char*>(view.buf), (size_t)view.len));
+	PyBuffer_Release(&view);
+	try
+	{
+		return PyBool_FromLong(self->bphf->loadHotCache(is));
+	}
+	catch (const std::bad_alloc&)
+	{
+		return PyErr_NoMemory();
+	}
+	catch (const std::exception& e)
+	{
+		PyErr_SetString(PyExc_ValueError, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* NativeMphf_clear_hot_cache(NativeMphf* self, PyObject*)
+{
+	self->bphf->clearHotCache();
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeMphf_hot_cache_stats(NativeMphf* self, PyObject*)
+{
+	return Py_BuildValue("{s:K,s:K,s:I}", "slots", (unsigned long long)self->bphf->hotCacheSlots(),
+	                     "filled", (unsigned long long)self->bphf->hotCacheFilled(), "min_level", self->bphf->hotCacheMinLevel());
+}
+
+static PyMethodDef NativeMphf_methods[] = {
+    {"lookup", (PyCFunction)NativeMphf_lookup, METH_O, "Return the index of a key, or -1 if it is not in the set."},
+    {"lookup_many", (PyCFunction)(void (*)(void))NativeMphf_lookup_many, METH_VARARGS | METH_KEYWORDS, "lookup_many(keys, out, num_thread=1, numa_replicas=False): batched lookup between uint64 buffers, ULLONG_MAX for unknown keys, on a persistent pool of num_thread threads."},
+    {"lookup_packed", (PyCFunction)NativeMphf_lookup_packed, METH_VARARGS, "lookup_packed(offsets, data, out): batched lookup of packed string keys (string mphf), ULLONG_MAX for unknown keys."},
+    {"nbKeys", (PyCFunction)NativeMphf_nbKeys, METH_NOARGS, "Return the number of keys."},
+    {"totalBitSize", (PyCFunction)NativeMphf_totalBitSize, METH_NOARGS, "Return the total size in bits."},
+    {"build_stats", (PyCFunction)NativeMphf_build_stats, METH_NOARGS, "Return the per level build counters and the sizes of the parts as a dict."},
+    {"set_rank_layout", (PyCFunction)NativeMphf_set_rank_layout, METH_O, "set_rank_layout(layout): 0 flat, 1 interleaved (rank in one cache line)."},
+    {"final_hash", (PyCFunction)NativeMphf_final_hash, METH_NOARGS, "Return the last-level hash as a dict."},
+    {"build_hot_cache", (PyCFunction)(void (*)(void))NativeMphf_build_hot_cache, METH_VARARGS | METH_KEYWORDS, "build_hot_cache(sample, slots=4096, min_level=2, data=None): hot key cache of the deep keys of a uint64 sample buffer, or of packed string keys (sample the offsets, data the bytes)."},
+    {"hot_cache_bytes", (PyCFunction)NativeMphf_hot_cache_bytes, METH_NOARGS, "Return the hot key cache file as bytes."},
+    {"load_hot_cache", (PyCFunction)NativeMphf_load_hot_cache, METH_O, "load_hot_cache(buffer): set the hot key cache from a file image, False if it was built for another mphf."},
+    {"clear_hot_cache", (PyCFunction)NativeMphf_clear_hot_cache, METH_NOARGS, "Drop the hot key cache."},
+    {"hot_cache_stats", (PyCFunction)NativeMphf_hot_cache_stats, METH_NOARGS, "Return the slots, filled slots and min_level of the hot key cache as a dict."},
+    {"save", (PyCFunction)(void (*)(void))NativeMphf_save, METH_VARARGS | METH_KEYWORDS, "save(path, version=1, checksum=True, num_thread=1): save to a binary file, v1 (BBHash layout) or v2 (aligned sections), num_thread threads writing chunks in place."},
+    {"load", (PyCFunction)(void (*)(void))NativeMphf_load, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "load(path, num_thread=1): load from a binary file (C++ BooPHF format), num_thread threads reading chunks in place."},
+    {"from_packed", (PyCFunction)(void (*)(void))NativeMphf_from_packed, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "from_packed(offsets, data, num_thread=1, gamma=2.0, writeEach=False, progress=False, perc_elem_loaded=0.03, reduction=0, tmp_dir='.', fingerprint_bits=0, progress_interval=1.0, gamma_schedule=None, min_level_keys=0, max_levels=0): string mphf over packed keys, hashed with murmur3_128."},
+    {"mmap", (PyCFunction)(void (*)(void))NativeMphf_mmap, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "mmap(path, verify=False): map a binary file read-only, level bitsets are used in place."},
+    {"from_file", (PyCFunction)(void (*)(void))NativeMphf_from_file, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "from_file(path, n, num_thread=1, gamma=2.0, progress=False, reduction=0, tmp_dir='.', hasher=0, fingerprint_bits=0, progress_interval=1.0): writeEach build from a raw file of uint64 keys."},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyGetSetDef NativeMphf_getset[] = {
+    {"gamma", (getter)NativeMphf_get_gamma, nullptr, nullptr, nullptr},
+    {"nb_levels", (getter)NativeMphf_get_nb_levels, nullptr, nullptr, nullptr},
+    {"level_domains", (getter)NativeMphf_get_level_domains, nullptr, nullptr, nullptr},
+    {"scheduled", (getter)NativeMphf_get_scheduled, nullptr, nullptr, nullptr},
+    {"lastbitsetrank", (getter)NativeMphf_get_lastbitsetrank, nullptr, nullptr, nullptr},
+    {"built", (getter)NativeMphf_get_built, nullptr, nullptr, nullptr},
+    {"rank_layout", (getter)NativeMphf_get_rank_layout, nullptr, nullptr, nullptr},
+    {"reduction", (getter)NativeMphf_get_reduction, nullptr, nullptr, nullptr},
+    {"hasher", (getter)NativeMphf_get_hasher, nullptr, nullptr, nullptr},
+    {"fingerprint_bits", (getter)NativeMphf_get_fingerprint_bits, nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+static PyTypeObject NativeMphfType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark sharded_mphf type
+////////////////////////////////////////////////////////////////
+
+typedef boomphf::sharded_mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>> sharded_t;
+
+typedef struct
+{
+	PyObject_HEAD
+	sharded_t* sharded;
+} NativeSharded;
+
+static void NativeSharded_dealloc(NativeSharded* self)
+{
+	delete self->sharded;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject* NativeSharded_new(PyTypeObject* type, PyObject*, PyObject*)
+{
+	NativeSharded* self = reinterpret_cast<NativeSharded*>(type->tp_alloc(type, 0));
+	if (self == nullptr)
+		return nullptr;
+	self->sharded = new (std::nothrow) sharded_t();
+	if (self->sharded == nullptr)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return reinterpret_cast<PyObject*>(self);
+}
+
+static int NativeSharded_init(NativeSharded* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"n", "input_range", "nb_shards", "num_thread", "gamma", "perc_elem_loaded", "reduction", nullptr};
+	unsigned long long n = 0;
+	PyObject* input_range = nullptr;
+	unsigned int nb_shards = 0;
+	int num_thread = 1;
+	double gamma = 2.0;
+	float perc_elem_loaded = 1.0f;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOIidfI", const_cast<char**>(kwlist),
+	                                 &n, &input_range, &nb_shards, &num_thread, &gamma, &perc_elem_loaded, &reduction))
+		return -1;
+
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return -1;
+	}
+
+	if (n == 0 || input_range == nullptr || input_range == Py_None)
+		return 0;
+
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return -1;
+	}
+
+	std::vector<uint64_t> keys;
+	if (!collect_keys(input_range, keys))
+		return -1;
+
+	sharded_t* built = nullptr;
+	bool oom = false;
+	std::string error, invalid;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		built = new sharded_t(n, keys, nb_shards, num_thread, gamma, perc_elem_loaded, static_cast<boomphf::mphf_reduction>(reduction));
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::invalid_argument& e)
+	{
+		invalid = e.what(); // duplicate keys in a shard
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what(); // build threads could not be started
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	if (!invalid.empty())
+	{
+		PyErr_SetString(PyExc_ValueError, invalid.c_str());
+		return -1;
+	}
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_RuntimeError, error.c_str());
+		return -1;
+	}
+
+	delete self->sharded;
+	self->sharded = built;
+	return 0;
+}
+
+static PyObject* NativeSharded_lookup(NativeSharded* self, PyObject* arg)
+{
+	unsigned long long key = PyLong_AsUnsignedLongLongMask(arg);
+	if (key == (unsigned long long)-1 && PyErr_Occurred())
+		return nullptr;
+	return lookup_result(self->sharded->lookup(static_cast<uint64_t>(key)));
+}
+
+static PyObject* NativeSharded_lookup_many(NativeSharded* self, PyObject* args)
+{
+	PyObject *keys_obj, *out_obj;
+	if (!PyArg_ParseTuple(args, "OO", &keys_obj, &out_obj))
+		return nullptr;
+
+	Py_buffer keys, out;
+	if (!get_u64_buffer(keys_obj, &keys, false))
+		return nullptr;
+	if (!get_u64_buffer(out_obj, &out, true))
+	{
+		PyBuffer_Release(&keys);
+		return nullptr;
+	}
+	if (out.len != keys.len)
+	{
+		PyBuffer_Release(&keys);
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "out must have the same length as keys");
+		return nullptr;
+	}
+
+	Py_BEGIN_ALLOW_THREADS;
+	self->sharded->lookup(static_cast<const uint64_t*>(keys.buf), static_cast<size_t>(keys.len / 8), static_cast<uint64_t*>(out.buf));
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&keys);
+	PyBuffer_Release(&out);
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeSharded_shard_of(PyObject*, PyObject* args)
+{
+	PyObject* key_obj;
+	unsigned int nb_shards;
+	if (!PyArg_ParseTuple(args, "OI", &key_obj, &nb_shards))
+		return nullptr;
+	unsigned long long key = PyLong_AsUnsignedLongLongMask(key_obj);
+	if (key == (unsigned long long)-1 && PyErr_Occurred())
+		return nullptr;
+	if (nb_shards == 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "nb_shards must be >= 1");
+		return nullptr;
+	}
+	return PyLong_FromUnsignedLong(sharded_t::shard_of(static_cast<uint64_t>(key), nb_shards));
+}
+
+static PyObject* NativeSharded_nbKeys(NativeSharded* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->sharded->nbKeys());
+}
+
+static PyObject* NativeSharded_totalBitSize(NativeSharded* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->sharded->totalBitSize());
+}
+
+static PyObject* NativeSharded_save(NativeSharded* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "checksum", nullptr};
+	PyObject* path_bytes = nullptr;
+	int checksum = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &checksum))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	bool ok;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	std::ofstream os(path, std::ios::binary);
+	ok = static_cast<bool>(os);
+	if (ok)
+	{
+		try
+		{
+			self->sharded->save(os, checksum != 0);
+		}
+		catch (const std::bad_alloc&)
+		{
+			oom = true;
+		}
+		os.close();
+		ok = !os.fail();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		return PyErr_NoMemory();
+	if (!ok)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeSharded_load(PyObject* cls, PyObject* arg)
+{
+	PyObject* path_bytes = nullptr;
+	if (!PyUnicode_FSConverter(arg, &path_bytes))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeSharded* self = reinterpret_cast<NativeSharded*>(obj);
+
+	bool ok;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	std::ifstream is(path, std::ios::binary);
+	ok = static_cast<bool>(is);
+	if (ok)
+	{
+		try
+		{
+			self->sharded->load(is);
+		}
+		catch (const std::bad_alloc&)
+		{
+			oom = true;
+		}
+		catch (const std::exception& e)
+		{
+			error = e.what();
+		}
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	if (!ok)
+	{
+		Py_DECREF(obj);
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	}
+	return obj;
+}
+
+static PyObject* NativeSharded_get_nb_shards(NativeSharded* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->sharded->nbShards());
+}
+
+static PyObject* NativeSharded_get_built(NativeSharded* self, void*)
+{
+	return PyBool_FromLong(self->sharded->built());
+}
+
+static PyMethodDef NativeSharded_methods[] = {
+    {"lookup", (PyCFunction)NativeSharded_lookup, METH_O, "Return the index of a key, or -1 if it is not in the set."},
+    {"lookup_many", (PyCFunction)NativeSharded_lookup_many, METH_VARARGS, "lookup_many(keys, out): batched lookup between uint64 buffers, ULLONG_MAX for unknown keys."},
+    {"shard_of", (PyCFunction)NativeSharded_shard_of, METH_VARARGS | METH_STATIC, "shard_of(key, nb_shards): shard of a key."},
+    {"nbKeys", (PyCFunction)NativeSharded_nbKeys, METH_NOARGS, "Return the number of keys."},
+    {"totalBitSize", (PyCFunction)NativeSharded_totalBitSize, METH_NOARGS, "Return the total size in bits."},
+    {"save", (PyCFunction)(void (*)(void))NativeSharded_save, METH_VARARGS | METH_KEYWORDS, "save(path, checksum=True): save as a sharded container (v2 shards)."},
+    {"load", (PyCFunction)NativeSharded_load, METH_O | METH_CLASS, "Load a sharded container."},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyGetSetDef NativeSharded_getset[] = {
+    {"nb_shards", (getter)NativeSharded_get_nb_shards, nullptr, nullptr, nullptr},
+    {"built", (getter)NativeSharded_get_built, nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+static PyTypeObject NativeShardedType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark overlay_mphf type
+////////////////////////////////////////////////////////////////
+
+typedef boomphf::overlay_mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>> overlay_t;
+
+typedef struct
+{
+	PyObject_HEAD
+	overlay_t* overlay;
+	std::shared_mutex* rw; // lookups, saves and getters hold it shared, append exclusive
+} NativeOverlay;
+
+static void NativeOverlay_dealloc(NativeOverlay* self)
+{
+	delete self->overlay;
+	delete self->rw;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject* NativeOverlay_new(PyTypeObject* type, PyObject*, PyObject*)
+{
+	NativeOverlay* self = reinterpret_cast<NativeOverlay*>(type->tp_alloc(type, 0));
+	if (self == nullptr)
+		return nullptr;
+	self->overlay = new (std::nothrow) overlay_t();
+	self->rw = new (std::nothrow) std::shared_mutex();
+	if (self->overlay == nullptr || self->rw == nullptr)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return reinterpret_cast<PyObject*>(self);
+}
+
+// base over keys, built without the GIL ; nullptr with the Python error set on failure
+static overlay_t* build_overlay(const std::vector<uint64_t>& keys, int num_thread, double gamma, unsigned int fingerprint_bits, unsigned int reduction)
+{
+	overlay_t* built = nullptr;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		built = new overlay_t(keys.size(), keys, num_thread, gamma, fingerprint_bits, static_cast<boomphf::mphf_reduction>(reduction));
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		PyErr_NoMemory();
+	else if (!error.empty())
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+	return built;
+}
+
+static int NativeOverlay_init(NativeOverlay* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"n", "input_range", "num_thread", "gamma", "fingerprint_bits", "reduction", nullptr};
+	unsigned long long n = 0;
+	PyObject* input_range = nullptr;
+	int num_thread = 1;
+	double gamma = 2.0;
+	unsigned int fingerprint_bits = 8;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOidII", const_cast<char**>(kwlist),
+	                                 &n, &input_range, &num_thread, &gamma, &fingerprint_bits, &reduction))
+		return -1;
+
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return -1;
+	}
+
+	if (n == 0 || input_range == nullptr || input_range == Py_None)
+		return 0;
+
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return -1;
+	}
+
+	std::vector<uint64_t> keys;
+	if (!collect_keys(input_range, keys))
+		return -1;
+	if (keys.size() != n)
+	{
+		PyErr_SetString(PyExc_ValueError, "n must be the number of keys");
+		return -1;
+	}
+
+	overlay_t* built = build_overlay(keys, num_thread, gamma, fingerprint_bits, reduction);
+	if (built == nullptr)
+		return -1;
+	std::unique_lock<std::shared_mutex> guard(*self->rw);
+	delete self->overlay;
+	self->overlay = built;
+	return 0;
+}
+
+// the delta is built without the GIL but with rw exclusive, lookups from other threads wait for the appended overlay
+static PyObject* NativeOverlay_append(NativeOverlay* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"input_range", "num_thread", "gamma", nullptr};
+	PyObject* input_range;
+	int num_thread = 1;
+	double gamma = 2.0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|id", const_cast<char**>(kwlist), &input_range, &num_thread, &gamma))
+		return nullptr;
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return nullptr;
+	}
+
+	std::vector<uint64_t> keys;
+	if (!collect_keys(input_range, keys))
+		return nullptr;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		std::unique_lock<std::shared_mutex> guard(*self->rw);
+		self->overlay->append(keys.size(), keys, num_thread, gamma);
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		return PyErr_NoMemory();
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	Py_RETURN_NONE;
+}
+
+// overlay_t::compact, the fresh base is built without the GIL so lookups on self go on meanwhile
+static PyObject* NativeOverlay_compact(NativeOverlay* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"input_range", "num_thread", "gamma", nullptr};
+	PyObject* input_range;
+	int num_thread = 1;
+	double gamma = 2.0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|id", const_cast<char**>(kwlist), &input_range, &num_thread, &gamma))
+		return nullptr;
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return nullptr;
+	}
+
+	std::vector<uint64_t> keys;
+	if (!collect_keys(input_range, keys))
+		return nullptr;
+	// read once, an append from another thread may change self during the build (the result lacks its keys)
+	uint64_t nkeys;
+	unsigned int fingerprint_bits, reduction;
+	{
+		std::shared_lock<std::shared_mutex> guard(*self->rw);
+		nkeys = self->overlay->nbKeys();
+		fingerprint_bits = self->overlay->fingerprintBits();
+		reduction = self->overlay->reduction();
+	}
+	if (keys.size() != nkeys)
+	{
+		PyErr_Format(PyExc_ValueError, "Compaction needs the %llu keys of the overlay", (unsigned long long)nkeys);
+		return nullptr;
+	}
+
+	PyObject* obj = PyObject_CallObject(reinterpret_cast<PyObject*>(Py_TYPE(self)), nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	overlay_t* built = build_overlay(keys, num_thread, gamma, fingerprint_bits, reduction);
+	if (built == nullptr)
+	{
+		Py_DECREF(obj);
+		return nullptr;
+	}
+	NativeOverlay* compacted = reinterpret_cast<NativeOverlay*>(obj);
+	delete compacted->overlay;
+	compacted->overlay = built;
+	return obj;
+}
+
+static PyObject* NativeOverlay_lookup(NativeOverlay* self, PyObject* arg)
+{
+	unsigned long long key = PyLong_AsUnsignedLongLongMask(arg);
+	if (key == (unsigned long long)-1 && PyErr_Occurred())
+		return nullptr;
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return lookup_result(self->overlay->lookup(static_cast<uint64_t>(key)));
+}
+
+static PyObject* NativeOverlay_lookup_many(NativeOverlay* self, PyObject* args)
+{
+	PyObject *keys_obj, *out_obj;
+	if (!PyArg_ParseTuple(args, "OO", &keys_obj, &out_obj))
+		return nullptr;
+
+	Py_buffer keys, out;
+	if (!get_u64_buffer(keys_obj, &keys, false))
+		return nullptr;
+	if (!get_u64_buffer(out_obj, &out, true))
+	{
+		PyBuffer_Release(&keys);
+		return nullptr;
+	}
+	if (out.len != keys.len)
+	{
+		PyBuffer_Release(&keys);
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "out must have the same length as keys");
+		return nullptr;
+	}
+
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		std::shared_lock<std::shared_mutex> guard(*self->rw);
+		self->overlay->lookup(static_cast<const uint64_t*>(keys.buf), static_cast<size_t>(keys.len / 8), static_cast<uint64_t*>(out.buf));
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true; // the miss lists of the delta lookups
+	}
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&keys);
+	PyBuffer_Release(&out);
+	if (oom)
+		return PyErr_NoMemory();
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeOverlay_should_compact(NativeOverlay* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"max_deltas", "max_delta_fraction", nullptr};
+	unsigned int max_deltas = MPHF_OVERLAY_MAX_DELTAS;
+	double max_delta_fraction = MPHF_OVERLAY_MAX_DELTA_FRACTION;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Id", const_cast<char**>(kwlist), &max_deltas, &max_delta_fraction))
+		return nullptr;
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyBool_FromLong(self->overlay->shouldCompact(max_deltas, max_delta_fraction));
+}
+
+static PyObject* NativeOverlay_nbKeys(NativeOverlay* self, PyObject*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLongLong(self->overlay->nbKeys());
+}
+
+static PyObject* NativeOverlay_totalBitSize(NativeOverlay* self, PyObject*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLongLong(self->overlay->totalBitSize());
+}
+
+static PyObject* NativeOverlay_save(NativeOverlay* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "checksum", nullptr};
+	PyObject* path_bytes = nullptr;
+	int checksum = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &checksum))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	bool ok;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	std::ofstream os(path, std::ios::binary);
+	ok = static_cast<bool>(os);
+	if (ok)
+	{
+		try
+		{
+			std::shared_lock<std::shared_mutex> guard(*self->rw);
+			self->overlay->save(os, checksum != 0);
+		}
+		catch (const std::bad_alloc&)
+		{
+			oom = true;
+		}
+		os.close();
+		ok = !os.fail();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		return PyErr_NoMemory();
+	if (!ok)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeOverlay_load(PyObject* cls, PyObject* arg)
+{
+	PyObject* path_bytes = nullptr;
+	if (!PyUnicode_FSConverter(arg, &path_bytes))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeOverlay* self = reinterpret_cast<NativeOverlay*>(obj);
+
+	bool ok;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	std::ifstream is(path, std::ios::binary);
+	ok = static_cast<bool>(is);
+	if (ok)
+	{
+		try
+		{
+			std::unique_lock<std::shared_mutex> guard(*self->rw);
+			self->overlay->load(is);
+		}
+		catch (const std::bad_alloc&)
+		{
+			oom = true;
+		}
+		catch (const std::exception& e)
+		{
+			error = e.what();
+		}
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	if (!ok)
+	{
+		Py_DECREF(obj);
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	}
+	return obj;
+}
+
+static PyObject* NativeOverlay_get_nb_segments(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLong(self->overlay->nbSegments());
+}
+
+static PyObject* NativeOverlay_get_nb_overrides(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLongLong(self->overlay->overrides().size());
+}
+
+static PyObject* NativeOverlay_get_base_keys(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLongLong(self->overlay->baseKeys());
+}
+
+static PyObject* NativeOverlay_get_fingerprint_bits(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLong(self->overlay->fingerprintBits());
+}
+
+static PyObject* NativeOverlay_get_reduction(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyLong_FromUnsignedLong(self->overlay->reduction());
+}
+
+static PyObject* NativeOverlay_get_built(NativeOverlay* self, void*)
+{
+	std::shared_lock<std::shared_mutex> guard(*self->rw);
+	return PyBool_FromLong(self->overlay->built());
+}
+
+static PyMethodDef NativeOverlay_methods[] = {
+    {"append", (PyCFunction)(void (*)(void))NativeOverlay_append, METH_VARARGS | METH_KEYWORDS, "append(input_range, num_thread=1, gamma=2.0): delta over keys not in the overlay yet."},
+    {"compact", (PyCFunction)(void (*)(void))NativeOverlay_compact, METH_VARARGS | METH_KEYWORDS, "compact(input_range, num_thread=1, gamma=2.0): new overlay with a single base over all the keys."},
+    {"lookup", (PyCFunction)NativeOverlay_lookup, METH_O, "Return the index of a key, or -1 if it is not in the set."},
+    {"lookup_many", (PyCFunction)NativeOverlay_lookup_many, METH_VARARGS, "lookup_many(keys, out): batched lookup between uint64 buffers, ULLONG_MAX for unknown keys."},
+    {"should_compact", (PyCFunction)(void (*)(void))NativeOverlay_should_compact, METH_VARARGS | METH_KEYWORDS, "should_compact(max_deltas, max_delta_fraction): True past either bound."},
+    {"nbKeys", (PyCFunction)NativeOverlay_nbKeys, METH_NOARGS, "Return the number of keys."},
+    {"totalBitSize", (PyCFunction)NativeOverlay_totalBitSize, METH_NOARGS, "Return the total size in bits."},
+    {"save", (PyCFunction)(void (*)(void))NativeOverlay_save, METH_VARARGS | METH_KEYWORDS, "save(path, checksum=True): save as an overlay container (v2 segments)."},
+    {"load", (PyCFunction)NativeOverlay_load, METH_O | METH_CLASS, "Load an overlay container."},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyGetSetDef NativeOverlay_getset[] = {
+    {"nb_segments", (getter)NativeOverlay_get_nb_segments, nullptr, nullptr, nullptr},
+    {"nb_overrides", (getter)NativeOverlay_get_nb_overrides, nullptr, nullptr, nullptr},
+    {"base_keys", (getter)NativeOverlay_get_base_keys, nullptr, nullptr, nullptr},
+    {"fingerprint_bits", (getter)NativeOverlay_get_fingerprint_bits, nullptr, nullptr, nullptr},
+    {"reduction", (getter)NativeOverlay_get_reduction, nullptr, nullptr, nullptr},
+    {"built", (getter)NativeOverlay_get_built, nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+static PyTypeObject NativeOverlayType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark static_map type
+////////////////////////////////////////////////////////////////
+
+typedef boomphf::static_map<uint64_t, uint64_t, boomphf::SingleHashFunctor<uint64_t>> static_map_t;
+
+typedef struct
+{
+	PyObject_HEAD
+	static_map_t* map;
+} NativeStaticMap;
+
+static void NativeStaticMap_dealloc(NativeStaticMap* self)
+{
+	delete self->map;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject* NativeStaticMap_new(PyTypeObject* type, PyObject*, PyObject*)
+{
+	NativeStaticMap* self = reinterpret_cast<NativeStaticMap*>(type->tp_alloc(type, 0));
+	if (self == nullptr)
+		return nullptr;
+	self->map = new (std::nothrow) static_map_t();
+	if (self->map == nullptr)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return reinterpret_cast<PyObject*>(self);
+}
+
+static int NativeStaticMap_init(NativeStaticMap* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"n", "input_range", "values", "value_bits", "fingerprint_bits", "num_thread", "gamma", "reduction", nullptr};
+	unsigned long long n = 0;
+	PyObject* input_range = nullptr;
+	PyObject* values_obj = nullptr;
+	unsigned int value_bits = 64;
+	unsigned int fingerprint_bits = 0;
+	int num_thread = 1;
+	double gamma = 2.0;
+	unsigned int reduction = boomphf::MPHF_REDUCE_MODULO;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOOIIidI", const_cast<char**>(kwlist),
+	                                 &n, &input_range, &values_obj, &value_bits, &fingerprint_bits, &num_thread, &gamma, &reduction))
+		return -1;
+
+	if (reduction != boomphf::MPHF_REDUCE_MODULO && reduction != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown reduction %u", reduction);
+		return -1;
+	}
+
+	if (n == 0 || input_range == nullptr || input_range == Py_None)
+		return 0;
+
+	if (num_thread < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "num_thread must be >= 1");
+		return -1;
+	}
+
+	std::vector<uint64_t> keys, values;
+	if (!collect_keys(input_range, keys) || values_obj == nullptr || !collect_keys(values_obj, values))
+	{
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_ValueError, "a static map needs values");
+		return -1;
+	}
+	if (keys.size() != n || values.size() != n)
+	{
+		PyErr_SetString(PyExc_ValueError, "n must be the number of keys and of values");
+		return -1;
+	}
+
+	static_map_t* built = nullptr;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		built = new static_map_t(keys.size(), keys, values.data(), value_bits, fingerprint_bits, num_thread, gamma, static_cast<boomphf::mphf_reduction>(reduction));
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	if (!error.empty())
+	{
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return -1;
+	}
+	delete self->map;
+	self->map = built;
+	return 0;
+}
+
+static PyObject* NativeStaticMap_get(NativeStaticMap* self, PyObject* arg)
+{
+	unsigned long long key = PyLong_AsUnsignedLongLongMask(arg);
+	if (key == (unsigned long long)-1 && PyErr_Occurred())
+		return nullptr;
+	uint64_t value;
+	if (!self->map->find(static_cast<uint64_t>(key), value))
+		Py_RETURN_NONE;
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject* NativeStaticMap_get_many(NativeStaticMap* self, PyObject* args)
+{
+	PyObject *keys_obj, *out_obj;
+	unsigned long long missing = 0;
+	if (!PyArg_ParseTuple(args, "OO|K", &keys_obj, &out_obj, &missing))
+		return nullptr;
+
+	Py_buffer keys, out;
+	if (!get_u64_buffer(keys_obj, &keys, false))
+		return nullptr;
+	if (!get_u64_buffer(out_obj, &out, true))
+	{
+		PyBuffer_Release(&keys);
+		return nullptr;
+	}
+	if (out.len != keys.len)
+	{
+		PyBuffer_Release(&keys);
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "out must have the same length as keys");
+		return nullptr;
+	}
+
+	Py_BEGIN_ALLOW_THREADS;
+	self->map->get(static_cast<const uint64_t*>(keys.buf), static_cast<size_t>(keys.len / 8), static_cast<uint64_t*>(out.buf), missing);
+	Py_END_ALLOW_THREADS;
+
+	PyBuffer_Release(&keys);
+	PyBuffer_Release(&out);
+	Py_RETURN_NONE;
+}
+
+static PyObject* NativeStaticMap_nbKeys(NativeStaticMap* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->map->nbKeys());
+}
+
+static PyObject* NativeStaticMap_totalBitSize(NativeStaticMap* self, PyObject*)
+{
+	return PyLong_FromUnsignedLongLong(self->map->totalBitSize());
+}
+
+static PyObject* NativeStaticMap_save(NativeStaticMap* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "checksum", nullptr};
+	PyObject* path_bytes = nullptr;
+	int checksum = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &checksum))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+
+	bool ok;
+	bool oom = false;
+	Py_BEGIN_ALLOW_THREADS;
+	std::ofstream os(path, std::ios::binary);
+	ok = static_cast<bool>(os);
+	if (ok)
+	{
+		try
+		{
+			self->map->save(os, checksum != 0);
+		}
+		catch (const std::bad_alloc&)
+		{
+			oom = true;
+		}
+		os.close();
+		ok = !os.fail();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+		return PyErr_NoMemory();
+	if (!ok)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	Py_RETURN_NONE;
+}
+
+// static_map_t::load (map false) or static_map_t::map of path into a new cls object
+static PyObject* open_static_map(PyObject* cls, const std::string& path, bool map, bool verify)
+{
+	PyObject* obj = PyObject_CallObject(cls, nullptr);
+	if (obj == nullptr)
+		return nullptr;
+	NativeStaticMap* self = reinterpret_cast<NativeStaticMap*>(obj);
+
+	bool os_error = false;
+	bool oom = false;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS;
+	try
+	{
+		if (map)
+		{
+			self->map->map(path, verify);
+		}
+		else
+		{
+			std::ifstream is(path, std::ios::binary);
+			if (!is)
+				throw std::invalid_argument("Error opening " + path);
+			self->map->load(is);
+		}
+	}
+	catch (const std::invalid_argument&)
+	{
+		os_error = true; // opening or mapping path
+	}
+	catch (const std::bad_alloc&)
+	{
+		oom = true;
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS;
+
+	if (oom)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+	if (os_error)
+	{
+		Py_DECREF(obj);
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+	}
+	if (!error.empty())
+	{
+		Py_DECREF(obj);
+		PyErr_SetString(PyExc_ValueError, error.c_str());
+		return nullptr;
+	}
+	return obj;
+}
+
+static PyObject* NativeStaticMap_load(PyObject* cls, PyObject* arg)
+{
+	PyObject* path_bytes = nullptr;
+	if (!PyUnicode_FSConverter(arg, &path_bytes))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+	return open_static_map(cls, path, false, false);
+}
+
+static PyObject* NativeStaticMap_mmap(PyObject* cls, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = {"path", "verify", nullptr};
+	PyObject* path_bytes = nullptr;
+	int verify = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p", const_cast<char**>(kwlist), PyUnicode_FSConverter, &path_bytes, &verify))
+		return nullptr;
+	std::string path(PyBytes_AS_STRING(path_bytes));
+	Py_DECREF(path_bytes);
+	return open_static_map(cls, path, true, verify != 0);
+}
+
+static PyObject* NativeStaticMap_get_value_bits(NativeStaticMap* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->map->valueBits());
+}
+
+static PyObject* NativeStaticMap_get_fingerprint_bits(NativeStaticMap* self, void*)
+{
+	return PyLong_FromUnsignedLong(self->map->fingerprintBits());
+}
+
+static PyObject* NativeStaticMap_get_mapped(NativeStaticMap* self, void*)
+{
+	return PyBool_FromLong(self->map->mapped());
+}
+
+static PyMethodDef NativeStaticMap_methods[] = {
+    {"get", (PyCFunction)NativeStaticMap_get, METH_O, "Return the value of a key, or None if its fingerprint rejects it."},
+    {"get_many", (PyCFunction)NativeStaticMap_get_many, METH_VARARGS, "get_many(keys, out, missing=0): batched get between uint64 buffers, missing for rejected keys."},
+    {"nbKeys", (PyCFunction)NativeStaticMap_nbKeys, METH_NOARGS, "Return the number of keys."},
+    {"totalBitSize", (PyCFunction)NativeStaticMap_totalBitSize, METH_NOARGS, "Return the total size in bits."},
+    {"save", (PyCFunction)(void (*)(void))NativeStaticMap_save, METH_VARARGS | METH_KEYWORDS, "save(path, checksum=True): save as a static map file (v2 mphf)."},
+    {"load", (PyCFunction)NativeStaticMap_load, METH_O | METH_CLASS, "Load a static map file, checksums are verified."},
+    {"mmap", (PyCFunction)(void (*)(void))NativeStaticMap_mmap, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "mmap(path, verify=False): map a static map file read-only, used in place."},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyGetSetDef NativeStaticMap_getset[] = {
+    {"value_bits", (getter)NativeStaticMap_get_value_bits, nullptr, nullptr, nullptr},
+    {"fingerprint_bits", (getter)NativeStaticMap_get_fingerprint_bits, nullptr, nullptr, nullptr},
+    {"mapped", (getter)NativeStaticMap_get_mapped, nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+static PyTypeObject NativeStaticMapType = {
+    PyVarObject_HEAD_INIT(nullptr, 0)};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark module
+////////////////////////////////////////////////////////////////
+
+static struct PyModuleDef native_module = {
+    PyModuleDef_HEAD_INIT,
+    "pybbhash._native",
+    "Compiled BooPHF backend for pybbhash.",
+    -1,
+    nullptr};
+
+PyMODINIT_FUNC PyInit__native(void)
+{
+	NativeMphfType.tp_name = "pybbhash._native.mphf";
+	NativeMphfType.tp_basicsize = sizeof(NativeMphf);
+	NativeMphfType.tp_flags = Py_TPFLAGS_DEFAULT;
+	NativeMphfType.tp_doc = "boomphf::mphf<uint64_t, SingleHasher_t>, SingleHasher_t picked by the hasher id (MPHF_HASHER_*)";
+	NativeMphfType.tp_new = NativeMphf_new;
+	NativeMphfType.tp_init = (initproc)NativeMphf_init;
+	NativeMphfType.tp_dealloc = (destructor)NativeMphf_dealloc;
+	NativeMphfType.tp_methods = NativeMphf_methods;
+	NativeMphfType.tp_getset = NativeMphf_getset;
+
+	NativeShardedType.tp_name = "pybbhash._native.sharded_mphf";
+	NativeShardedType.tp_basicsize = sizeof(NativeSharded);
+	NativeShardedType.tp_flags = Py_TPFLAGS_DEFAULT;
+	NativeShardedType.tp_doc = "boomphf::sharded_mphf<uint64_t, SingleHashFunctor<uint64_t>>";
+	NativeShardedType.tp_new = NativeSharded_new;
+	NativeShardedType.tp_init = (initproc)NativeSharded_init;
+	NativeShardedType.tp_dealloc = (destructor)NativeSharded_dealloc;
+	NativeShardedType.tp_methods = NativeSharded_methods;
+	NativeShardedType.tp_getset = NativeSharded_getset;
+
+	NativeOverlayType.tp_name = "pybbhash._native.overlay_mphf";
+	NativeOverlayType.tp_basicsize = sizeof(NativeOverlay);
+	NativeOverlayType.tp_flags = Py_TPFLAGS_DEFAULT;
+	NativeOverlayType.tp_doc = "boomphf::overlay_mphf<uint64_t, SingleHashFunctor<uint64_t>>";
+	NativeOverlayType.tp_new = NativeOverlay_new;
+	NativeOverlayType.tp_init = (initproc)NativeOverlay_init;
+	NativeOverlayType.tp_dealloc = (destructor)NativeOverlay_dealloc;
+	NativeOverlayType.tp_methods = NativeOverlay_methods;
+	NativeOverlayType.tp_getset = NativeOverlay_getset;
+
+	NativeStaticMapType.tp_name = "pybbhash._native.static_map";
+	NativeStaticMapType.tp_basicsize = sizeof(NativeStaticMap);
+	NativeStaticMapType.tp_flags = Py_TPFLAGS_DEFAULT;
+	NativeStaticMapType.tp_doc = "boomphf::static_map<uint64_t, uint64_t, SingleHashFunctor<uint64_t>>";
+	NativeStaticMapType.tp_new = NativeStaticMap_new;
+	NativeStaticMapType.tp_init = (initproc)NativeStaticMap_init;
+	NativeStaticMapType.tp_dealloc = (destructor)NativeStaticMap_dealloc;
+	NativeStaticMapType.tp_methods = NativeStaticMap_methods;
+	NativeStaticMapType.tp_getset = NativeStaticMap_getset;
+
+	if (PyType_Ready(&NativeMphfType) < 0 || PyType_Ready(&NativeShardedType) < 0 || PyType_Ready(&NativeOverlayType) < 0 || PyType_Ready(&NativeStaticMapType) < 0)
+		return nullptr;
+
+	PyObject* m = PyModule_Create(&native_module);
+	if (m == nullptr)
+		return nullptr;
+
+	Py_INCREF(&NativeMphfType);
+	if (PyModule_AddObject(m, "mphf", reinterpret_cast<PyObject*>(&NativeMphfType)) < 0)
+	{
+		Py_DECREF(&NativeMphfType);
+		Py_DECREF(m);
+		return nullptr;
+	}
+	Py_INCREF(&NativeShardedType);
+	if (PyModule_AddObject(m, "sharded_mphf", reinterpret_cast<PyObject*>(&NativeShardedType)) < 0)
+	{
+		Py_DECREF(&NativeShardedType);
+		Py_DECREF(m);
+		return nullptr;
+	}
+	Py_INCREF(&NativeOverlayType);
+	if (PyModule_AddObject(m, "overlay_mphf", reinterpret_cast<PyObject*>(&NativeOverlayType)) < 0)
+	{
+		Py_DECREF(&NativeOverlayType);
+		Py_DECREF(m);
+		return nullptr;
+	}
+	Py_INCREF(&NativeStaticMapType);
+	if (PyModule_AddObject(m, "static_map", reinterpret_cast<PyObject*>(&NativeStaticMapType)) < 0)
+	{
+		Py_DECREF(&NativeStaticMapType);
+		Py_DECREF(m);
+		return nullptr;
+	}
+	return m;
+}
@@ -4,9 +4,18 @@ This is a minimal port of the C++ `bitVector` used by BooPHF. It's not optimized
 for memory or speed; it aims to preserve the semantics needed by the MPH builder.
 """
 
-from typing import List
+import sys
+from array import array
+from typing import Tuple, Union
 
 WORDSZ = 64
+MASK64 = (1 << 64) - 1
+
+# in-memory rank layouts, same values as the C++ rank_layout enum
+RANK_LAYOUTS = ("flat", "interleaved")
+# interleaved: lines of 8 words, the rank before the line then 7 words (448 bits)
+LINE_WORDS = 8
+LINE_BITS = 448
 
 
 if hasattr(int, "bit_count"):  # Python ≥ 3.10
@@ -23,16 +32,19 @@ class bitvector:
         self._size = int(nbits)
         # number of 64-bit words
         self._nchar = 1 + (self._size // WORDSZ) if self._size > 0 else 0
-        # underlying array of python ints (represent 64-bit words)
-        self._bitArray: List[int] = [0] * self._nchar
+        # underlying 64-bit words; array('Q') or a read-only memoryview after map()
+        self._bitArray = array("Q", bytes(8 * self._nchar))
         # ranks sampling array (same idea as C++ implementation)
         self._nb_bits_per_rank_sample = 512
-        self._ranks: List[int] = []
+        self._ranks = array("Q")
+        # interleaved layout (see interleave()), None when flat
+        self._lines = None
 
     def resize(self, newsize: int):
         self._size = int(newsize)
         self._nchar = 1 + (self._size // WORDSZ) if self._size > 0 else 0
-        self._bitArray = [0] * self._nchar
+        self._bitArray = array("Q", bytes(8 * self._nchar))
+        self._lines = None
 
     def size(self) -> int:
         return self._size
@@ -41,17 +53,26 @@ class bitvector:
         for i in range(self._nchar):
             self._bitArray[i] = 0
 
-    def clearCollisions(self, start: int, size: int, cc: 'bitvector'):
+    def clearCollisions(self, start: int, size: int, cc: 'bitvector') -> int:
+        """Clear the bits set in cc, return how many positions were set in cc."""
         assert start & 63 == 0
         assert size & 63 == 0
         ids = start // 64
+        ncleared = 0
         for ii in range(size // 64):
-            self._bitArray[ids + ii] &= ~(cc.get64(ii))
+            word = cc.get64(ii)
+            if word:
+                ncleared += popcount64(word)
+                self._bitArray[ids + ii] &= ~word & MASK64
         cc.clear()
+        return ncleared
 
     def get(self, pos: int) -> int:
         if pos < 0 or pos >= self._size:
             return 0
+        if self._lines is not None:
+            line, bit = divmod(pos, LINE_BITS)
+            return (self._lines[line * LINE_WORDS + 1 + (bit >> 6)] >> (bit & 63)) & 1
         return (self._bitArray[pos >> 6] >> (pos & 63)) & 1
 
     # name preserved: non-atomic test-and-set (single-threaded)
@@ -63,6 +84,9 @@ class bitvector:
         return old
 
     def get64(self, cell64: int) -> int:
+        if self._lines is not None:
+            line, word = divmod(cell64, LINE_WORDS - 1)
+            return self._lines[line * LINE_WORDS + 1 + word]
         return self._bitArray[cell64]
 
     def set(self, pos: int):
@@ -71,15 +95,58 @@ class bitvector:
 
     def reset(self, pos: int):
         idx = pos >> 6
-        self._bitArray[idx] &= ~(1 << (pos & 63))
+        self._bitArray[idx] &= ~(1 << (pos & 63)) & MASK64
 
     def bitSize(self) -> int:
         # bits used by array + ranks (approx)
+        if self._lines is not None:
+            return len(self._lines) * WORDSZ
         return self._nchar * WORDSZ + len(self._ranks) * WORDSZ
 
+    def rankBitSize(self) -> int:
+        # part of bitSize() spent on ranks (and line padding)
+        return self.bitSize() - self._nchar * WORDSZ
+
+    def layout(self) -> str:
+        return "flat" if self._lines is None else "interleaved"
+
+    def interleave(self) -> None:
+        """Switch a ranked vector to the interleaved layout (read-only afterwards), as C++ bitVector::interleave."""
+        if self._lines is not None:
+            return
+        per_line = LINE_WORDS - 1
+        nlines = -(-self._nchar // per_line)
+        lines = array("Q", bytes(8 * LINE_WORDS * nlines))
+        cur_rank = self._ranks[0]
+        for ll in range(nlines):
+            first = ll * per_line
+            chunk = array("Q", self._bitArray[first:first + per_line])
+            lines[ll * LINE_WORDS] = cur_rank
+            lines[ll * LINE_WORDS + 1:ll * LINE_WORDS + 1 + len(chunk)] = chunk
+            cur_rank += sum(popcount64(w) for w in chunk)
+        self._lines = lines
+        self._bitArray = array("Q")
+        self._ranks = array("Q")
+
+    def flattened(self) -> "bitvector":
+        """Flat copy of this vector, with the same ranks."""
+        flat = bitvector(self._size)
+        flat._bitArray = array("Q", (self.get64(ii) for ii in range(self._nchar)))
+        flat.build_ranks(self._lines[0] if self._lines is not None else self._ranks[0])
+        return flat
+
+    def set_layout(self, layout: str) -> None:
+        if layout not in RANK_LAYOUTS:
+            raise ValueError(f"unknown rank layout {layout!r} (expected one of {RANK_LAYOUTS})")
+        if layout == "interleaved":
+            self.interleave()
+        elif self._lines is not None:
+            flat = self.flattened()
+            self._bitArray, self._ranks, self._lines = flat._bitArray, flat._ranks, None
+
     def build_ranks(self, offset: int = 0) -> int:
         # compute sampled ranks per _nb_bits_per_rank_sample
-        self._ranks = []
+        self._ranks = array("Q")
         cur_rank = offset
         for i in range(self._nchar):
             if ((i * WORDSZ) % self._nb_bits_per_rank_sample) == 0:
@@ -90,6 +157,13 @@ class bitvector:
     def rank(self, pos: int) -> int:
         if pos >= self._size:
             pos = self._size - 1
+        if self._lines is not None:
+            line, bit = divmod(pos, LINE_BITS)
+            base = line * LINE_WORDS
+            r = self._lines[base]
+            for w in range(bit >> 6):
+                r += popcount64(self._lines[base + 1 + w])
+            return r + popcount64(self._lines[base + 1 + (bit >> 6)] & ((1 << (bit & 63)) - 1))
         word_idx = pos // WORDSZ
         word_offset = pos % WORDSZ
         block = pos // self._nb_bits_per_rank_sample
@@ -111,18 +185,20 @@ class bitvector:
         Compatible with C++ bitVector::save format."""
         import struct
 
+        if self._lines is not None:
+            self.flattened().save(os)
+            return
+
         # Write _size (uint64_t)
         os.write(struct.pack("<Q", self._size))
         # Write _nchar (uint64_t)
         os.write(struct.pack("<Q", self._nchar))
         # Write _bitArray (array of uint64_t)
-        for w in self._bitArray:
-            os.write(struct.pack("<Q", w & ((1 << 64) - 1)))
+        os.write(words_to_bytes(self._bitArray))
         # Write ranks size (uint64_t)
         os.write(struct.pack("<Q", len(self._ranks)))
         # Write _ranks (array of uint64_t)
-        for r in self._ranks:
-            os.write(struct.pack("<Q", r))
+        os.write(words_to_bytes(self._ranks))
 
     @staticmethod
     def load(is_stream):
@@ -140,15 +216,71 @@ class bitvector:
         # Read _nchar (uint64_t)
         bv._nchar = struct.unpack("<Q", is_stream.read(8))[0]
         # Read _bitArray
-        bv._bitArray = []
-        for _ in range(bv._nchar):
-            w = struct.unpack("<Q", is_stream.read(8))[0]
-            bv._bitArray.append(w)
+        bv._bitArray = _read_words(is_stream, bv._nchar)
         # Read ranks size
         sizer = struct.unpack("<Q", is_stream.read(8))[0]
         # Read _ranks
-        bv._ranks = []
-        for _ in range(sizer):
-            r = struct.unpack("<Q", is_stream.read(8))[0]
-            bv._ranks.append(r)
+        bv._ranks = _read_words(is_stream, sizer)
         return bv
+
+    @staticmethod
+    def map(buf, offset: int = 0) -> Tuple["bitvector", int]:
+        """Zero-copy load of a record written by save() inside buf (e.g. an mmap).
+        Words are read in place, the result is read-only and keeps buf alive.
+        Returns the bitvector and the offset just past the record. Little-endian hosts only."""
+        import struct
+
+        mv = memoryview(buf).cast("B")
+        if len(mv) - offset < 16:
+            raise ValueError("truncated bitvector record")
+        size, nchar = struct.unpack_from("<QQ", mv, offset)
+        offset += 16
+        if nchar != 1 + size // WORDSZ or len(mv) - offset < 8 * (nchar + 1):
+            raise ValueError("truncated bitvector record")
+        bits = mv[offset:offset + 8 * nchar]
+        offset += 8 * nchar
+        sizer = struct.unpack_from("<Q", mv, offset)[0]
+        offset += 8
+        if len(mv) - offset < 8 * sizer:
+            raise ValueError("truncated bitvector record")
+        bv = bitvector.from_words(size, bits, mv[offset:offset + 8 * sizer], copy=False)
+        return bv, offset + 8 * sizer
+
+    @staticmethod
+    def from_words(size: int, bits, ranks, copy: bool = True) -> "bitvector":
+        """Build a bitvector of size bits from little-endian word buffers (v2 file sections).
+        With copy=False the buffers are used in place (little-endian hosts only)."""
+        bv = bitvector(0)
+        bv._size = size
+        bv._nchar = 1 + size // WORDSZ
+        bv._bitArray = words_from_bytes(bits, copy)
+        bv._ranks = words_from_bytes(ranks, copy)
+        return bv
+
+
+def words_to_bytes(words) -> Union[bytes, memoryview]:
+    """Serialize 64-bit words as little-endian uint64, like the C++ writer on x86/arm.
+    On little-endian hosts this is a byte view of words, written without a copy."""
+    if sys.byteorder == "little":
+        return memoryview(words).cast("B")
+    swapped = array("Q", words)
+    swapped.byteswap()
+    return swapped.tobytes()
+
+
+def words_from_bytes(buf, copy: bool = True):
+    """Inverse of words_to_bytes: an array('Q'), or a 'Q' memoryview over buf if not copy."""
+    if not copy:
+        return memoryview(buf).cast("B").cast("Q")
+    words = array("Q")
+    words.frombytes(buf)
+    if sys.byteorder != "little":
+        words.byteswap()
+    return words
+
+
+def _read_words(is_stream, count: int) -> array:
+    data = is_stream.read(8 * count)
+    if len(data) != 8 * count:
+        raise EOFError("truncated bitvector record")
+    return words_from_bytes(data)
@@ -3,15 +3,242 @@
 This is a simplified port intended for correctness and clarity rather than speed.
 """
 
-from typing import Iterable, Dict, List, Tuple, Optional, Union
+from typing import Any, Callable, Iterable, Dict, List, Tuple, Optional, Union
 from pathlib import Path
+from array import array
+from bisect import bisect_left
+from concurrent.futures import Future, ThreadPoolExecutor
+import io
+import mmap as _mmap
+import os
+import struct
+import sys
+import tempfile
+import threading
+import time
+import zlib
 
-from pybbhash.bitvector import bitvector
-from pybbhash.hashfunctors import XorshiftHashFunctors, SingleHashFunctor
+from pybbhash import fileformat
+from pybbhash.bitvector import RANK_LAYOUTS, bitvector, words_from_bytes, words_to_bytes
+from pybbhash.hashfunctors import HASHERS, SINGLE_HASHERS, XorshiftHashFunctors, SingleHashFunctor, murmur3_128
 import math
 
+try:  # optional compiled backend (see setup.py)
+    from pybbhash import _native
+except ImportError:
+    _native = None
+
 hash_pair_t = Tuple[int, int]
 
+# lookup_many marks keys not in the set with ULLONG_MAX (-1 seen as int64), like the C++ lookup
+ULLONG_MAX = (1 << 64) - 1
+
+# seed of the fingerprint hash, not one of the XorshiftHashFunctors or shard seeds (C++ MPHF_FINGERPRINT_SEED)
+FINGERPRINT_SEED = 0x3C6EF372FE94F82B
+
+# levels of an mphf by default, the last one is the final table's (C++ MPHF_NB_LEVELS)
+NB_LEVELS = 25
+
+# hot key cache defaults (C++ MPHF_HOT_SLOTS, MPHF_HOT_MIN_LEVEL)
+HOT_SLOTS = 4096
+HOT_MIN_LEVEL = 2
+
+
+ProgressCallback = Callable[[Dict[str, Any]], None]
+
+
+def console_progress(info: Dict[str, Any]) -> None:
+    """Progress callback of progress=True: one line on stderr, same as the C++ console_progress."""
+    fraction = min(1.0, info["done"] / info["total"]) if info["total"] > 0 else 1.0
+    remaining = info["seconds"] * (1.0 - fraction) / fraction if fraction > 0 else 0.0
+    min_e, min_r = int(info["seconds"] // 60), int(remaining // 60)
+    sys.stderr.write(f"\r[Building BooPHF]  {100 * fraction:<5.3g}%   level {info['level']:2d}   "
+                     f"elapsed: {min_e:3d} min {info['seconds'] - min_e * 60:<2.0f} sec   "
+                     f"remaining: {min_r:3d} min {remaining - min_r * 60:<2.0f} sec" + ("\n" if info["finished"] else ""))
+    sys.stderr.flush()
+
+
+def _progress_callback(progress) -> Optional[ProgressCallback]:
+    # progress argument of the builds: a callable, or a bool selecting console_progress
+    if callable(progress):
+        return progress
+    return console_progress if progress else None
+
+
+def native_available() -> bool:
+    """Return True if the compiled BooPHF backend is installed."""
+    return _native is not None
+
+
+def _use_native(backend: Optional[str]) -> bool:
+    if backend is None:
+        return _native is not None
+    if backend == "native":
+        if _native is None:
+            raise ImportError("pybbhash native backend is not built")
+        return True
+    if backend == "python":
+        return False
+    raise ValueError(f"unknown backend {backend!r} (expected 'native', 'python' or None)")
+
+
+def _u64_view(buf, writable: bool = False) -> memoryview:
+    # 1-d contiguous buffer of 64-bit integers (array('Q'), numpy uint64/int64, memoryview)
+    mv = memoryview(buf)
+    if mv.ndim > 1 or mv.itemsize != 8 or mv.format.lstrip("@=<") not in ("Q", "q", "L", "l"):
+        raise TypeError("expected a contiguous 1-d buffer of native 64-bit integers")
+    if writable and mv.readonly:
+        raise TypeError("output buffer is read-only")
+    return mv.cast("B").cast("Q")
+
+
+# save/load num_thread > 1 split the file in pieces of IO_CHUNK bytes, same as the C++ MPHF_IO_CHUNK
+IO_CHUNK = 4 << 20
+
+
+class _positional_writer:
+    """File-like sink keeping the written buffers with their offsets, flushed by pwrite at those offsets."""
+
+    def __init__(self):
+        self.pieces = []
+        self.pos = 0
+
+    def write(self, data) -> None:
+        data = memoryview(data).cast("B")
+        self.pieces.append((self.pos, data))
+        self.pos += len(data)
+
+    def flush_to(self, fpath: Union[str, Path], num_thread: int) -> None:
+        chunks = [(offset + ii, data[ii:ii + IO_CHUNK]) for offset, data in self.pieces for ii in range(0, len(data), IO_CHUNK)]
+        fd = os.open(fpath, os.O_WRONLY | os.O_CREAT | os.O_TRUNC | getattr(os, "O_BINARY", 0), 0o666)
+        try:
+            os.ftruncate(fd, self.pos)  # padding reads back as zeros
+
+            def transfer(chunk):
+                offset, data = chunk
+                while len(data):
+                    written = os.pwrite(fd, data, offset)
+                    offset += written
+                    data = data[written:]
+
+            with ThreadPoolExecutor(num_thread) as pool:
+                list(pool.map(transfer, chunks))
+        finally:
+            os.close(fd)
+
+
+def _read_file(fpath: Union[str, Path], num_thread: int) -> bytearray:
+    # whole file, IO_CHUNK pieces read in place on num_thread threads
+    with open(fpath, "rb") as f:
+        buf = bytearray(os.fstat(f.fileno()).st_size)
+        mv = memoryview(buf)
+        fd = f.fileno()
+
+        def transfer(offset):
+            chunk = mv[offset:offset + IO_CHUNK]
+            while len(chunk):
+                nread = os.preadv(fd, [chunk], offset)
+                if nread == 0:
+                    raise ValueError(f"truncated mphf file {fpath}")
+                offset += nread
+                chunk = chunk[nread:]
+
+        with ThreadPoolExecutor(num_thread) as pool:
+            list(pool.map(transfer, range(0, len(buf), IO_CHUNK)))
+    return buf
+
+
+def _positional_io(num_thread: int) -> bool:
+    return num_thread > 1 and hasattr(os, "pwrite") and hasattr(os, "preadv")
+
+
+class packed_keys:
+    """str / bytes keys packed in one data blob with n + 1 uint64 offsets.
+
+    Key ii is data[offsets[ii]:offsets[ii + 1]]; offsets is any 1-d buffer of
+    64-bit integers, data any bytes-like object. Builds and lookups read them
+    in place (from_keys packs a list, str keys are UTF-8 encoded).
+    """
+
+    def __init__(self, offsets, data):
+        self.offsets = offsets
+        self.data = data
+        self._offsets = _u64_view(offsets)
+        if len(self._offsets) == 0:
+            raise ValueError("offsets holds n + 1 positions")
+
+    @classmethod
+    def from_keys(cls, keys: Iterable[Union[str, bytes]]) -> "packed_keys":
+        data = bytearray()
+        offsets = array("Q", [0])
+        for key in keys:
+            data += _key_bytes(key)
+            offsets.append(len(data))
+        return cls(offsets, data)
+
+    def __len__(self) -> int:
+        return len(self._offsets) - 1
+
+    def __iter__(self):
+        blob = memoryview(self.data).cast("B")
+        begin = self._offsets[0]
+        for end in self._offsets[1:]:
+            if end < begin or end > len(blob):
+                raise ValueError("packed key offsets must be non-decreasing and within data")
+            yield bytes(blob[begin:end])
+            begin = end
+
+
+def _key_bytes(key) -> bytes:
+    if isinstance(key, str):
+        return key.encode("utf-8")
+    if isinstance(key, (bytes, bytearray, memoryview)):
+        return bytes(key)
+    raise TypeError(f"string keys are str or bytes, not {type(key).__name__}")
+
+
+def _string_keys(keys) -> Optional[packed_keys]:
+    # packed_keys, or a list / tuple of str / bytes keys; None for integer keys
+    if isinstance(keys, packed_keys):
+        return keys
+    if isinstance(keys, (list, tuple)) and keys and isinstance(keys[0], (str, bytes, bytearray, memoryview)):
+        return packed_keys.from_keys(keys)
+    return None
+
+
+def _key128(key: bytes) -> int:
+    # string key as the 128-bit integer h1 | h2 << 64 the levels hash (Key128HashFunctor)
+    h1, h2 = murmur3_128(key)
+    return h1 | (h2 << 64)
+
+
+def _final_key(key: int) -> int:
+    # final table key: the key itself, the 64-bit fingerprint h1 ^ h2 of a 128-bit string key
+    return (key ^ (key >> 64)) & ULLONG_MAX
+
+
+def _hot_slot(h0: int, slot_bits: int) -> int:
+    # slot of a key from its level 0 hash (C++ hot_key_table::slotOf)
+    return ((h0 * 0x9E3779B97F4A7C15) & ULLONG_MAX) >> (64 - slot_bits)
+
+
+def _packed_get(words, idx: int, bits: int) -> int:
+    # slot idx of bits bits packed in uint64 words (C++ fingerprint_array::get)
+    pos = idx * bits
+    word, shift = pos >> 6, pos & 63
+    value = words[word] >> shift
+    if shift + bits > 64:
+        value |= words[word + 1] << (64 - shift)
+    return value & ((1 << bits) - 1)
+
+
+def _packed_or(words: List[int], idx: int, bits: int, value: int) -> None:
+    # ORs value into slot idx of words (C++ fingerprint_array::set)
+    pos = idx * bits
+    words[pos >> 6] |= (value << (pos & 63)) & ULLONG_MAX
+    if (pos & 63) + bits > 64:
+        words[(pos >> 6) + 1] |= value >> (64 - (pos & 63))
+
 
 def fastrange64(word: int, p: int) -> int:
     if p == 0:
@@ -19,15 +246,29 @@ def fastrange64(word: int, p: int) -> int:
     return word % p
 
 
+def multiply_high64(word: int, p: int) -> int:
+    # Lemire's multiply-high reduction, (word * p) >> 64
+    return (word * p) >> 64
+
+
+# how levels map a hash to [0, hash_domain); same order as the C++ mphf_reduction enum
+REDUCTIONS = ("modulo", "multiply")
+
+
 class level:
-    def __init__(self, idx_begin=0, hash_domain=0):
+    def __init__(self, idx_begin=0, hash_domain=0, reduction="modulo"):
         self.idx_begin = idx_begin
         self.hash_domain = hash_domain
+        self.reduction = reduction
         self.bitset = bitvector(hash_domain)
 
+    def reduce(self, hash_raw: int) -> int:
+        if self.reduction == "multiply":
+            return multiply_high64(hash_raw, self.hash_domain)
+        return fastrange64(hash_raw, self.hash_domain)
+
     def get(self, hash_raw: int) -> int:
-        hashi = fastrange64(hash_raw, self.hash_domain)
-        return self.bitset.get(hashi)
+        return self.bitset.get(self.reduce(hash_raw))
 
 
 class mphf:
@@ -38,49 +279,198 @@ class mphf:
         num_thread: int = 1,
         gamma: float = 2.0,
         writeEach: bool = False,
-        progress: bool = False,
+        progress: Union[bool, ProgressCallback] = False,
         perc_elem_loaded: float = 0.03,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+        tmp_dir: Optional[Union[str, Path]] = None,
+        hasher: str = "hash64",
+        fingerprint_bits: int = 0,
+        progress_interval: float = 1.0,
+        gamma_schedule: Optional[Iterable[float]] = None,
+        min_level_keys: int = 0,
+        max_levels: int = NB_LEVELS,
     ):
-        # single-threaded implementation: ignore num_thread
+        # backend=None uses the compiled backend when installed, "python" forces this port
+        # reduction="multiply" replaces the per-level modulo by a multiply-high (files must be saved as v2)
+        # writeEach (native only) spills the keys of each level to per-thread files in tmp_dir (default: cwd)
+        # hasher picks the single hasher of the levels (HASHERS), v2 files record it, v1 files only hold "hash64"
+        # str / bytes keys (a list or packed_keys) are hashed once with murmur3_128 and take hasher "key128"
+        # fingerprint_bits > 0 stores a fingerprint of each key by its index (v2 files only), lookup then returns -1
+        # for keys not in the set but with probability 2**-fingerprint_bits; input_range is read twice (iterators are listed)
+        # progress is a callable receiving {done, total, level, seconds, finished} every progress_interval seconds
+        # and once finished (done == total), or True for console_progress; total estimates the keys read by the levels
+        # gamma_schedule gives level ii gamma_schedule[ii] bits per key reaching it (the last gamma past its end, it replaces
+        # gamma), uneven gammas are saved as v2 only; levels stop at max_levels or at the first one fewer than
+        # min_level_keys keys are expected to reach, those go to the final table (C++ mphf_level_schedule)
+        if reduction not in REDUCTIONS:
+            raise ValueError(f"unknown reduction {reduction!r} (expected one of {REDUCTIONS})")
+        if hasher not in HASHERS:
+            raise ValueError(f"unknown hasher {hasher!r} (expected one of {HASHERS})")
+        strings = _string_keys(input_range)
+        if strings is not None:
+            if hasher not in ("hash64", "key128"):
+                raise ValueError(f"string keys are hashed with hasher 'key128', not {hasher!r}")
+            if len(strings) != n:
+                raise ValueError("n must be the number of string keys")
+            hasher = "key128"
+        elif hasher == "key128" and input_range is not None:
+            raise ValueError("hasher 'key128' takes str / bytes keys")
+        if not 0 <= fingerprint_bits <= fileformat.FINGERPRINT_BITS_MAX:
+            raise ValueError(f"fingerprint_bits must be 0 to {fileformat.FINGERPRINT_BITS_MAX}")
+        if not progress_interval > 0:
+            raise ValueError("progress_interval must be > 0")
+        gammas = [float(g) for g in gamma_schedule] if gamma_schedule is not None else []
+        if not all(0.0 < g < math.inf for g in gammas):
+            raise ValueError("gamma_schedule gammas must be > 0")
+        if max_levels < 2:
+            raise ValueError("max_levels must be >= 2")
+        if min_level_keys < 0:
+            raise ValueError("min_level_keys must be >= 0")
+        if gammas:
+            # one gamma repeated is the BBHash schedule, sized and saved as such
+            gamma = gammas[0]
+            if all(g == gamma for g in gammas):
+                gammas = []
+        self._gammas = gammas
+        self._scheduled = bool(gammas)  # level sizes do not follow from gamma (FLAG_LEVEL_DOMAINS)
+        self._min_level_keys = int(min_level_keys)
+        self._max_levels = int(max_levels)
+        self._reduction = reduction
+        self._hasher_name = hasher
+        self._native = None
+        self._mmap = None  # set by mphf.mmap(), keeps the mapped bitsets valid
         self._gamma = gamma
         self._hash_domain = int(math.ceil(float(n) * gamma)) if n > 0 else 0
         self._nelem = int(n)
-        self._num_thread = 1
+        self._num_thread = max(1, int(num_thread))  # default of lookup_many (pure-Python builds are single-threaded)
         self._percent_elem_loaded_for_fastMode = perc_elem_loaded
-        self._withprogress = progress
+        self._progress = _progress_callback(progress)
+        self._progress_interval = float(progress_interval)
+        self._withprogress = self._progress is not None
         self._fastmode = False
         self._writeEachLevel = writeEach
-        self._final_hash: Dict[int, int] = {}
+        # final level: keys sorted, values in key order (see _set_final_table)
+        self._final_keys = array("Q")
+        self._final_values = array("Q")
         self._levels: List[level] = []
         self._nb_levels = 0
-        self._hasher = XorshiftHashFunctors(SingleHashFunctor())
+        self._hasher = XorshiftHashFunctors(SINGLE_HASHERS[HASHERS.index(hasher)]())
         self._lastbitsetrank = 0
+        self._stats = {"levels": [], "fast_mode_level": -1, "seconds": 0.0}  # build counters, see build_stats()
+        self._fingerprint_bits = 0
+        self._fingerprints = array("Q")  # packed, same layout as the v2 fingerprints section
+        self._hot_bits = 0  # hot key cache of 2**_hot_bits slots, see build_hot_cache
+        self._hot_keys = array("Q")
+        self._hot_indices = array("Q")
+        self._hot_min_level = HOT_MIN_LEVEL
 
         if self._nelem == 0 or input_range is None:
             self._built = False
             return
 
+        if _use_native(backend) and strings is not None:
+            self._native = _native.mphf.from_packed(
+                strings.offsets, strings.data, max(1, int(num_thread)), float(gamma), bool(writeEach),
+                progress, float(perc_elem_loaded), REDUCTIONS.index(reduction), "." if tmp_dir is None else tmp_dir,
+                int(fingerprint_bits), float(progress_interval), gammas or None, self._min_level_keys, self._max_levels,
+            )
+            self._sync_native()
+            return
+
+        if _use_native(backend):
+            self._native = _native.mphf(
+                self._nelem, input_range, max(1, int(num_thread)), float(gamma),
+                bool(writeEach), progress, float(perc_elem_loaded), REDUCTIONS.index(reduction),
+                "." if tmp_dir is None else tmp_dir, HASHERS.index(hasher), int(fingerprint_bits), float(progress_interval),
+                gammas or None, self._min_level_keys, self._max_levels,
+            )
+            self._sync_native()
+            return
+
         if self._percent_elem_loaded_for_fastMode > 0.0:
             self._fastmode = True
 
+        if fingerprint_bits and strings is None and iter(input_range) is input_range:
+            input_range = list(input_range)  # read again for the fingerprints
+
+        build_start = time.perf_counter()
         self.setup()
+        self._stats["fast_mode_level"] = self._fastModeLevel if self._fastmode else -1
+        self._progress_start = self._progress_last = build_start
 
         offset = 0
+        # input_range is read once: each level returns the keys that reached it
+        # and the next level only scans those (generators work)
+        keys = input_range if strings is None else (_key128(key) for key in strings)
         for ii in range(self._nb_levels):
+            level_start = time.perf_counter()
             self._tempBitset = bitvector(self._levels[ii].hash_domain)
             # process level
-            self.processLevel(input_range, ii)
+            keys = self.processLevel(keys, ii)
             # clear collisions
-            self._levels[ii].bitset.clearCollisions(0, self._levels[ii].hash_domain, self._tempBitset)
+            collisions = self._levels[ii].bitset.clearCollisions(0, self._levels[ii].hash_domain, self._tempBitset)
 
-            offset = self._levels[ii].bitset.build_ranks(offset)
+            next_offset = self._levels[ii].bitset.build_ranks(offset)
+            self._stats["levels"].append({
+                "keys_in": self._cptLevel, "keys_read": self._cptRead, "keys_placed": next_offset - offset,
+                "collisions": collisions, "spill_bytes_written": 0, "spill_bytes_read": 0,
+                "seconds": time.perf_counter() - level_start,
+            })
+            offset = next_offset
             del self._tempBitset
 
         self._lastbitsetrank = offset
+        self._set_final_table(self._final_entries)
+        if len(self._final_keys) != len(self._final_entries):
+            # every copy of a repeated key falls through all the levels, the table keeps one
+            if strings is None:
+                raise ValueError("Keys repeated in the final level, the input has duplicate keys")
+            raise ValueError("Keys with the same final level fingerprint, the input has duplicate keys")
+        del self._final_entries
+        self._stats["levels"][-1]["keys_placed"] = len(self._final_keys)
+        self._stats["seconds"] = time.perf_counter() - build_start
+        if self._withprogress:
+            self._report_progress(self._cptTotalProcessed, self._nb_levels - 1, finished=True)
         self._built = True
+        if fingerprint_bits:
+            self._add_fingerprints(input_range if strings is None else (_key128(key) for key in strings), fingerprint_bits)
+
+    def _sync_native(self):
+        # mirror the native object's metadata so callers see the same attributes as the pure port
+        self._gamma = self._native.gamma
+        self._nelem = self._native.nbKeys()
+        self._nb_levels = self._native.nb_levels
+        self._scheduled = self._native.scheduled
+        self._lastbitsetrank = self._native.lastbitsetrank
+        self._reduction = REDUCTIONS[self._native.reduction]
+        self._hasher_name = HASHERS[self._native.hasher]
+        self._fingerprint_bits = self._native.fingerprint_bits
+        self._set_final_table(self._native.final_hash().items())
+        self._levels = []
+        self._built = self._native.built
+
+    @property
+    def _final_hash(self) -> Dict[int, int]:
+        # dict view of the final table, for inspection; lookups bisect the arrays
+        return dict(zip(self._final_keys, self._final_values))
+
+    def _set_final_table(self, entries: Iterable[Tuple[int, int]]) -> None:
+        # flat arrays sorted by key: 16 bytes per key instead of a dict entry,
+        # and the same layout as the v2 final keys/values sections
+        self._final_keys = array("Q")
+        self._final_values = array("Q")
+        previous = None
+        for key, value in sorted(entries):
+            if key == previous:
+                continue  # a key inserted twice keeps its smallest value, like the C++ table
+            self._final_keys.append(key)
+            self._final_values.append(value)
+            previous = key
 
     def setup(self):
         self._cptTotalProcessed = 0
+        self._final_entries: List[Tuple[int, int]] = []
         if self._fastmode:
             # pre-allocate setLevelFastmode size
             self.setLevelFastmode = [0] * int(
@@ -89,35 +479,75 @@ class mphf:
         else:
             self.setLevelFastmode = []
 
-        self._proba_collision = 1.0 - pow(
-            ((self._gamma * float(self._nelem) - 1) / (self._gamma * float(self._nelem))),
-            max(1, self._nelem - 1),
-        )
-        sum_geom = (
-            self._gamma * (1.0 + self._proba_collision / (1.0 - self._proba_collision))
-            if self._proba_collision < 1.0
-            else self._gamma
+        # the last level is the final table's: it stops at the first one fewer than min_level_keys keys reach
+        self._level_reach(self._max_levels)
+        self._nb_levels = self._max_levels
+        for ii in range(1, self._max_levels):
+            if self._nelem * self._reach[ii] < self._min_level_keys:
+                self._nb_levels = ii + 1
+                break
+        self._levels = [level() for _ in range(self._nb_levels)]
+        self._set_domains()
+
+        self._fastModeLevel = 0
+        for ii in range(self._nb_levels):
+            if self._reach[ii] < self._percent_elem_loaded_for_fastMode:
+                self._fastModeLevel = ii
+                break
+
+        # progress total: level 0 reads the n keys, level ii the ~n * reach[ii - 1] that reached level ii - 1
+        self._progress_total = self._nelem + sum(
+            int(self._nelem * self._reach[ii - 1]) for ii in range(1, self._nb_levels)
         )
 
-        self._nb_levels = 25
-        self._levels = [level() for _ in range(self._nb_levels)]
+    def _collision_probability(self, gamma: float) -> float:
+        # fraction of the keys in a level of gamma * n bits that collide
+        return 1.0 - pow(((gamma * float(self._nelem) - 1) / (gamma * float(self._nelem))), max(1, self._nelem - 1))
+
+    def _level_gamma(self, ii: int) -> float:
+        return self._gammas[min(ii, len(self._gammas) - 1)] if self._gammas else self._gamma
+
+    def _level_reach(self, nb_levels: int) -> None:
+        # _reach[ii]: expected fraction of the keys reaching level ii, p**ii for one gamma as in BBHash,
+        # the product of the collision probabilities of the levels before ii for a schedule (C++ levelReach)
+        self._proba_collision = self._collision_probability(self._gamma)
+        self._reach = []
+        for ii in range(nb_levels):
+            if not self._gammas:
+                self._reach.append(pow(self._proba_collision, ii))
+            else:
+                self._reach.append(1.0 if ii == 0 else self._reach[-1] * self._collision_probability(self._level_gamma(ii - 1)))
 
+    def _set_domains(self, sizes: Optional[List[int]] = None) -> None:
+        # level ii hashes into gamma_ii * n * reach[ii] bits, rounded up to a multiple of 64, or into sizes
         previous_idx = 0
+        self._hash_domain = int(math.ceil(float(self._nelem) * self._gamma))
         for ii in range(self._nb_levels):
             self._levels[ii].idx_begin = previous_idx
-            hd = int(math.ceil(self._hash_domain * pow(self._proba_collision, ii)))
-            # round up to multiple of 64
+            if sizes is not None:
+                hd = sizes[ii]
+            elif self._gammas:
+                hd = int(int(math.ceil(float(self._nelem) * self._level_gamma(ii))) * self._reach[ii])  # as C++ setDomains
+            else:
+                hd = int(math.ceil(self._hash_domain * self._reach[ii]))
             hd = ((hd + 63) // 64) * 64
             if hd == 0:
                 hd = 64
             self._levels[ii].hash_domain = hd
+            self._levels[ii].reduction = self._reduction
             previous_idx += hd
 
-        self._fastModeLevel = 0
-        for ii in range(self._nb_levels):
-            if pow(self._proba_collision, ii) < self._percent_elem_loaded_for_fastMode:
-                self._fastModeLevel = ii
-                break
+    def _report_progress(self, done: int, level_idx: int, finished: bool = False) -> None:
+        # sampled in the build loop: at most one call per progress interval, then the finished one
+        now = time.perf_counter()
+        if not finished and now - self._progress_last < self._progress_interval:
+            return
+        self._progress_last = now
+        total = max(self._progress_total, done) if finished else self._progress_total
+        self._progress({
+            "done": total if finished else min(done, total), "total": total, "level": level_idx,
+            "seconds": now - self._progress_start, "finished": finished,
+        })
 
     def getLevel(self, val: int, maxlevel: int = 100, minlevel: int = 0) -> Tuple[int, int]:
         # returns (level, last_hash)
@@ -137,23 +567,250 @@ class mphf:
             level_idx += 1
         return level_idx, hash_raw
 
-    def lookup(self, elem: int) -> int:
+    def lookup(self, elem: Union[int, str, bytes]) -> int:
+        if self._hasher_name == "key128":
+            elem = _key_bytes(elem)
+            if self._native is None:
+                elem = _key128(elem)
+        if self._native is not None:
+            return self._native.lookup(elem)
+        idx = self._lookup_index(elem)
+        if idx >= 0 and self._fingerprint_bits and self._fingerprint_at(idx) != self._fingerprint_of(elem):
+            return -1
+        return idx
+
+    def _lookup_index(self, elem: int) -> int:
+        # index without the fingerprint check, arbitrary for most keys not in the set
         if not self._built:
             return -1
+        if self._hot_bits and self._nb_levels > 1:
+            h0 = self._hasher.h0([0, 0], elem)
+            if not self._levels[0].get(h0):
+                slot = _hot_slot(h0, self._hot_bits)
+                if self._hot_indices[slot] != ULLONG_MAX and self._hot_keys[slot] == _final_key(elem):
+                    return self._hot_indices[slot]
         level_idx, level_hash = self.getLevel(elem)
         if level_idx == self._nb_levels - 1:
-            if elem not in self._final_hash:
+            fingerprint = _final_key(elem)
+            idx = bisect_left(self._final_keys, fingerprint)
+            if idx == len(self._final_keys) or self._final_keys[idx] != fingerprint:
                 return -1
-            return self._final_hash[elem] + self._lastbitsetrank
-        non_minimal = fastrange64(level_hash, self._levels[level_idx].hash_domain)
+            return self._final_values[idx] + self._lastbitsetrank
+        non_minimal = self._levels[level_idx].reduce(level_hash)
         return self._levels[level_idx].bitset.rank(non_minimal)
 
-    def processLevel(self, input_range: Iterable[int], i: int):
+    def lookup_many(self, keys, out=None, num_thread: Optional[int] = None, numa_replicas: bool = False):
+        """Batched lookup over a buffer of uint64 keys.
+
+        keys: any 1-d buffer of 64-bit integers (array('Q'), numpy uint64, memoryview).
+        out: optional preallocated writable uint64 buffer of the same length, filled in place;
+        a new array('Q') is allocated otherwise. Returns out.
+        Keys not in the set are marked ULLONG_MAX (-1 when viewed as int64).
+        An mphf of string keys takes packed_keys or a list of str / bytes keys.
+        num_thread (default: the constructor's, 1 after load) splits the batch over a persistent
+        pool of native threads, kept for the next calls; numa_replicas copies the mphf to each NUMA
+        node and pins the node's threads to it. The pure-Python backend looks up on the calling thread.
+        """
+        if num_thread is None:
+            num_thread = self._num_thread
+        if self._hasher_name == "key128":
+            return self._lookup_many_strings(keys, out)
+        kv = _u64_view(keys)
+        if out is None:
+            out = array("Q", bytes(8 * len(kv)))
+        ov = _u64_view(out, writable=True)
+        if len(ov) != len(kv):
+            raise ValueError("out must have the same length as keys")
+
+        if self._native is not None:
+            self._native.lookup_many(kv, ov, num_thread, numa_replicas)
+            return out
+
+        for ii, key in enumerate(kv):
+            idx = self.lookup(key)
+            ov[ii] = ULLONG_MAX if idx < 0 else idx
+        return out
+
+    @property
+    def level_domains(self) -> List[int]:
+        """Bits of each level, the last level is the final table's."""
+        if self._native is not None:
+            return self._native.level_domains
+        return [lv.hash_domain for lv in self._levels]
+
+    @property
+    def fingerprint_bits(self) -> int:
+        """Bits per key fingerprint, 0 if lookups do not check fingerprints."""
+        return self._fingerprint_bits
+
+    def _fingerprint_of(self, key: int) -> int:
+        # top bits of a hash of key independent of the level hashes (C++ mphf::fingerprintOf)
+        return self._hasher.single_hasher(key, FINGERPRINT_SEED) >> (64 - self._fingerprint_bits)
+
+    def _fingerprint_at(self, idx: int) -> int:
+        return _packed_get(self._fingerprints, idx, self._fingerprint_bits)
+
+    def _add_fingerprints(self, keys: Iterable[int], bits: int) -> None:
+        self._fingerprint_bits = bits
+        words = [0] * fileformat.fingerprint_words(self._nelem, bits)
+        for key in keys:
+            idx = self._lookup_index(key)
+            if not 0 <= idx < self._nelem:
+                raise ValueError("fingerprints are computed from the keys of the mphf")
+            _packed_or(words, idx, bits, self._fingerprint_of(key))
+        self._fingerprints = array("Q", words)
+
+    def build_hot_cache(self, sample, slots: int = HOT_SLOTS, min_level: int = HOT_MIN_LEVEL) -> None:
+        """Cache the index of the most looked-up deep keys of sample.
+
+        sample: the keys of a sample of query traffic or of an access log, each as often as it
+        was looked up: a uint64 buffer, an iterable of keys or the path of a raw file of
+        little-endian uint64 keys (str / bytes keys or packed_keys for an mphf of string keys).
+        Keys whose lookup walks down to level min_level or deeper compete for the slots (a power
+        of two, 16 bytes each), the most frequent one of each slot keeps its index. Lookups that
+        miss level 0 check the slot of their key before the next levels; results are unchanged.
+        save() writes the cache next to the mphf file (<path>.hot), load() and mmap() read it.
+        """
+        if not 2 <= slots <= 1 << fileformat.HOT_SLOT_BITS_MAX or slots & (slots - 1):
+            raise ValueError(f"a hot key cache has a power of two slots, 2 to 2**{fileformat.HOT_SLOT_BITS_MAX}")
+        if not self._built:
+            raise ValueError("a hot key cache is built for a built mphf")
+        if isinstance(sample, (str, Path)) and self._hasher_name != "key128":
+            with open(sample, "rb") as f:
+                sample = words_from_bytes(f.read())
+        if self._hasher_name == "key128":
+            packed = sample if isinstance(sample, packed_keys) else packed_keys.from_keys(sample)
+            if self._native is not None:
+                self._native.build_hot_cache(packed.offsets, slots, min_level, packed.data)
+                return
+            keys = (_key128(key) for key in packed)
+        else:
+            try:
+                keys = _u64_view(sample)
+            except TypeError:
+                keys = array("Q", sample)
+            if self._native is not None:
+                self._native.build_hot_cache(keys, slots, min_level)
+                return
+
+        self.clear_hot_cache()  # lookups below walk the levels
+        slot_bits = slots.bit_length() - 1
+        counts: Dict[int, List[int]] = {}  # final key -> [count, slot, index]
+        for key in keys:
+            final = _final_key(key)
+            seen = counts.get(final)
+            if seen is not None:
+                seen[0] += 1
+                continue
+            if self.getLevel(key)[0] < min_level:
+                continue
+            idx = self._lookup_index(key)
+            if idx >= 0:
+                counts[final] = [1, _hot_slot(self._hasher.h0([0, 0], key), slot_bits), idx]
+
+        # the most frequent key of a slot takes it, the smallest key on ties (same as C++)
+        self._hot_keys = array("Q", bytes(8 * slots))
+        self._hot_indices = array("Q", [ULLONG_MAX]) * slots
+        best = [0] * slots
+        for final in sorted(counts):
+            count, slot, idx = counts[final]
+            if count > best[slot]:
+                best[slot] = count
+                self._hot_keys[slot] = final
+                self._hot_indices[slot] = idx
+        self._hot_bits = slot_bits
+        self._hot_min_level = min_level
+
+    def clear_hot_cache(self) -> None:
+        """Drop the hot key cache (see build_hot_cache)."""
+        if self._native is not None:
+            self._native.clear_hot_cache()
+            return
+        self._hot_bits = 0
+        self._hot_keys = array("Q")
+        self._hot_indices = array("Q")
+
+    def hot_cache_stats(self) -> dict:
+        """Slots, filled slots and min_level of the hot key cache, 0 slots without one."""
+        if self._native is not None:
+            return self._native.hot_cache_stats()
+        filled = sum(1 for idx in self._hot_indices if idx != ULLONG_MAX)
+        return {"slots": len(self._hot_indices), "filled": filled, "min_level": self._hot_min_level}
+
+    def save_hot_cache(self, fpath: Union[str, Path]) -> None:
+        """Write the hot key cache next to the mphf file fpath (fpath + ".hot") without saving the mphf.
+
+        Without a cache, a cache file left there is removed.
+        """
+        hot_path = Path(str(fpath) + fileformat.HOT_SUFFIX)
+        if not self.hot_cache_stats()["slots"]:
+            hot_path.unlink(missing_ok=True)
+            return
+        if self._native is not None:
+            hot_path.write_bytes(self._native.hot_cache_bytes())
+            return
+        pairs = array("Q", bytes(16 * len(self._hot_keys)))
+        pairs[0::2] = self._hot_keys
+        pairs[1::2] = self._hot_indices
+        filled = sum(1 for idx in self._hot_indices if idx != ULLONG_MAX)
+        with open(hot_path, "wb") as f:
+            fileformat.write_hot(f, self._hot_bits, HASHERS.index(self._hasher_name), self._nelem, self._lastbitsetrank,
+                                 self._final_crc(), self._hot_min_level, filled, bytes(words_to_bytes(pairs)))
+
+    def _load_hot_cache(self, fpath: Union[str, Path]) -> None:
+        # fpath + ".hot" when there is one, ignored when it was built for another mphf
+        try:
+            data = Path(str(fpath) + fileformat.HOT_SUFFIX).read_bytes()
+        except FileNotFoundError:
+            return
+        if self._native is not None:
+            self._native.load_hot_cache(data)
+            return
+        header, slots = fileformat.read_hot(data)
+        if (header["hasher_id"] != HASHERS.index(self._hasher_name) or header["nelem"] != self._nelem
+                or header["lastbitsetrank"] != self._lastbitsetrank or header["final_crc"] != self._final_crc()):
+            return
+        pairs = words_from_bytes(slots)
+        keys, indices = array("Q", pairs[0::2]), array("Q", pairs[1::2])
+        if any(idx != ULLONG_MAX and idx >= self._nelem for idx in indices):
+            raise ValueError("corrupt hot key cache file: index out of range")
+        if sum(1 for idx in indices if idx != ULLONG_MAX) != header["nb_filled"]:
+            raise ValueError("corrupt hot key cache file: bad header")
+        self._hot_keys, self._hot_indices = keys, indices
+        self._hot_bits = header["slot_bits"]
+        self._hot_min_level = header["min_level"]
+
+    def _final_crc(self) -> int:
+        # crc32 of the final keys then values (C++ mphf::finalCrc)
+        return zlib.crc32(words_to_bytes(self._final_values), zlib.crc32(words_to_bytes(self._final_keys)))
+
+    def _lookup_many_strings(self, keys, out):
+        packed = keys if isinstance(keys, packed_keys) else packed_keys.from_keys(keys)
+        if out is None:
+            out = array("Q", bytes(8 * len(packed)))
+        ov = _u64_view(out, writable=True)
+        if len(ov) != len(packed):
+            raise ValueError("out must have the same length as keys")
+
+        if self._native is not None:
+            self._native.lookup_packed(packed.offsets, packed.data, ov)
+            return out
+
+        for ii, key in enumerate(packed):
+            idx = self.lookup(key)
+            ov[ii] = ULLONG_MAX if idx < 0 else idx
+        return out
+
+    def processLevel(self, input_range: Iterable[int], i: int) -> array:
+        """Insert the keys of input_range that reach level i, return them (array('Q')).
+
+        Keys placed at level i are filtered out when the next level scans them.
+        """
         # allocate the bitset for this level
         self._levels[i].bitset = bitvector(self._levels[i].hash_domain)
+        # 128-bit string keys do not fit array('Q')
+        reached = [] if self._hasher_name == "key128" else array("Q")
         # simple single-threaded scan
-        writebuff: List[int] = []
-        writebuff_sz = 0
         cpt = 0
         for val in input_range:
             lvl, _ = self.getLevel(val, i if self._writeEachLevel else i)
@@ -165,72 +822,182 @@ class mphf:
                         self.setLevelFastmode.append(val)
                 if i == self._nb_levels - 1:
                     # final hash
-                    self._final_hash[val] = len(self._final_hash)
+                    self._final_entries.append((_final_key(val), len(self._final_entries)))
                 else:
-                    # compute next hash and set bit
-                    # here we simply compute h0/h1/next relative to val
+                    # hash for level i, same as the last hash getLevel computed
+                    # (getLevel stops before probing level i, so redo levels 0..i)
                     s = [0, 0]
-                    if lvl == 0:
-                        level_hash = self._hasher.h0(s, val)
-                    elif lvl == 1:
+                    level_hash = self._hasher.h0(s, val)
+                    if lvl >= 1:
                         level_hash = self._hasher.h1(s, val)
-                    else:
+                    for _ in range(2, lvl + 1):
                         level_hash = self._hasher.next(s)
-                    hashl = fastrange64(level_hash, self._levels[i].hash_domain)
+                    hashl = self._levels[i].reduce(level_hash)
                     if self._levels[i].bitset.atomic_test_and_set(hashl):
                         # if collision, set in temp bitset
                         self._tempBitset.atomic_test_and_set(hashl)
+                    reached.append(val)
             cpt += 1
             if self._withprogress and (cpt & 1023) == 0:
-                pass
-        self._cptLevel = cpt
+                self._report_progress(self._cptTotalProcessed + cpt, i)
+        self._cptRead = cpt
+        self._cptTotalProcessed += cpt
+        self._cptLevel = len(reached) if i < self._nb_levels - 1 else len(self._final_entries)
+        return reached
 
     def nbKeys(self) -> int:
         return self._nelem
 
     def totalBitSize(self) -> int:
+        if self._native is not None:
+            return self._native.totalBitSize()
         totalsizeBitset = sum(l.bitset.bitSize() for l in self._levels)
-        totalsize = totalsizeBitset + len(self._final_hash) * 42 * 8
+        totalsize = totalsizeBitset + len(self._final_keys) * 16 * 8  # sorted keys + values
+        totalsize += len(self._fingerprints) * 64
         return totalsize
 
-    def save(self, fpath: Union[str, Path]) -> None:
-        """Save mphf to binary file compatible with C++ format."""
-        import struct
-
-        with open(fpath, "wb") as os:
-            # Write _gamma (double, 8 bytes)
-            os.write(struct.pack("<d", self._gamma))
-            # Write _nb_levels (uint32_t, 4 bytes)
-            os.write(struct.pack("<I", self._nb_levels))
-            # Write _lastbitsetrank (uint64_t, 8 bytes)
-            os.write(struct.pack("<Q", self._lastbitsetrank))
-            # Write _nelem (uint64_t, 8 bytes)
-            os.write(struct.pack("<Q", self._nelem))
-
-            # Save each level's bitset
-            for ii in range(self._nb_levels):
-                self._levels[ii].bitset.save(os)
-
-            # Save final hash
-            final_hash_size = len(self._final_hash)
-            os.write(struct.pack("<Q", final_hash_size))
-
-            for key, value in self._final_hash.items():
-                # Write key (int/uint64_t, 8 bytes)
-                os.write(struct.pack("<Q", key))
-                # Write value (uint64_t, 8 bytes)
-                os.write(struct.pack("<Q", value))
+    def build_stats(self) -> dict:
+        """Per level build counters and the sizes of the parts, same keys as C++ mphf::build_stats().
+
+        "levels" holds for each level the keys that reached it (keys_in), the keys scanned to
+        find them (keys_read), the keys it placed (the final table for the last level), the
+        positions cleared as collisions, its bitset_bytes (ranks included) and rank_bytes, the
+        writeEach spill I/O and its wall time. Counters are zero for a loaded or mapped mphf.
+        Also: fast_mode_level (-1 without fast mode), final_keys, final_bytes,
+        fingerprint_bytes, total_bits (totalBitSize()) and seconds (whole build).
+        """
+        if self._native is not None:
+            return self._native.build_stats()
+        built = self._stats["levels"]
+        levels = []
+        for ii, lv in enumerate(self._levels):
+            stats = dict(built[ii]) if ii < len(built) else {
+                "keys_in": 0, "keys_read": 0, "keys_placed": 0, "collisions": 0,
+                "spill_bytes_written": 0, "spill_bytes_read": 0, "seconds": 0.0}
+            stats["bitset_bytes"] = lv.bitset.bitSize() // 8
+            stats["rank_bytes"] = lv.bitset.rankBitSize() // 8
+            levels.append(stats)
+        return {
+            "levels": levels,
+            "fast_mode_level": self._stats["fast_mode_level"],
+            "final_keys": len(self._final_keys),
+            "final_bytes": len(self._final_keys) * 16,
+            "fingerprint_bytes": len(self._fingerprints) * 8,
+            "total_bits": self.totalBitSize(),
+            "seconds": self._stats["seconds"],
+        }
+
+    @property
+    def rank_layout(self) -> str:
+        """In-memory layout of the level bitsets, "flat" or "interleaved" (see set_rank_layout)."""
+        if self._native is not None:
+            return RANK_LAYOUTS[self._native.rank_layout]
+        return self._levels[0].bitset.layout() if self._levels else "flat"
+
+    def set_rank_layout(self, layout: str) -> None:
+        """Switch a built or loaded mphf between rank layouts.
+
+        "interleaved" stores each level as 64-byte lines (rank counter + 448 bits)
+        so a lookup reads one cache line per level, for ~1.8% more bits than
+        "flat" (see totalBitSize). Mapped bitsets are copied. Files are unchanged.
+        """
+        if layout not in RANK_LAYOUTS:
+            raise ValueError(f"unknown rank layout {layout!r} (expected one of {RANK_LAYOUTS})")
+        if self._native is not None:
+            self._native.set_rank_layout(RANK_LAYOUTS.index(layout))
+            return
+        for lv in self._levels:
+            lv.bitset.set_layout(layout)
+
+    def save(self, fpath: Union[str, Path], version: int = fileformat.FORMAT_V1, checksum: bool = True,
+             num_thread: int = 1) -> None:
+        """Save mphf to binary file compatible with C++ format.
+
+        version=1 writes the BBHash layout, version=2 the aligned v2 layout
+        (for mmap), with a crc32 per section unless checksum is False.
+        num_thread > 1 writes the file in place by chunks on that many threads
+        (os.pwrite, the same bytes; sequential where it is missing).
+        A hot key cache is written to fpath + ".hot" (see build_hot_cache).
+        """
+        if version not in (fileformat.FORMAT_V1, fileformat.FORMAT_V2):
+            raise ValueError(f"unsupported mphf format version {version}")
+
+        if version == fileformat.FORMAT_V1 and self._reduction != "modulo":
+            raise ValueError("the v1 mphf format only stores modulo reduction, save as v2")
+        if version == fileformat.FORMAT_V1 and self._hasher_name != "hash64":
+            raise ValueError("the v1 mphf format does not record the hasher, save as v2")
+        if version == fileformat.FORMAT_V1 and self._fingerprint_bits:
+            raise ValueError("the v1 mphf format has no fingerprints, save as v2")
+        if version == fileformat.FORMAT_V1 and self._scheduled:
+            raise ValueError("the v1 mphf format only stores levels sized from one gamma, save as v2")
+
+        if self._native is not None:
+            self._native.save(str(fpath), version, checksum, num_thread)
+            self.save_hot_cache(fpath)
+            return
+
+        write = self._write_v2 if version == fileformat.FORMAT_V2 else lambda f, _: self._write_v1(f)
+        if _positional_io(num_thread):
+            writer = _positional_writer()
+            write(writer, checksum)
+            writer.flush_to(fpath, num_thread)
+        else:
+            with open(fpath, "wb") as f:
+                write(f, checksum)
+        self.save_hot_cache(fpath)
+
+    def _write_v1(self, os) -> None:
+        # Header: _gamma (double), _nb_levels (uint32_t), _lastbitsetrank and _nelem (uint64_t)
+        os.write(struct.pack("<dIQQ", self._gamma, self._nb_levels, self._lastbitsetrank, self._nelem))
+
+        # Save each level's bitset
+        for ii in range(self._nb_levels):
+            self._levels[ii].bitset.save(os)
+
+        # Save final hash: its size, then the (key, value) pairs interleaved in one write
+        final_hash_size = len(self._final_keys)
+        os.write(struct.pack("<Q", final_hash_size))
+        pairs = array("Q", bytes(16 * final_hash_size))
+        pairs[0::2] = array("Q", self._final_keys)
+        pairs[1::2] = array("Q", self._final_values)
+        os.write(words_to_bytes(pairs))
 
     @staticmethod
-    def load(fpath: Union[str, Path]) -> "mphf":
-        """Load mphf from binary file compatible with C++ format."""
-        import struct
+    def load(fpath: Union[str, Path], backend: Optional[str] = None, num_thread: int = 1) -> "mphf":
+        """Load mphf from binary file compatible with C++ format.
 
+        Both v1 and v2 files are accepted, v2 section checksums are verified.
+        num_thread > 1 reads the file by chunks on that many threads (os.preadv,
+        sequential where it is missing or on big-endian hosts).
+        The hot key cache saved with the file (fpath + ".hot") is loaded too,
+        unless it was built for another mphf.
+        """
         mph = mphf()
 
+        if _use_native(backend):
+            mph._native = _native.mphf.load(str(fpath), num_thread)
+            mph._sync_native()
+            mph._load_hot_cache(fpath)
+            return mph
+
+        if _positional_io(num_thread) and sys.byteorder == "little":
+            buf = memoryview(_read_file(fpath, num_thread))
+            if buf[:8] == fileformat.MAGIC:
+                mph._load_v2(buf, copy=False, verify=True)
+            else:
+                mph._load_v1(buf, fpath)
+            mph._load_hot_cache(fpath)
+            return mph
+
         with open(fpath, "rb") as is_stream:
+            first = is_stream.read(8)
+            if first == fileformat.MAGIC:
+                mph._load_v2(first + is_stream.read(), copy=True, verify=True)
+                mph._load_hot_cache(fpath)
+                return mph
+
             # Read _gamma (double)
-            mph._gamma = struct.unpack("<d", is_stream.read(8))[0]
+            mph._gamma = struct.unpack("<d", first)[0]
             # Read _nb_levels (uint32_t)
             mph._nb_levels = struct.unpack("<I", is_stream.read(4))[0]
             # Read _lastbitsetrank (uint64_t)
@@ -245,43 +1012,855 @@ class mphf:
                 lv.bitset = bitvector.load(is_stream)
                 mph._levels.append(lv)
 
-            # Mini setup: recompute size of each level (same as C++)
-            mph._proba_collision = 1.0 - pow(
-                ((mph._gamma * float(mph._nelem) - 1) / (mph._gamma * float(mph._nelem))),
-                mph._nelem - 1,
-            )
-            previous_idx = 0
-            mph._hash_domain = int(math.ceil(float(mph._nelem) * mph._gamma))
+            mph._loaded_setup()
 
-            for ii in range(mph._nb_levels):
-                mph._levels[ii].idx_begin = previous_idx
-                hd = int(math.ceil(mph._hash_domain * pow(mph._proba_collision, ii)))
-                hd = ((hd + 63) // 64) * 64
-                if hd == 0:
-                    hd = 64
-                mph._levels[ii].hash_domain = hd
-                previous_idx += hd
-
-            # Restore final hash
-            mph._final_hash = {}
+            # Restore final hash: (key, value) pairs, in any order in v1 files
             final_hash_size = struct.unpack("<Q", is_stream.read(8))[0]
-
-            for ii in range(final_hash_size):
-                # Read key (uint64_t)
-                key = struct.unpack("<Q", is_stream.read(8))[0]
-                # Read value (uint64_t)
-                value = struct.unpack("<Q", is_stream.read(8))[0]
-                mph._final_hash[key] = value
+            data = is_stream.read(16 * final_hash_size)
+            if len(data) != 16 * final_hash_size:
+                raise EOFError("truncated mphf file")
+            pairs = words_from_bytes(data)
+            mph._set_final_table(zip(pairs[0::2], pairs[1::2]))
 
             mph._built = True
-            mph._hasher = XorshiftHashFunctors(SingleHashFunctor())
-            mph._num_thread = 1
-            mph._fastmode = False
-            mph._withprogress = False
-            mph._writeEachLevel = False
 
+        mph._load_hot_cache(fpath)
+        return mph
+
+    @staticmethod
+    def mmap(fpath: Union[str, Path], backend: Optional[str] = None, verify: bool = False) -> "mphf":
+        """Open an mphf file written by save() without copying its level bitsets.
+
+        The file is mapped read-only and pages are read on first lookup, so
+        opening is O(number of levels) whatever the file size. The mapping is
+        released when the returned object is garbage collected. v2 files are
+        aligned for this; their section checksums are only checked with
+        verify=True, which reads the whole file. The pure-Python backend falls
+        back to load() on big-endian hosts. A hot key cache is loaded as by load().
+        """
+        mph = mphf()
+
+        if _use_native(backend):
+            mph._native = _native.mphf.mmap(str(fpath), verify)
+            mph._sync_native()
+            mph._load_hot_cache(fpath)
+            return mph
+
+        if sys.byteorder != "little":
+            return mphf.load(fpath, backend="python")
+
+        with open(fpath, "rb") as f:
+            mm = _mmap.mmap(f.fileno(), 0, access=_mmap.ACCESS_READ)
+        buf = memoryview(mm)
+        if buf[:8] == fileformat.MAGIC:
+            mph._load_v2(buf, copy=False, verify=verify)
+        else:
+            mph._load_v1(buf, fpath)
+        mph._mmap = mm
+        mph._load_hot_cache(fpath)
         return mph
 
+    def _load_v1(self, buf, fpath) -> None:
+        # v1 file held in buf (mmap or bytearray), levels read in place, little-endian hosts only
+        try:
+            self._gamma, self._nb_levels, self._lastbitsetrank, self._nelem = struct.unpack_from("<dIQQ", buf, 0)
+        except struct.error:
+            raise ValueError(f"truncated mphf file {fpath}") from None
+        offset = struct.calcsize("<dIQQ")
+
+        self._levels = []
+        for ii in range(self._nb_levels):
+            lv = level()
+            lv.bitset, offset = bitvector.map(buf, offset)
+            self._levels.append(lv)
+
+        self._loaded_setup()
+
+        # the final hash is small, copy it into the sorted arrays
+        if len(buf) - offset < 8:
+            raise ValueError(f"truncated mphf file {fpath}")
+        final_hash_size = struct.unpack_from("<Q", buf, offset)[0]
+        offset += 8
+        if len(buf) - offset < 16 * final_hash_size:
+            raise ValueError(f"truncated mphf file {fpath}")
+        pairs = buf[offset:offset + 16 * final_hash_size].cast("Q")
+        self._set_final_table(zip(pairs[0::2], pairs[1::2]))
+        self._built = True
+
+    def _write_v2(self, f, checksum: bool) -> None:
+        sections = []
+        for ii in range(self._nb_levels):
+            bv = self._levels[ii].bitset
+            if bv.layout() != "flat":
+                bv = bv.flattened()
+            sections.append((fileformat.SECTION_LEVEL_BITS, ii, bv.size(), words_to_bytes(bv._bitArray)))
+            sections.append((fileformat.SECTION_LEVEL_RANKS, ii, 0, words_to_bytes(bv._ranks)))
+        sections.append((fileformat.SECTION_FINAL_KEYS, 0, 8, words_to_bytes(self._final_keys)))
+        sections.append((fileformat.SECTION_FINAL_VALUES, 0, 0, words_to_bytes(self._final_values)))
+
+        flags = fileformat.FLAG_MULTIPLY_HIGH if self._reduction == "multiply" else 0
+        if self._fingerprint_bits:
+            sections.append((fileformat.SECTION_FINGERPRINTS, 0, self._fingerprint_bits, words_to_bytes(self._fingerprints)))
+            flags |= fileformat.FLAG_FINGERPRINTS
+        if self._scheduled:
+            flags |= fileformat.FLAG_LEVEL_DOMAINS
+        fileformat.write_v2(f, self._gamma, self._nb_levels, self._lastbitsetrank, self._nelem, sections, checksum, flags,
+                            HASHERS.index(self._hasher_name))
+
+    def _load_v2(self, buf, copy: bool, verify: bool) -> None:
+        header, sections = fileformat.read_v2(buf, verify)
+        self._gamma = header["gamma"]
+        self._nb_levels = header["nb_levels"]
+        self._lastbitsetrank = header["lastbitsetrank"]
+        self._nelem = header["nelem"]
+        self._reduction = "multiply" if header["flags"] & fileformat.FLAG_MULTIPLY_HIGH else "modulo"
+        self._hasher_name = HASHERS[header["hasher_id"]]
+
+        self._levels = []
+        for ii in range(self._nb_levels):
+            bits, size = sections[(fileformat.SECTION_LEVEL_BITS, ii)]
+            ranks, _ = sections[(fileformat.SECTION_LEVEL_RANKS, ii)]
+            lv = level()
+            lv.bitset = bitvector.from_words(size, bits, ranks, copy)
+            self._levels.append(lv)
+
+        sizes = None
+        if header["flags"] & fileformat.FLAG_LEVEL_DOMAINS:
+            sizes = [lv.bitset.size() for lv in self._levels]
+            if any(size == 0 or size % 64 for size in sizes):
+                raise ValueError("corrupt mphf file: bad level size")
+        self._loaded_setup(sizes)
+
+        # the final table is used as stored (in place when mapped), its order is checked with the checksums
+        keys = words_from_bytes(sections[(fileformat.SECTION_FINAL_KEYS, 0)][0], copy)
+        values = words_from_bytes(sections[(fileformat.SECTION_FINAL_VALUES, 0)][0], copy)
+        if verify and any(keys[ii - 1] >= keys[ii] for ii in range(1, len(keys))):
+            raise ValueError("corrupt mphf file: final hash keys are not sorted")
+        self._final_keys = keys
+        self._final_values = values
+        if header["flags"] & fileformat.FLAG_FINGERPRINTS:
+            words, self._fingerprint_bits = sections[(fileformat.SECTION_FINGERPRINTS, 0)]
+            self._fingerprints = words_from_bytes(words, copy)
+        self._built = True
+
+    def _loaded_setup(self, sizes: Optional[List[int]] = None):
+        # mini setup after load/mmap: recompute size of each level (same as C++), or take the sizes recorded
+        # by a v2 file with FLAG_LEVEL_DOMAINS
+        self._gammas = []
+        self._scheduled = sizes is not None
+        self._level_reach(self._nb_levels)
+        self._set_domains(sizes)
+
+        self._hasher = XorshiftHashFunctors(SINGLE_HASHERS[HASHERS.index(self._hasher_name)]())
+        self._num_thread = 1
+        self._fastmode = False
+        self._progress = None
+        self._withprogress = False
+        self._writeEachLevel = False
+
+
+SPOOLS = ("memory", "disk")
+
+
+def _read_spool(path: str, block: int = 1 << 16):
+    # keys of a spool file, block by block
+    with open(path, "rb") as f:
+        while True:
+            data = f.read(8 * block)
+            if not data:
+                return
+            yield from words_from_bytes(data)
+
+
+class _spool_keys:
+    # keys of a spool file, read again by each iteration (fingerprints)
+    def __init__(self, path: str):
+        self._path = path
+
+    def __iter__(self):
+        return _read_spool(self._path)
+
+
+class mphf_builder:
+    """Single-pass construction from a stream: add_batch() the keys, then finalize().
+
+    Every key is read once and appended to a spool: array('Q') in memory, or
+    with spool="disk" a raw uint64 file in tmp_dir. Only the spool and the
+    shrinking sets of keys left by each level are read afterwards. Native disk
+    builds use writeEach level files in tmp_dir too. The other arguments are
+    the mphf(...) ones.
+    """
+
+    def __init__(
+        self,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        progress: Union[bool, ProgressCallback] = False,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+        spool: str = "memory",
+        tmp_dir: Optional[Union[str, Path]] = None,
+        hasher: str = "hash64",
+        fingerprint_bits: int = 0,
+        progress_interval: float = 1.0,
+    ):
+        if spool not in SPOOLS:
+            raise ValueError(f"unknown spool {spool!r} (expected one of {SPOOLS})")
+        if reduction not in REDUCTIONS:
+            raise ValueError(f"unknown reduction {reduction!r} (expected one of {REDUCTIONS})")
+        if hasher not in HASHERS:
+            raise ValueError(f"unknown hasher {hasher!r} (expected one of {HASHERS})")
+        if hasher == "key128":
+            raise ValueError("mphf_builder takes integer keys, build string keys with mphf(n, keys)")
+        self._native_build = _use_native(backend)
+        if not 0 <= fingerprint_bits <= fileformat.FINGERPRINT_BITS_MAX:
+            raise ValueError(f"fingerprint_bits must be 0 to {fileformat.FINGERPRINT_BITS_MAX}")
+        if not progress_interval > 0:
+            raise ValueError("progress_interval must be > 0")
+        self._options = dict(num_thread=num_thread, gamma=gamma, progress=progress, reduction=reduction, hasher=hasher,
+                             fingerprint_bits=fingerprint_bits, progress_interval=progress_interval)
+        self._tmp_dir = tmp_dir
+        self._count = 0
+        self._keys: Optional[array] = None
+        self._spool = None
+        if spool == "disk":
+            self._spool = tempfile.NamedTemporaryFile(dir=tmp_dir, prefix="bbhash_spool_", suffix=".tmp", delete=False)
+        else:
+            self._keys = array("Q")
+
+    def __len__(self) -> int:
+        return self._count
+
+    def add_batch(self, keys) -> None:
+        """Append keys, a uint64 buffer (array('Q'), numpy) or any iterable of ints in [0, 2**64)."""
+        if self._keys is None and self._spool is None:
+            raise ValueError("mphf_builder already finalized")
+        try:
+            batch = _u64_view(keys)
+        except TypeError:
+            batch = memoryview(array("Q", keys))
+        if self._spool is not None:
+            self._spool.write(batch.cast("B"))
+        else:
+            self._keys.frombytes(batch.cast("B"))
+        self._count += len(batch)
+
+    def finalize(self) -> "mphf":
+        """Build the mphf of all added keys. The spool is released, the builder cannot be reused."""
+        if self._keys is None and self._spool is None:
+            raise ValueError("mphf_builder already finalized")
+        backend = "native" if self._native_build else "python"
+        if self._keys is not None:
+            keys, self._keys = self._keys, None
+            return mphf(len(keys), keys, backend=backend, tmp_dir=self._tmp_dir, **self._options)
+
+        spool, self._spool = self._spool, None
+        spool.close()
+        try:
+            if not self._native_build:
+                return mphf(self._count, _spool_keys(spool.name), backend=backend, **self._options)
+            mph = mphf()
+            mph._native = _native.mphf.from_file(
+                spool.name, self._count, max(1, int(self._options["num_thread"])), float(self._options["gamma"]),
+                self._options["progress"], REDUCTIONS.index(self._options["reduction"]),
+                "." if self._tmp_dir is None else self._tmp_dir, HASHERS.index(self._options["hasher"]),
+                int(self._options["fingerprint_bits"]), float(self._options["progress_interval"]),
+            )
+            mph._sync_native()
+            return mph
+        finally:
+            os.remove(spool.name)
+
+    def __del__(self):
+        # a builder dropped before finalize() removes its spool file
+        if getattr(self, "_spool", None) is not None:
+            self._spool.close()
+            os.remove(self._spool.name)
+
+
+# default keys per shard and shard hash seed, same as the C++ MPHF_SHARD_KEYS / MPHF_SHARD_SEED
+SHARD_KEYS = 1 << 20
+SHARD_SEED = 0x6666666699999999
+
+
+class sharded_mphf:
+    """Keys bucketed by a hash of their own into nb_shards independent mphf.
+
+    lookup(key) is the index of key in its shard plus the number of keys in
+    the shards before it. Native builds run num_thread shards at a time, one
+    thread each; pure-Python builds build the shards one after the other.
+    nb_shards=None gives one shard per SHARD_KEYS keys, small enough for the
+    levels of a shard to stay in cache.
+
+    Distributed builds route each key to shard_of(key, nb_shards), build and
+    save (version=2) each shard anywhere, then merge() the files in shard order.
+    """
+
+    _shard_hasher = SingleHashFunctor()
+
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        nb_shards: Optional[int] = None,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        perc_elem_loaded: float = 1.0,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ):
+        if reduction not in REDUCTIONS:
+            raise ValueError(f"unknown reduction {reduction!r} (expected one of {REDUCTIONS})")
+        if nb_shards is not None and nb_shards < 1:
+            raise ValueError("nb_shards must be >= 1")
+        self._native = None
+        self._shards: List[Optional[mphf]] = []  # None for an empty shard
+        self._offsets = [0]
+
+        if n == 0 or input_range is None:
+            return
+        if nb_shards is None:
+            nb_shards = max(1, -(-int(n) // SHARD_KEYS))
+
+        if _use_native(backend):
+            self._native = _native.sharded_mphf(
+                int(n), input_range, nb_shards, max(1, int(num_thread)), float(gamma), float(perc_elem_loaded),
+                REDUCTIONS.index(reduction),
+            )
+            return
+
+        routed = [array("Q") for _ in range(nb_shards)]
+        for key in input_range:
+            routed[self.shard_of(key, nb_shards)].append(key)
+        for keys in routed:
+            self._shards.append(mphf(len(keys), keys, gamma=gamma, perc_elem_loaded=perc_elem_loaded,
+                                     backend="python", reduction=reduction) if keys else None)
+        self._set_offsets()
+
+    @staticmethod
+    def shard_of(key: int, nb_shards: int) -> int:
+        """Shard of key among nb_shards, from the high bits of a hash independent of the level hashes."""
+        return multiply_high64(sharded_mphf._shard_hasher(key & ULLONG_MAX, SHARD_SEED), nb_shards)
+
+    def _set_offsets(self):
+        self._offsets = [0]
+        for shard in self._shards:
+            self._offsets.append(self._offsets[-1] + (shard.nbKeys() if shard is not None else 0))
+
+    @property
+    def nb_shards(self) -> int:
+        if self._native is not None:
+            return self._native.nb_shards
+        return len(self._shards)
+
+    def lookup(self, elem: int) -> int:
+        if self._native is not None:
+            return self._native.lookup(elem)
+        if not self._shards:
+            return -1
+        s = self.shard_of(elem, len(self._shards))
+        if self._shards[s] is None:
+            return -1
+        idx = self._shards[s].lookup(elem)
+        return -1 if idx < 0 else self._offsets[s] + idx
+
+    def lookup_many(self, keys, out=None):
+        """Batched lookup, same buffers and ULLONG_MAX marking as mphf.lookup_many."""
+        kv = _u64_view(keys)
+        if out is None:
+            out = array("Q", bytes(8 * len(kv)))
+        ov = _u64_view(out, writable=True)
+        if len(ov) != len(kv):
+            raise ValueError("out must have the same length as keys")
+
+        if self._native is not None:
+            self._native.lookup_many(kv, ov)
+            return out
+
+        for ii, key in enumerate(kv):
+            idx = self.lookup(key)
+            ov[ii] = ULLONG_MAX if idx < 0 else idx
+        return out
+
+    def nbKeys(self) -> int:
+        if self._native is not None:
+            return self._native.nbKeys()
+        return self._offsets[-1]
+
+    def totalBitSize(self) -> int:
+        """Size of the shards plus the offsets table."""
+        if self._native is not None:
+            return self._native.totalBitSize()
+        return 64 * len(self._offsets) + sum(shard.totalBitSize() for shard in self._shards if shard is not None)
+
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None:
+        """Save as one sharded container file, each shard a v2 file (crc32 per section unless checksum is False)."""
+        if self._native is not None:
+            self._native.save(str(fpath), checksum)
+            return
+        blobs = []
+        for shard in self._shards:
+            buf = io.BytesIO()
+            if shard is not None:
+                shard._write_v2(buf, checksum)
+            blobs.append(buf.getvalue())
+        with open(fpath, "wb") as f:
+            fileformat.write_sharded(f, self._offsets, blobs)
+
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> "sharded_mphf":
+        """Load a file written by save() or merge(), the shard checksums are verified."""
+        sh = sharded_mphf()
+        if _use_native(backend):
+            sh._native = _native.sharded_mphf.load(str(fpath))
+            return sh
+
+        with open(fpath, "rb") as f:
+            offsets, blobs = fileformat.read_sharded(f.read())
+        for s, blob in enumerate(blobs):
+            shard = None
+            if len(blob):
+                shard = mphf()
+                shard._load_v2(blob, copy=True, verify=True)
+                if shard.nbKeys() != offsets[s + 1] - offsets[s]:
+                    raise ValueError("corrupt sharded mphf file: shard size mismatch")
+            sh._shards.append(shard)
+        sh._set_offsets()
+        return sh
+
+    @staticmethod
+    def merge(shard_paths: List[Optional[Union[str, Path]]], fpath: Union[str, Path]) -> None:
+        """Write the sharded container of shards saved with version=2, in shard order (None for an empty shard).
+
+        Shard s must have been built from the keys with shard_of(key, len(shard_paths)) == s.
+        """
+        offsets = [0]
+        blobs = []
+        for path in shard_paths:
+            blob = b""
+            if path is not None:
+                with open(path, "rb") as f:
+                    blob = f.read()
+            nelem = fileformat.read_v2(blob, verify=False)[0]["nelem"] if blob else 0
+            offsets.append(offsets[-1] + nelem)
+            blobs.append(blob)
+        with open(fpath, "wb") as f:
+            fileformat.write_sharded(f, offsets, blobs)
+
+
+# should_compact() defaults, same as the C++ MPHF_OVERLAY_MAX_DELTAS / MPHF_OVERLAY_MAX_DELTA_FRACTION
+OVERLAY_MAX_DELTAS = 8
+OVERLAY_MAX_DELTA_FRACTION = 0.25
+
+
+class overlay_mphf:
+    """A base mphf plus delta mphf built over keys added later.
+
+    append() builds a delta over new keys only, they get the indices after
+    nbKeys() and existing indices never change. Every segment has
+    fingerprint_bits fingerprints, so lookup(key) is the index from the first
+    segment accepting key, base first; a key outside the base costs one more
+    probe per delta. New keys an older segment accepts anyway (probability
+    2**-fingerprint_bits per segment) are kept in a small exact override table.
+
+    compact() builds a fresh single-segment overlay from all the keys (an mphf
+    does not store them), compact_async() does so on a background thread while
+    lookups go on. Indices change on compaction. save() writes the base, the
+    deltas and the overrides as one overlay container.
+    """
+
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        fingerprint_bits: int = 8,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ):
+        if reduction not in REDUCTIONS:
+            raise ValueError(f"unknown reduction {reduction!r} (expected one of {REDUCTIONS})")
+        if not 1 <= fingerprint_bits <= fileformat.FINGERPRINT_BITS_MAX:
+            raise ValueError(f"fingerprint_bits must be 1 to {fileformat.FINGERPRINT_BITS_MAX}")
+        self._native = None
+        self._segments: List[mphf] = []  # base first, then the deltas in append order
+        self._offsets = [0]
+        self._overrides: Dict[int, int] = {}
+
+        if n == 0 or input_range is None:
+            return
+
+        if _use_native(backend):
+            self._native = _native.overlay_mphf(
+                int(n), input_range, max(1, int(num_thread)), float(gamma), int(fingerprint_bits),
+                REDUCTIONS.index(reduction),
+            )
+            return
+
+        self._segments.append(mphf(n, list(input_range), gamma=gamma, perc_elem_loaded=1.0, backend="python",
+                                   reduction=reduction, fingerprint_bits=fingerprint_bits))
+        self._set_offsets()
+
+    def _set_offsets(self):
+        self._offsets = [0]
+        for segment in self._segments:
+            self._offsets.append(self._offsets[-1] + segment.nbKeys())
+
+    def append(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> None:
+        """Add n keys not in the overlay yet, with indices nbKeys() to nbKeys() + n - 1."""
+        keys = list(input_range)
+        if len(keys) != n:
+            raise ValueError("n must be the number of keys")
+        if self._native is not None:
+            self._native.append(keys, max(1, int(num_thread)), float(gamma))
+            return
+        if not self._segments:
+            raise ValueError("Append to an overlay mphf without a base")
+        if not keys:
+            return
+        base = self._segments[0]
+        delta = mphf(n, keys, gamma=gamma, perc_elem_loaded=1.0, backend="python", reduction=base._reduction,
+                     fingerprint_bits=base.fingerprint_bits)
+        # new keys an older segment accepts would resolve there
+        start = self.nbKeys()
+        for key in keys:
+            if self.lookup(key) >= 0:
+                self._overrides[key & ULLONG_MAX] = start + delta.lookup(key)
+        self._segments.append(delta)
+        self._set_offsets()
+
+    def compact(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> "overlay_mphf":
+        """New overlay with a single base over the n == nbKeys() keys of this one (this overlay is not changed)."""
+        keys = list(input_range)
+        if len(keys) != n or n != self.nbKeys():
+            raise ValueError(f"Compaction needs the {self.nbKeys()} keys of the overlay")
+        compacted = overlay_mphf()
+        if self._native is not None:
+            compacted._native = self._native.compact(keys, max(1, int(num_thread)), float(gamma))
+            return compacted
+        base = self._segments[0]
+        return overlay_mphf(n, keys, num_thread, gamma, base.fingerprint_bits, backend="python",
+                            reduction=base._reduction)
+
+    def compact_async(self, n: int, input_range: Iterable[int], num_thread: int = 1, gamma: float = 2.0) -> Future:
+        """compact() on a background thread, the future holds the new overlay.
+
+        Native compactions build without the GIL, so lookups and appends on
+        this overlay go on meanwhile (an append waits for the lookups running
+        and they wait for it). Keys appended after the call are not in the
+        result: append them to it too, then swap the result in.
+        """
+        keys = list(input_range)
+        future: Future = Future()
+
+        def run():
+            try:
+                future.set_result(self.compact(n, keys, num_thread, gamma))
+            except BaseException as e:
+                future.set_exception(e)
+
+        threading.Thread(target=run, name="overlay_mphf.compact", daemon=True).start()
+        return future
+
+    def should_compact(self, max_deltas: int = OVERLAY_MAX_DELTAS,
+                       max_delta_fraction: float = OVERLAY_MAX_DELTA_FRACTION) -> bool:
+        """True once there are more than max_deltas deltas, or more than max_delta_fraction delta keys per base key."""
+        if self._native is not None:
+            return self._native.should_compact(max_deltas, max_delta_fraction)
+        delta_keys = self.nbKeys() - self.base_keys
+        return self.nb_segments - 1 > max_deltas or delta_keys > max_delta_fraction * self.base_keys
+
+    @property
+    def nb_segments(self) -> int:
+        if self._native is not None:
+            return self._native.nb_segments
+        return len(self._segments)
+
+    @property
+    def nb_overrides(self) -> int:
+        if self._native is not None:
+            return self._native.nb_overrides
+        return len(self._overrides)
+
+    @property
+    def base_keys(self) -> int:
+        if self._native is not None:
+            return self._native.base_keys
+        return self._offsets[1] if self._segments else 0
+
+    @property
+    def fingerprint_bits(self) -> int:
+        if self._native is not None:
+            return self._native.fingerprint_bits
+        return self._segments[0].fingerprint_bits if self._segments else 0
+
+    def lookup(self, elem: int) -> int:
+        if self._native is not None:
+            return self._native.lookup(elem)
+        for s, segment in enumerate(self._segments):
+            idx = segment.lookup(elem)
+            if idx >= 0:
+                idx += self._offsets[s]
+                return self._overrides.get(elem & ULLONG_MAX, idx) if self._overrides else idx
+        return -1
+
+    def lookup_many(self, keys, out=None):
+        """Batched lookup, same buffers and ULLONG_MAX marking as mphf.lookup_many."""
+        kv = _u64_view(keys)
+        if out is None:
+            out = array("Q", bytes(8 * len(kv)))
+        ov = _u64_view(out, writable=True)
+        if len(ov) != len(kv):
+            raise ValueError("out must have the same length as keys")
+
+        if self._native is not None:
+            self._native.lookup_many(kv, ov)
+            return out
+
+        for ii, key in enumerate(kv):
+            idx = self.lookup(key)
+            ov[ii] = ULLONG_MAX if idx < 0 else idx
+        return out
+
+    def nbKeys(self) -> int:
+        if self._native is not None:
+            return self._native.nbKeys()
+        return self._offsets[-1]
+
+    def totalBitSize(self) -> int:
+        """Size of the segments plus the offsets and override tables."""
+        if self._native is not None:
+            return self._native.totalBitSize()
+        return 64 * len(self._offsets) + 128 * len(self._overrides) + sum(s.totalBitSize() for s in self._segments)
+
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None:
+        """Save as one overlay container file, each segment a v2 file (crc32 per section unless checksum is False)."""
+        if self._native is not None:
+            self._native.save(str(fpath), checksum)
+            return
+        blobs = []
+        for segment in self._segments:
+            buf = io.BytesIO()
+            segment._write_v2(buf, checksum)
+            blobs.append(buf.getvalue())
+        with open(fpath, "wb") as f:
+            fileformat.write_overlay(f, self._offsets, sorted(self._overrides.items()), blobs)
+
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> "overlay_mphf":
+        """Load a file written by save(), the segment checksums are verified."""
+        ov = overlay_mphf()
+        if _use_native(backend):
+            ov._native = _native.overlay_mphf.load(str(fpath))
+            return ov
+
+        with open(fpath, "rb") as f:
+            offsets, overrides, blobs = fileformat.read_overlay(f.read())
+        for s, blob in enumerate(blobs):
+            segment = mphf()
+            segment._load_v2(blob, copy=True, verify=True)
+            if segment.nbKeys() != offsets[s + 1] - offsets[s]:
+                raise ValueError("corrupt overlay mphf file: segment size mismatch")
+            if not segment.fingerprint_bits:
+                raise ValueError("corrupt overlay mphf file: segment without fingerprints")
+            ov._segments.append(segment)
+        ov._overrides = dict(overrides)
+        ov._set_offsets()
+        return ov
+
+
+class static_map:
+    """Read-only map from uint64 keys to unsigned values, on top of an mphf.
+
+    The mphf (without fingerprints) gives each key its slot in one packed
+    array of value_bits + fingerprint_bits bit slots: the value of the key, and
+    above it an optional fingerprint of the key. A get is the mphf lookup plus
+    one slot read, which checks the fingerprint too, about (mphf bits/key +
+    value_bits + fingerprint_bits) bits per key. Keys not in the map get the
+    default with probability 1 - 2**-fingerprint_bits, otherwise (always
+    without fingerprints) some value of the map. save() writes one file that
+    mmap() opens in place.
+    """
+
+    def __init__(
+        self,
+        n: int = 0,
+        input_range: Optional[Iterable[int]] = None,
+        values: Optional[Iterable[int]] = None,
+        value_bits: Optional[int] = None,
+        fingerprint_bits: int = 0,
+        num_thread: int = 1,
+        gamma: float = 2.0,
+        backend: Optional[str] = None,
+        reduction: str = "modulo",
+    ):
+        # values[ii] is the value of the ii-th key, value_bits=None fits the largest value
+        if reduction not in REDUCTIONS:
+            raise ValueError(f"unknown reduction {reduction!r} (expected one of {REDUCTIONS})")
+        self._native = None
+        self._mmap = None  # set by static_map.mmap(), keeps the mapped slots valid
+        self._index = mphf()
+        self._slots = array("Q")  # value | fingerprint << value_bits, by mphf index
+        self._value_bits = 64 if value_bits is None else int(value_bits)
+        self._fingerprint_bits = int(fingerprint_bits)
+
+        if n == 0 or input_range is None:
+            return
+        keys = list(input_range)
+        values = list(values) if values is not None else []
+        if len(keys) != n or len(values) != n:
+            raise ValueError("n must be the number of keys and of values")
+        if value_bits is None:
+            self._value_bits = max(1, max(values).bit_length())
+        if not 1 <= self._value_bits <= fileformat.MAP_SLOT_BITS_MAX:
+            raise ValueError(f"value_bits must be 1 to {fileformat.MAP_SLOT_BITS_MAX}")
+        if not 0 <= self._fingerprint_bits <= fileformat.MAP_SLOT_BITS_MAX - self._value_bits:
+            raise ValueError(f"value_bits + fingerprint_bits must be at most {fileformat.MAP_SLOT_BITS_MAX}")
+        for value in values:
+            if not 0 <= value < (1 << self._value_bits):
+                raise ValueError(f"value {value} does not fit in {self._value_bits} bits")
+
+        if _use_native(backend):
+            self._native = _native.static_map(
+                int(n), keys, values, self._value_bits, self._fingerprint_bits, max(1, int(num_thread)), float(gamma),
+                REDUCTIONS.index(reduction),
+            )
+            return
+
+        self._index = mphf(n, keys, gamma=gamma, perc_elem_loaded=1.0, backend="python", reduction=reduction)
+        bits = self._value_bits + self._fingerprint_bits
+        words = [0] * fileformat.fingerprint_words(n, bits)
+        seen = bytearray(n)  # n keys in n distinct slots fill them all
+        for key, value in zip(keys, values):
+            idx = self._index.lookup(key)
+            if not 0 <= idx < n:
+                raise ValueError("keys that the mphf does not map, the input has duplicate keys")
+            if seen[idx]:
+                raise ValueError("duplicate keys: two keys map to the same slot")
+            seen[idx] = 1
+            _packed_or(words, idx, bits, value | (self._fingerprint_of(key) << self._value_bits))
+        self._slots = array("Q", words)
+
+    def _fingerprint_of(self, key: int) -> int:
+        # the fingerprint of mphf fingerprints, fingerprint_bits wide (C++ mphf::fingerprintOf)
+        if not self._fingerprint_bits:
+            return 0
+        return self._index._hasher.single_hasher(key & ULLONG_MAX, FINGERPRINT_SEED) >> (64 - self._fingerprint_bits)
+
+    def get(self, key: int, default: Optional[int] = None) -> Optional[int]:
+        """Value of key, default when the fingerprint rejects it."""
+        if self._native is not None:
+            value = self._native.get(key)
+            return default if value is None else value
+        idx = self._index.lookup(key)
+        if idx < 0:
+            return default
+        slot = _packed_get(self._slots, idx, self._value_bits + self._fingerprint_bits)
+        if slot >> self._value_bits != self._fingerprint_of(key):
+            return default
+        return slot & ((1 << self._value_bits) - 1)
+
+    def __getitem__(self, key: int) -> int:
+        value = self.get(key)
+        if value is None:
+            raise KeyError(key)
+        return value
+
+    def __contains__(self, key: int) -> bool:
+        return self.get(key) is not None
+
+    def __len__(self) -> int:
+        return self.nbKeys()
+
+    def get_many(self, keys, out=None, default: int = 0):
+        """Batched get from a uint64 buffer into out (allocated when None), default for rejected keys."""
+        kv = _u64_view(keys)
+        if out is None:
+            out = array("Q", bytes(8 * len(kv)))
+        ov = _u64_view(out, writable=True)
+        if len(ov) != len(kv):
+            raise ValueError("out must have the same length as keys")
+
+        if self._native is not None:
+            self._native.get_many(kv, ov, default & ULLONG_MAX)
+            return out
+
+        for ii, key in enumerate(kv):
+            ov[ii] = self.get(key, default) & ULLONG_MAX
+        return out
+
+    @property
+    def value_bits(self) -> int:
+        if self._native is not None:
+            return self._native.value_bits
+        return self._value_bits
+
+    @property
+    def fingerprint_bits(self) -> int:
+        if self._native is not None:
+            return self._native.fingerprint_bits
+        return self._fingerprint_bits
+
+    def nbKeys(self) -> int:
+        if self._native is not None:
+            return self._native.nbKeys()
+        return self._index.nbKeys()
+
+    def totalBitSize(self) -> int:
+        """Size of the mphf plus the slots."""
+        if self._native is not None:
+            return self._native.totalBitSize()
+        return self._index.totalBitSize() + 64 * len(self._slots)
+
+    def save(self, fpath: Union[str, Path], checksum: bool = True) -> None:
+        """Save as one static map file, the mphf as a v2 file (crc32 per section unless checksum is False)."""
+        if self._native is not None:
+            self._native.save(str(fpath), checksum)
+            return
+        buf = io.BytesIO()
+        self._index._write_v2(buf, checksum)
+        with open(fpath, "wb") as f:
+            fileformat.write_map(f, self._value_bits, self._fingerprint_bits, self._index.nbKeys(), buf.getvalue(),
+                                 words_to_bytes(self._slots))
+
+    @staticmethod
+    def load(fpath: Union[str, Path], backend: Optional[str] = None) -> "static_map":
+        """Load a file written by save(), the checksums are verified."""
+        sm = static_map()
+        if _use_native(backend):
+            sm._native = _native.static_map.load(str(fpath))
+            return sm
+        with open(fpath, "rb") as f:
+            sm._load(f.read(), copy=True, verify=True)
+        return sm
+
+    @staticmethod
+    def mmap(fpath: Union[str, Path], backend: Optional[str] = None, verify: bool = False) -> "static_map":
+        """Open a file written by save() without copying it, as mphf.mmap (checksums only with verify=True)."""
+        sm = static_map()
+        if _use_native(backend):
+            sm._native = _native.static_map.mmap(str(fpath), verify)
+            return sm
+        if sys.byteorder != "little":
+            return static_map.load(fpath, backend="python")
+        with open(fpath, "rb") as f:
+            mm = _mmap.mmap(f.fileno(), 0, access=_mmap.ACCESS_READ)
+        sm._load(memoryview(mm), copy=False, verify=verify)
+        sm._mmap = mm
+        return sm
+
+    def _load(self, buf, copy: bool, verify: bool) -> None:
+        header, image, slots = fileformat.read_map(buf, verify)
+        if image[:8] != fileformat.MAGIC:
+            raise ValueError("corrupt static map file: the mphf is not a v2 file")
+        self._index._load_v2(image, copy, verify)
+        if self._index.nbKeys() != header["nelem"]:
+            raise ValueError("corrupt static map file: mphf size mismatch")
+        self._value_bits = header["value_bits"]
+        self._fingerprint_bits = header["fingerprint_bits"]
+        self._slots = words_from_bytes(slots, copy)
+
 
 def main():
     import random
@@ -0,0 +1,396 @@
+﻿"""v2 container for mphf files: header, table of contents, aligned sections.
+
+Mirrors the C++ definitions in BooPHF.h (`mphf_file_header`, `mphf_file_section`,
+`mphf_sharded_header`, `mphf_overlay_header`, `mphf_hot_header`, `mphf_map_header`). v1 is the original BBHash layout and is read/written by
+`mphf.save`/`mphf.load` directly; see docs/BINARY_FORMAT.md for the layouts.
+"""
+
+import struct
+import zlib
+from typing import Dict, List, Tuple
+
+FORMAT_V1 = 1
+FORMAT_V2 = 2
+
+MAGIC = b"\x89BBH\r\n\x1a\n"
+SECTION_ALIGN = 64
+
+# header flags
+FLAG_CRC32 = 1
+FLAG_MULTIPLY_HIGH = 2  # levels reduce hashes with multiply-high, else modulo
+FLAG_FINGERPRINTS = 4  # a fingerprints section follows the final values
+FLAG_LEVEL_DOMAINS = 8  # level sizes are the aux of their bits sections (gamma schedule), else they follow from gamma
+FLAGS_KNOWN = FLAG_CRC32 | FLAG_MULTIPLY_HIGH | FLAG_FINGERPRINTS | FLAG_LEVEL_DOMAINS
+
+# hasher ids, index into hashfunctors.HASHERS
+HASHER_XORSHIFT = 0  # SingleHashFunctor + XorshiftHashFunctors
+HASHER_WYMIX = 1  # WyMixHashFunctor + XorshiftHashFunctors
+HASHER_CRC32C = 2  # Crc32cHashFunctor + XorshiftHashFunctors
+HASHER_KEY128 = 3  # Key128HashFunctor + XorshiftHashFunctors, string keys (final keys are fingerprints)
+HASHERS_KNOWN = (HASHER_XORSHIFT, HASHER_WYMIX, HASHER_CRC32C, HASHER_KEY128)
+
+# section kinds
+SECTION_LEVEL_BITS = 1  # index = level, aux = bit size
+SECTION_LEVEL_RANKS = 2  # index = level
+SECTION_FINAL_KEYS = 3  # sorted, aux = key size
+SECTION_FINAL_VALUES = 4  # same order as the keys
+SECTION_FINGERPRINTS = 5  # one per mphf index, aux = bits per fingerprint
+
+FINGERPRINT_BITS_MAX = 32
+
+
+def fingerprint_words(nslots: int, bits: int) -> int:
+    """uint64 words holding nslots packed fingerprints of bits bits."""
+    return (nslots * bits + 63) // 64
+
+# magic, version, flags, hasher_id, nb_levels, gamma, nelem, lastbitsetrank, nb_sections, toc_crc, reserved[2]
+HEADER = struct.Struct("<8sIIIIdQQII8x")
+# kind, index, offset, length, aux, crc, reserved
+SECTION = struct.Struct("<IIQQQI4x")
+
+# sharded container (sharded_mphf): header, nb_shards + 1 index offsets, nb_shards + 1 file positions,
+# then one v2 file per shard at an aligned position, empty shards have no bytes
+SHARDED_MAGIC = b"\x89BBS\r\n\x1a\n"
+SHARDED_VERSION = 1
+# magic, version, nb_shards, nelem, table_crc, reserved[9]
+SHARDED_HEADER = struct.Struct("<8sIIQI36x")
+
+# overlay container (overlay_mphf): header, nb_segments + 1 index offsets, nb_segments + 1 file positions,
+# nb_overrides sorted override keys then their indices, then one v2 file per segment (the base first)
+OVERLAY_MAGIC = b"\x89BBO\r\n\x1a\n"
+OVERLAY_VERSION = 1
+# magic, version, nb_segments, nelem, nb_overrides, table_crc, reserved[7]
+OVERLAY_HEADER = struct.Struct("<8sIIQQI28x")
+
+# hot key cache (mphf.build_hot_cache), saved as <mphf file>.hot: header, then 2^slot_bits (key, index)
+# uint64 pairs, index ULLONG_MAX for an empty slot
+HOT_MAGIC = b"\x89BBK\r\n\x1a\n"
+HOT_VERSION = 1
+HOT_SUFFIX = ".hot"
+HOT_SLOT_BITS_MAX = 30
+# magic, version, slot_bits, hasher_id, key_size, nelem, lastbitsetrank, nb_filled, final_crc, slots_crc, min_level, reserved
+HOT_HEADER = struct.Struct("<8sIIIIQQQIII4x")
+
+# static map (static_map): header, the mphf as a v2 file, then nelem packed slots of value_bits + fingerprint_bits
+# bits (value low, fingerprint high, same packing as the fingerprints section), both at aligned positions
+MAP_MAGIC = b"\x89BBM\r\n\x1a\n"
+MAP_VERSION = 1
+MAP_SLOT_BITS_MAX = 64
+# magic, version, value_bits, fingerprint_bits, slots_crc, nelem, mphf_offset, mphf_length, slots_offset, reserved[2]
+MAP_HEADER = struct.Struct("<8sIIIIQQQQ8x")
+
+assert HEADER.size == 64 and SECTION.size == 40 and SHARDED_HEADER.size == 64 and OVERLAY_HEADER.size == 64
+assert HOT_HEADER.size == 64 and MAP_HEADER.size == 64
+
+
+def write_v2(f, gamma: float, nb_levels: int, lastbitsetrank: int, nelem: int,
+             sections: List[Tuple[int, int, int, bytes]], checksum: bool = True, flags: int = 0,
+             hasher_id: int = HASHER_XORSHIFT) -> None:
+    """Write a v2 file to binary stream f.
+
+    sections holds (kind, index, aux, payload) in file order, flags are
+    header flags besides FLAG_CRC32 (set from checksum).
+    """
+    toc = []
+    pos = HEADER.size + SECTION.size * len(sections)
+    for kind, index, aux, payload in sections:
+        offset = -(-pos // SECTION_ALIGN) * SECTION_ALIGN
+        crc = zlib.crc32(payload) if checksum else 0
+        toc.append(SECTION.pack(kind, index, offset, len(payload), aux, crc))
+        pos = offset + len(payload)
+    toc_bytes = b"".join(toc)
+
+    f.write(HEADER.pack(MAGIC, FORMAT_V2, flags | (FLAG_CRC32 if checksum else 0), hasher_id, nb_levels,
+                        gamma, nelem, lastbitsetrank, len(sections), zlib.crc32(toc_bytes)))
+    f.write(toc_bytes)
+    pos = HEADER.size + len(toc_bytes)
+    for entry, (_, _, _, payload) in zip(toc, sections):
+        offset = SECTION.unpack(entry)[2]
+        f.write(b"\0" * (offset - pos))
+        f.write(payload)
+        pos = offset + len(payload)
+
+
+def read_v2(buf, verify: bool = True) -> Tuple[dict, Dict[Tuple[int, int], Tuple[memoryview, int]]]:
+    """Parse a v2 file held in buf (bytes or mmap).
+
+    Returns the header fields and {(kind, index): (payload view, aux)}. The
+    table of contents checksum is always checked, section checksums only if
+    verify. Raises ValueError on truncated or corrupt files.
+    """
+    mv = memoryview(buf).cast("B")
+    if len(mv) < HEADER.size:
+        raise ValueError("truncated mphf file")
+    magic, version, flags, hasher_id, nb_levels, gamma, nelem, lastbitsetrank, nb_sections, toc_crc = \
+        HEADER.unpack_from(mv, 0)
+    if magic != MAGIC:
+        raise ValueError("not a v2 mphf file")
+    if version != FORMAT_V2:
+        raise ValueError(f"unsupported mphf format version {version}")
+    if flags & ~FLAGS_KNOWN:
+        raise ValueError(f"unsupported mphf file flags {flags:#x}")
+    if hasher_id not in HASHERS_KNOWN:
+        raise ValueError(f"unsupported mphf hasher id {hasher_id}")
+    with_fingerprints = bool(flags & FLAG_FINGERPRINTS)
+    if nb_sections != 2 * nb_levels + 2 + with_fingerprints or len(mv) - HEADER.size < SECTION.size * nb_sections:
+        raise ValueError("corrupt mphf file: unexpected number of sections")
+    toc_end = HEADER.size + SECTION.size * nb_sections
+    if zlib.crc32(mv[HEADER.size:toc_end]) != toc_crc:
+        raise ValueError("corrupt mphf file: table of contents checksum mismatch")
+
+    # level bits then ranks in level order, then final keys then values, then fingerprints (same as checkFileLayout)
+    expected = [(k, ii) for ii in range(nb_levels) for k in (SECTION_LEVEL_BITS, SECTION_LEVEL_RANKS)]
+    expected += [(SECTION_FINAL_KEYS, 0), (SECTION_FINAL_VALUES, 0)]
+    if with_fingerprints:
+        expected.append((SECTION_FINGERPRINTS, 0))
+
+    sections = {}
+    pos = toc_end
+    for ii, (kind, index, offset, length, aux, crc) in enumerate(SECTION.iter_unpack(mv[HEADER.size:toc_end])):
+        if (kind, index) != expected[ii]:
+            raise ValueError(f"corrupt mphf file: unexpected section {kind}/{index}")
+        if offset < pos or offset % SECTION_ALIGN or offset + length > len(mv):
+            raise ValueError("corrupt mphf file: section out of bounds")
+        if kind == SECTION_LEVEL_BITS:
+            ok = length == 8 * (1 + aux // 64)
+        elif kind == SECTION_FINAL_KEYS:
+            ok = aux == 8 and length % 8 == 0  # uint64 keys
+        elif kind == SECTION_FINGERPRINTS:
+            ok = 1 <= aux <= FINGERPRINT_BITS_MAX and length == 8 * fingerprint_words(nelem, aux)
+        else:
+            ok = length % 8 == 0
+        if not ok:
+            raise ValueError(f"corrupt mphf file: bad section {kind}/{index}")
+        payload = mv[offset:offset + length]
+        if verify and (flags & FLAG_CRC32) and zlib.crc32(payload) != crc:
+            raise ValueError("corrupt mphf file: section checksum mismatch")
+        sections[(kind, index)] = (payload, aux)
+        pos = offset + length
+    if len(sections[(SECTION_FINAL_KEYS, 0)][0]) != len(sections[(SECTION_FINAL_VALUES, 0)][0]):
+        raise ValueError("corrupt mphf file: final hash keys and values differ in size")
+
+    header = {
+        "version": version,
+        "flags": flags,
+        "hasher_id": hasher_id,
+        "nb_levels": nb_levels,
+        "gamma": gamma,
+        "nelem": nelem,
+        "lastbitsetrank": lastbitsetrank,
+    }
+    return header, sections
+
+
+def write_sharded(f, offsets: List[int], shards: List[bytes]) -> None:
+    """Write a sharded container to binary stream f.
+
+    shards holds the v2 file of each shard (b"" for an empty shard), offsets
+    the nb_shards + 1 prefix sums of their key counts.
+    """
+    table_end = SHARDED_HEADER.size + 16 * (len(shards) + 1)
+    positions = []
+    pos = table_end
+    for blob in shards:
+        if blob:
+            pos = -(-pos // SECTION_ALIGN) * SECTION_ALIGN
+        positions.append(pos)
+        pos += len(blob)
+    positions.append(pos)
+
+    offsets_bytes = struct.pack(f"<{len(offsets)}Q", *offsets)
+    positions_bytes = struct.pack(f"<{len(positions)}Q", *positions)
+    f.write(SHARDED_HEADER.pack(SHARDED_MAGIC, SHARDED_VERSION, len(shards), offsets[-1],
+                                zlib.crc32(positions_bytes, zlib.crc32(offsets_bytes))))
+    f.write(offsets_bytes)
+    f.write(positions_bytes)
+    pos = table_end
+    for start, blob in zip(positions, shards):
+        f.write(b"\0" * (start - pos))
+        f.write(blob)
+        pos = start + len(blob)
+
+
+def read_sharded(buf) -> Tuple[List[int], List[memoryview]]:
+    """Parse a sharded container held in buf (bytes or mmap).
+
+    Returns the nb_shards + 1 index offsets and a view on the v2 file of each
+    shard (empty for an empty shard). Raises ValueError on truncated or corrupt files.
+    """
+    mv = memoryview(buf).cast("B")
+    if len(mv) < SHARDED_HEADER.size:
+        raise ValueError("truncated sharded mphf file")
+    magic, version, nb_shards, nelem, table_crc = SHARDED_HEADER.unpack_from(mv, 0)
+    if magic != SHARDED_MAGIC:
+        raise ValueError("not a sharded mphf file")
+    if version != SHARDED_VERSION:
+        raise ValueError(f"unsupported sharded mphf version {version}")
+    table_end = SHARDED_HEADER.size + 16 * (nb_shards + 1)
+    if len(mv) < table_end:
+        raise ValueError("truncated sharded mphf file")
+    table = mv[SHARDED_HEADER.size:table_end]
+    if zlib.crc32(table[8 * (nb_shards + 1):], zlib.crc32(table[:8 * (nb_shards + 1)])) != table_crc:
+        raise ValueError("corrupt sharded mphf file: table checksum mismatch")
+    words = struct.unpack_from(f"<{2 * (nb_shards + 1)}Q", table)
+    offsets, positions = list(words[:nb_shards + 1]), words[nb_shards + 1:]
+
+    shards = []
+    pos = table_end
+    for s in range(nb_shards):
+        if positions[s] < pos or positions[s + 1] < positions[s] or offsets[s + 1] < offsets[s]:
+            raise ValueError("corrupt sharded mphf file: shard out of bounds")
+        if positions[s + 1] > len(mv):
+            raise ValueError("truncated sharded mphf file")
+        shards.append(mv[positions[s]:positions[s + 1]])
+        pos = positions[s + 1]
+    if offsets[-1] != nelem:
+        raise ValueError("corrupt sharded mphf file: key count mismatch")
+    return offsets, shards
+
+
+def write_overlay(f, offsets: List[int], overrides: List[Tuple[int, int]], segments: List[bytes]) -> None:
+    """Write an overlay container to binary stream f.
+
+    segments holds the v2 file of each segment, the base first, offsets the
+    nb_segments + 1 prefix sums of their key counts, overrides the
+    (key, index) pairs sorted by key.
+    """
+    table = struct.pack(f"<{len(offsets)}Q", *offsets)
+    table_end = OVERLAY_HEADER.size + 16 * (len(segments) + 1) + 16 * len(overrides)
+    positions = []
+    pos = table_end
+    for blob in segments:
+        pos = -(-pos // SECTION_ALIGN) * SECTION_ALIGN
+        positions.append(pos)
+        pos += len(blob)
+    positions.append(pos)
+
+    table += struct.pack(f"<{len(positions)}Q", *positions)
+    table += struct.pack(f"<{len(overrides)}Q", *(key for key, _ in overrides))
+    table += struct.pack(f"<{len(overrides)}Q", *(idx for _, idx in overrides))
+    f.write(OVERLAY_HEADER.pack(OVERLAY_MAGIC, OVERLAY_VERSION, len(segments), offsets[-1], len(overrides),
+                                zlib.crc32(table)))
+    f.write(table)
+    pos = table_end
+    for start, blob in zip(positions, segments):
+        f.write(b"\0" * (start - pos))
+        f.write(blob)
+        pos = start + len(blob)
+
+
+def read_overlay(buf) -> Tuple[List[int], List[Tuple[int, int]], List[memoryview]]:
+    """Parse an overlay container held in buf (bytes or mmap).
+
+    Returns the nb_segments + 1 index offsets, the sorted (key, index)
+    overrides and a view on the v2 file of each segment. Raises ValueError on
+    truncated or corrupt files.
+    """
+    mv = memoryview(buf).cast("B")
+    if len(mv) < OVERLAY_HEADER.size:
+        raise ValueError("truncated overlay mphf file")
+    magic, version, nb_segments, nelem, nb_overrides, table_crc = OVERLAY_HEADER.unpack_from(mv, 0)
+    if magic != OVERLAY_MAGIC:
+        raise ValueError("not an overlay mphf file")
+    if version != OVERLAY_VERSION:
+        raise ValueError(f"unsupported overlay mphf version {version}")
+    if nb_segments == 0 or nb_overrides > nelem:
+        raise ValueError("corrupt overlay mphf file: bad header")
+    table_end = OVERLAY_HEADER.size + 16 * (nb_segments + 1) + 16 * nb_overrides
+    if len(mv) < table_end:
+        raise ValueError("truncated overlay mphf file")
+    if zlib.crc32(mv[OVERLAY_HEADER.size:table_end]) != table_crc:
+        raise ValueError("corrupt overlay mphf file: table checksum mismatch")
+    words = struct.unpack_from(f"<{2 * (nb_segments + 1 + nb_overrides)}Q", mv, OVERLAY_HEADER.size)
+    offsets, positions = list(words[:nb_segments + 1]), words[nb_segments + 1:2 * (nb_segments + 1)]
+    keys = words[2 * (nb_segments + 1):2 * (nb_segments + 1) + nb_overrides]
+    overrides = list(zip(keys, words[2 * (nb_segments + 1) + nb_overrides:]))
+    if any(a >= b for a, b in zip(keys, keys[1:])):
+        raise ValueError("corrupt overlay mphf file: override keys are not sorted")
+
+    segments = []
+    pos = table_end
+    for s in range(nb_segments):
+        if positions[s] < pos or positions[s + 1] <= positions[s] or offsets[s + 1] < offsets[s]:
+            raise ValueError("corrupt overlay mphf file: segment out of bounds")
+        if positions[s + 1] > len(mv):
+            raise ValueError("truncated overlay mphf file")
+        segments.append(mv[positions[s]:positions[s + 1]])
+        pos = positions[s + 1]
+    if offsets[0] != 0 or offsets[-1] != nelem:
+        raise ValueError("corrupt overlay mphf file: key count mismatch")
+    return offsets, overrides, segments
+
+def write_hot(f, slot_bits: int, hasher_id: int, nelem: int, lastbitsetrank: int, final_crc: int, min_level: int,
+              nb_filled: int, slots: bytes) -> None:
+    """Write a hot key cache file to binary stream f, slots holding the little-endian (key, index) pairs."""
+    f.write(HOT_HEADER.pack(HOT_MAGIC, HOT_VERSION, slot_bits, hasher_id, 8, nelem, lastbitsetrank, nb_filled,
+                            final_crc, zlib.crc32(slots), min_level))
+    f.write(slots)
+
+
+def read_hot(buf) -> Tuple[dict, memoryview]:
+    """Parse a hot key cache file held in buf.
+
+    Returns the header fields and a view on the slots. Raises ValueError on
+    truncated or corrupt files; whether the cache belongs to an mphf is left
+    to the caller (hasher_id, nelem, lastbitsetrank, final_crc).
+    """
+    mv = memoryview(buf).cast("B")
+    if len(mv) < HOT_HEADER.size:
+        raise ValueError("truncated hot key cache file")
+    (magic, version, slot_bits, hasher_id, key_size, nelem, lastbitsetrank, nb_filled, final_crc, slots_crc,
+     min_level) = HOT_HEADER.unpack_from(mv, 0)
+    if magic != HOT_MAGIC:
+        raise ValueError("not a hot key cache file")
+    if version != HOT_VERSION:
+        raise ValueError(f"unsupported hot key cache version {version}")
+    if not 1 <= slot_bits <= HOT_SLOT_BITS_MAX or key_size != 8:
+        raise ValueError("corrupt hot key cache file: bad header")
+    end = HOT_HEADER.size + 16 * (1 << slot_bits)
+    if len(mv) < end:
+        raise ValueError("truncated hot key cache file")
+    slots = mv[HOT_HEADER.size:end]
+    if zlib.crc32(slots) != slots_crc:
+        raise ValueError("corrupt hot key cache file: slots checksum mismatch")
+    header = {"slot_bits": slot_bits, "hasher_id": hasher_id, "nelem": nelem, "lastbitsetrank": lastbitsetrank,
+              "nb_filled": nb_filled, "final_crc": final_crc, "min_level": min_level}
+    return header, slots
+
+
+def write_map(f, value_bits: int, fingerprint_bits: int, nelem: int, image: bytes, slots: bytes) -> None:
+    """Write a static map file to binary stream f, image being the v2 file of its mphf."""
+    slots_offset = -(-(MAP_HEADER.size + len(image)) // SECTION_ALIGN) * SECTION_ALIGN
+    f.write(MAP_HEADER.pack(MAP_MAGIC, MAP_VERSION, value_bits, fingerprint_bits, zlib.crc32(slots), nelem,
+                            MAP_HEADER.size, len(image), slots_offset))
+    f.write(image)
+    f.write(b"\0" * (slots_offset - MAP_HEADER.size - len(image)))
+    f.write(slots)
+
+
+def read_map(buf, verify: bool = True) -> Tuple[dict, memoryview, memoryview]:
+    """Parse a static map file held in buf (bytes or mmap).
+
+    Returns the header fields, a view on the v2 file of the mphf and a view on
+    the slots. The slots checksum is only checked with verify. Raises
+    ValueError on truncated or corrupt files.
+    """
+    mv = memoryview(buf).cast("B")
+    if len(mv) < MAP_HEADER.size:
+        raise ValueError("truncated static map file")
+    (magic, version, value_bits, fingerprint_bits, slots_crc, nelem, mphf_offset, mphf_length,
+     slots_offset) = MAP_HEADER.unpack_from(mv, 0)
+    if magic != MAP_MAGIC:
+        raise ValueError("not a static map file")
+    if version != MAP_VERSION:
+        raise ValueError(f"unsupported static map version {version}")
+    if (not 1 <= value_bits <= MAP_SLOT_BITS_MAX or value_bits + fingerprint_bits > MAP_SLOT_BITS_MAX
+            or mphf_offset < MAP_HEADER.size or mphf_offset % SECTION_ALIGN or slots_offset % SECTION_ALIGN
+            or mphf_offset + mphf_length > slots_offset):
+        raise ValueError("corrupt static map file: bad header")
+    slots_end = slots_offset + 8 * fingerprint_words(nelem, value_bits + fingerprint_bits)
+    if len(mv) < slots_end:
+        raise ValueError("truncated static map file")
+    slots = mv[slots_offset:slots_end]
+    if verify and zlib.crc32(slots) != slots_crc:
+        raise ValueError("corrupt static map file: slots checksum mismatch")
+    header = {"value_bits": value_bits, "fingerprint_bits": fingerprint_bits, "nelem": nelem}
+    return header, mv[mphf_offset:mphf_offset + mphf_length], slots
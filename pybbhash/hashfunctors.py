@@ -1,11 +1,12 @@
 ﻿"""Hash functors ported from BooPHF C++ code.
 
-This provides a SingleHashFunctor (wrapper around a simple hash64) and
-an Xorshift-based multi-hasher that yields multiple pseudo-random hashes
-from two seeds (h0 and h1).
+This provides the single hashers (SingleHashFunctor around a simple hash64,
+WyMixHashFunctor, Crc32cHashFunctor) and an Xorshift-based multi-hasher that
+yields multiple pseudo-random hashes from two seeds (h0 and h1).
 """
 
-from typing import List
+import struct
+from typing import List, Tuple
 
 
 class HashFunctors:
@@ -72,6 +73,117 @@ class SingleHashFunctor:
         return self._hf.hashWithSeed(key, seed)
 
 
+class WyMixHashFunctor:
+    """wyhash-style mix of a 64-bit key (C++ WyMixHashFunctor), not wyhash of the key bytes."""
+
+    @staticmethod
+    def _wymum(a: int, b: int) -> int:
+        # low ^ high 64 bits of the 128-bit product
+        p = a * b
+        return (p ^ (p >> 64)) & 0xFFFFFFFFFFFFFFFF
+
+    def __call__(self, key: int, seed: int = 0xAAAAAAAA55555555) -> int:
+        k = key & 0xFFFFFFFFFFFFFFFF
+        h = self._wymum(k ^ 0xA0761D6478BD642F, (seed ^ 0xE7037ED1A0B428DB) & 0xFFFFFFFFFFFFFFFF)
+        return self._wymum(h, k ^ 0x8EBC6AF09C88C6E3)
+
+
+def _crc32c_table() -> List[int]:
+    table = []
+    for ii in range(256):
+        c = ii
+        for _ in range(8):
+            c = (0x82F63B78 ^ (c >> 1)) if c & 1 else (c >> 1)
+        table.append(c)
+    return table
+
+
+_CRC32C_TABLE = _crc32c_table()
+
+
+def crc32c_u64(crc: int, v: int) -> int:
+    """crc32c of the 8 little-endian bytes of v, without pre/post inversion (the SSE4.2 crc32 instruction)."""
+    for _ in range(8):
+        crc = _CRC32C_TABLE[(crc ^ v) & 0xFF] ^ (crc >> 8)
+        v >>= 8
+    return crc
+
+
+class Crc32cHashFunctor:
+    """Two crc32c of the key joined and finalised with fmix64 (C++ Crc32cHashFunctor)."""
+
+    def __call__(self, key: int, seed: int = 0xAAAAAAAA55555555) -> int:
+        k = key & 0xFFFFFFFFFFFFFFFF
+        h = (crc32c_u64((seed >> 32) & 0xFFFFFFFF, (k * 0x9E3779B97F4A7C15) & 0xFFFFFFFFFFFFFFFF) << 32) | \
+            crc32c_u64(seed & 0xFFFFFFFF, k)
+        h ^= h >> 33
+        h = (h * 0xFF51AFD7ED558CCD) & 0xFFFFFFFFFFFFFFFF
+        h ^= h >> 33
+        h = (h * 0xC4CEB9FE1A85EC53) & 0xFFFFFFFFFFFFFFFF
+        h ^= h >> 33
+        return h
+
+
+_M64 = 0xFFFFFFFFFFFFFFFF
+
+
+def _rotl64(x: int, r: int) -> int:
+    return ((x << r) | (x >> (64 - r))) & _M64
+
+
+def _fmix64(k: int) -> int:
+    k ^= k >> 33
+    k = (k * 0xFF51AFD7ED558CCD) & _M64
+    k ^= k >> 33
+    k = (k * 0xC4CEB9FE1A85EC53) & _M64
+    k ^= k >> 33
+    return k
+
+
+def murmur3_128(data: bytes, seed: int = 0) -> Tuple[int, int]:
+    """MurmurHash3_x64_128 of data, (h1, h2) as in the reference (C++ murmur3_128)."""
+    c1, c2 = 0x87C37B91114253D5, 0x4CF5AD432745937F
+    h1 = h2 = seed & _M64
+    n = len(data)
+    nblocks = n // 16
+    for k1, k2 in struct.iter_unpack("<QQ", data[:16 * nblocks]):
+        h1 ^= (_rotl64((k1 * c1) & _M64, 31) * c2) & _M64
+        h1 = (((_rotl64(h1, 27) + h2) * 5) + 0x52DCE729) & _M64
+        h2 ^= (_rotl64((k2 * c2) & _M64, 33) * c1) & _M64
+        h2 = (((_rotl64(h2, 31) + h1) * 5) + 0x38495AB5) & _M64
+
+    tail = data[16 * nblocks:]
+    if len(tail) > 8:
+        k2 = int.from_bytes(tail[8:], "little")
+        h2 ^= (_rotl64((k2 * c2) & _M64, 33) * c1) & _M64
+    if tail:
+        k1 = int.from_bytes(tail[:8], "little")
+        h1 ^= (_rotl64((k1 * c1) & _M64, 31) * c2) & _M64
+
+    h1 ^= n
+    h2 ^= n
+    h1 = (h1 + h2) & _M64
+    h2 = (h2 + h1) & _M64
+    h1 = _fmix64(h1)
+    h2 = _fmix64(h2)
+    h1 = (h1 + h2) & _M64
+    h2 = (h2 + h1) & _M64
+    return h1, h2
+
+
+class Key128HashFunctor:
+    """Single hasher of 128-bit keys h1 | h2 << 64 (murmur3_128 of a string key), C++ Key128HashFunctor."""
+
+    def __call__(self, key: int, seed: int = 0xAAAAAAAA55555555) -> int:
+        return WyMixHashFunctor._wymum((key & _M64) ^ seed, (key >> 64) ^ 0xE7037ED1A0B428DB)
+
+
+# single hashers by hasher id of the v2 file header (C++ MPHF_HASHER_*), and their names
+# ("key128" is the hasher of string / bytes keys, integer keys take the others)
+SINGLE_HASHERS = (SingleHashFunctor, WyMixHashFunctor, Crc32cHashFunctor, Key128HashFunctor)
+HASHERS = ("hash64", "wymix", "crc32c", "key128")
+
+
 class XorshiftHashFunctors:
     """Generate multiple hashes using xorshift state seeded from single-hasher."""
 
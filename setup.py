@@ -4,8 +4,9 @@ This setup.py is provided for backward compatibility.
 The project is configured primarily through pyproject.toml.
 """
 
-from setuptools import setup
+from setuptools import setup, Extension
 import os
+import sys
 
 # Read version from pyproject.toml or use default
 version = "0.2.1"
@@ -21,6 +22,31 @@ try:
 except Exception:
     pass
 
+# Optional compiled backend built from the C++ BooPHF headers.
+# Set PYBBHASH_PURE_PYTHON=1 to skip it; a failed build also falls back to pure Python.
+CPP_HEADERS = os.path.join('tests', 'cross_language', 'cpp_headers')
+
+if sys.platform == 'win32':
+    native_compile_args = ['/std:c++17', '/O2', '/EHsc']
+    native_link_args = []
+else:
+    native_compile_args = ['-std=c++17', '-O3', '-pthread']
+    native_link_args = ['-pthread']
+
+ext_modules = []
+if os.environ.get('PYBBHASH_PURE_PYTHON', '') not in ('1', 'true', 'yes'):
+    ext_modules.append(
+        Extension(
+            "pybbhash._native",
+            sources=["pybbhash/_native.cpp"],
+            include_dirs=[CPP_HEADERS],
+            language="c++",
+            extra_compile_args=native_compile_args,
+            extra_link_args=native_link_args,
+            optional=True,
+        )
+    )
+
 setup(
     name="pybbhash",
     version=version,
@@ -31,6 +57,7 @@ setup(
     url="https://github.com/icyyoung719/pybbhash",
     license="MIT",
     packages=["pybbhash"],
+    ext_modules=ext_modules,
     python_requires=">=3.8",
     classifiers=[
         "Development Status :: 4 - Beta",
@@ -0,0 +1,164 @@
+﻿// Level bitset insertion strategies of the mphf build :
+//   cas     : seq_cst compare-exchange loop (the former bitVector::atomic_test_and_set)
+//   fetch_or: relaxed fetch_or (bitVector::atomic_test_and_set)
+//   private : per-thread plain bitsets ORed together after the level (mphf::mergePrivateBits)
+//
+// g++ -std=c++17 -O2 -pthread bench_level_bits.cpp -o bench_level_bits
+// ./bench_level_bits [nkeys] [gamma]
+#include "../cross_language/cpp_headers/BooPHF.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static uint64_t xorshift(uint64_t& x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+// same bits as bitVector::atomic_test_and_set before it used fetch_or
+static uint64_t cas_test_and_set(std::atomic<uint64_t>* words, uint64_t pos)
+{
+	uint64_t mask = 1ULL << (pos & 63);
+	std::atomic<uint64_t>& word = words[pos >> 6];
+	uint64_t oldval = word.load(std::memory_order_seq_cst);
+	while (!word.compare_exchange_weak(oldval, oldval | mask, std::memory_order_seq_cst))
+	{
+	}
+	return (oldval >> (pos & 63)) & 1;
+}
+
+// runs body(tid, first, last) on nthreads threads over [0, nkeys), returns the wall time in seconds
+template <typename Body>
+static double run_threads(int nthreads, uint64_t nkeys, Body body)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; t++)
+		threads.emplace_back(body, t, nkeys * t / nthreads, nkeys * (t + 1) / nthreads);
+	for (auto& t : threads)
+		t.join();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// level bits and collision count of one strategy, checked against the others
+struct level_result
+{
+	double seconds;
+	uint64_t nset;
+	uint64_t ncoll;
+};
+
+static level_result count_bits(double seconds, const bitVector& bits, const bitVector& coll)
+{
+	level_result res = {seconds, 0, 0};
+	for (uint64_t w = 0; w < bits.size() / 64; w++)
+	{
+		res.nset += __builtin_popcountll(bits.get64(w));
+		res.ncoll += __builtin_popcountll(coll.get64(w));
+	}
+	return res;
+}
+
+static level_result bench_cas(int nthreads, uint64_t nkeys, uint64_t domain)
+{
+	std::vector<std::atomic<uint64_t>> bits(domain / 64);
+	std::vector<std::atomic<uint64_t>> coll(domain / 64);
+	double seconds = run_threads(nthreads, nkeys, [&](int, uint64_t first, uint64_t last)
+	                             {
+		for (uint64_t k = first; k < last; k++)
+		{
+			uint64_t x = (k + 1) * 0x9E3779B97F4A7C15ULL;
+			uint64_t pos = xorshift(x) % domain;
+			if (cas_test_and_set(bits.data(), pos))
+				cas_test_and_set(coll.data(), pos);
+		} });
+	bitVector out_bits(domain), out_coll(domain);
+	for (uint64_t w = 0; w < domain / 64; w++)
+	{
+		out_bits.set64(w, bits[w].load());
+		out_coll.set64(w, coll[w].load());
+	}
+	return count_bits(seconds, out_bits, out_coll);
+}
+
+static level_result bench_fetch_or(int nthreads, uint64_t nkeys, uint64_t domain)
+{
+	bitVector bits(domain), coll(domain);
+	double seconds = run_threads(nthreads, nkeys, [&](int, uint64_t first, uint64_t last)
+	                             {
+		for (uint64_t k = first; k < last; k++)
+		{
+			uint64_t x = (k + 1) * 0x9E3779B97F4A7C15ULL;
+			uint64_t pos = xorshift(x) % domain;
+			if (bits.atomic_test_and_set(pos))
+				coll.atomic_test_and_set(pos);
+		} });
+	return count_bits(seconds, bits, coll);
+}
+
+static level_result bench_private(int nthreads, uint64_t nkeys, uint64_t domain)
+{
+	uint64_t nwords = domain / 64;
+	bitVector bits(domain), coll(domain);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::vector<uint64_t>> priv(nthreads, std::vector<uint64_t>(2 * nwords, 0));
+	run_threads(nthreads, nkeys, [&](int tid, uint64_t first, uint64_t last)
+	            {
+		std::vector<uint64_t>& mine = priv[tid];
+		for (uint64_t k = first; k < last; k++)
+		{
+			uint64_t x = (k + 1) * 0x9E3779B97F4A7C15ULL;
+			uint64_t pos = xorshift(x) % domain;
+			uint64_t mask = 1ULL << (pos & 63);
+			mine[nwords + (pos >> 6)] |= mine[pos >> 6] & mask;
+			mine[pos >> 6] |= mask;
+		} });
+	for (uint64_t w = 0; w < nwords; w++)
+	{
+		uint64_t once = 0;
+		uint64_t twice = 0;
+		for (const auto& mine : priv)
+		{
+			twice |= (once & mine[w]) | mine[nwords + w];
+			once |= mine[w];
+		}
+		bits.set64(w, once);
+		coll.set64(w, twice);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return count_bits(seconds, bits, coll);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t nkeys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000ULL;
+	double gamma = argc > 2 ? std::atof(argv[2]) : 2.0;
+	uint64_t domain = ((uint64_t)(nkeys * gamma) + 63) / 64 * 64;
+
+	std::cout << "nkeys " << nkeys << "  domain " << domain << " bits  hardware threads " << std::thread::hardware_concurrency() << "\n";
+	std::cout << "threads  strategy   Mkeys/s   (private bitsets : " << (2 * domain / 8) << " bytes per thread)\n";
+	for (int nthreads : {1, 8, 32})
+	{
+		level_result cas = bench_cas(nthreads, nkeys, domain);
+		level_result fetch_or = bench_fetch_or(nthreads, nkeys, domain);
+		level_result priv = bench_private(nthreads, nkeys, domain);
+		for (auto& r : {std::make_pair("cas", cas), std::make_pair("fetch_or", fetch_or), std::make_pair("private", priv)})
+		{
+			std::cout << "  " << nthreads << "\t " << r.first << "\t" << (nkeys / r.second.seconds / 1e6) << "\n";
+			if (r.second.nset != cas.nset || r.second.ncoll != cas.ncoll)
+			{
+				std::cerr << " " << r.first << " sets different bits\n";
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
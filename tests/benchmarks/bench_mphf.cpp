@@ -0,0 +1,386 @@
+﻿// Build, lookup and load benchmarks of boomphf::mphf, results written as JSON
+// (same schema as bench_mphf.py, compare runs with compare.py) :
+//   build        : wall time of the construction for each key count, thread count and gamma
+//   lookup_*     : latency per lookup (mean and percentiles in ns) of keys in the set (hit) or not (miss),
+//                  one key at a time (single, timed LOOKUP_GROUP lookups at a time) or NBLOOKUPBATCH keys per call (batch)
+//   load_stream  : load() of a v2 file through an ifstream
+//   load_mmap    : map() of the same file
+//   save_stream  : save() of that v2 file through an ofstream
+//   save_file, load_file : save(path) / load(path) of it, positional chunked I/O on each thread count
+//   lookup_skew_*, lookup_skew_hot_* : lookups of a skewed trace (90% on 10000 hot keys), without and with
+//                  a hot key cache of MPHF_HOT_SLOTS slots built from the first half of the trace
+//   lookup_pool  : ns per key of lookup_pool::lookup over the hit keys in one batch, on each thread count
+//   map_get_hit_*: latency per get of a static_map of 32-bit values with 8-bit fingerprints (one slot read per get),
+//                  single or batched as the lookups, with its bits_per_key
+//   build_schedule, lookup_schedule_* : build and lookups of an mphf whose level 0 has 1.5 * gamma and the next
+//                  levels 0.75 * gamma, stopping once fewer than SCHEDULE_MIN_KEYS keys reach a level, with its
+//                  bits_per_key and nb_levels
+//   bits_per_key : totalBitSize() / n, reported with the build
+//
+// g++ -std=c++17 -O2 -pthread bench_mphf.cpp -o bench_mphf
+// ./bench_mphf [--keys 1000000,10000000,100000000] [--threads 1,4] [--gamma 1,2] [--lookups 1000000] [--tmp-dir .] [--out bench_mphf_cpp.json]
+#include "../cross_language/cpp_headers/BooPHF.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOOKUP_GROUP 16 // single lookups timed together, a clock read costs about as much as a lookup
+#define SCHEDULE_MIN_KEYS 1000 // build_schedule : keys reaching a level below which the rest go to the final table
+
+typedef boomphf::SingleHashFunctor<uint64_t> hasher_t;
+typedef boomphf::mphf<uint64_t, hasher_t> boophf_t;
+
+static uint64_t xorshift(uint64_t& x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+// distinct keys, the xorshift has no cycle shorter than 2^64 - 1
+static std::vector<uint64_t> xorshift_keys(uint64_t n, uint64_t seed)
+{
+	std::vector<uint64_t> keys(n);
+	for (uint64_t ii = 0; ii < n; ii++)
+		keys[ii] = xorshift(seed);
+	return keys;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::vector<double> parse_list(const char* arg)
+{
+	std::vector<double> values;
+	std::stringstream ss(arg);
+	for (std::string item; std::getline(ss, item, ',');)
+		values.push_back(std::atof(item.c_str()));
+	return values;
+}
+
+// one JSON object of the "benchmarks" array, fields in insertion order
+class record
+{
+  public:
+	record(const std::string& kind, uint64_t n, int threads, double gamma)
+	{
+		std::ostringstream name;
+		name << kind << "/n:" << n << "/threads:" << threads << "/gamma:" << gamma;
+		add("name", "\"" + name.str() + "\"");
+		add("backend", "\"cpp\"");
+		add("n", n);
+		add("threads", threads);
+		add("gamma", gamma);
+	}
+
+	template <typename T>
+	record& add(const char* key, const T& value)
+	{
+		std::ostringstream os;
+		os.precision(9);
+		os << value;
+		return add(key, os.str());
+	}
+
+	record& add(const char* key, const std::string& json)
+	{
+		_fields += (_fields.empty() ? "" : ", ") + std::string("\"") + key + "\": " + json;
+		return *this;
+	}
+
+	std::string str() const { return "{" + _fields + "}"; }
+
+  private:
+	std::string _fields;
+};
+
+// mean and percentiles in ns of per lookup samples
+struct latency
+{
+	double mean, p50, p90, p99;
+	size_t samples;
+};
+
+static latency summarize(std::vector<double> ns)
+{
+	std::sort(ns.begin(), ns.end());
+	double mean = 0;
+	for (double v : ns)
+		mean += v;
+	auto pct = [&](double p)
+	{ return ns[std::min<size_t>(ns.size() - 1, static_cast<size_t>(p * ns.size()))]; };
+	return {mean / ns.size(), pct(0.50), pct(0.90), pct(0.99), ns.size()};
+}
+
+// per lookup latency samples over queries, LOOKUP_GROUP keys at a time (single) or NBLOOKUPBATCH keys per call (batch)
+static std::vector<double> time_lookups(const boophf_t& bphf, const std::vector<uint64_t>& queries, bool batch, uint64_t& checksum)
+{
+	size_t group = batch ? NBLOOKUPBATCH : LOOKUP_GROUP;
+	std::vector<double> ns;
+	ns.reserve(queries.size() / group);
+	uint64_t out[NBLOOKUPBATCH];
+	for (size_t ii = 0; ii + group <= queries.size(); ii += group)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if (batch)
+			bphf.lookup(queries.data() + ii, group, out);
+		else
+			for (size_t jj = 0; jj < group; jj++)
+				out[jj] = bphf.lookup(queries[ii + jj]);
+		ns.push_back(seconds_since(start) * 1e9 / group);
+		checksum += out[0]; // keeps the lookups
+	}
+	return ns;
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<double> key_counts = {1e6, 1e7, 1e8};
+	std::vector<double> thread_counts = {1, 4};
+	std::vector<double> gammas = {1.0, 2.0};
+	uint64_t nlookups = 1000000;
+	std::string tmp_dir = ".";
+	std::string out_path = "bench_mphf_cpp.json";
+	for (int ii = 1; ii + 1 < argc; ii += 2)
+	{
+		std::string opt = argv[ii];
+		if (opt == "--keys")
+			key_counts = parse_list(argv[ii + 1]);
+		else if (opt == "--threads")
+			thread_counts = parse_list(argv[ii + 1]);
+		else if (opt == "--gamma")
+			gammas = parse_list(argv[ii + 1]);
+		else if (opt == "--lookups")
+			nlookups = std::strtoull(argv[ii + 1], nullptr, 10);
+		else if (opt == "--tmp-dir")
+			tmp_dir = argv[ii + 1];
+		else if (opt == "--out")
+			out_path = argv[ii + 1];
+		else
+		{
+			std::cerr << "unknown option " << opt << "\n";
+			return 2;
+		}
+	}
+
+	std::vector<std::string> results;
+	uint64_t checksum = 0;
+	for (double nd : key_counts)
+	{
+		uint64_t n = static_cast<uint64_t>(nd);
+		std::vector<uint64_t> keys = xorshift_keys(n, 0x9E3779B97F4A7C15ULL);
+		std::vector<uint64_t> misses = xorshift_keys(nlookups, 0xD1B54A32D192ED03ULL);
+		std::vector<uint64_t> hits(nlookups);
+		uint64_t x = 0x2545F4914F6CDD1DULL;
+		for (auto& key : hits)
+			key = keys[xorshift(x) % n];
+
+		for (double gamma : gammas)
+		{
+			for (size_t t = 0; t < thread_counts.size(); t++)
+			{
+				int threads = static_cast<int>(thread_counts[t]);
+				auto start = std::chrono::steady_clock::now();
+				boophf_t bphf(n, keys, threads, gamma, false, false);
+				double build_s = seconds_since(start);
+				double bits_per_key = double(bphf.totalBitSize()) / n;
+				record build("build", n, threads, gamma);
+				build.add("real_time", build_s).add("time_unit", std::string("\"s\"")).add("keys_per_second", n / build_s).add("bits_per_key", bits_per_key);
+				results.push_back(build.str());
+				std::cout << "build    n " << n << "  threads " << threads << "  gamma " << gamma << "  " << build_s << " s  " << bits_per_key << " bits/key\n";
+
+				// the structure does not depend on the thread count : lookups and loads once per gamma
+				if (t > 0)
+					continue;
+				const std::pair<const char*, const std::vector<uint64_t>*> workloads[] = {{"hit", &hits}, {"miss", &misses}};
+				for (const auto& workload : workloads)
+				{
+					for (bool batch : {false, true})
+					{
+						std::string kind = std::string("lookup_") + workload.first + (batch ? "_batch" : "_single");
+						latency lat = summarize(time_lookups(bphf, *workload.second, batch, checksum));
+						record r(kind, n, 1, gamma);
+						r.add("real_time", lat.mean).add("time_unit", std::string("\"ns\"")).add("p50_ns", lat.p50).add("p90_ns", lat.p90).add("p99_ns", lat.p99).add("samples", lat.samples);
+						results.push_back(r.str());
+						std::cout << kind << "  n " << n << "  gamma " << gamma << "  mean " << lat.mean << "  p50 " << lat.p50 << "  p99 " << lat.p99 << " ns\n";
+					}
+				}
+
+				{
+					boomphf::mphf_level_schedule schedule;
+					schedule.gammas = {1.5 * gamma, 0.75 * gamma};
+					schedule.min_keys = SCHEDULE_MIN_KEYS;
+					start = std::chrono::steady_clock::now();
+					boophf_t scheduled(n, keys, threads, gamma, false, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".", nullptr, 1.0, schedule);
+					double scheduled_s = seconds_since(start);
+					double scheduled_bits = double(scheduled.totalBitSize()) / n;
+					record r("build_schedule", n, threads, gamma);
+					r.add("real_time", scheduled_s).add("time_unit", std::string("\"s\"")).add("keys_per_second", n / scheduled_s).add("bits_per_key", scheduled_bits).add("nb_levels", scheduled.nbLevels());
+					results.push_back(r.str());
+					std::cout << "build_schedule  n " << n << "  threads " << threads << "  gamma " << 1.5 * gamma << " / " << 0.75 * gamma << "  " << scheduled_s << " s  " << scheduled_bits << " bits/key  " << scheduled.nbLevels() << " levels\n";
+					for (const auto& workload : workloads)
+					{
+						for (bool batch : {false, true})
+						{
+							std::string kind = std::string("lookup_schedule_") + workload.first + (batch ? "_batch" : "_single");
+							latency lat = summarize(time_lookups(scheduled, *workload.second, batch, checksum));
+							record s(kind, n, 1, gamma);
+							s.add("real_time", lat.mean).add("time_unit", std::string("\"ns\"")).add("p50_ns", lat.p50).add("p90_ns", lat.p90).add("p99_ns", lat.p99).add("samples", lat.samples);
+							results.push_back(s.str());
+							std::cout << kind << "  n " << n << "  gamma " << gamma << "  mean " << lat.mean << "  p50 " << lat.p50 << "  p99 " << lat.p99 << " ns\n";
+						}
+					}
+				}
+
+				std::vector<uint64_t> skew(nlookups);
+				for (auto& key : skew)
+					key = (xorshift(x) % 10 != 0) ? keys[xorshift(x) % std::min<uint64_t>(n, 10000)] : keys[xorshift(x) % n];
+				for (bool hot : {false, true})
+				{
+					if (hot)
+						bphf.buildHotCache(skew.data(), skew.size() / 2);
+					for (bool batch : {false, true})
+					{
+						std::string kind = std::string(hot ? "lookup_skew_hot" : "lookup_skew") + (batch ? "_batch" : "_single");
+						latency lat = summarize(time_lookups(bphf, skew, batch, checksum));
+						record r(kind, n, 1, gamma);
+						r.add("real_time", lat.mean).add("time_unit", std::string("\"ns\"")).add("p50_ns", lat.p50).add("p90_ns", lat.p90).add("p99_ns", lat.p99).add("samples", lat.samples);
+						results.push_back(r.str());
+						std::cout << kind << "  n " << n << "  gamma " << gamma << "  mean " << lat.mean << "  p50 " << lat.p50 << "  p99 " << lat.p99 << " ns\n";
+					}
+				}
+				bphf.clearHotCache();
+
+				for (double td : thread_counts)
+				{
+					int pool_threads = static_cast<int>(td);
+					boomphf::lookup_pool<boophf_t> pool(bphf, pool_threads);
+					std::vector<uint64_t> out(hits.size());
+					start = std::chrono::steady_clock::now();
+					pool.lookup(hits.data(), hits.size(), out.data());
+					double pool_ns = seconds_since(start) * 1e9 / hits.size();
+					checksum += out[0];
+					record r("lookup_pool", n, pool_threads, gamma);
+					r.add("real_time", pool_ns).add("time_unit", std::string("\"ns\""));
+					results.push_back(r.str());
+					std::cout << "lookup_pool  n " << n << "  threads " << pool_threads << "  gamma " << gamma << "  " << pool_ns << " ns/key\n";
+				}
+
+				{
+					std::vector<uint32_t> values(n);
+					for (uint64_t ii = 0; ii < n; ii++)
+						values[ii] = static_cast<uint32_t>(keys[ii]);
+					boomphf::static_map<uint64_t, uint32_t, hasher_t> map(n, keys, values.data(), 32, 8, 1, gamma);
+					double map_bits_per_key = (double)map.totalBitSize() / n;
+					for (bool batch : {false, true})
+					{
+						size_t group = batch ? NBLOOKUPBATCH : LOOKUP_GROUP;
+						std::vector<double> ns;
+						uint32_t out[NBLOOKUPBATCH];
+						for (size_t ii = 0; ii + group <= hits.size(); ii += group)
+						{
+							start = std::chrono::steady_clock::now();
+							if (batch)
+								map.get(hits.data() + ii, group, out);
+							else
+								for (size_t jj = 0; jj < group; jj++)
+									out[jj] = map.get(hits[ii + jj]);
+							ns.push_back(seconds_since(start) * 1e9 / group);
+							checksum += out[0];
+						}
+						latency lat = summarize(ns);
+						std::string kind = std::string("map_get_hit") + (batch ? "_batch" : "_single");
+						record r(kind, n, 1, gamma);
+						r.add("real_time", lat.mean).add("time_unit", std::string("\"ns\"")).add("p50_ns", lat.p50).add("p90_ns", lat.p90).add("p99_ns", lat.p99).add("samples", lat.samples).add("bits_per_key", map_bits_per_key);
+						results.push_back(r.str());
+						std::cout << kind << "  n " << n << "  gamma " << gamma << "  mean " << lat.mean << "  p50 " << lat.p50 << "  p99 " << lat.p99 << " ns  " << map_bits_per_key << " bits/key\n";
+					}
+				}
+
+				std::string path = tmp_dir + "/bench_mphf.tmp.mphf";
+				{
+					start = std::chrono::steady_clock::now();
+					std::ofstream os(path, std::ios::binary);
+					bphf.save(os, MPHF_FORMAT_V2);
+					os.close();
+					double save_s = seconds_since(start);
+					record r("save_stream", n, 1, gamma);
+					r.add("real_time", save_s).add("time_unit", std::string("\"s\""));
+					results.push_back(r.str());
+					std::cout << "save_stream  n " << n << "  gamma " << gamma << "  " << save_s << " s\n";
+				}
+				for (double td : thread_counts)
+				{
+					int io_threads = static_cast<int>(td);
+					start = std::chrono::steady_clock::now();
+					bphf.save(path, MPHF_FORMAT_V2, true, io_threads);
+					double save_s = seconds_since(start);
+					boophf_t loaded;
+					start = std::chrono::steady_clock::now();
+					loaded.load(path, io_threads);
+					double load_s = seconds_since(start);
+					if (loaded.lookup(hits[0]) != bphf.lookup(hits[0]))
+					{
+						std::cerr << "loaded mphf differs\n";
+						return 1;
+					}
+					record rs("save_file", n, io_threads, gamma), rl("load_file", n, io_threads, gamma);
+					rs.add("real_time", save_s).add("time_unit", std::string("\"s\""));
+					rl.add("real_time", load_s).add("time_unit", std::string("\"s\""));
+					results.push_back(rs.str());
+					results.push_back(rl.str());
+					std::cout << "save_file    n " << n << "  threads " << io_threads << "  gamma " << gamma << "  " << save_s << " s\n";
+					std::cout << "load_file    n " << n << "  threads " << io_threads << "  gamma " << gamma << "  " << load_s << " s\n";
+				}
+				for (bool mapped : {false, true})
+				{
+					boophf_t loaded;
+					start = std::chrono::steady_clock::now();
+					if (mapped)
+						loaded.map(path);
+					else
+					{
+						std::ifstream is(path, std::ios::binary);
+						loaded.load(is);
+					}
+					double load_s = seconds_since(start);
+					if (loaded.lookup(hits[0]) != bphf.lookup(hits[0]))
+					{
+						std::cerr << "loaded mphf differs\n";
+						return 1;
+					}
+					record r(mapped ? "load_mmap" : "load_stream", n, 1, gamma);
+					r.add("real_time", load_s).add("time_unit", std::string("\"s\""));
+					results.push_back(r.str());
+					std::cout << (mapped ? "load_mmap  " : "load_stream") << "  n " << n << "  gamma " << gamma << "  " << load_s << " s\n";
+				}
+				std::remove(path.c_str());
+			}
+		}
+	}
+
+	char date[32];
+	std::time_t now = std::time(nullptr);
+	std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+	std::ofstream os(out_path);
+	os << "{\n  \"context\": {\"date\": \"" << date << "\", \"num_cpus\": " << std::thread::hardware_concurrency()
+	   << ", \"library\": \"boomphf C++\", \"checksum\": " << checksum << "},\n  \"benchmarks\": [\n";
+	for (size_t ii = 0; ii < results.size(); ii++)
+		os << "    " << results[ii] << (ii + 1 < results.size() ? ",\n" : "\n");
+	os << "  ]\n}\n";
+	std::cout << "results written to " << out_path << "\n";
+	return 0;
+}
@@ -0,0 +1,158 @@
+﻿"""Build, lookup and load benchmarks of pybbhash.mphf, results written as JSON.
+
+Same measures and schema as bench_mphf.cpp (compare runs with compare.py), for
+the pure Python port (backend "python") and the compiled extension ("native"):
+build time per key count, thread count and gamma, bits per key from
+totalBitSize(), lookup latency percentiles of keys in the set (hit) or not
+(miss) one at a time (single) or BATCH keys per lookup_many call (batch), and
+load() against mmap() of a v2 file.
+
+python bench_mphf.py [--keys 1000000,10000000,100000000] [--threads 1,4] [--gamma 1,2]
+                     [--backends python,native] [--python-max-keys 1000000] [--out bench_mphf_py.json]
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import sys
+import tempfile
+import time
+from array import array
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", ".."))
+
+import pybbhash
+from pybbhash import mphf
+
+BATCH = 64  # NBLOOKUPBATCH of BooPHF.h
+GROUP = 16  # single lookups timed together, a clock read costs about as much as a native lookup
+
+
+def random_keys(n: int, seed: int) -> array:
+    # 64-bit random keys, duplicates are unlikely enough below 2**32 keys
+    keys = array("Q")
+    keys.frombytes(random.Random(seed).randbytes(8 * n))
+    return keys
+
+
+def latency(samples):
+    """Mean and percentiles of per lookup samples in ns."""
+    samples = sorted(samples)
+
+    def pct(p):
+        return samples[min(len(samples) - 1, int(p * len(samples)))]
+
+    return {"real_time": sum(samples) / len(samples), "time_unit": "ns",
+            "p50_ns": pct(0.50), "p90_ns": pct(0.90), "p99_ns": pct(0.99), "samples": len(samples)}
+
+
+def time_lookups(h, queries: array, batch: bool):
+    group = BATCH if batch else GROUP
+    out = array("Q", bytes(8 * group))
+    clock = time.perf_counter_ns
+    lookup = h.lookup
+    samples = []
+    for ii in range(0, len(queries) - group + 1, group):
+        chunk = queries[ii:ii + group]
+        if batch:
+            start = clock()
+            h.lookup_many(chunk, out)
+        else:
+            start = clock()
+            for key in chunk:
+                lookup(key)
+        samples.append((clock() - start) / group)
+    return samples
+
+
+def record(kind, backend, n, threads, gamma, **fields):
+    rec = {"name": f"{kind}/n:{n}/threads:{threads}/gamma:{gamma:g}", "backend": backend,
+           "n": n, "threads": threads, "gamma": gamma}
+    rec.update(fields)
+    return rec
+
+
+def bench(backend, n, thread_counts, gammas, nlookups, tmp_dir, results):
+    keys = random_keys(n, 41)
+    rng = random.Random(43)
+    hits = array("Q", (keys[rng.randrange(n)] for _ in range(nlookups)))
+    misses = random_keys(nlookups, 47)
+    for gamma in gammas:
+        for t, threads in enumerate(thread_counts):
+            if backend == "python" and t > 0:
+                break  # the pure Python build runs on one thread
+            start = time.perf_counter()
+            h = mphf(n=n, input_range=keys, num_thread=threads, gamma=gamma, backend=backend)
+            build_s = time.perf_counter() - start
+            bits_per_key = h.totalBitSize() / n
+            results.append(record("build", backend, n, threads, gamma, real_time=build_s, time_unit="s",
+                                  keys_per_second=n / build_s, bits_per_key=bits_per_key))
+            print(f"{backend:6} build    n {n}  threads {threads}  gamma {gamma:g}  {build_s:.3f} s  {bits_per_key:.3f} bits/key")
+
+            # the structure does not depend on the thread count: lookups and loads once per gamma
+            if t > 0:
+                continue
+            for workload, queries in (("hit", hits), ("miss", misses)):
+                for batch in (False, True):
+                    kind = f"lookup_{workload}_{'batch' if batch else 'single'}"
+                    lat = latency(time_lookups(h, queries, batch))
+                    results.append(record(kind, backend, n, 1, gamma, **lat))
+                    print(f"{backend:6} {kind}  n {n}  gamma {gamma:g}  mean {lat['real_time']:.1f}  "
+                          f"p50 {lat['p50_ns']:.1f}  p99 {lat['p99_ns']:.1f} ns")
+
+            path = os.path.join(tmp_dir, "bench_mphf.tmp.mphf")
+            h.save(path, version=2)
+            for kind, load in (("load_stream", mphf.load), ("load_mmap", mphf.mmap)):
+                start = time.perf_counter()
+                loaded = load(path, backend=backend)
+                load_s = time.perf_counter() - start
+                if loaded.lookup(hits[0]) != h.lookup(hits[0]):
+                    raise RuntimeError("loaded mphf differs")
+                results.append(record(kind, backend, n, 1, gamma, real_time=load_s, time_unit="s"))
+                print(f"{backend:6} {kind:11}  n {n}  gamma {gamma:g}  {load_s:.6f} s")
+                del loaded  # releases the mapping before the file is removed
+            os.remove(path)
+
+
+def parse_list(arg, kind):
+    return [kind(float(x)) for x in arg.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--keys", default="1000000,10000000,100000000")
+    parser.add_argument("--threads", default="1,4")
+    parser.add_argument("--gamma", default="1,2")
+    parser.add_argument("--backends", default="python,native")
+    parser.add_argument("--lookups", type=int, default=1000000, help="lookups per workload (native)")
+    parser.add_argument("--python-lookups", type=int, default=20000, help="lookups per workload (python)")
+    parser.add_argument("--python-max-keys", type=int, default=1000000, help="larger key counts skip the python backend")
+    parser.add_argument("--tmp-dir", default=tempfile.gettempdir())
+    parser.add_argument("--out", default="bench_mphf_py.json")
+    args = parser.parse_args()
+
+    backends = args.backends.split(",")
+    if "native" in backends and not pybbhash.native_available():
+        print("native backend not built, skipped")
+        backends.remove("native")
+
+    results = []
+    for n in parse_list(args.keys, int):
+        for backend in backends:
+            if backend == "python" and n > args.python_max_keys:
+                print(f"python build    n {n}  skipped (--python-max-keys {args.python_max_keys})")
+                continue
+            nlookups = args.python_lookups if backend == "python" else args.lookups
+            bench(backend, n, parse_list(args.threads, int), parse_list(args.gamma, float), nlookups, args.tmp_dir, results)
+
+    context = {"date": time.strftime("%Y-%m-%dT%H:%M:%S"), "num_cpus": os.cpu_count(),
+               "library": f"pybbhash {pybbhash.__version__}", "python": platform.python_version()}
+    with open(args.out, "w") as f:
+        json.dump({"context": context, "benchmarks": results}, f, indent=2)
+    print(f"results written to {args.out}")
+
+
+if __name__ == "__main__":
+    main()
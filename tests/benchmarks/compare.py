@@ -0,0 +1,48 @@
+﻿"""Compare two result files of bench_mphf.cpp / bench_mphf.py.
+
+Benchmarks are matched by name and backend, the change of the metric (real_time by
+default) is printed for each, and the exit status is 1 when one got slower (or
+larger) by more than the threshold.
+
+python compare.py baseline.json contender.json [--metric real_time] [--threshold 0.10]
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {(b["name"], b["backend"]): b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument("--metric", default="real_time", help="field compared, e.g. p99_ns or bits_per_key")
+    parser.add_argument("--threshold", type=float, default=0.10, help="relative increase reported as a regression")
+    args = parser.parse_args()
+
+    baseline, contender = load(args.baseline), load(args.contender)
+    regressions = 0
+    for key in sorted(baseline.keys() & contender.keys()):
+        old, new = baseline[key].get(args.metric), contender[key].get(args.metric)
+        if old is None or new is None:
+            continue
+        change = (new - old) / old if old else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print(f"{key[1]:6} {key[0]:48} {old:14.6g} {new:14.6g} {change:+8.1%}{flag}")
+    for key in sorted(baseline.keys() ^ contender.keys()):
+        print(f"{key[1]:6} {key[0]:48} only in {args.baseline if key in baseline else args.contender}")
+    if regressions:
+        print(f"{regressions} regression(s) over {args.threshold:.0%} on {args.metric}")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -11,11 +11,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory> // for make_shared
 #include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -31,15 +44,18 @@ namespace boomphf
 // #pragma mark utils
 ////////////////////////////////////////////////////////////////
 
-// iterator from disk file of uint64_t with buffered read,   todo template
+// elements per fread of bfile_iterator, large sequential reads (1 MiB of uint64_t)
+#define BFILE_BUFFSIZE 131072
+
+// iterator from disk files of basetype with buffered read, walks the files one after the other
 template <typename basetype>
 class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 {
   public:
 	bfile_iterator()
-	    : _is(nullptr), _pos(0), _inbuff(0), _cptread(0)
+	    : _is(nullptr), _ifile(0), _pos(0), _inbuff(0), _cptread(0)
 	{
-		_buffsize = 10000;
+		_buffsize = BFILE_BUFFSIZE;
 		_buffer = (basetype*)malloc(_buffsize * sizeof(basetype));
 	}
 
@@ -48,6 +64,8 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 		_buffsize = cr._buffsize;
 		_pos = cr._pos;
 		_is = cr._is;
+		_files = cr._files;
+		_ifile = cr._ifile;
 		_buffer = (basetype*)malloc(_buffsize * sizeof(basetype));
 		memcpy(_buffer, cr._buffer, _buffsize * sizeof(basetype));
 		_inbuff = cr._inbuff;
@@ -55,13 +73,21 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 		_elem = cr._elem;
 	}
 
-	bfile_iterator(FILE* is) : _is(is), _pos(0), _inbuff(0), _cptread(0)
+	bfile_iterator(FILE* is) : bfile_iterator(std::vector<FILE*>(1, is))
+	{
+	}
+
+	bfile_iterator(const std::vector<FILE*>& files) : _files(files), _ifile(0), _pos(0), _inbuff(0), _cptread(0)
 	{
 		// printf("bf it %p\n",_is);
-		_buffsize = 10000;
+		_buffsize = BFILE_BUFFSIZE;
 		_buffer = (basetype*)malloc(_buffsize * sizeof(basetype));
-		int reso = fseek(_is, 0, SEEK_SET);
-		advance();
+		_is = _files.empty() ? nullptr : _files[0];
+		if (_is != nullptr)
+		{
+			fseek(_is, 0, SEEK_SET);
+			advance();
+		}
 	}
 
 	~bfile_iterator()
@@ -91,7 +117,7 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 				return false;
 			}
 		}
-		assert(lhs._is == rhs._is);
+		assert(lhs._files == rhs._files);
 		return rhs._pos == lhs._pos;
 	}
 
@@ -105,10 +131,10 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 
 		_pos++;
 
-		if (_cptread >= _inbuff)
+		while (_cptread >= _inbuff)
 		{
 
-			int res = fread(_buffer, sizeof(basetype), _buffsize, _is);
+			size_t res = fread(_buffer, sizeof(basetype), _buffsize, _is);
 
 			// printf("read %i new elem last %llu  %p\n",res,_buffer[res-1],_is);
 			_inbuff = res;
@@ -116,9 +142,15 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 
 			if (res == 0)
 			{
-				_is = nullptr;
-				_pos = 0;
-				return;
+				// end of this file, go on with the next one
+				if (++_ifile >= _files.size())
+				{
+					_is = nullptr;
+					_pos = 0;
+					return;
+				}
+				_is = _files[_ifile];
+				fseek(_is, 0, SEEK_SET);
 			}
 		}
 
@@ -127,25 +159,23 @@ class bfile_iterator : public std::iterator<std::forward_iterator_tag, basetype>
 	}
 	basetype _elem;
 	FILE* _is;
+	std::vector<FILE*> _files;
+	size_t _ifile;
 	unsigned long _pos;
 
 	basetype* _buffer; // for buffered read
-	int _inbuff, _cptread;
-	int _buffsize;
+	size_t _inbuff, _cptread;
+	size_t _buffsize;
 };
 
+// binary files of type_elem read back to back, e.g. the per-thread files of one level
 template <typename type_elem>
 class file_binary
 {
   public:
 	file_binary(const char* filename)
+	    : file_binary(std::vector<std::string>(1, filename))
 	{
-		_is = fopen(filename, "rb");
-
-		if (!_is)
-		{
-			throw std::invalid_argument("Error opening " + std::string(filename));
-		}
 	}
 
 	file_binary(const std::string& filename)
@@ -153,22 +183,165 @@ class file_binary
 	{
 	}
 
+	file_binary(const std::vector<std::string>& filenames)
+	{
+		for (const std::string& filename : filenames)
+		{
+			FILE* is = fopen(filename.c_str(), "rb");
+			if (!is)
+			{
+				close();
+				throw std::invalid_argument("Error opening " + filename);
+			}
+			// bfile_iterator reads BFILE_BUFFSIZE elems at a time, no point copying through the stdio buffer
+			setvbuf(is, NULL, _IONBF, 0);
+			_files.push_back(is);
+		}
+	}
+
 	~file_binary()
 	{
-		fclose(_is);
+		close();
 	}
 
 	bfile_iterator<type_elem> begin() const
 	{
-		return bfile_iterator<type_elem>(_is);
+		return bfile_iterator<type_elem>(_files);
 	}
 
 	bfile_iterator<type_elem> end() const { return bfile_iterator<type_elem>(); }
 
 	size_t size() const { return 0; } // todo ?
 
+	const std::vector<FILE*>& files() const { return _files; }
+
   private:
-	FILE* _is;
+	void close()
+	{
+		for (FILE* is : _files)
+			fclose(is);
+		_files.clear();
+	}
+
+	std::vector<FILE*> _files;
+};
+
+// reads the files of a file_binary in blocks of BFILE_BUFFSIZE elems from a background thread, which keeps
+// up to nbuffers blocks in flight : the next blocks are read while consumers process the ones they hold
+template <typename type_elem>
+class block_reader
+{
+  public:
+	struct block
+	{
+		const type_elem* data;
+		size_t size;
+		size_t slot;
+	};
+
+	block_reader(const file_binary<type_elem>& files, size_t nbuffers)
+	    : _files(files.files()), _buffers(nbuffers, std::vector<type_elem>(BFILE_BUFFSIZE))
+	{
+		for (size_t ii = 0; ii < nbuffers; ii++)
+			_free.push_back(ii);
+		_thread = std::thread([this]()
+		                      { read_all(); });
+	}
+
+	block_reader(const block_reader&) = delete;
+	block_reader& operator=(const block_reader&) = delete;
+
+	~block_reader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_cv_free.notify_all();
+		_thread.join();
+	}
+
+	// next block in file order, false once all files are read ; thread safe
+	bool next(block& b)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cv_ready.wait(lock, [this]()
+		               { return !_ready.empty() || _done; });
+		if (_ready.empty())
+			return false;
+		b = _ready.front();
+		_ready.pop_front();
+		return true;
+	}
+
+	// hand the buffer of b back to the reader
+	void release(const block& b)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_free.push_back(b.slot);
+		}
+		_cv_free.notify_one();
+	}
+
+	// true if a read failed, the blocks handed out are then incomplete
+	bool failed() const { return _failed; }
+
+  private:
+	void read_all()
+	{
+		for (FILE* is : _files)
+		{
+			fseek(is, 0, SEEK_SET);
+			for (;;)
+			{
+				size_t slot;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_cv_free.wait(lock, [this]()
+					              { return !_free.empty() || _stop; });
+					if (_stop)
+						return;
+					slot = _free.back();
+					_free.pop_back();
+				}
+
+				size_t res = fread(_buffers[slot].data(), sizeof(type_elem), BFILE_BUFFSIZE, is);
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (res > 0)
+						_ready.push_back(block{_buffers[slot].data(), res, slot});
+					else
+						_free.push_back(slot);
+				}
+				if (res > 0)
+					_cv_ready.notify_one();
+				if (res < BFILE_BUFFSIZE)
+				{
+					if (ferror(is))
+						_failed = true;
+					break;
+				}
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_done = true;
+		}
+		_cv_ready.notify_all();
+	}
+
+	std::vector<FILE*> _files;
+	std::vector<std::vector<type_elem>> _buffers;
+	std::vector<size_t> _free; // slots the reader can fill
+	std::deque<block> _ready;  // filled, in file order
+	std::mutex _mutex;
+	std::condition_variable _cv_free;
+	std::condition_variable _cv_ready;
+	bool _stop = false;
+	bool _done = false;
+	std::atomic<bool> _failed{false};
+	std::thread _thread;
 };
 
 ////////////////////////////////////////////////////////////////
@@ -179,6 +352,39 @@ class file_binary
 typedef std::array<uint64_t, 10> hash_set_t;
 typedef std::array<uint64_t, 2> hash_pair_t;
 
+// hasher ids, recorded in v2 file headers : a file only loads into an mphf hashing with the same id
+#define MPHF_HASHER_XORSHIFT 0      // SingleHashFunctor + XorshiftHashFunctors
+#define MPHF_HASHER_WYMIX 1         // WyMixHashFunctor + XorshiftHashFunctors
+#define MPHF_HASHER_CRC32C 2        // Crc32cHashFunctor + XorshiftHashFunctors
+#define MPHF_HASHER_KEY128 3        // Key128HashFunctor + XorshiftHashFunctors, keys are murmur3_128 hashes of strings
+#define MPHF_HASHER_CUSTOM 0xFFFFFFFF // any other single hasher, not checked on load
+
+// hasher id of a single hasher : its static hasher_id member, MPHF_HASHER_CUSTOM without one
+template <typename SingleHasher_t, typename = void>
+struct mphf_hasher_id : std::integral_constant<uint32_t, MPHF_HASHER_CUSTOM>
+{
+};
+template <typename SingleHasher_t>
+struct mphf_hasher_id<SingleHasher_t, std::void_t<decltype(SingleHasher_t::hasher_id)>> : std::integral_constant<uint32_t, SingleHasher_t::hasher_id>
+{
+};
+
+// Lemire's multiply-high (word * p) >> 64 : maps word to [0, p) from its high bits
+inline uint64_t multiply_high64(const uint64_t word, const uint64_t p)
+{
+#if defined(__SIZEOF_INT128__)
+	return (uint64_t)(((unsigned __int128)word * p) >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return __umulh(word, p);
+#else
+	// 64x64 -> high 64 bits from 32-bit halves
+	uint64_t a_lo = (uint32_t)word, a_hi = word >> 32, b_lo = (uint32_t)p, b_hi = p >> 32;
+	uint64_t mid = (a_lo * b_lo >> 32) + (uint32_t)(a_hi * b_lo) + a_lo * b_hi;
+	return a_hi * b_hi + (a_hi * b_lo >> 32) + (mid >> 32);
+#endif
+}
+
+
 template <typename Item>
 class HashFunctors
 {
@@ -268,10 +474,185 @@ class SingleHashFunctor
 		return hashFunctors.hashWithSeed(key, seed);
 	}
 
+	static constexpr uint32_t hasher_id = MPHF_HASHER_XORSHIFT;
+
   private:
 	HashFunctors<Item> hashFunctors;
 };
 
+// wyhash's mum : low ^ high 64 bits of the 128-bit product
+inline uint64_t wymum(uint64_t a, uint64_t b)
+{
+	return (a * b) ^ multiply_high64(a, b);
+}
+
+// wyhash-style mix of a 64-bit key : two rounds of wymum (64x64 -> 128 multiply, low ^ high)
+// with the wyhash constants, about 3x cheaper than hash64. Not bit-compatible with wyhash of the key bytes.
+template <typename Item>
+class WyMixHashFunctor
+{
+  public:
+	uint64_t operator()(const Item& key, uint64_t seed = 0xAAAAAAAA55555555ULL) const
+	{
+		uint64_t k = static_cast<uint64_t>(key);
+		return wymum(wymum(k ^ 0xa0761d6478bd642fULL, seed ^ 0xe7037ed1a0b428dbULL), k ^ 0x8ebc6af09c88c6e3ULL);
+	}
+
+	static constexpr uint32_t hasher_id = MPHF_HASHER_WYMIX;
+};
+
+// crc32c (Castagnoli, reflected 0x82F63B78) of the 8 little-endian bytes of v, without pre/post inversion
+// (the semantics of the SSE4.2 crc32 instruction)
+inline uint32_t crc32c_u64_generic(uint32_t crc, uint64_t v)
+{
+	static const std::array<uint32_t, 256> table = []
+	{
+		std::array<uint32_t, 256> t{};
+		for (uint32_t ii = 0; ii < 256; ii++)
+		{
+			uint32_t c = ii;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0x82F63B78u ^ (c >> 1) : (c >> 1);
+			t[ii] = c;
+		}
+		return t;
+	}();
+
+	for (int ii = 0; ii < 8; ii++, v >>= 8)
+		crc = table[(crc ^ v) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(BITVECTOR_X86_DISPATCH) && defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_u64_sse42(uint32_t crc, uint64_t v)
+{
+	return (uint32_t)_mm_crc32_u64(crc, v);
+}
+#endif
+
+// crc32c of one word, with the crc32 instruction when the cpu has SSE4.2
+inline uint32_t crc32c_u64(uint32_t crc, uint64_t v)
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+	return (uint32_t)_mm_crc32_u64(crc, v);
+#elif defined(BITVECTOR_X86_DISPATCH) && defined(__x86_64__)
+	static const bool sse42 = []
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.2") != 0;
+	}();
+	return sse42 ? crc32c_u64_sse42(crc, v) : crc32c_u64_generic(crc, v);
+#else
+	return crc32c_u64_generic(crc, v);
+#endif
+}
+
+inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// two crc32c of the key (the second one of the key times the golden ratio : crc is linear, crcs of the same
+// word under two seeds only differ by a constant) joined and finalised with murmur3's fmix64
+template <typename Item>
+class Crc32cHashFunctor
+{
+  public:
+	uint64_t operator()(const Item& key, uint64_t seed = 0xAAAAAAAA55555555ULL) const
+	{
+		uint64_t k = static_cast<uint64_t>(key);
+		return fmix64(((uint64_t)crc32c_u64((uint32_t)(seed >> 32), k * 0x9E3779B97F4A7C15ULL) << 32) | crc32c_u64((uint32_t)seed, k));
+	}
+
+	static constexpr uint32_t hasher_id = MPHF_HASHER_CRC32C;
+};
+
+// MurmurHash3_x64_128 (Austin Appleby, public domain) of len bytes : string and bytes keys are hashed once
+// with it, the mphf is built over the 128-bit hashes (Key128HashFunctor). {h1, h2} as in the reference.
+inline hash_pair_t murmur3_128(const void* key, size_t len, uint64_t seed = 0)
+{
+	const unsigned char* data = static_cast<const unsigned char*>(key);
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = seed, h2 = seed;
+
+	size_t nblocks = len / 16;
+	for (size_t ii = 0; ii < nblocks; ii++)
+	{
+		uint64_t k1, k2;
+		memcpy(&k1, data + 16 * ii, 8); // little-endian hosts
+		memcpy(&k2, data + 16 * ii + 8, 8);
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const unsigned char* tail = data + nblocks * 16;
+	uint64_t k1 = 0, k2 = 0;
+	size_t rest = len & 15;
+	for (size_t ii = rest; ii > 8; ii--)
+		k2 ^= (uint64_t)tail[ii - 1] << (8 * (ii - 9));
+	if (rest > 8)
+	{
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+	}
+	for (size_t ii = std::min<size_t>(rest, 8); ii > 0; ii--)
+		k1 ^= (uint64_t)tail[ii - 1] << (8 * (ii - 1));
+	if (rest > 0)
+	{
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	return {h1, h2};
+}
+
+// single hasher of 128-bit keys (murmur3_128 of a string) : one wymum of both words
+class Key128HashFunctor
+{
+  public:
+	uint64_t operator()(const hash_pair_t& key, uint64_t seed = 0xAAAAAAAA55555555ULL) const
+	{
+		return wymum(key[0] ^ seed, key[1] ^ 0xe7037ed1a0b428dbULL);
+	}
+
+	static constexpr uint32_t hasher_id = MPHF_HASHER_KEY128;
+};
+
 template <typename Item, class SingleHasher_t>
 class XorshiftHashFunctors
 {
@@ -319,6 +700,16 @@ class XorshiftHashFunctors
 		return s[1];
 	}
 
+	// hash of level `level` (h0, h1 or next) from the state s it left
+	uint64_t last(const hash_pair_t& s, int level) const
+	{
+		if (level == 0)
+			return s[0];
+		if (level == 1)
+			return s[1];
+		return s[0] + s[1];
+	}
+
 	// return next hash an update state s
 	uint64_t next(hash_pair_t& s) const
 	{
@@ -388,722 +779,4056 @@ iter_range<Iterator> range(Iterator begin, Iterator end)
 
 ////////////////////////////////////////////////////////////////
 // #pragma mark -
-// #pragma mark level
+// #pragma mark file format
 ////////////////////////////////////////////////////////////////
 
-inline uint64_t fastrange64(const uint64_t word, const uint64_t p)
-{
-	// todo: Use compile-time optimizations
-	return word % p;
-}
+// v1 : the original BBHash layout (header, bitVector records, key/value pairs), no magic
+// v2 : magic + header, table of contents, 64-byte aligned sections with optional crc32
+#define MPHF_FORMAT_V1 1
+#define MPHF_FORMAT_V2 2
+#define MPHF_V1_HEADER_SIZE 28 // gamma, nb_levels, lastbitsetrank, nelem
+#define MPHF_SECTION_ALIGN 64
 
-class level
+static const char mphf_file_magic[8] = {'\x89', 'B', 'B', 'H', '\r', '\n', '\x1a', '\n'};
+
+// header flags
+#define MPHF_FLAG_CRC32 1
+#define MPHF_FLAG_MULTIPLY_HIGH 2 // levels reduce hashes with multiply-high (mphf_reduction), else modulo
+#define MPHF_FLAG_FINGERPRINTS 4  // a fingerprints section follows the final values
+#define MPHF_FLAG_LEVEL_DOMAINS 8 // level sizes are the aux of their bits sections (gamma schedule), else they follow from gamma
+#define MPHF_FLAGS_KNOWN (MPHF_FLAG_CRC32 | MPHF_FLAG_MULTIPLY_HIGH | MPHF_FLAG_FINGERPRINTS | MPHF_FLAG_LEVEL_DOMAINS)
+
+// hasher ids : MPHF_HASHER_* (hasher section)
+
+enum mphf_section_kind : uint32_t
 {
-  public:
-	level() = default;
-	~level() = default;
+	MPHF_SECTION_LEVEL_BITS = 1,   // index = level, aux = bit size
+	MPHF_SECTION_LEVEL_RANKS = 2,  // index = level
+	MPHF_SECTION_FINAL_KEYS = 3,   // sorted, aux = key size
+	MPHF_SECTION_FINAL_VALUES = 4, // same order as the keys
+	MPHF_SECTION_FINGERPRINTS = 5, // one per mphf index, aux = bits per fingerprint
+};
 
-	uint64_t get(uint64_t hash_raw) const
-	{
-		//	uint64_t hashi =    hash_raw %  hash_domain; //
-		// uint64_t hashi = (uint64_t)(  ((__uint128_t) hash_raw * (__uint128_t) hash_domain) >> 64ULL);
-		uint64_t hashi = fastrange64(hash_raw, hash_domain);
-		return bitset.get(hashi);
-	}
+struct mphf_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t hasher_id;
+	uint32_t nb_levels;
+	double gamma;
+	uint64_t nelem;
+	uint64_t lastbitsetrank;
+	uint32_t nb_sections;
+	uint32_t toc_crc; // crc32 of the table of contents, always checked
+	uint32_t reserved[2];
+};
+static_assert(sizeof(mphf_file_header) == 64, "v2 header is 64 bytes");
 
-	uint64_t idx_begin;
-	uint64_t hash_domain;
-	bitVector bitset;
+// table of contents entry, the toc follows the header
+struct mphf_file_section
+{
+	uint32_t kind;
+	uint32_t index;
+	uint64_t offset; // from the start of the file, multiple of MPHF_SECTION_ALIGN
+	uint64_t length; // in bytes
+	uint64_t aux;
+	uint32_t crc; // crc32 of the section, 0 without MPHF_FLAG_CRC32
+	uint32_t reserved;
 };
+static_assert(sizeof(mphf_file_section) == 40, "v2 toc entry is 40 bytes");
 
-////////////////////////////////////////////////////////////////
-// #pragma mark -
-// #pragma mark mphf
-////////////////////////////////////////////////////////////////
+// sharded container (sharded_mphf) : header, then nb_shards + 1 index offsets (prefix sums of the shard sizes),
+// then nb_shards + 1 file positions (the last one is the file size), then each shard as a v2 file,
+// at a MPHF_SECTION_ALIGN aligned position. An empty shard has no bytes (same position as the next one).
+#define MPHF_SHARDED_VERSION 1
 
-#define NBBUFF 10000
-// #define NBBUFF 2
+static const char mphf_sharded_magic[8] = {'\x89', 'B', 'B', 'S', '\r', '\n', '\x1a', '\n'};
 
-template <typename Range, typename Iterator>
-struct thread_args
+struct mphf_sharded_header
 {
-	void* boophf;
-	Range const* range;
-	std::shared_ptr<void> it_p;    /* used to be "Iterator it" but because of fastmode, iterator is polymorphic; TODO: think about whether it should be a unique_ptr actually */
-	std::shared_ptr<void> until_p; /* to cache the "until" variable */
-	int level;
+	char magic[8];
+	uint32_t version;
+	uint32_t nb_shards;
+	uint64_t nelem;
+	uint32_t table_crc; // crc32 of the offsets and positions, always checked
+	uint32_t reserved[9];
 };
+static_assert(sizeof(mphf_sharded_header) == 64, "sharded header is 64 bytes");
 
-// forward declaration
+// overlay container (overlay_mphf) : header, then nb_segments + 1 index offsets, then nb_segments + 1 file positions,
+// then the nb_overrides sorted override keys and their indices, then each segment as a v2 file at a
+// MPHF_SECTION_ALIGN aligned position. Segment 0 is the base, the others the deltas in append order.
+#define MPHF_OVERLAY_VERSION 1
 
-template <typename elem_t, typename Hasher_t, typename Range, typename it_type>
-void thread_processLevel(thread_args<Range, it_type>* targ);
+static const char mphf_overlay_magic[8] = {'\x89', 'B', 'B', 'O', '\r', '\n', '\x1a', '\n'};
 
-/* Hasher_t returns a single hash when operator()(elem_t key) is called.
-   if used with XorshiftHashFunctors, it must have the following operator: operator()(elem_t key, uint64_t seed) */
-template <typename elem_t, typename Hasher_t>
-class mphf
+struct mphf_overlay_header
 {
+	char magic[8];
+	uint32_t version;
+	uint32_t nb_segments;
+	uint64_t nelem;
+	uint64_t nb_overrides;
+	uint32_t table_crc; // crc32 of the offsets, positions, override keys and indices, always checked
+	uint32_t reserved[7];
+};
+static_assert(sizeof(mphf_overlay_header) == 64, "overlay header is 64 bytes");
 
-	/* this mechanisms gets P hashes out of Hasher_t */
-	typedef XorshiftHashFunctors<elem_t, Hasher_t> MultiHasher_t;
-	// typedef HashFunctors<elem_t> MultiHasher_t; // original code (but only works for int64 keys)  (seems to be as fast as the current xorshift)
-	// typedef IndepHashFunctors<elem_t,Hasher_t> MultiHasher_t; //faster than xorshift
+// hot key cache (mphf::saveHotCache), kept next to the mphf file : header, then the 2^slot_bits slots
+// (key_size bytes of final key, uint64 index, ULLONG_MAX for an empty slot, padded to 8 bytes)
+#define MPHF_HOT_VERSION 1
 
-  public:
-	mphf() : _built(false)
-	{
-	}
+static const char mphf_hot_magic[8] = {'\x89', 'B', 'B', 'K', '\r', '\n', '\x1a', '\n'};
 
-	~mphf()
-	{
-	}
+struct mphf_hot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_bits;
+	uint32_t hasher_id;
+	uint32_t key_size;
+	uint64_t nelem; // nelem, lastbitsetrank and final_crc of the mphf the cache was built for
+	uint64_t lastbitsetrank;
+	uint64_t nb_filled;
+	uint32_t final_crc; // crc32 of the final keys then values
+	uint32_t slots_crc; // crc32 of the slots, always checked
+	uint32_t min_level;
+	uint32_t reserved;
+};
+static_assert(sizeof(mphf_hot_header) == 64, "hot key cache header is 64 bytes");
 
-	// allow perc_elem_loaded  elements to be loaded in ram for faster construction (default 3%), set to 0 to desactivate
-	template <typename Range>
-	mphf(uint64_t n, Range const& input_range, int num_thread = 1, double gamma = 2.0, bool writeEach = true, bool progress = true, float perc_elem_loaded = 0.03) : _gamma(gamma), _hash_domain(static_cast<uint64_t>(ceil(double(n) * gamma))), _nelem(n), _num_thread(num_thread), _percent_elem_loaded_for_fastMode(perc_elem_loaded), _withprogress(progress)
-	{
-		if (n == 0)
-			return;
+// static map (static_map) : header, then the mphf as a v2 file, then its packed slots (nelem slots of
+// value_bits + fingerprint_bits bits, see fingerprint_array), both at MPHF_SECTION_ALIGN aligned positions
+#define MPHF_MAP_VERSION 1
 
-		_fastmode = false;
+static const char mphf_map_magic[8] = {'\x89', 'B', 'B', 'M', '\r', '\n', '\x1a', '\n'};
 
-		if (_percent_elem_loaded_for_fastMode > 0.0)
-			_fastmode = true;
+struct mphf_map_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t value_bits;
+	uint32_t fingerprint_bits;
+	uint32_t slots_crc; // crc32 of the slots, checked by load and by map with verify
+	uint64_t nelem;
+	uint64_t mphf_offset;
+	uint64_t mphf_length;
+	uint64_t slots_offset;
+	uint32_t reserved[2];
+};
+static_assert(sizeof(mphf_map_header) == 64, "static map header is 64 bytes");
 
-		if (writeEach)
-		{
-			_writeEachLevel = true;
-			_fastmode = false;
-		}
-		else
+// crc32 (zlib polynomial), crc chains calls over consecutive buffers
+inline uint32_t crc32(const void* data, size_t len, uint32_t crc = 0)
+{
+	static const std::array<uint32_t, 256> table = []
+	{
+		std::array<uint32_t, 256> t{};
+		for (uint32_t ii = 0; ii < 256; ii++)
 		{
-			_writeEachLevel = false;
+			uint32_t c = ii;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+			t[ii] = c;
 		}
+		return t;
+	}();
+
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	crc = ~crc;
+	for (size_t ii = 0; ii < len; ii++)
+		crc = table[(crc ^ p[ii]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
 
-		setup();
-
-		if (_withprogress)
-		{
-			_progressBar.timer_mode = 1;
-
-			double total_raw = _nb_levels;
-
-			double sum_geom_read = (1.0 / (1.0 - _proba_collision));
-			double total_writeEach = sum_geom_read + 1.0;
-
-			double total_fastmode_ram = (_fastModeLevel + 1) + (pow(_proba_collision, _fastModeLevel)) * (_nb_levels - (_fastModeLevel + 1));
+// one bits and one ranks section per level, the final keys and values, and the optional fingerprints
+inline uint64_t mphf_nb_sections(const mphf_file_header& header)
+{
+	return 2ULL * header.nb_levels + 2 + ((header.flags & MPHF_FLAG_FINGERPRINTS) ? 1 : 0);
+}
 
-			printf("for info, total work write each  : %.3f    total work inram from level %i : %.3f  total work raw : %.3f \n", total_writeEach, _fastModeLevel, total_fastmode_ram, total_raw);
+// check a v2 header and its table of contents against a file of file_size bytes
+// sections are : level bits then ranks in level order, then final keys then values, then the fingerprints
+// they must be aligned, in increasing offset order and must not overlap
+inline void checkFileLayout(const mphf_file_header& header, const std::vector<mphf_file_section>& toc, uint64_t file_size)
+{
+	if (header.version != MPHF_FORMAT_V2)
+		throw std::runtime_error("Unsupported mphf format version " + std::to_string(header.version));
+	if (header.flags & ~MPHF_FLAGS_KNOWN)
+		throw std::runtime_error("Unsupported mphf file flags " + std::to_string(header.flags));
+	if (crc32(toc.data(), toc.size() * sizeof(mphf_file_section)) != header.toc_crc)
+		throw std::runtime_error("Corrupt mphf file: table of contents checksum mismatch");
+
+	if (toc.size() != mphf_nb_sections(header))
+		throw std::runtime_error("Corrupt mphf file: unexpected number of sections");
+
+	uint64_t pos = sizeof(mphf_file_header) + toc.size() * sizeof(mphf_file_section);
+	for (size_t ii = 0; ii < toc.size(); ii++)
+	{
+		const mphf_file_section& s = toc[ii];
+		uint32_t kind = ii < 2ULL * header.nb_levels ? (ii % 2 == 0 ? MPHF_SECTION_LEVEL_BITS : MPHF_SECTION_LEVEL_RANKS) : (ii % 2 == 0 ? MPHF_SECTION_FINAL_KEYS : MPHF_SECTION_FINAL_VALUES);
+		if (ii == 2ULL * header.nb_levels + 2)
+			kind = MPHF_SECTION_FINGERPRINTS;
+		uint32_t index = ii < 2ULL * header.nb_levels ? (uint32_t)(ii / 2) : 0;
+		if (s.kind != kind || s.index != index)
+			throw std::runtime_error("Corrupt mphf file: unexpected section " + std::to_string(s.kind) + "/" + std::to_string(s.index));
+		if (s.offset < pos || s.offset % MPHF_SECTION_ALIGN != 0 || s.offset > file_size || s.length > file_size - s.offset)
+			throw std::runtime_error("Corrupt mphf file: section out of bounds");
+		pos = s.offset + s.length;
+	}
+}
 
-			if (writeEach)
+// task(ii) for ii in [0, n) on num_thread threads, the first exception thrown is rethrown here
+template <typename Task>
+inline void parallel_tasks(size_t n, int num_thread, Task task)
+{
+	std::atomic<size_t> next(0);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto run = [&]()
+	{
+		for (size_t ii; (ii = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+		{
+			try
 			{
-				_progressBar.init(_nelem * total_writeEach, "Building BooPHF", num_thread);
+				task(ii);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
 			}
-			else if (_fastmode)
-				_progressBar.init(_nelem * total_fastmode_ram, "Building BooPHF", num_thread);
-			else
-				_progressBar.init(_nelem * _nb_levels, "Building BooPHF", num_thread);
 		}
+	};
+	std::vector<std::thread> threads;
+	for (int t = 1; t < num_thread && (size_t)t < n; t++)
+		threads.emplace_back(run);
+	run();
+	for (auto& t : threads)
+		t.join();
+	if (error)
+		std::rethrow_exception(error);
+}
 
-		uint64_t offset = 0;
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
-		{
-			_tempBitset = new bitVector(_levels[ii].hash_domain); // temp collision bitarray for this level
+// bytes per pread / pwrite of mphf::save(path) / load(path), the unit of work of their threads
+#define MPHF_IO_CHUNK (4ULL << 20)
 
-			processLevel(input_range, ii);
+// length bytes at offset in a file, at data in memory
+struct mphf_io_range
+{
+	uint64_t offset;
+	char* data;
+	uint64_t length;
+};
 
-			_levels[ii].bitset.clearCollisions(0, _levels[ii].hash_domain, _tempBitset);
+// read or write ranges in MPHF_IO_CHUNK pieces on num_thread threads
+inline void positional_io(const positional_file& file, const std::vector<mphf_io_range>& ranges, bool write, int num_thread)
+{
+	std::vector<mphf_io_range> pieces;
+	for (const mphf_io_range& r : ranges)
+	{
+		for (uint64_t done = 0; done < r.length; done += MPHF_IO_CHUNK)
+			pieces.push_back({r.offset + done, r.data + done, std::min<uint64_t>(MPHF_IO_CHUNK, r.length - done)});
+	}
+	auto transfer = [&](size_t ii)
+	{
+		const mphf_io_range& p = pieces[ii];
+		if (write)
+			file.write(p.data, p.length, p.offset);
+		else
+			file.read(p.data, p.length, p.offset);
+	};
+	parallel_tasks(pieces.size(), num_thread, transfer);
+}
 
-			offset = _levels[ii].bitset.build_ranks(offset);
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark level
+////////////////////////////////////////////////////////////////
 
-			delete _tempBitset;
-		}
+// how a level maps a 64-bit hash into [0, hash_domain)
+enum mphf_reduction : uint32_t
+{
+	MPHF_REDUCE_MODULO = 0,   // word % p, the BBHash mapping (v1 files, default)
+	MPHF_REDUCE_MULTIPLY = 1, // Lemire's multiply-high (word * p) >> 64, recorded in v2 files (MPHF_FLAG_MULTIPLY_HIGH)
+};
 
-		if (_withprogress)
-			_progressBar.finish_threaded();
-
-		_lastbitsetrank = offset;
-
-		// printf("used temp ram for construction : %lli MB \n",setLevelFastmode.capacity()* sizeof(elem_t) /1024ULL/1024ULL);
+inline uint64_t fastrange64(const uint64_t word, const uint64_t p)
+{
+	return word % p;
+}
 
-		std::vector<elem_t>().swap(setLevelFastmode); // clear setLevelFastmode reallocating
-		std::lock_guard<std::mutex> lock(_mutex);
-		_built = true;
+// reduction of one level, with the domain's reciprocal precomputed :
+// modulo mode gives exactly word % p but with multiplications instead of a 64-bit division
+// (Lemire, Kaser, Kurz, "Faster remainder by direct computation", 2019), when 128-bit integers are available
+class range_reducer
+{
+  public:
+	void init(uint64_t p, mphf_reduction mode)
+	{
+		assert(p > 1);
+		_p = p;
+		_mode = mode;
+#if defined(__SIZEOF_INT128__)
+		_m = ~(unsigned __int128)0 / p + 1;
+#endif
 	}
 
-	uint64_t lookup(const elem_t& elem) const
+	uint64_t operator()(uint64_t word) const
 	{
-		if (!_built)
-			return ULLONG_MAX;
-
-		// auto hashes = _hasher(elem);
-		uint64_t non_minimal_hp, minimal_hp;
-
-		hash_pair_t bbhash;
-		int level;
-		uint64_t level_hash = getLevel(bbhash, elem, &level);
+		if (_mode == MPHF_REDUCE_MULTIPLY)
+			return multiply_high64(word, _p);
+#if defined(__SIZEOF_INT128__)
+		unsigned __int128 lowbits = _m * word;
+		unsigned __int128 bottom = ((lowbits & ~uint64_t(0)) * _p) >> 64;
+		return (uint64_t)((bottom + (lowbits >> 64) * _p) >> 64);
+#else
+		return fastrange64(word, _p);
+#endif
+	}
 
-		if (level == (_nb_levels - 1))
-		{
-			auto in_final_map = _final_hash.find(elem);
-			if (in_final_map == _final_hash.end())
-			{
-				// elem was not in orignal set of keys
-				return ULLONG_MAX; //  means elem not in set
-			}
-			else
-			{
-				minimal_hp = in_final_map->second + _lastbitsetrank;
-				// printf("lookup %llu  level %i   --> %llu \n",elem,level,minimal_hp);
+	mphf_reduction mode() const { return _mode; }
 
-				return minimal_hp;
-			}
-			//				minimal_hp = _final_hash[elem] + _lastbitsetrank;
-			//				return minimal_hp;
-		}
-		else
-		{
-			// non_minimal_hp =  level_hash %  _levels[level].hash_domain; // in fact non minimal hp would be  + _levels[level]->idx_begin
-			non_minimal_hp = fastrange64(level_hash, _levels[level].hash_domain);
-		}
-		minimal_hp = _levels[level].bitset.rank(non_minimal_hp);
-		//	printf("lookup %llu  level %i   --> %llu \n",elem,level,minimal_hp);
+  private:
+	uint64_t _p = 0;
+	mphf_reduction _mode = MPHF_REDUCE_MODULO;
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 _m = 0; // ceil(2^128 / p)
+#endif
+};
 
-		return minimal_hp;
-	}
+class level
+{
+  public:
+	level() = default;
+	~level() = default;
 
-	uint64_t nbKeys() const
+	uint64_t get(uint64_t hash_raw) const
 	{
-		return _nelem;
+		return bitset.get(reduce(hash_raw));
 	}
 
-	uint64_t totalBitSize()
+	// hash_domain and reduce must be set together
+	void setDomain(uint64_t domain, mphf_reduction mode)
 	{
-
-		uint64_t totalsizeBitset = 0;
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
-		{
-			totalsizeBitset += _levels[ii].bitset.bitSize();
-		}
-
-		uint64_t totalsize = totalsizeBitset + _final_hash.size() * 42 * 8; // unordered map takes approx 42B per elem [personal test] (42B with uint64_t key, would be larger for other type of elem)
-
-		printf("Bitarray    %" PRIu64 "  bits (%.2f %%)   (array + ranks )\n",
-		       totalsizeBitset, 100 * (float)totalsizeBitset / totalsize);
-		printf("Last level hash  %12lu  bits (%.2f %%) (nb in last level hash %lu)\n",
-		       _final_hash.size() * 42 * 8, 100 * (float)(_final_hash.size() * 42 * 8) / totalsize,
-		       _final_hash.size());
-		return totalsize;
+		hash_domain = domain;
+		reduce.init(domain, mode);
 	}
 
-	template <typename Iterator> // typename Range,
-	void pthread_processLevel(std::vector<elem_t>& buffer, std::shared_ptr<Iterator> shared_it, std::shared_ptr<Iterator> until_p, int i)
-	{
-		uint64_t nb_done = 0;
-		int tid = _nb_living.fetch_add(1, std::memory_order_relaxed);
-		auto until = *until_p;
-		uint64_t inbuff = 0;
+	uint64_t idx_begin;
+	uint64_t hash_domain;
+	range_reducer reduce;
+	bitVector bitset;
+};
 
-		uint64_t writebuff = 0;
-		std::vector<elem_t>& myWriteBuff = bufferperThread[tid];
+// what a lookup needs of a level, packed in a fixed size array by the mphf specialised on its level count
+struct level_probe
+{
+	range_reducer reduce;
+	const bitVector* bits;
+};
 
-		for (bool isRunning = true; isRunning;)
+// bits and rank samples of all the levels, then during a build the collision bitset, in one zeroed
+// allocation (anonymous_memory : page aligned, huge pages when available) sized from the level domains.
+// Levels are laid out like the level sections of a v2 file (bits then ranks of each level, MPHF_SECTION_ALIGN
+// aligned), so saveV2 writes them and loadV2 reads them with a single call.
+class level_arena
+{
+  public:
+	// collision_bits : largest level domain of a build, 0 for loads
+	level_arena(const std::vector<level>& levels, uint64_t collision_bits) : _bits(levels.size()), _ranks(levels.size())
+	{
+		uint64_t pos = 0;
+		for (size_t ii = 0; ii < levels.size(); ii++)
 		{
+			_bits[ii] = pos;
+			_ranks[ii] = align(pos + bitsBytes(levels[ii].hash_domain));
+			pos = _ranks[ii] + ranksBytes(levels[ii].hash_domain);
+			_levelsBytes = pos;
+			pos = align(pos);
+		}
+		_collisions = pos;
+		_memory.reset(new anonymous_memory(pos + (collision_bits > 0 ? bitsBytes(collision_bits) : 0)));
+	}
 
-			// safely copy n items into buffer
-			{
-				std::lock_guard<std::mutex> lock(_mutex);
-				for (; inbuff < NBBUFF && (*shared_it) != until; ++(*shared_it))
-				{
-					buffer[inbuff] = *(*shared_it);
-					inbuff++;
-				}
-				if ((*shared_it) == until)
-					isRunning = false;
-			}
-
-			// do work on the n elems of the buffer
-			//	printf("filling input  buff \n");
-
-			for (uint64_t ii = 0; ii < inbuff; ii++)
-			{
-				elem_t val = buffer[ii];
-				// printf("processing %llu  level %i\n",val, i);
-
-				// auto hashes = _hasher(val);
-				hash_pair_t bbhash;
-				int level;
-				uint64_t level_hash;
-				if (_writeEachLevel)
-					getLevel(bbhash, val, &level, i, i - 1);
-				else
-					getLevel(bbhash, val, &level, i);
+	static uint64_t bitsBytes(uint64_t size) { return (1ULL + size / 64ULL) * sizeof(uint64_t); }
+	static uint64_t ranksBytes(uint64_t size) { return bitVector::nbRankSamples(size) * sizeof(uint64_t); }
 
-				// uint64_t level_hash = getLevel(bbhash,val,&level, i);
+	// offsets from data()
+	uint64_t bitsOffset(uint32_t ii) const { return _bits[ii]; }
+	uint64_t ranksOffset(uint32_t ii) const { return _ranks[ii]; }
+	// end of the ranks of the last level
+	uint64_t levelsBytes() const { return _levelsBytes; }
 
-				//__sync_fetch_and_add(& _cptTotalProcessed,1);
+	char* data() const { return _memory->data(); }
+	uint64_t* bits(uint32_t ii) const { return reinterpret_cast<uint64_t*>(data() + _bits[ii]); }
+	uint64_t* ranks(uint32_t ii) const { return reinterpret_cast<uint64_t*>(data() + _ranks[ii]); }
+	uint64_t* collisions() const { return reinterpret_cast<uint64_t*>(data() + _collisions); }
 
-				if (level == i) // insert into lvl i
-				{
+	// point the level bitsets here, with their rank samples when ranked (loads)
+	void attach(std::vector<level>& levels, bool ranked) const
+	{
+		for (uint32_t ii = 0; ii < levels.size(); ii++)
+		{
+			uint64_t size = levels[ii].hash_domain;
+			levels[ii].bitset.attach(size, bits(ii), ranks(ii), ranked ? bitVector::nbRankSamples(size) : 0);
+		}
+	}
 
-					//	__sync_fetch_and_add(& _cptLevel,1);
+	// true while the level bitsets are the flat, ranked ones of this arena (not interleaved or replaced)
+	bool holds(const std::vector<level>& levels) const
+	{
+		for (uint32_t ii = 0; ii < levels.size(); ii++)
+		{
+			const bitVector& bv = levels[ii].bitset;
+			if (!bv.attached() || bv.words() != bits(ii) || bv.rankSamples() != ranks(ii) || bv.nbRankSamples() != bitVector::nbRankSamples(bv.size()))
+				return false;
+		}
+		return true;
+	}
 
-					if (_fastmode && i == _fastModeLevel)
-					{
+	// end of the build : the collision bitset pages go back to the system
+	void releaseCollisions() { _memory->shrink(_collisions); }
 
-						int idxl2 = _idxLevelsetLevelFastmode.fetch_add(1, std::memory_order_relaxed);
-						// si depasse taille attendue pour setLevelFastmode, fall back sur slow mode mais devrait pas arriver si hash ok et proba avec nous
-						if (idxl2 >= setLevelFastmode.size())
-							_fastmode = false;
-						else
-							setLevelFastmode[idxl2] = val; // create set for fast mode
-					}
+  private:
+	static uint64_t align(uint64_t pos) { return (pos + MPHF_SECTION_ALIGN - 1) / MPHF_SECTION_ALIGN * MPHF_SECTION_ALIGN; }
 
-					// insert to level i+1 : either next level of the cascade or final hash if last level reached
-					if (i == _nb_levels - 1) // stop cascade here, insert into exact hash
-					{
-						uint64_t hashidx = _hashidx.fetch_add(1, std::memory_order_relaxed);
+	std::unique_ptr<anonymous_memory> _memory;
+	std::vector<uint64_t> _bits;
+	std::vector<uint64_t> _ranks;
+	uint64_t _levelsBytes = 0;
+	uint64_t _collisions = 0;
+};
 
-						std::lock_guard<std::mutex> lock(_mutex);
-						// calc rank de fin  precedent level qq part, puis init hashidx avec ce rank, direct minimal, pas besoin inser ds bitset et rank
-						_final_hash[val] = hashidx;
-					}
-					else
-					{
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark final table
+////////////////////////////////////////////////////////////////
 
-						// ils ont reach ce level
-						// insert elem into curr level on disk --> sera utilise au level+1 , (mais encore besoin filtre)
-
-						if (_writeEachLevel && i > 0 && i < _nb_levels - 1)
-						{
-							if (writebuff >= NBBUFF)
-							{
-								write_with_file_lock(_currlevelFile, myWriteBuff, writebuff);
-							}
-
-							// myWriteBuff[writebuff++] = val;
-							// myWriteBuff = 0;
-						}
-
-						// computes next hash
-
-						if (level == 0)
-							level_hash = _hasher.h0(bbhash, val);
-						else if (level == 1)
-							level_hash = _hasher.h1(bbhash, val);
-						else
-						{
-							level_hash = _hasher.next(bbhash);
-						}
-						insertIntoLevel(level_hash, i); // should be safe
-					}
-				}
+// key stored by the final table : the key itself, or a 64-bit fingerprint of a 128-bit hashed key (string keys,
+// both words already went into every level hash)
+template <typename elem_t>
+struct mphf_final_key
+{
+	typedef elem_t type;
+	static const elem_t& of(const elem_t& key) { return key; }
+};
+template <>
+struct mphf_final_key<hash_pair_t>
+{
+	typedef uint64_t type;
+	static uint64_t of(const hash_pair_t& key) { return key[0] ^ key[1]; }
+};
 
-				nb_done++;
-				if ((nb_done & 1023) == 0 && _withprogress)
-				{
-					_progressBar.inc(nb_done, tid);
-					nb_done = 0;
-				}
-			}
+// exact table for the keys that fell through every level : two flat arrays sorted by key
+// 8 + sizeof(elem_t) bytes per key instead of ~42B for an unordered_map
+// integral keys are found by interpolation search (falls back to bisection), others by binary search
+template <typename elem_t>
+class final_table
+{
+  public:
+	final_table() = default;
 
-			inbuff = 0;
+	// copies keep pointing at the same external arrays when viewing (see view())
+	final_table(const final_table& r) { *this = r; }
+	final_table& operator=(const final_table& r)
+	{
+		_keys = r._keys;
+		_values = r._values;
+		_nkeys = r._nkeys;
+		if (r._keys_ptr == r._keys.data())
+			sync();
+		else
+		{
+			_keys_ptr = r._keys_ptr;
+			_values_ptr = r._values_ptr;
 		}
+		return *this;
+	}
 
-		if (_writeEachLevel && writebuff > 0)
+	// entries in any order, sorted here
+	void build(std::vector<std::pair<elem_t, uint64_t>>& entries)
+	{
+		std::sort(entries.begin(), entries.end());
+		// a key inserted twice keeps its smallest value (mergeFinalKeys rejects builds where that happens)
+		entries.erase(std::unique(entries.begin(), entries.end(), [](const std::pair<elem_t, uint64_t>& a, const std::pair<elem_t, uint64_t>& b)
+		                          { return !(a.first < b.first) && !(b.first < a.first); }),
+		              entries.end());
+		_keys.resize(entries.size());
+		_values.resize(entries.size());
+		for (size_t ii = 0; ii < entries.size(); ii++)
 		{
-			write_with_file_lock(_currlevelFile, myWriteBuff, writebuff);
-
-			writebuff = 0;
+			_keys[ii] = entries[ii].first;
+			_values[ii] = entries[ii].second;
 		}
+		_nkeys = entries.size();
+		sync();
 	}
 
-	void save(std::ostream& os) const
+	// copy sorted arrays, keys and values need not be aligned
+	void assign(const void* keys, const void* values, uint64_t nkeys)
 	{
-
-		os.write(reinterpret_cast<char const*>(&_gamma), sizeof(_gamma));
-		os.write(reinterpret_cast<char const*>(&_nb_levels), sizeof(_nb_levels));
-		os.write(reinterpret_cast<char const*>(&_lastbitsetrank), sizeof(_lastbitsetrank));
-		os.write(reinterpret_cast<char const*>(&_nelem), sizeof(_nelem));
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		_keys.resize(nkeys);
+		_values.resize(nkeys);
+		if (nkeys > 0)
 		{
-			_levels[ii].bitset.save(os);
+			memcpy(_keys.data(), keys, nkeys * sizeof(elem_t));
+			memcpy(_values.data(), values, nkeys * sizeof(uint64_t));
 		}
+		_nkeys = nkeys;
+		sync();
+	}
 
-		// save final hash
-		uint64_t final_hash_size = _final_hash.size();
+	// use sorted, aligned external arrays in place (a mapped v2 file), they must outlive this table
+	void view(const elem_t* keys, const uint64_t* values, uint64_t nkeys)
+	{
+		std::vector<elem_t>().swap(_keys);
+		std::vector<uint64_t>().swap(_values);
+		_keys_ptr = keys;
+		_values_ptr = values;
+		_nkeys = nkeys;
+	}
 
-		os.write(reinterpret_cast<char const*>(&final_hash_size), sizeof(uint64_t));
+	void clear()
+	{
+		std::vector<elem_t>().swap(_keys);
+		std::vector<uint64_t>().swap(_values);
+		_nkeys = 0;
+		sync();
+	}
 
-		// typename std::unordered_map<elem_t,uint64_t,Hasher_t>::iterator
-		for (auto it = _final_hash.begin(); it != _final_hash.end(); ++it)
+	// true if keys are sorted, checked on untrusted (v1) input
+	bool sorted() const
+	{
+		for (uint64_t ii = 1; ii < _nkeys; ii++)
 		{
-			os.write(reinterpret_cast<char const*>(&(it->first)), sizeof(elem_t));
-			os.write(reinterpret_cast<char const*>(&(it->second)), sizeof(uint64_t));
+			if (!(_keys_ptr[ii - 1] < _keys_ptr[ii]))
+				return false;
 		}
+		return true;
 	}
 
-	void load(std::istream& is)
+	// value stored for key, ULLONG_MAX if absent
+	uint64_t find(const elem_t& key) const
 	{
+		uint64_t idx = index_of(key);
+		return idx == ULLONG_MAX ? ULLONG_MAX : _values_ptr[idx];
+	}
 
-		is.read(reinterpret_cast<char*>(&_gamma), sizeof(_gamma));
-		is.read(reinterpret_cast<char*>(&_nb_levels), sizeof(_nb_levels));
-		is.read(reinterpret_cast<char*>(&_lastbitsetrank), sizeof(_lastbitsetrank));
-		is.read(reinterpret_cast<char*>(&_nelem), sizeof(_nelem));
+	uint64_t size() const { return _nkeys; }
+	const elem_t* keys() const { return _keys_ptr; }
+	const uint64_t* values() const { return _values_ptr; }
+	uint64_t bitSize() const { return _nkeys * (sizeof(elem_t) + sizeof(uint64_t)) * 8ULL; }
 
-		_levels.resize(_nb_levels);
+  private:
+	void sync()
+	{
+		_keys_ptr = _keys.data();
+		_values_ptr = _values.data();
+	}
 
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+	uint64_t index_of(const elem_t& key) const
+	{
+		uint64_t lo = 0, hi = _nkeys; // search in [lo, hi)
+		if constexpr (std::is_integral<elem_t>::value)
 		{
-			//_levels[ii].bitset = new bitVector();
-			_levels[ii].bitset.load(is);
+			// a few interpolation probes, each narrows [lo, hi) like a bisection step would
+			for (int probe = 0; probe < 4 && hi - lo > 16; probe++)
+			{
+				elem_t first = _keys_ptr[lo], last = _keys_ptr[hi - 1];
+				if (key < first || last < key)
+					return ULLONG_MAX;
+				if (!(first < last))
+					break;
+				uint64_t mid = lo + (uint64_t)((long double)((uint64_t)key - (uint64_t)first) / (long double)((uint64_t)last - (uint64_t)first) * (long double)(hi - 1 - lo));
+				if (mid >= hi)
+					mid = hi - 1;
+				if (_keys_ptr[mid] < key)
+					lo = mid + 1;
+				else if (key < _keys_ptr[mid])
+					hi = mid;
+				else
+					return mid;
+			}
 		}
+		const elem_t* it = std::lower_bound(_keys_ptr + lo, _keys_ptr + hi, key);
+		if (it == _keys_ptr + hi || key < *it)
+			return ULLONG_MAX;
+		return (uint64_t)(it - _keys_ptr);
+	}
 
-		// mini setup, recompute size of each level
-		_proba_collision = 1.0 - pow(((_gamma * (double)_nelem - 1) / (_gamma * (double)_nelem)), _nelem - 1);
-		uint64_t previous_idx = 0;
-		_hash_domain = (uint64_t)(ceil(double(_nelem) * _gamma));
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
-		{
-			//_levels[ii] = new level();
-			_levels[ii].idx_begin = previous_idx;
-			_levels[ii].hash_domain = (((uint64_t)(_hash_domain * pow(_proba_collision, ii)) + 63) / 64) * 64;
-			if (_levels[ii].hash_domain == 0)
-				_levels[ii].hash_domain = 64;
-			previous_idx += _levels[ii].hash_domain;
-		}
+	std::vector<elem_t> _keys;
+	std::vector<uint64_t> _values;
+	const elem_t* _keys_ptr = nullptr;     // _keys.data(), or external memory
+	const uint64_t* _values_ptr = nullptr; // _values.data(), or external memory
+	uint64_t _nkeys = 0;
+};
 
-		// restore final hash
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark fingerprints
+////////////////////////////////////////////////////////////////
 
-		_final_hash.clear();
-		uint64_t final_hash_size;
+#define MPHF_FINGERPRINT_BITS_MAX 32
+#define MPHF_FINGERPRINT_SEED 0x3C6EF372FE94F82BULL // not one of the XorshiftHashFunctors or shard seeds
 
-		is.read(reinterpret_cast<char*>(&final_hash_size), sizeof(uint64_t));
+// optional b-bit fingerprint of the key at each mphf index, packed in uint64 words (slot ii is bits [ii * b, ii * b + b))
+// a lookup whose fingerprint differs returns ULLONG_MAX : keys not in the set pass with probability 2^-b
+// slots hold 1 to 64 bits, static_map packs its values (and their fingerprints) the same way
+class fingerprint_array
+{
+  public:
+	fingerprint_array() = default;
 
-		for (uint64_t ii = 0; ii < final_hash_size; ii++)
-		{
-			elem_t key;
-			uint64_t value;
+	// copies keep pointing at the same external words when viewing (see view())
+	fingerprint_array(const fingerprint_array& r) { *this = r; }
+	fingerprint_array& operator=(const fingerprint_array& r)
+	{
+		_words = r._words;
+		_words_ptr = (r._words_ptr == r._words.data()) ? _words.data() : r._words_ptr;
+		_nslots = r._nslots;
+		_bits = r._bits;
+		return *this;
+	}
 
-			is.read(reinterpret_cast<char*>(&key), sizeof(elem_t));
-			is.read(reinterpret_cast<char*>(&value), sizeof(uint64_t));
+	static uint64_t nbWords(uint64_t nslots, uint32_t bits) { return (nslots * bits + 63) / 64; }
 
-			_final_hash[key] = value;
-		}
-		_built = true;
+	// ORs fp into slot ii of words, concurrent callers fill distinct slots of zeroed words
+	static void set(std::atomic<uint64_t>* words, uint64_t ii, uint32_t bits, uint64_t fp)
+	{
+		uint64_t pos = ii * bits;
+		uint32_t shift = pos & 63;
+		words[pos >> 6].fetch_or(fp << shift, std::memory_order_relaxed);
+		if (shift + bits > 64)
+			words[(pos >> 6) + 1].fetch_or(fp >> (64 - shift), std::memory_order_relaxed);
 	}
 
-  private:
-	void setup()
+	void assign(std::vector<uint64_t>&& words, uint64_t nslots, uint32_t bits)
 	{
-		uint64_t tid_hash = std::hash<std::thread::id>{}(std::this_thread::get_id());
-		_pid = static_cast<int>(tid_hash);
-		// printf("pt self %llu  pid %i \n",printPt(pthread_self()),_pid);
+		_words = std::move(words);
+		_words_ptr = _words.data();
+		_nslots = nslots;
+		_bits = bits;
+	}
 
-		_cptTotalProcessed = 0;
+	// copy nbWords(nslots, bits) words, which need not be aligned
+	void assign(const void* words, uint64_t nslots, uint32_t bits)
+	{
+		std::vector<uint64_t> copy(nbWords(nslots, bits));
+		if (!copy.empty())
+			memcpy(copy.data(), words, copy.size() * sizeof(uint64_t));
+		assign(std::move(copy), nslots, bits);
+	}
 
-		if (_fastmode)
-		{
-			setLevelFastmode.resize(_percent_elem_loaded_for_fastMode * (double)_nelem);
-		}
+	// use aligned external words in place (a mapped v2 file), they must outlive this array
+	void view(const uint64_t* words, uint64_t nslots, uint32_t bits)
+	{
+		std::vector<uint64_t>().swap(_words);
+		_words_ptr = words;
+		_nslots = nslots;
+		_bits = bits;
+	}
 
-		bufferperThread.resize(_num_thread);
-		if (_writeEachLevel)
-		{
-			for (uint32_t ii = 0; ii < _num_thread; ii++)
-			{
-				bufferperThread[ii].resize(NBBUFF);
-			}
-		}
+	void clear()
+	{
+		std::vector<uint64_t>().swap(_words);
+		_words_ptr = nullptr;
+		_nslots = 0;
+		_bits = 0;
+	}
 
-		_proba_collision = 1.0 - pow(((_gamma * (double)_nelem - 1) / (_gamma * (double)_nelem)), _nelem - 1);
+	uint64_t get(uint64_t ii) const
+	{
+		uint64_t pos = ii * _bits;
+		uint32_t shift = pos & 63;
+		uint64_t fp = _words_ptr[pos >> 6] >> shift;
+		if (shift + _bits > 64)
+			fp |= _words_ptr[(pos >> 6) + 1] << (64 - shift);
+		return fp & (~0ULL >> (64 - _bits));
+	}
 
-		double sum_geom = _gamma * (1.0 + _proba_collision / (1.0 - _proba_collision));
-		// printf("proba collision %f  sum_geom  %f   \n",_proba_collision,sum_geom);
+	void prefetch(uint64_t ii) const { BITVECTOR_PREFETCH(_words_ptr + ((ii * _bits) >> 6)); }
 
-		_nb_levels = 25;
-		_levels.resize(_nb_levels);
+	uint32_t bits() const { return _bits; } // 0 : no fingerprints
+	uint64_t size() const { return _nslots; }
+	const uint64_t* words() const { return _words_ptr; }
+	uint64_t nbWords() const { return nbWords(_nslots, _bits); }
+	uint64_t bitSize() const { return nbWords() * 64; }
 
-		// build levels
-		uint64_t previous_idx = 0;
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
-		{
+  private:
+	std::vector<uint64_t> _words;
+	const uint64_t* _words_ptr = nullptr; // _words.data(), or external memory
+	uint64_t _nslots = 0;
+	uint32_t _bits = 0;
+};
 
-			_levels[ii].idx_begin = previous_idx;
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark hot key cache
+////////////////////////////////////////////////////////////////
 
-			// round size to nearest superior multiple of 64, makes it easier to clear a level
-			_levels[ii].hash_domain = (((uint64_t)(_hash_domain * pow(_proba_collision, ii)) + 63) / 64) * 64;
-			if (_levels[ii].hash_domain == 0)
-				_levels[ii].hash_domain = 64;
-			previous_idx += _levels[ii].hash_domain;
+#define MPHF_HOT_SLOTS 4096 // default number of slots, 64 KB with 8-byte keys
+#define MPHF_HOT_SLOT_BITS_MAX 30
+#define MPHF_HOT_MIN_LEVEL 2 // keys found at this level or deeper are cached by default
 
-			// printf("build level %i bit array : start %12llu, size %12llu  ",ii,_levels[ii]->idx_begin,_levels[ii]->hash_domain );
-			// printf(" expected elems : %.2f %% total \n",100.0*pow(_proba_collision,ii));
-		}
+// direct-mapped table of the indices of frequently looked-up keys, one slot per level 0 hash.
+// Lookups that miss level 0 check the slot of their key before walking the next levels.
+template <typename key_t>
+class hot_key_table
+{
+  public:
+	struct slot
+	{
+		key_t key;      // final key of mphf : the key, or its 64-bit fingerprint for 128-bit keys
+		uint64_t index; // ULLONG_MAX : empty
+	};
 
-		for (uint32_t ii = 0; ii < _nb_levels; ii++)
-		{
-			if (pow(_proba_collision, ii) < _percent_elem_loaded_for_fastMode)
-			{
-				_fastModeLevel = ii;
-				// printf("fast mode level :  %i \n",ii);
-				break;
-			}
-		}
+	// keys that collided at level 0 share the low (modulo) or high (multiply-high) bits of h0,
+	// the multiply spreads them over the table
+	static uint64_t slotOf(uint64_t h0, uint32_t slot_bits) { return (h0 * 0x9E3779B97F4A7C15ULL) >> (64 - slot_bits); }
+
+	// slots.size() is a power of two, 2 or more
+	void assign(std::vector<slot>&& slots, uint32_t min_level)
+	{
+		_slots = std::move(slots);
+		_slot_bits = 0;
+		while ((1ULL << _slot_bits) < _slots.size())
+			_slot_bits++;
+		_min_level = min_level;
+		_filled = 0;
+		for (const slot& s : _slots)
+			_filled += s.index != ULLONG_MAX;
 	}
 
-	// compute level and returns hash of last level reached
-	uint64_t getLevel(hash_pair_t& bbhash, const elem_t& val, int* res_level, int maxlevel = 100, int minlevel = 0) const
-	// uint64_t getLevel(hash_pair_t & bbhash, elem_t val,int * res_level, int maxlevel = 100, int minlevel =0)
+	void clear()
+	{
+		std::vector<slot>().swap(_slots);
+		_slot_bits = 0;
+		_filled = 0;
+	}
 
+	bool find(const key_t& key, uint64_t h0, uint64_t& index) const
 	{
-		int level = 0;
-		uint64_t hash_raw = 0;
+		const slot& s = _slots[slotOf(h0, _slot_bits)];
+		if (s.index == ULLONG_MAX || !(s.key == key))
+			return false;
+		index = s.index;
+		return true;
+	}
 
-		for (uint32_t ii = 0; ii < (_nb_levels - 1) && ii < maxlevel; ii++)
-		{
+	bool empty() const { return _slots.empty(); }
+	uint64_t size() const { return _slots.size(); }
+	uint64_t filled() const { return _filled; }
+	uint32_t slotBits() const { return _slot_bits; }
+	uint32_t minLevel() const { return _min_level; }
+	const std::vector<slot>& slots() const { return _slots; }
 
-			// calc le hash suivant
-			if (ii == 0)
-				hash_raw = _hasher.h0(bbhash, val);
-			else if (ii == 1)
-				hash_raw = _hasher.h1(bbhash, val);
-			else
-			{
-				hash_raw = _hasher.next(bbhash);
-			}
+  private:
+	std::vector<slot> _slots;
+	uint32_t _slot_bits = 0;
+	uint32_t _min_level = MPHF_HOT_MIN_LEVEL;
+	uint64_t _filled = 0;
+};
 
-			if (ii >= minlevel && _levels[ii].get(hash_raw)) //
-			// if(  _levels[ii].get(hash_raw) ) //
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark mphf
+////////////////////////////////////////////////////////////////
 
+#define NBBUFF 10000
+// a level is built in per-thread private bitsets, ORed together at the end of the level,
+// when all of them fit in this many bytes (0 always uses the shared atomic bitset)
+#ifndef MPHF_PRIVATE_BITS_MAX
+#define MPHF_PRIVATE_BITS_MAX (1ULL << 24)
+#endif
+// #define NBBUFF 2
+
+// nb of keys walked through the levels together by the batched lookup
+#define NBLOOKUPBATCH 64
+// level of the keys the batched lookup found in the hot key cache
+#define MPHF_HOT_LEVEL UINT32_MAX
+
+template <typename Range, typename Iterator>
+struct thread_args
+{
+	void* boophf;
+	Range const* range;
+	std::shared_ptr<void> it_p;    /* used to be "Iterator it" but because of fastmode, iterator is polymorphic; TODO: think about whether it should be a unique_ptr actually */
+	std::shared_ptr<void> until_p; /* to cache the "until" variable */
+	int level;
+};
+
+// forward declaration
+
+template <typename elem_t, typename Hasher_t, uint32_t MaxLevels, typename Range, typename it_type, typename level_it_type = it_type>
+void thread_processLevel(thread_args<Range, it_type>* targ);
+
+// levels of an mphf, unless fixed by its MaxLevels template parameter
+#define MPHF_NB_LEVELS 25
+
+// one level of mphf::build_stats(), the counters are zero for a loaded or mapped mphf
+struct mphf_level_stats
+{
+	uint64_t keys_in = 0;             // keys that reached the level
+	uint64_t keys_read = 0;           // keys scanned to find them (input, fast mode set or level files)
+	uint64_t keys_placed = 0;         // keys the level gave an index to, the final table for the last level
+	uint64_t collisions = 0;          // positions cleared by clearCollisions, hit by two keys or more
+	uint64_t bitset_bytes = 0;        // level bits and ranks
+	uint64_t rank_bytes = 0;          // of which ranks
+	uint64_t spill_bytes_written = 0; // writeEach level files
+	uint64_t spill_bytes_read = 0;
+	double seconds = 0; // wall time of the level, ranks included
+};
+
+struct mphf_build_stats
+{
+	std::vector<mphf_level_stats> levels;
+	int fast_mode_level = -1; // first level whose keys are kept in ram for the next ones, -1 without fast mode
+	uint64_t final_keys = 0;  // size of the final table
+	uint64_t final_bytes = 0;
+	uint64_t fingerprint_bytes = 0;
+	uint64_t total_bits = 0; // totalBitSize()
+	double seconds = 0;      // wall time of the build, fingerprints excluded
+};
+
+// level sizes of a build : level ii has gammas[ii] bits per key expected to reach it (the last gamma past the end,
+// the gamma of the mphf for all levels when empty, as in BBHash). Levels stop at max_levels (0 : MaxLevels or
+// MPHF_NB_LEVELS) or at the first one fewer than min_keys keys are expected to reach, those go to the final table.
+// Uneven gammas are recorded in v2 files only (MPHF_FLAG_LEVEL_DOMAINS).
+struct mphf_level_schedule
+{
+	std::vector<double> gammas;
+	uint64_t min_keys = 0;
+	uint32_t max_levels = 0;
+};
+
+/* Hasher_t returns a single hash when operator()(elem_t key) is called.
+   if used with XorshiftHashFunctors, it must have the following operator: operator()(elem_t key, uint64_t seed) */
+/* MaxLevels > 0 (opt-in) fixes the number of levels at compile time : lookup probes packed level descriptors
+   in a loop unrolled by the compiler, h0 / h1 are not behind a per level branch. Such an mphf builds MaxLevels levels
+   and only loads files with MaxLevels levels (MPHF_NB_LEVELS for the default ones). */
+template <typename elem_t, typename Hasher_t, uint32_t MaxLevels = 0>
+class mphf
+{
+	static_assert(MaxLevels == 0 || MaxLevels >= 2, "an mphf has at least one level before the final table");
+
+	/* this mechanisms gets P hashes out of Hasher_t */
+	typedef XorshiftHashFunctors<elem_t, Hasher_t> MultiHasher_t;
+	typedef typename mphf_final_key<elem_t>::type final_key_t; // what the final table stores for a key
+	static constexpr size_t v1_pair_size = sizeof(final_key_t) + sizeof(uint64_t); // v1 final hash record
+	// typedef HashFunctors<elem_t> MultiHasher_t; // original code (but only works for int64 keys)  (seems to be as fast as the current xorshift)
+	// typedef IndepHashFunctors<elem_t,Hasher_t> MultiHasher_t; //faster than xorshift
+
+	// a key with the xorshift state left by the hash of the last level it reached,
+	// the next level resumes from it (fast mode sets and level files)
+	struct level_entry
+	{
+		elem_t key;
+		hash_pair_t state;
+	};
+
+  public:
+	mphf() : _built(false)
+	{
+	}
+
+	~mphf()
+	{
+	}
+
+	// allow perc_elem_loaded  elements to be loaded in ram for faster construction (default 3%), set to 0 to desactivate
+	// (1.0 : all keys fit in ram, the in ram set starts at level 0 ; it shrinks to the keys left at each level)
+	// reduction : how levels map hashes to positions, MPHF_REDUCE_MULTIPLY is faster but needs the v2 file format
+	// writeEach : keys that reach level i are written with their hash state to per-thread files in tmp_dir and read back for level i+1,
+	// so input_range is read twice and only NBBUFF keys per thread are held in ram
+	// progress : console_progress on stderr, replaced by on_progress when set (called every progress_interval seconds
+	// from a reporter thread, see progress_reporter)
+	// schedule : per level gammas and early termination, see mphf_level_schedule (its gammas replace gamma)
+	template <typename Range>
+	mphf(uint64_t n, Range const& input_range, int num_thread = 1, double gamma = 2.0, bool writeEach = true, bool progress = true, float perc_elem_loaded = 0.03, mphf_reduction reduction = MPHF_REDUCE_MODULO, const std::string& tmp_dir = ".", progress_callback on_progress = nullptr, double progress_interval = 1.0, const mphf_level_schedule& schedule = mphf_level_schedule()) : _gamma(gamma), _hash_domain(static_cast<uint64_t>(ceil(double(n) * gamma))), _nelem(n), _num_thread(num_thread), _percent_elem_loaded_for_fastMode(perc_elem_loaded), _withprogress(progress || on_progress), _reduction(reduction), _tmpdir(tmp_dir)
+	{
+		checkSchedule(schedule);
+		if (n == 0)
+			return;
+
+		auto build_start = std::chrono::steady_clock::now();
+		_fastmode = false;
+
+		if (_percent_elem_loaded_for_fastMode > 0.0)
+			_fastmode = true;
+
+		if (writeEach)
+		{
+			_writeEachLevel = true;
+			_fastmode = false;
+		}
+		else
+		{
+			_writeEachLevel = false;
+		}
+
+		setup(schedule);
+
+		if (_withprogress)
+			_progress.start(expectedKeysRead(), _num_thread, on_progress ? std::move(on_progress) : progress_callback(console_progress), progress_interval);
+
+		uint64_t offset = 0;
+		bitVector collisions; // temp collision bitarray of the level being built, at the end of the arena
+		_tempBitset = &collisions;
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			auto level_start = std::chrono::steady_clock::now();
+			_progress.setLevel(ii);
+			collisions.attach(_levels[ii].hash_domain, _arena->collisions(), nullptr);
+
+			processLevel(input_range, ii);
+
+			_stats.levels[ii].collisions = _levels[ii].bitset.clearCollisions(0, _levels[ii].hash_domain, _tempBitset);
+			memset(_arena->collisions(), 0, level_arena::bitsBytes(_levels[ii].hash_domain)); // zeroed for the next level
+
+			uint64_t next_offset = _levels[ii].bitset.build_ranks(offset);
+			_nbPlacedPrevLevel = next_offset - offset; // one bit per key placed at level ii
+			_stats.levels[ii].keys_placed = _nbPlacedPrevLevel;
+			_stats.levels[ii].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - level_start).count();
+			offset = next_offset;
+		}
+
+		_progress.finish();
+		_tempBitset = nullptr;
+		_arena->releaseCollisions();
+
+		_lastbitsetrank = offset;
+
+		mergeFinalKeys();
+		_stats.levels[_nb_levels - 1].keys_placed = _final_hash.size();
+		_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+		// printf("used temp ram for construction : %lli MB \n",setLevelFastmode.capacity()* sizeof(level_entry) /1024ULL/1024ULL);
+
+		std::vector<level_entry>().swap(setLevelFastmode); // clear setLevelFastmode reallocating
+		std::vector<level_entry>().swap(setLevelFastmodeNext);
+		std::lock_guard<std::mutex> lock(_mutex);
+		_built = true;
+	}
+
+	uint64_t lookup(const elem_t& elem) const
+	{
+		uint64_t idx = lookupIndex(elem);
+		if (_fingerprints.bits() > 0 && idx != ULLONG_MAX && _fingerprints.get(idx) != fingerprintOf(elem, _fingerprints.bits()))
+			return ULLONG_MAX;
+		return idx;
+	}
+
+	// index of elem without the fingerprint check : keys not in the set get an arbitrary index unless they reach the final table
+	uint64_t lookupIndex(const elem_t& elem) const
+	{
+		if (!_built)
+			return ULLONG_MAX;
+		if (!_hot.empty())
+			return lookupHot(elem);
+		if constexpr (MaxLevels > 0)
+			return lookupFixed(elem);
+
+		// auto hashes = _hasher(elem);
+		hash_pair_t bbhash = {0, 0};
+		int level;
+		uint64_t level_hash = getLevel(bbhash, elem, &level);
+		return indexAt(elem, level, level_hash);
+	}
+
+	// index of elem from the level getLevel found and the hash it returned
+	uint64_t indexAt(const elem_t& elem, int level, uint64_t level_hash) const
+	{
+		uint64_t non_minimal_hp, minimal_hp;
+
+		if (level == (int)_nb_levels - 1)
+		{
+			uint64_t in_final = _final_hash.find(final_key_of(elem));
+			if (in_final == ULLONG_MAX)
+			{
+				// elem was not in orignal set of keys
+				return ULLONG_MAX; //  means elem not in set
+			}
+			else
+			{
+				minimal_hp = in_final + _lastbitsetrank;
+				// printf("lookup %llu  level %i   --> %llu \n",elem,level,minimal_hp);
+
+				return minimal_hp;
+			}
+		}
+		else
+		{
+			// non_minimal_hp =  level_hash %  _levels[level].hash_domain; // in fact non minimal hp would be  + _levels[level]->idx_begin
+			non_minimal_hp = _levels[level].reduce(level_hash);
+		}
+		minimal_hp = _levels[level].bitset.rank(non_minimal_hp);
+		//	printf("lookup %llu  level %i   --> %llu \n",elem,level,minimal_hp);
+
+		return minimal_hp;
+	}
+
+	// batched lookup : out[ii] = lookup(keys[ii]), ULLONG_MAX for elems not in set
+	// keys are walked level by level in blocks of NBLOOKUPBATCH, so that the hashes and the
+	// bitset / rank accesses of a whole block are issued (and prefetched) before they are used,
+	// then the fingerprints of the block are prefetched and checked the same way.
+	// Keys that miss level 0 and hit the hot key cache stop there with their cached index.
+	void lookup(const elem_t* keys, size_t nkeys, uint64_t* out) const
+	{
+		if (!_built)
+		{
+			std::fill(out, out + nkeys, ULLONG_MAX);
+			return;
+		}
+
+		hash_pair_t bbhash[NBLOOKUPBATCH];
+		uint64_t pos[NBLOOKUPBATCH];
+		uint32_t key_level[NBLOOKUPBATCH];
+		uint32_t pending[NBLOOKUPBATCH];
+
+		for (size_t start = 0; start < nkeys; start += NBLOOKUPBATCH)
+		{
+			const uint32_t nb = static_cast<uint32_t>(std::min<size_t>(NBLOOKUPBATCH, nkeys - start));
+			const elem_t* batch = keys + start;
+
+			uint32_t npending = nb;
+			for (uint32_t jj = 0; jj < nb; jj++)
+				pending[jj] = jj;
+
+			for (uint32_t ii = 0; ii < (_nb_levels - 1) && npending > 0; ii++)
+			{
+				const level& lvl = _levels[ii];
+
+				// next hash of every key still walking, prefetch its bit
+				for (uint32_t pp = 0; pp < npending; pp++)
+				{
+					uint32_t jj = pending[pp];
+					uint64_t hash_raw;
+					if (ii == 0)
+						hash_raw = _hasher.h0(bbhash[jj], batch[jj]);
+					else if (ii == 1)
+						hash_raw = _hasher.h1(bbhash[jj], batch[jj]);
+					else
+						hash_raw = _hasher.next(bbhash[jj]);
+					pos[jj] = lvl.reduce(hash_raw);
+					lvl.bitset.prefetch(pos[jj]);
+				}
+
+				// keys whose bit is set stop here, prefetch their rank sample
+				uint32_t nstill = 0;
+				for (uint32_t pp = 0; pp < npending; pp++)
+				{
+					uint32_t jj = pending[pp];
+					if (lvl.bitset.get(pos[jj]))
+					{
+						key_level[jj] = ii;
+						lvl.bitset.prefetch_rank(pos[jj]);
+					}
+					else if (ii == 0 && !_hot.empty() && _hot.find(final_key_of(batch[jj]), bbhash[jj][0], pos[jj]))
+					{
+						key_level[jj] = MPHF_HOT_LEVEL; // pos holds the index
+					}
+					else
+					{
+						pending[nstill++] = jj;
+					}
+				}
+				npending = nstill;
+			}
+
+			for (uint32_t pp = 0; pp < npending; pp++)
+				key_level[pending[pp]] = _nb_levels - 1;
+
+			uint64_t* res = out + start;
+			for (uint32_t jj = 0; jj < nb; jj++)
+			{
+				if (key_level[jj] == MPHF_HOT_LEVEL)
+				{
+					res[jj] = pos[jj];
+				}
+				else if (key_level[jj] == _nb_levels - 1)
+				{
+					uint64_t in_final = _final_hash.find(final_key_of(batch[jj]));
+					res[jj] = (in_final == ULLONG_MAX) ? ULLONG_MAX : in_final + _lastbitsetrank;
+				}
+				else
+				{
+					res[jj] = _levels[key_level[jj]].bitset.rank(pos[jj]);
+				}
+			}
+
+			if (_fingerprints.bits() > 0)
+			{
+				for (uint32_t jj = 0; jj < nb; jj++)
+				{
+					if (res[jj] != ULLONG_MAX)
+						_fingerprints.prefetch(res[jj]);
+				}
+				for (uint32_t jj = 0; jj < nb; jj++)
+				{
+					if (res[jj] != ULLONG_MAX && _fingerprints.get(res[jj]) != fingerprintOf(batch[jj], _fingerprints.bits()))
+						res[jj] = ULLONG_MAX;
+				}
+			}
+		}
+	}
+
+	// b-bit fingerprints of the keys the mphf was built from, input_range is read once more
+	// (split among num_thread threads when it is random access). Lookups then reject other keys
+	// with probability 1 - 2^-bits for one more cache line. Throws invalid_argument for bits
+	// outside [1, MPHF_FINGERPRINT_BITS_MAX] or keys that the mphf does not map.
+	template <typename Range>
+	void addFingerprints(Range const& input_range, uint32_t bits, int num_thread = 1)
+	{
+		if (bits == 0 || bits > MPHF_FINGERPRINT_BITS_MAX)
+			throw std::invalid_argument("Fingerprints have 1 to " + std::to_string(MPHF_FINGERPRINT_BITS_MAX) + " bits");
+		if (!_built)
+			throw std::invalid_argument("Fingerprints are added to a built mphf");
+		_fingerprints.clear();
+
+		std::vector<std::atomic<uint64_t>> words(fingerprint_array::nbWords(_nelem, bits));
+		std::atomic<bool> unknown(false);
+		typedef decltype(input_range.begin()) it_type;
+		it_type first = input_range.begin();
+		if constexpr (std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<it_type>::iterator_category>::value)
+		{
+			uint64_t n = static_cast<uint64_t>(input_range.end() - first);
+			uint64_t nthreads = std::max(1, num_thread);
+			std::vector<std::thread> threads;
+			for (uint64_t t = 1; t < nthreads; t++)
+				threads.emplace_back([&, t]
+				                     { fingerprintKeys(first + n * t / nthreads, first + n * (t + 1) / nthreads, bits, words.data(), unknown); });
+			fingerprintKeys(first, first + n / nthreads, bits, words.data(), unknown);
+			for (auto& th : threads)
+				th.join();
+		}
+		else
+		{
+			fingerprintKeys(first, input_range.end(), bits, words.data(), unknown);
+		}
+		if (unknown.load())
+			throw std::invalid_argument("Fingerprints are computed from the keys of the mphf");
+
+		std::vector<uint64_t> packed(words.size());
+		for (size_t ii = 0; ii < words.size(); ii++)
+			packed[ii] = words[ii].load(std::memory_order_relaxed);
+		_fingerprints.assign(std::move(packed), _nelem, bits);
+	}
+
+	uint32_t fingerprintBits() const { return _fingerprints.bits(); }
+
+	// top bits of a hash of key independent of the level hashes, bits in [1, 64]
+	static uint64_t fingerprintOf(const elem_t& key, uint32_t bits)
+	{
+		static const Hasher_t hasher;
+		return hasher(key, MPHF_FINGERPRINT_SEED) >> (64 - bits);
+	}
+
+	const fingerprint_array& fingerprints() const { return _fingerprints; }
+
+	// hot key cache over the keys of sample (a sample of the query traffic, an access log) whose lookup walks down
+	// to level min_level or deeper : the most frequent one of each of the nslots slots (a power of two, 16 bytes
+	// each with 8-byte keys) keeps its index. Lookups give the same results, the keys found in the cache do not
+	// walk the levels past level 0. Keys of sample not in the set are skipped when the final table rejects them.
+	// Throws invalid_argument for a bad nslots or an mphf that is not built.
+	void buildHotCache(const elem_t* sample, size_t nsample, uint64_t nslots = MPHF_HOT_SLOTS, uint32_t min_level = MPHF_HOT_MIN_LEVEL)
+	{
+		if (nslots < 2 || nslots > (1ULL << MPHF_HOT_SLOT_BITS_MAX) || (nslots & (nslots - 1)) != 0)
+			throw std::invalid_argument("A hot key cache has a power of two slots, 2 to 2^" + std::to_string(MPHF_HOT_SLOT_BITS_MAX));
+		if (!_built)
+			throw std::invalid_argument("A hot key cache is built for a built mphf");
+		_hot.clear(); // lookups below walk the levels
+
+		struct candidate
+		{
+			final_key_t key;
+			uint64_t slot;
+			uint64_t index;
+		};
+		uint32_t slot_bits = 0;
+		while ((1ULL << slot_bits) < nslots)
+			slot_bits++;
+		std::vector<candidate> deep;
+		for (size_t ii = 0; ii < nsample; ii++)
+		{
+			hash_pair_t bbhash = {0, 0};
+			int level;
+			uint64_t level_hash = getLevel(bbhash, sample[ii], &level);
+			if (level < (int)min_level)
+				continue;
+			uint64_t index = indexAt(sample[ii], level, level_hash);
+			if (index == ULLONG_MAX)
+				continue;
+			deep.push_back(candidate{final_key_of(sample[ii]), hot_key_table<final_key_t>::slotOf(_hasher.h0(bbhash, sample[ii]), slot_bits), index});
+		}
+		std::sort(deep.begin(), deep.end(), [](const candidate& a, const candidate& b)
+		          { return a.key < b.key; });
+
+		// runs of the same key, the longest run of a slot takes it (the smallest key on ties)
+		std::vector<typename hot_key_table<final_key_t>::slot> slots(nslots);
+		std::vector<uint64_t> best(nslots, 0);
+		for (auto& s : slots)
+			s.index = ULLONG_MAX;
+		for (size_t ii = 0, run; ii < deep.size(); ii += run)
+		{
+			run = 1;
+			while (ii + run < deep.size() && !(deep[ii].key < deep[ii + run].key))
+				run++;
+			if (run > best[deep[ii].slot])
+			{
+				best[deep[ii].slot] = run;
+				slots[deep[ii].slot].key = deep[ii].key;
+				slots[deep[ii].slot].index = deep[ii].index;
+			}
+		}
+		_hot.assign(std::move(slots), min_level);
+	}
+
+	const hot_key_table<final_key_t>& hotCache() const { return _hot; }
+
+	// cache of another mphf instance over the same keys (copies, replicas)
+	void setHotCache(const hot_key_table<final_key_t>& hot) { _hot = hot; }
+
+	void clearHotCache() { _hot.clear(); }
+
+	void saveHotCache(std::ostream& os) const
+	{
+		static_assert(std::is_trivially_copyable<final_key_t>::value, "hot key caches are saved for trivially copyable keys");
+		typedef typename hot_key_table<final_key_t>::slot slot_t;
+		mphf_hot_header header = {};
+		memcpy(header.magic, mphf_hot_magic, sizeof(header.magic));
+		header.version = MPHF_HOT_VERSION;
+		header.slot_bits = _hot.slotBits();
+		header.hasher_id = mphf_hasher_id<Hasher_t>::value;
+		header.key_size = sizeof(final_key_t);
+		header.nelem = _nelem;
+		header.lastbitsetrank = _lastbitsetrank;
+		header.nb_filled = _hot.filled();
+		header.final_crc = finalCrc();
+		header.slots_crc = crc32(_hot.slots().data(), _hot.size() * sizeof(slot_t));
+		header.min_level = _hot.minLevel();
+		os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		os.write(reinterpret_cast<char const*>(_hot.slots().data()), (std::streamsize)(_hot.size() * sizeof(slot_t)));
+	}
+
+	// false (and no cache) for the cache of another mphf : other hasher, key count, rank or final table.
+	// Throws runtime_error for a truncated or corrupt file.
+	bool loadHotCache(std::istream& is)
+	{
+		static_assert(std::is_trivially_copyable<final_key_t>::value, "hot key caches are loaded for trivially copyable keys");
+		typedef typename hot_key_table<final_key_t>::slot slot_t;
+		_hot.clear();
+		mphf_hot_header header;
+		is.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!is)
+			throw std::runtime_error("Truncated hot key cache file");
+		if (memcmp(header.magic, mphf_hot_magic, sizeof(header.magic)) != 0)
+			throw std::runtime_error("Not a hot key cache file");
+		if (header.version != MPHF_HOT_VERSION)
+			throw std::runtime_error("Unsupported hot key cache version " + std::to_string(header.version));
+		if (header.slot_bits < 1 || header.slot_bits > MPHF_HOT_SLOT_BITS_MAX || header.key_size != sizeof(final_key_t))
+			throw std::runtime_error("Corrupt hot key cache file: bad header");
+		if (header.hasher_id != mphf_hasher_id<Hasher_t>::value || header.nelem != _nelem || header.lastbitsetrank != _lastbitsetrank || header.final_crc != finalCrc())
+			return false;
+
+		std::vector<slot_t> slots(1ULL << header.slot_bits);
+		is.read(reinterpret_cast<char*>(slots.data()), (std::streamsize)(slots.size() * sizeof(slot_t)));
+		if (!is)
+			throw std::runtime_error("Truncated hot key cache file");
+		if (crc32(slots.data(), slots.size() * sizeof(slot_t)) != header.slots_crc)
+			throw std::runtime_error("Corrupt hot key cache file: slots checksum mismatch");
+		for (const slot_t& s : slots)
+		{
+			if (s.index != ULLONG_MAX && s.index >= _nelem)
+				throw std::runtime_error("Corrupt hot key cache file: index out of range");
+		}
+		_hot.assign(std::move(slots), header.min_level);
+		if (_hot.filled() != header.nb_filled)
+		{
+			_hot.clear();
+			throw std::runtime_error("Corrupt hot key cache file: bad header");
+		}
+		return true;
+	}
+
+	uint64_t nbKeys() const
+	{
+		return _nelem;
+	}
+
+	double gamma() const { return _gamma; }
+
+	uint32_t nbLevels() const { return _nb_levels; }
+
+	// bits of level ii < nbLevels(), the last level is the final table's
+	uint64_t levelDomain(uint32_t ii) const { return _levels[ii].hash_domain; }
+
+	// level sizes do not follow from gamma (uneven mphf_level_schedule gammas), saved as v2 only
+	bool scheduled() const { return _scheduled; }
+
+	uint64_t lastBitsetRank() const { return _lastbitsetrank; }
+
+	mphf_reduction reduction() const { return _reduction; }
+
+	bool built() const { return _built; }
+
+	const final_table<final_key_t>& finalHash() const { return _final_hash; }
+
+	// in-memory layout of the level bitsets, once built / loaded / mapped (flat by default)
+	// interleaved costs ~1.8% more bits than flat and makes rank() a single cache line ;
+	// a mapped mphf gets its bitsets copied out of the mapping. Saved files are unchanged.
+	void setRankLayout(rank_layout layout)
+	{
+		for (uint32_t ii = 0; ii < _nb_levels && ii < _levels.size(); ii++)
+			_levels[ii].bitset.setLayout(layout);
+	}
+
+	rank_layout rankLayout() const
+	{
+		return (!_levels.empty() && _levels[0].bitset.interleaved()) ? RANK_LAYOUT_INTERLEAVED : RANK_LAYOUT_FLAT;
+	}
+
+	// level bits and ranks, final table and fingerprints (breakdown in build_stats())
+	uint64_t totalBitSize() const
+	{
+		uint64_t totalsize = _final_hash.bitSize() + _fingerprints.bitSize(); // sorted keys + values
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+			totalsize += _levels[ii].bitset.bitSize();
+		return totalsize;
+	}
+
+	// per level counters of the build (zero when loaded or mapped) and the current sizes of the parts
+	mphf_build_stats build_stats() const
+	{
+		mphf_build_stats stats = _stats;
+		stats.levels.resize(_nb_levels);
+		for (uint32_t ii = 0; ii < _nb_levels && ii < _levels.size(); ii++)
+		{
+			stats.levels[ii].bitset_bytes = _levels[ii].bitset.bitSize() / 8;
+			stats.levels[ii].rank_bytes = _levels[ii].bitset.rankBitSize() / 8;
+		}
+		stats.final_keys = _final_hash.size();
+		stats.final_bytes = _final_hash.bitSize() / 8;
+		stats.fingerprint_bytes = _fingerprints.bitSize() / 8;
+		stats.total_bits = totalBitSize();
+		return stats;
+	}
+
+	template <typename Iterator> // typename Range,
+	void pthread_processLevel(std::vector<elem_t>& buffer, std::shared_ptr<Iterator> shared_it, std::shared_ptr<Iterator> until_p, int i)
+	{
+		uint64_t nb_done = 0;
+		uint64_t nb_read = 0;
+		uint64_t nb_reached = 0;
+		int tid = _nb_living.fetch_add(1, std::memory_order_relaxed);
+		auto until = *until_p;
+		uint64_t inbuff = 0;
+
+		uint64_t writebuff = 0;
+		std::vector<level_entry>& myWriteBuff = bufferperThread[tid];
+
+		if constexpr (std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value)
+		{
+			// random access input : threads claim chunks of NBBUFF elems with an atomic cursor, no lock
+			// (shared_it is never advanced)
+			const Iterator begin = *shared_it;
+			const uint64_t nb_elems = static_cast<uint64_t>(until - begin);
+			for (;;)
+			{
+				uint64_t start = _chunkCursor.fetch_add(NBBUFF, std::memory_order_relaxed);
+				if (start >= nb_elems)
+					break;
+				const Iterator chunk_end = begin + std::min<uint64_t>(start + NBBUFF, nb_elems);
+				for (Iterator it = begin + start; it != chunk_end; ++it)
+				{
+					nb_reached += processElem(*it, i, tid, writebuff, myWriteBuff);
+					progressStep(nb_done, tid);
+				}
+				nb_read += static_cast<uint64_t>(chunk_end - (begin + start));
+			}
+		}
+		else
+		{
+			// forward-only input (e.g. bfile_iterator) : copy NBBUFF elems at a time under the lock
+			for (bool isRunning = true; isRunning;)
+			{
+
+				// safely copy n items into buffer
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					for (; inbuff < NBBUFF && (*shared_it) != until; ++(*shared_it))
+					{
+						buffer[inbuff] = *(*shared_it);
+						inbuff++;
+					}
+					if ((*shared_it) == until)
+						isRunning = false;
+				}
+
+				// do work on the n elems of the buffer
+				for (uint64_t ii = 0; ii < inbuff; ii++)
+				{
+					nb_reached += processElem(buffer[ii], i, tid, writebuff, myWriteBuff);
+					progressStep(nb_done, tid);
+				}
+
+				nb_read += inbuff;
+				inbuff = 0;
+			}
+		}
+
+		if (_writeEachLevel && writebuff > 0)
+		{
+			writeLevelFile(tid, myWriteBuff, writebuff);
+		}
+		_cptLevel.fetch_add(nb_reached, std::memory_order_relaxed);
+		_cptTotalProcessed.fetch_add(nb_read, std::memory_order_relaxed);
+		progressFlush(nb_done, tid);
+	}
+
+	// level files pass : whole blocks from the background reader, one lock per block instead of per elem
+	void pthread_processBlocks(block_reader<level_entry>& reader, int i)
+	{
+		uint64_t nb_done = 0;
+		uint64_t nb_read = 0;
+		uint64_t nb_reached = 0;
+		int tid = _nb_living.fetch_add(1, std::memory_order_relaxed);
+		uint64_t writebuff = 0;
+		std::vector<level_entry>& myWriteBuff = bufferperThread[tid];
+
+		typename block_reader<level_entry>::block b;
+		while (reader.next(b))
+		{
+			for (size_t ii = 0; ii < b.size; ii++)
+			{
+				nb_reached += processElem(b.data[ii], i, tid, writebuff, myWriteBuff);
+				progressStep(nb_done, tid);
+			}
+			nb_read += b.size;
+			reader.release(b);
+		}
+
+		if (writebuff > 0)
+		{
+			writeLevelFile(tid, myWriteBuff, writebuff);
+		}
+		_cptLevel.fetch_add(nb_reached, std::memory_order_relaxed);
+		_cptTotalProcessed.fetch_add(nb_read, std::memory_order_relaxed);
+		progressFlush(nb_done, tid);
+	}
+
+	// one key of the input for level i, levels 0..i-1 are probed from scratch, true if it reaches level i
+	// called concurrently by the build threads (tid is the caller's)
+	bool processElem(const elem_t& val, int i, int tid, uint64_t& writebuff, std::vector<level_entry>& myWriteBuff)
+	{
+		hash_pair_t bbhash = {0, 0};
+		int level;
+		getLevel(bbhash, val, &level, i);
+
+		if (level != i) // not for lvl i
+			return false;
+
+		placeElem(val, bbhash, i, tid, writebuff, myWriteBuff);
+		return true;
+	}
+
+	// one key that reached level i-1 (fast mode set, level files) with the hash state it had there :
+	// only level i-1 is probed, its hash comes from the state, level i costs one more xorshift step
+	bool processElem(const level_entry& entry, int i, int tid, uint64_t& writebuff, std::vector<level_entry>& myWriteBuff)
+	{
+		hash_pair_t bbhash = entry.state;
+		if (_levels[i - 1].get(_hasher.last(bbhash, i - 1))) // placed at level i-1
+			return false;
+
+		placeElem(entry.key, bbhash, i, tid, writebuff, myWriteBuff);
+		return true;
+	}
+
+	// val reaches level i, bbhash is its state after the hash of level i-1
+	void placeElem(const elem_t& val, hash_pair_t& bbhash, int i, int tid, uint64_t& writebuff, std::vector<level_entry>& myWriteBuff)
+	{
+		// insert to level i+1 : either next level of the cascade or final hash if last level reached
+		if (i == (int)_nb_levels - 1) // stop cascade here, insert into exact hash
+		{
+			// per thread, indices are given when the threads' keys are merged (see mergeFinalKeys)
+			_finalKeysPerThread[tid].push_back(final_key_of(val));
+			return;
+		}
+
+		// computes next hash
+		uint64_t level_hash;
+		if (i == 0)
+			level_hash = _hasher.h0(bbhash, val);
+		else if (i == 1)
+			level_hash = _hasher.h1(bbhash, val);
+		else
+		{
+			level_hash = _hasher.next(bbhash);
+		}
+
+		// from _fastModeLevel on, the keys that reach level i are kept for level i+1
+		if (_fastmode && i >= _fastModeLevel)
+		{
+			std::vector<level_entry>& fastmode_set = (i == _fastModeLevel) ? setLevelFastmode : setLevelFastmodeNext;
+			uint64_t idxl2 = _idxLevelsetLevelFastmode.fetch_add(1, std::memory_order_relaxed);
+			// si depasse taille attendue pour setLevelFastmode, fall back sur slow mode mais devrait pas arriver si hash ok et proba avec nous
+			// (only at _fastModeLevel, the next sets are sized exactly)
+			if (idxl2 >= fastmode_set.size())
+				_fastmode = false;
+			else
+				fastmode_set[idxl2] = level_entry{val, bbhash}; // create set for fast mode
+		}
+
+		// ils ont reach ce level
+		// insert elem into curr level on disk --> sera utilise au level+1 , (mais encore besoin filtre)
+
+		if (_writeEachLevel && i > 0)
+		{
+			if (writebuff >= NBBUFF)
+			{
+				writeLevelFile(tid, myWriteBuff, writebuff);
+			}
+
+			myWriteBuff[writebuff++] = level_entry{val, bbhash};
+		}
+
+		insertIntoLevel(level_hash, i, tid); // should be safe
+	}
+
+	// last level keys get consecutive indices in thread order, then the final table is sorted
+	void mergeFinalKeys()
+	{
+		size_t total = 0;
+		for (const auto& keys : _finalKeysPerThread)
+			total += keys.size();
+		std::vector<std::pair<final_key_t, uint64_t>> entries;
+		entries.reserve(total);
+		for (auto& keys : _finalKeysPerThread)
+		{
+			for (const final_key_t& key : keys)
+				entries.emplace_back(key, entries.size());
+			std::vector<final_key_t>().swap(keys);
+		}
+		_final_hash.build(entries);
+		// every copy of a repeated key falls through all the levels, the table keeps one and an index goes unused
+		// (fingerprints of distinct keys only meet if their 128-bit hashes collide, the keys are duplicates then)
+		if (_final_hash.size() != total)
+		{
+			if (std::is_same<final_key_t, elem_t>::value)
+				throw std::invalid_argument("Keys repeated in the final level, the input has duplicate keys");
+			throw std::runtime_error("Keys with the same final level fingerprint, the input has duplicate keys");
+		}
+	}
+
+	static final_key_t final_key_of(const elem_t& key) { return mphf_final_key<elem_t>::of(key); }
+
+	template <typename Iterator>
+	void fingerprintKeys(Iterator it, Iterator until, uint32_t bits, std::atomic<uint64_t>* words, std::atomic<bool>& unknown) const
+	{
+		elem_t keys[NBLOOKUPBATCH];
+		uint64_t idx[NBLOOKUPBATCH];
+		while (it != until)
+		{
+			uint32_t nb = 0;
+			for (; nb < NBLOOKUPBATCH && it != until; ++it)
+				keys[nb++] = *it;
+			lookup(keys, nb, idx);
+			for (uint32_t jj = 0; jj < nb; jj++)
+			{
+				if (idx[jj] >= _nelem)
+					unknown.store(true, std::memory_order_relaxed);
+				else
+					fingerprint_array::set(words, idx[jj], bits, fingerprintOf(keys[jj], bits));
+			}
+		}
+	}
+
+	// threads report every 1024 keys read, and what is left when they are done with a level (progressFlush)
+	void progressStep(uint64_t& nb_done, int tid)
+	{
+		nb_done++;
+		if ((nb_done & 1023) == 0 && _withprogress)
+		{
+			_progress.add(tid, nb_done);
+			nb_done = 0;
+		}
+	}
+
+	void progressFlush(uint64_t nb_done, int tid)
+	{
+		if (_withprogress)
+			_progress.add(tid, nb_done);
+	}
+
+	// keys the levels read, from the level sizes of setup() : about n * _reach[ii] keys reach level ii, and level ii
+	// reads them from level ii-1 (fast mode set past _fastModeLevel, level files past level 1) or scans the input
+	uint64_t expectedKeysRead() const
+	{
+		double total = 0;
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			bool from_previous = (_writeEachLevel && ii > 1) || (_fastmode && static_cast<int>(ii) > _fastModeLevel);
+			total += from_previous ? double(_nelem) * _reach[ii - 1] : double(_nelem);
+		}
+		return static_cast<uint64_t>(total);
+	}
+
+	// version : MPHF_FORMAT_V1 (BBHash compatible) or MPHF_FORMAT_V2 (aligned sections, checksum adds a crc32 per section)
+	void save(std::ostream& os, uint32_t version = MPHF_FORMAT_V1, bool checksum = true) const
+	{
+		if (version == MPHF_FORMAT_V2)
+		{
+			saveV2(os, checksum);
+			return;
+		}
+		checkSaveV1(version);
+
+		char header[MPHF_V1_HEADER_SIZE];
+		packHeaderV1(header);
+		os.write(header, sizeof(header));
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			_levels[ii].bitset.save(os);
+		}
+
+		// save final hash, its (key, value) pairs in one write
+		uint64_t final_hash_size = _final_hash.size();
+		os.write(reinterpret_cast<char const*>(&final_hash_size), sizeof(uint64_t));
+		std::vector<char> pairs = packedFinalHash();
+		os.write(pairs.data(), (std::streamsize)pairs.size());
+	}
+
+	// save(os) through positional writes at the offsets of the layout, MPHF_IO_CHUNK bytes at a time on num_thread threads
+	// (same bytes). Throws std::system_error when the file cannot be written.
+	void save(const std::string& path, uint32_t version = MPHF_FORMAT_V1, bool checksum = true, int num_thread = 1) const
+	{
+		std::vector<mphf_io_range> ranges;
+		auto add = [&](uint64_t offset, const void* data, uint64_t length)
+		{ ranges.push_back({offset, const_cast<char*>(static_cast<const char*>(data)), length}); };
+		std::vector<bitVector> flat; // interleaved levels are written flat
+		flat.reserve(_nb_levels);
+		uint64_t file_size = 0;
+
+		// v1 : header, per level its size, word count, words, rank count and ranks, then the final hash
+		char header[MPHF_V1_HEADER_SIZE];
+		std::vector<uint64_t> records(3ULL * _nb_levels + 1);
+		std::vector<char> pairs;
+		// v2 : header and table of contents, then the sections at their offsets (padding is left to resize())
+		std::vector<char> head;
+		if (version == MPHF_FORMAT_V2)
+		{
+			mphf_file_header v2_header;
+			std::vector<mphf_file_section> toc;
+			std::vector<const void*> payload;
+			layoutV2(checksum, num_thread, v2_header, toc, payload, flat);
+			head.resize(sizeof(v2_header) + toc.size() * sizeof(mphf_file_section));
+			memcpy(head.data(), &v2_header, sizeof(v2_header));
+			memcpy(head.data() + sizeof(v2_header), toc.data(), toc.size() * sizeof(mphf_file_section));
+			add(0, head.data(), head.size());
+			size_t first = 0;
+			if (_nb_levels > 0 && _arena && _arena->holds(_levels))
+			{
+				first = 2 * _nb_levels;
+				add(toc[0].offset, _arena->data(), _arena->levelsBytes());
+			}
+			for (size_t ii = first; ii < toc.size(); ii++)
+				add(toc[ii].offset, payload[ii], toc[ii].length);
+			file_size = toc.back().offset + toc.back().length;
+		}
+		else
+		{
+			checkSaveV1(version);
+			packHeaderV1(header);
+			add(0, header, sizeof(header));
+			uint64_t pos = sizeof(header);
+			for (uint32_t ii = 0; ii < _nb_levels; ii++)
+			{
+				const bitVector& bv = flatLevel(ii, flat);
+				uint64_t* record = &records[3ULL * ii];
+				record[0] = bv.size();
+				record[1] = bv.nchar();
+				record[2] = bv.nbRankSamples();
+				add(pos, record, 2 * sizeof(uint64_t));
+				pos += 2 * sizeof(uint64_t);
+				add(pos, bv.words(), bv.nchar() * sizeof(uint64_t));
+				pos += bv.nchar() * sizeof(uint64_t);
+				add(pos, record + 2, sizeof(uint64_t));
+				pos += sizeof(uint64_t);
+				add(pos, bv.rankSamples(), bv.nbRankSamples() * sizeof(uint64_t));
+				pos += bv.nbRankSamples() * sizeof(uint64_t);
+			}
+			records.back() = _final_hash.size();
+			add(pos, &records.back(), sizeof(uint64_t));
+			pos += sizeof(uint64_t);
+			pairs = packedFinalHash();
+			add(pos, pairs.data(), pairs.size());
+			file_size = pos + pairs.size();
+		}
+
+		positional_file file(path, true);
+		file.resize(file_size);
+		positional_io(file, ranges, true, num_thread);
+	}
+
+	// reads both formats, v2 section checksums are verified
+	void load(std::istream& is)
+	{
+		// v1 files start with gamma, v2 files with the magic
+		char first[8] = {0};
+		is.read(first, sizeof(first));
+		if (memcmp(first, mphf_file_magic, sizeof(first)) == 0)
+		{
+			loadV2(is);
+			return;
+		}
+		memcpy(&_gamma, first, sizeof(_gamma));
+		_reduction = MPHF_REDUCE_MODULO;
+		_scheduled = false;
+		_fingerprints.clear();
+		_hot.clear();
+
+		is.read(reinterpret_cast<char*>(&_nb_levels), sizeof(_nb_levels));
+		is.read(reinterpret_cast<char*>(&_lastbitsetrank), sizeof(_lastbitsetrank));
+		is.read(reinterpret_cast<char*>(&_nelem), sizeof(_nelem));
+		checkLevelCount();
+
+		_levels.resize(_nb_levels);
+
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			//_levels[ii].bitset = new bitVector();
+			_levels[ii].bitset.load(is);
+		}
+		_mapping.reset();
+		_arena.reset();
+
+		loadedSetup();
+
+		// restore final hash, v1 pairs come in any order ; read in blocks, a corrupt size does not allocate it all
+		uint64_t final_hash_size;
+
+		is.read(reinterpret_cast<char*>(&final_hash_size), sizeof(uint64_t));
+
+		const uint64_t block = 1ULL << 16;
+		std::vector<char> pairs;
+		for (uint64_t ii = 0; ii < final_hash_size && is; ii += block)
+		{
+			uint64_t nb = std::min(block, final_hash_size - ii);
+			size_t at = pairs.size();
+			pairs.resize(at + nb * v1_pair_size);
+			is.read(pairs.data() + at, (std::streamsize)(nb * v1_pair_size));
+			pairs.resize(at + (size_t)is.gcount() / v1_pair_size * v1_pair_size);
+		}
+		loadPackedFinalHash(pairs.data(), pairs.size() / v1_pair_size);
+		_built = true;
+	}
+
+	// load(is) through positional reads on num_thread threads, the levels straight into one level_arena.
+	// Files whose levels do not have the sizes loadedSetup() gives (not written by this version) are read by load(is).
+	// Throws std::system_error when the file cannot be opened or read.
+	void load(const std::string& path, int num_thread = 1)
+	{
+		bool loaded;
+		{
+			positional_file file(path, false);
+			uint64_t file_size = file.size();
+			char first[sizeof(mphf_file_magic)] = {0};
+			file.read(first, std::min<uint64_t>(sizeof(first), file_size), 0);
+			if (memcmp(first, mphf_file_magic, sizeof(first)) == 0)
+				loaded = loadV2File(file, file_size, num_thread);
+			else
+				loaded = loadV1File(file, file_size, num_thread);
+		}
+		if (!loaded)
+		{
+			std::ifstream is(path, std::ios::binary);
+			if (!is)
+				throw std::system_error(errno, std::generic_category(), "Error opening " + path);
+			load(is);
+			if (is.fail())
+				throw std::runtime_error("Truncated mphf file");
+		}
+	}
+
+	// zero-copy load : the level bitsets point directly into a read-only mapping of a file written by save()
+	// pages are faulted in on first lookup, the mapping lives as long as this mphf
+	// v2 section checksums are only checked with verify (it reads the whole file)
+	void map(const std::string& path, bool verify = false)
+	{
+		auto mapping = std::make_shared<mapped_file>(path);
+		const char* p = mapping->data();
+		const char* end = p + mapping->size();
+
+		if (mapping->size() >= sizeof(mphf_file_magic) && memcmp(p, mphf_file_magic, sizeof(mphf_file_magic)) == 0)
+		{
+			mapV2(mapping, verify);
+			return;
+		}
+
+		const size_t header_size = sizeof(_gamma) + sizeof(_nb_levels) + sizeof(_lastbitsetrank) + sizeof(_nelem);
+		if (mapping->size() < header_size)
+			throw std::runtime_error("Truncated mphf file " + path);
+		memcpy(&_gamma, p, sizeof(_gamma));
+		_reduction = MPHF_REDUCE_MODULO;
+		_scheduled = false;
+		_fingerprints.clear();
+		_hot.clear();
+		p += sizeof(_gamma);
+		memcpy(&_nb_levels, p, sizeof(_nb_levels));
+		p += sizeof(_nb_levels);
+		memcpy(&_lastbitsetrank, p, sizeof(_lastbitsetrank));
+		p += sizeof(_lastbitsetrank);
+		memcpy(&_nelem, p, sizeof(_nelem));
+		p += sizeof(_nelem);
+		checkLevelCount();
+
+		// each level takes at least 4 words, reject corrupt level counts before allocating
+		if (_nb_levels > (uint64_t)(end - p) / (4 * sizeof(uint64_t)))
+			throw std::runtime_error("Truncated mphf file " + path);
+
+		_levels.clear();
+		_levels.resize(_nb_levels);
+		_arena.reset();
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			p = _levels[ii].bitset.map(p, end);
+			if (p == nullptr)
+				throw std::runtime_error("Truncated mphf file " + path);
+		}
+
+		loadedSetup();
+
+		// the final hash is small : copy it into a sorted table
+		uint64_t final_hash_size;
+		if ((size_t)(end - p) < sizeof(uint64_t))
+			throw std::runtime_error("Truncated mphf file " + path);
+		memcpy(&final_hash_size, p, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+		if (final_hash_size > (uint64_t)(end - p) / (sizeof(final_key_t) + sizeof(uint64_t)))
+			throw std::runtime_error("Truncated mphf file " + path);
+
+		std::vector<std::pair<final_key_t, uint64_t>> entries(final_hash_size);
+		for (uint64_t ii = 0; ii < final_hash_size; ii++)
+		{
+			memcpy(&entries[ii].first, p, sizeof(final_key_t));
+			p += sizeof(final_key_t);
+			memcpy(&entries[ii].second, p, sizeof(uint64_t));
+			p += sizeof(uint64_t);
+		}
+		_final_hash.build(entries);
+		_mapping = mapping;
+		_built = true;
+	}
+
+	// zero-copy load of the v2 file at [offset, offset + length) of a mapping shared with a container (static_map)
+	// offset must be a multiple of MPHF_SECTION_ALIGN for the sections to stay aligned
+	void map(const std::shared_ptr<mapped_file>& mapping, uint64_t offset, uint64_t length, bool verify = false)
+	{
+		if (offset % MPHF_SECTION_ALIGN != 0 || offset > mapping->size() || length > mapping->size() - offset)
+			throw std::runtime_error("Corrupt mphf file: section out of bounds");
+		mapV2(mapping, verify, offset, length);
+	}
+
+	bool mapped() const { return _mapping != nullptr; }
+
+	// true while the level bitsets live in one level_arena : built or loaded from a v2 file, flat rank layout
+	bool arenaBacked() const { return _arena && _arena->holds(_levels); }
+
+  private:
+	// v1 save preconditions, the format only knows modulo reduction, the xorshift hasher and no fingerprints
+	void checkSaveV1(uint32_t version) const
+	{
+		if (version != MPHF_FORMAT_V1)
+			throw std::invalid_argument("Unsupported mphf format version " + std::to_string(version));
+		if (_reduction != MPHF_REDUCE_MODULO)
+			throw std::invalid_argument("The v1 mphf format only stores modulo reduction, save as v2");
+		if (mphf_hasher_id<Hasher_t>::value != MPHF_HASHER_XORSHIFT && mphf_hasher_id<Hasher_t>::value != MPHF_HASHER_CUSTOM)
+			throw std::invalid_argument("The v1 mphf format does not record the hasher, save as v2");
+		if (_fingerprints.bits() > 0)
+			throw std::invalid_argument("The v1 mphf format has no fingerprints, save as v2");
+		if (_scheduled)
+			throw std::invalid_argument("The v1 mphf format only stores levels sized from one gamma, save as v2");
+	}
+
+	// gamma, nb_levels, lastbitsetrank, nelem, packed
+	void packHeaderV1(char* header) const
+	{
+		memcpy(header, &_gamma, sizeof(_gamma));
+		memcpy(header + sizeof(_gamma), &_nb_levels, sizeof(_nb_levels));
+		memcpy(header + sizeof(_gamma) + sizeof(_nb_levels), &_lastbitsetrank, sizeof(_lastbitsetrank));
+		memcpy(header + sizeof(_gamma) + sizeof(_nb_levels) + sizeof(_lastbitsetrank), &_nelem, sizeof(_nelem));
+	}
+
+	// v1 final hash records : key then value for each entry
+	std::vector<char> packedFinalHash() const
+	{
+		std::vector<char> pairs(_final_hash.size() * v1_pair_size);
+		for (uint64_t ii = 0; ii < _final_hash.size(); ii++)
+		{
+			memcpy(pairs.data() + ii * v1_pair_size, _final_hash.keys() + ii, sizeof(final_key_t));
+			memcpy(pairs.data() + ii * v1_pair_size + sizeof(final_key_t), _final_hash.values() + ii, sizeof(uint64_t));
+		}
+		return pairs;
+	}
+
+	void loadPackedFinalHash(const char* pairs, uint64_t nb)
+	{
+		std::vector<std::pair<final_key_t, uint64_t>> entries(nb);
+		for (uint64_t ii = 0; ii < nb; ii++)
+		{
+			memcpy(&entries[ii].first, pairs + ii * v1_pair_size, sizeof(final_key_t));
+			memcpy(&entries[ii].second, pairs + ii * v1_pair_size + sizeof(final_key_t), sizeof(uint64_t));
+		}
+		_final_hash.build(entries);
+	}
+
+	// level ii with flat ranks, interleaved levels are flattened into flat (reserved for every level, so it does not move)
+	const bitVector& flatLevel(uint32_t ii, std::vector<bitVector>& flat) const
+	{
+		if (!_levels[ii].bitset.interleaved())
+			return _levels[ii].bitset;
+		flat.push_back(_levels[ii].bitset.flattened());
+		return flat.back();
+	}
+
+	// header, table of contents and section payloads of a v2 file, section crcs on num_thread threads
+	void layoutV2(bool checksum, int num_thread, mphf_file_header& header, std::vector<mphf_file_section>& toc, std::vector<const void*>& payload, std::vector<bitVector>& flat) const
+	{
+		auto add_section = [&](uint32_t kind, uint32_t index, const void* data, uint64_t length, uint64_t aux)
+		{
+			mphf_file_section s = {};
+			s.kind = kind;
+			s.index = index;
+			s.length = length;
+			s.aux = aux;
+			toc.push_back(s);
+			payload.push_back(data);
+		};
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			const bitVector& bv = flatLevel(ii, flat);
+			add_section(MPHF_SECTION_LEVEL_BITS, ii, bv.words(), bv.nchar() * sizeof(uint64_t), bv.size());
+			add_section(MPHF_SECTION_LEVEL_RANKS, ii, bv.rankSamples(), bv.nbRankSamples() * sizeof(uint64_t), 0);
+		}
+		add_section(MPHF_SECTION_FINAL_KEYS, 0, _final_hash.keys(), _final_hash.size() * sizeof(final_key_t), sizeof(final_key_t));
+		add_section(MPHF_SECTION_FINAL_VALUES, 0, _final_hash.values(), _final_hash.size() * sizeof(uint64_t), 0);
+		if (_fingerprints.bits() > 0)
+			add_section(MPHF_SECTION_FINGERPRINTS, 0, _fingerprints.words(), _fingerprints.nbWords() * sizeof(uint64_t), _fingerprints.bits());
+		if (checksum)
+			parallel_tasks(toc.size(), num_thread, [&](size_t ii)
+			               { toc[ii].crc = crc32(payload[ii], toc[ii].length); });
+
+		uint64_t pos = sizeof(mphf_file_header) + toc.size() * sizeof(mphf_file_section);
+		for (auto& s : toc)
+		{
+			s.offset = (pos + MPHF_SECTION_ALIGN - 1) / MPHF_SECTION_ALIGN * MPHF_SECTION_ALIGN;
+			pos = s.offset + s.length;
+		}
+
+		header = {};
+		memcpy(header.magic, mphf_file_magic, sizeof(header.magic));
+		header.version = MPHF_FORMAT_V2;
+		header.flags = (checksum ? MPHF_FLAG_CRC32 : 0) | (_reduction == MPHF_REDUCE_MULTIPLY ? MPHF_FLAG_MULTIPLY_HIGH : 0) |
+		               (_fingerprints.bits() > 0 ? MPHF_FLAG_FINGERPRINTS : 0) | (_scheduled ? MPHF_FLAG_LEVEL_DOMAINS : 0);
+		header.hasher_id = mphf_hasher_id<Hasher_t>::value;
+		header.nb_levels = _nb_levels;
+		header.gamma = _gamma;
+		header.nelem = _nelem;
+		header.lastbitsetrank = _lastbitsetrank;
+		header.nb_sections = (uint32_t)toc.size();
+		header.toc_crc = crc32(toc.data(), toc.size() * sizeof(mphf_file_section));
+	}
+
+	void saveV2(std::ostream& os, bool checksum) const
+	{
+		mphf_file_header header;
+		std::vector<mphf_file_section> toc;
+		std::vector<const void*> payload;
+		std::vector<bitVector> flat; // interleaved levels are written flat
+		flat.reserve(_nb_levels);
+		layoutV2(checksum, 1, header, toc, payload, flat);
+
+		os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		os.write(reinterpret_cast<char const*>(toc.data()), (std::streamsize)(toc.size() * sizeof(mphf_file_section)));
+		uint64_t pos = sizeof(mphf_file_header) + toc.size() * sizeof(mphf_file_section);
+		static const char padding[MPHF_SECTION_ALIGN] = {0};
+		size_t first = 0;
+		if (_nb_levels > 0 && _arena && _arena->holds(_levels))
+		{
+			// the level sections and their padding are the arena bytes
+			first = 2 * _nb_levels;
+			assert(toc[first - 1].offset - toc[0].offset == _arena->ranksOffset(_nb_levels - 1));
+			os.write(padding, (std::streamsize)(toc[0].offset - pos));
+			os.write(_arena->data(), (std::streamsize)_arena->levelsBytes());
+			pos = toc[first - 1].offset + toc[first - 1].length;
+		}
+		for (size_t ii = first; ii < toc.size(); ii++)
+		{
+			os.write(padding, (std::streamsize)(toc[ii].offset - pos));
+			os.write(static_cast<const char*>(payload[ii]), (std::streamsize)toc[ii].length);
+			pos = toc[ii].offset + toc[ii].length;
+		}
+	}
+
+	// read the rest of a v2 file, the magic has been consumed
+	void loadV2(std::istream& is)
+	{
+		mphf_file_header header;
+		memcpy(header.magic, mphf_file_magic, sizeof(header.magic));
+		is.read(reinterpret_cast<char*>(&header) + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+		if (!is)
+			throw std::runtime_error("Truncated mphf file");
+
+		if (header.nb_sections != mphf_nb_sections(header))
+			throw std::runtime_error("Corrupt mphf file: unexpected number of sections");
+		std::vector<mphf_file_section> toc(header.nb_sections);
+		is.read(reinterpret_cast<char*>(toc.data()), (std::streamsize)(toc.size() * sizeof(mphf_file_section)));
+		if (!is)
+			throw std::runtime_error("Truncated mphf file");
+		checkFileLayout(header, toc, UINT64_MAX);
+		loadHeader(header);
+		loadedSetup(&toc);
+
+		std::vector<final_key_t> final_keys;
+		std::vector<uint64_t> final_values;
+		std::vector<uint64_t> fingerprints;
+		uint32_t fingerprint_bits = 0;
+		uint64_t pos = sizeof(mphf_file_header) + toc.size() * sizeof(mphf_file_section);
+		size_t first = 0;
+		std::unique_ptr<level_arena> arena = arenaFor(toc);
+		if (arena)
+		{
+			// all the level sections in one read, straight into the arena
+			first = 2 * _nb_levels;
+			is.ignore((std::streamsize)(toc[0].offset - pos));
+			is.read(arena->data(), (std::streamsize)arena->levelsBytes());
+			if (!is)
+				throw std::runtime_error("Truncated mphf file");
+			for (size_t ii = 0; ii < first; ii++)
+			{
+				if ((header.flags & MPHF_FLAG_CRC32) && crc32(arena->data() + (toc[ii].offset - toc[0].offset), toc[ii].length) != toc[ii].crc)
+					throw std::runtime_error("Corrupt mphf file: section checksum mismatch");
+			}
+			arena->attach(_levels, true);
+			_arena = std::move(arena);
+			pos = toc[first - 1].offset + toc[first - 1].length;
+		}
+		for (size_t ii = first; ii < toc.size(); ii++)
+		{
+			const mphf_file_section& s = toc[ii];
+			is.ignore((std::streamsize)(s.offset - pos));
+			const void* data = nullptr;
+			checkSection(s);
+			switch (s.kind)
+			{
+				case MPHF_SECTION_LEVEL_BITS:
+					_levels[s.index].bitset.loadWords(is, s.aux);
+					data = _levels[s.index].bitset.words();
+					break;
+				case MPHF_SECTION_LEVEL_RANKS:
+					_levels[s.index].bitset.loadRanks(is, s.length / sizeof(uint64_t));
+					data = _levels[s.index].bitset.rankSamples();
+					break;
+				case MPHF_SECTION_FINAL_KEYS:
+					final_keys.resize(s.length / sizeof(final_key_t));
+					is.read(reinterpret_cast<char*>(final_keys.data()), (std::streamsize)s.length);
+					data = final_keys.data();
+					break;
+				case MPHF_SECTION_FINAL_VALUES:
+					final_values.resize(s.length / sizeof(uint64_t));
+					is.read(reinterpret_cast<char*>(final_values.data()), (std::streamsize)s.length);
+					data = final_values.data();
+					break;
+				case MPHF_SECTION_FINGERPRINTS:
+					fingerprints.resize(s.length / sizeof(uint64_t));
+					is.read(reinterpret_cast<char*>(fingerprints.data()), (std::streamsize)s.length);
+					data = fingerprints.data();
+					fingerprint_bits = (uint32_t)s.aux;
+					break;
+			}
+			if (!is)
+				throw std::runtime_error("Truncated mphf file");
+			if ((header.flags & MPHF_FLAG_CRC32) && crc32(data, s.length) != s.crc)
+				throw std::runtime_error("Corrupt mphf file: section checksum mismatch");
+			pos = s.offset + s.length;
+		}
+		_mapping.reset();
+
+		loadFinalHash(final_keys.data(), final_values.data(), final_keys.size(), final_values.size(), false, true);
+		if (fingerprint_bits > 0)
+			_fingerprints.assign(std::move(fingerprints), _nelem, fingerprint_bits);
+		_built = true;
+	}
+
+	// positional v1 load, false (nothing read past the level records) if a level is not sized as loadedSetup() sizes it
+	bool loadV1File(const positional_file& file, uint64_t file_size, int num_thread)
+	{
+		char header[MPHF_V1_HEADER_SIZE];
+		if (file_size < sizeof(header))
+			throw std::runtime_error("Truncated mphf file");
+		file.read(header, sizeof(header), 0);
+		memcpy(&_gamma, header, sizeof(_gamma));
+		memcpy(&_nb_levels, header + sizeof(_gamma), sizeof(_nb_levels));
+		memcpy(&_lastbitsetrank, header + sizeof(_gamma) + sizeof(_nb_levels), sizeof(_lastbitsetrank));
+		memcpy(&_nelem, header + sizeof(_gamma) + sizeof(_nb_levels) + sizeof(_lastbitsetrank), sizeof(_nelem));
+		_reduction = MPHF_REDUCE_MODULO;
+		_scheduled = false;
+		_fingerprints.clear();
+		_hot.clear();
+		checkLevelCount();
+		// each level takes at least 4 words, reject corrupt level counts before allocating
+		if (_nb_levels > (file_size - sizeof(header)) / (4 * sizeof(uint64_t)))
+			throw std::runtime_error("Truncated mphf file");
+		_levels.clear();
+		_levels.resize(_nb_levels);
+		_mapping.reset();
+		_arena.reset();
+		loadedSetup();
+
+		// walk the level records for the offsets of their words and ranks
+		std::vector<uint64_t> words_at(_nb_levels), ranks_at(_nb_levels);
+		uint64_t pos = sizeof(header);
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			uint64_t size = _levels[ii].hash_domain;
+			uint64_t record[2];
+			if (file_size - pos < sizeof(record) + sizeof(uint64_t))
+				throw std::runtime_error("Truncated mphf file");
+			file.read(record, sizeof(record), pos);
+			if (record[0] != size || record[1] != 1ULL + size / 64ULL)
+				return false;
+			words_at[ii] = pos + sizeof(record);
+			pos = words_at[ii] + record[1] * sizeof(uint64_t);
+			uint64_t nranks;
+			if (pos > file_size - sizeof(uint64_t))
+				throw std::runtime_error("Truncated mphf file");
+			file.read(&nranks, sizeof(nranks), pos);
+			if (nranks != bitVector::nbRankSamples(size))
+				return false;
+			ranks_at[ii] = pos + sizeof(uint64_t);
+			pos = ranks_at[ii] + nranks * sizeof(uint64_t);
+			if (pos > file_size)
+				throw std::runtime_error("Truncated mphf file");
+		}
+		uint64_t final_hash_size;
+		if (file_size - pos < sizeof(uint64_t))
+			throw std::runtime_error("Truncated mphf file");
+		file.read(&final_hash_size, sizeof(uint64_t), pos);
+		pos += sizeof(uint64_t);
+		if (final_hash_size > (file_size - pos) / v1_pair_size)
+			throw std::runtime_error("Truncated mphf file");
+
+		std::unique_ptr<level_arena> arena(new level_arena(_levels, 0));
+		std::vector<char> pairs(final_hash_size * v1_pair_size);
+		std::vector<mphf_io_range> ranges;
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			uint64_t size = _levels[ii].hash_domain;
+			ranges.push_back({words_at[ii], reinterpret_cast<char*>(arena->bits(ii)), level_arena::bitsBytes(size)});
+			ranges.push_back({ranks_at[ii], reinterpret_cast<char*>(arena->ranks(ii)), level_arena::ranksBytes(size)});
+		}
+		ranges.push_back({pos, pairs.data(), pairs.size()});
+		positional_io(file, ranges, false, num_thread);
+
+		arena->attach(_levels, true);
+		_arena = std::move(arena);
+		loadPackedFinalHash(pairs.data(), final_hash_size);
+		_built = true;
+		return true;
+	}
+
+	// positional v2 load, false (only the header and table of contents read) if the levels do not fit an arena
+	bool loadV2File(const positional_file& file, uint64_t file_size, int num_thread)
+	{
+		mphf_file_header header;
+		if (file_size < sizeof(header))
+			throw std::runtime_error("Truncated mphf file");
+		file.read(&header, sizeof(header), 0);
+		if (header.nb_sections != mphf_nb_sections(header) || (uint64_t)header.nb_sections * sizeof(mphf_file_section) > file_size - sizeof(header))
+			throw std::runtime_error("Corrupt mphf file: unexpected number of sections");
+		std::vector<mphf_file_section> toc(header.nb_sections);
+		file.read(toc.data(), toc.size() * sizeof(mphf_file_section), sizeof(header));
+		checkFileLayout(header, toc, file_size);
+		loadHeader(header);
+		loadedSetup(&toc);
+		std::unique_ptr<level_arena> arena = arenaFor(toc);
+		if (!arena)
+			return false;
+		for (const mphf_file_section& s : toc)
+			checkSection(s);
+
+		// levels in one range into the arena, then the final keys, values and fingerprints
+		size_t first = 2 * _nb_levels;
+		std::vector<final_key_t> final_keys(toc[first].length / sizeof(final_key_t));
+		std::vector<uint64_t> final_values(toc[first + 1].length / sizeof(uint64_t));
+		std::vector<uint64_t> fingerprints;
+		std::vector<char*> data(toc.size());
+		for (size_t ii = 0; ii < first; ii++)
+			data[ii] = arena->data() + (toc[ii].offset - toc[0].offset);
+		data[first] = reinterpret_cast<char*>(final_keys.data());
+		data[first + 1] = reinterpret_cast<char*>(final_values.data());
+		if (toc.size() > first + 2)
+		{
+			fingerprints.resize(toc[first + 2].length / sizeof(uint64_t));
+			data[first + 2] = reinterpret_cast<char*>(fingerprints.data());
+		}
+		std::vector<mphf_io_range> ranges;
+		ranges.push_back({toc[0].offset, arena->data(), arena->levelsBytes()});
+		for (size_t ii = first; ii < toc.size(); ii++)
+			ranges.push_back({toc[ii].offset, data[ii], toc[ii].length});
+		positional_io(file, ranges, false, num_thread);
+		if (header.flags & MPHF_FLAG_CRC32)
+		{
+			parallel_tasks(toc.size(), num_thread, [&](size_t ii)
+			               {
+				               if (crc32(data[ii], toc[ii].length) != toc[ii].crc)
+					               throw std::runtime_error("Corrupt mphf file: section checksum mismatch"); });
+		}
+
+		arena->attach(_levels, true);
+		_arena = std::move(arena);
+		_mapping.reset();
+		loadFinalHash(final_keys.data(), final_values.data(), final_keys.size(), final_values.size(), false, true);
+		if (toc.size() > first + 2)
+			_fingerprints.assign(std::move(fingerprints), _nelem, (uint32_t)toc[first + 2].aux);
+		_built = true;
+		return true;
+	}
+
+	// the v2 file is the length bytes at offset in the mapping (the whole file by default)
+	void mapV2(const std::shared_ptr<mapped_file>& mapping, bool verify, uint64_t offset = 0, uint64_t length = ULLONG_MAX)
+	{
+		const char* base = mapping->data() + offset;
+		uint64_t size = std::min<uint64_t>(length, mapping->size() - offset);
+		mphf_file_header header;
+		if (size < sizeof(header))
+			throw std::runtime_error("Truncated mphf file");
+		memcpy(&header, base, sizeof(header));
+		if (memcmp(header.magic, mphf_file_magic, sizeof(header.magic)) != 0)
+			throw std::runtime_error("Not an mphf v2 file");
+		if (header.nb_sections != mphf_nb_sections(header) || (uint64_t)header.nb_sections * sizeof(mphf_file_section) > size - sizeof(header))
+			throw std::runtime_error("Corrupt mphf file: unexpected number of sections");
+		std::vector<mphf_file_section> toc(header.nb_sections);
+		memcpy(toc.data(), base + sizeof(header), toc.size() * sizeof(mphf_file_section));
+		checkFileLayout(header, toc, size);
+		loadHeader(header);
+
+		std::vector<const uint64_t*> ranks(_nb_levels, nullptr);
+		std::vector<uint64_t> nranks(_nb_levels, 0);
+		const final_key_t* final_keys = nullptr;
+		const uint64_t* final_values = nullptr;
+		uint64_t nkeys = 0, nvalues = 0;
+		for (const mphf_file_section& s : toc)
+		{
+			checkSection(s);
+			const char* data = base + s.offset;
+			if (verify && (header.flags & MPHF_FLAG_CRC32) && crc32(data, s.length) != s.crc)
+				throw std::runtime_error("Corrupt mphf file: section checksum mismatch");
+			switch (s.kind)
+			{
+				case MPHF_SECTION_LEVEL_BITS:
+					// ranks come after the bits of their level
+					_levels[s.index].bitset.view(s.aux, reinterpret_cast<const uint64_t*>(data), nullptr, 0);
+					break;
+				case MPHF_SECTION_LEVEL_RANKS:
+					ranks[s.index] = reinterpret_cast<const uint64_t*>(data);
+					nranks[s.index] = s.length / sizeof(uint64_t);
+					break;
+				case MPHF_SECTION_FINAL_KEYS:
+					final_keys = reinterpret_cast<const final_key_t*>(data);
+					nkeys = s.length / sizeof(final_key_t);
+					break;
+				case MPHF_SECTION_FINAL_VALUES:
+					final_values = reinterpret_cast<const uint64_t*>(data);
+					nvalues = s.length / sizeof(uint64_t);
+					break;
+				case MPHF_SECTION_FINGERPRINTS:
+					_fingerprints.view(reinterpret_cast<const uint64_t*>(data), _nelem, (uint32_t)s.aux);
+					break;
+			}
+		}
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			const bitVector& bv = _levels[ii].bitset;
+			_levels[ii].bitset.view(bv.size(), bv.words(), ranks[ii], nranks[ii]);
+		}
+
+		loadedSetup(&toc);
+		loadFinalHash(final_keys, final_values, nkeys, nvalues, true, verify);
+		_mapping = mapping;
+		_built = true;
+	}
+
+	void loadHeader(const mphf_file_header& header)
+	{
+		// custom hashers are the caller's business, as in v1 files
+		if (mphf_hasher_id<Hasher_t>::value != MPHF_HASHER_CUSTOM && header.hasher_id != mphf_hasher_id<Hasher_t>::value)
+			throw std::runtime_error("mphf file was built with hasher id " + std::to_string(header.hasher_id) + ", this mphf hashes with id " + std::to_string(mphf_hasher_id<Hasher_t>::value));
+		_gamma = header.gamma;
+		_nb_levels = header.nb_levels;
+		_lastbitsetrank = header.lastbitsetrank;
+		_nelem = header.nelem;
+		_reduction = (header.flags & MPHF_FLAG_MULTIPLY_HIGH) ? MPHF_REDUCE_MULTIPLY : MPHF_REDUCE_MODULO;
+		_scheduled = (header.flags & MPHF_FLAG_LEVEL_DOMAINS) != 0;
+		_fingerprints.clear();
+		_hot.clear();
+		_stats = mphf_build_stats();
+		checkLevelCount();
+		_levels.clear();
+		_levels.resize(_nb_levels);
+		_arena.reset();
+	}
+
+	// arena for the levels of a v2 file whose level sections have the sizes of loadedSetup() and sit
+	// where level_arena puts them, relative to the first one ; nullptr otherwise (sections read one by one)
+	std::unique_ptr<level_arena> arenaFor(const std::vector<mphf_file_section>& toc) const
+	{
+		if (_nb_levels == 0)
+			return nullptr;
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			uint64_t size = _levels[ii].hash_domain;
+			if (toc[2 * ii].aux != size || toc[2 * ii].length != level_arena::bitsBytes(size) || toc[2 * ii + 1].length != level_arena::ranksBytes(size))
+				return nullptr;
+		}
+		std::unique_ptr<level_arena> arena(new level_arena(_levels, 0));
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			if (toc[2 * ii].offset - toc[0].offset != arena->bitsOffset(ii) || toc[2 * ii + 1].offset - toc[0].offset != arena->ranksOffset(ii))
+				return nullptr;
+		}
+		return arena;
+	}
+
+	void checkLevelCount() const
+	{
+		if (MaxLevels > 0 && _nb_levels != MaxLevels)
+			throw std::runtime_error("mphf file has " + std::to_string(_nb_levels) + " levels, this mphf is specialised for " + std::to_string(MaxLevels));
+	}
+
+	// packed level descriptors of the specialised lookup, the bitVector objects of _levels do not move once resized
+	void syncProbes()
+	{
+		if constexpr (MaxLevels > 0)
+		{
+			for (uint32_t ii = 0; ii < MaxLevels - 1; ii++)
+				_probes[ii] = level_probe{_levels[ii].reduce, &_levels[ii].bitset};
+		}
+	}
+
+	// MaxLevels > 0 : same result as the generic lookup
+	uint64_t lookupFixed(const elem_t& elem) const
+	{
+		hash_pair_t bbhash;
+		uint64_t pos = 0;
+		uint32_t level = probeFixed<0>(bbhash, elem, pos);
+		if (level == MaxLevels - 1)
+		{
+			uint64_t in_final = _final_hash.find(final_key_of(elem));
+			return in_final == ULLONG_MAX ? ULLONG_MAX : in_final + _lastbitsetrank;
+		}
+		return _probes[level].bits->rank(pos);
+	}
+
+	// lookupIndex with a hot key cache : level 0, the slot of elem, then the other levels
+	uint64_t lookupHot(const elem_t& elem) const
+	{
+		hash_pair_t bbhash;
+		uint64_t hash_raw = _hasher.h0(bbhash, elem);
+		if (_nb_levels > 1 && _levels[0].get(hash_raw))
+			return _levels[0].bitset.rank(_levels[0].reduce(hash_raw));
+		uint64_t idx;
+		if (_hot.find(final_key_of(elem), hash_raw, idx))
+			return idx;
+		for (uint32_t ii = 1; ii < _nb_levels - 1; ii++)
+		{
+			hash_raw = (ii == 1) ? _hasher.h1(bbhash, elem) : _hasher.next(bbhash);
+			if (_levels[ii].get(hash_raw))
+				return _levels[ii].bitset.rank(_levels[ii].reduce(hash_raw));
+		}
+		uint64_t in_final = _final_hash.find(final_key_of(elem));
+		return in_final == ULLONG_MAX ? ULLONG_MAX : in_final + _lastbitsetrank;
+	}
+
+	// crc32 of the final keys then values, tells the hot key cache file of this mphf from others of the same size
+	uint32_t finalCrc() const
+	{
+		uint32_t crc = crc32(_final_hash.keys(), _final_hash.size() * sizeof(final_key_t));
+		return crc32(_final_hash.values(), _final_hash.size() * sizeof(uint64_t), crc);
+	}
+
+	// level of elem looking from level ii on (MaxLevels - 1 : final table), pos its position in that level
+	template <uint32_t ii>
+	uint32_t probeFixed(hash_pair_t& bbhash, const elem_t& elem, uint64_t& pos) const
+	{
+		if constexpr (ii == MaxLevels - 1)
+			return ii;
+		else
+		{
+			uint64_t hash_raw;
+			if constexpr (ii == 0)
+				hash_raw = _hasher.h0(bbhash, elem);
+			else if constexpr (ii == 1)
+				hash_raw = _hasher.h1(bbhash, elem);
+			else
+				hash_raw = _hasher.next(bbhash);
+			pos = _probes[ii].reduce(hash_raw);
+			if (_probes[ii].bits->get(pos))
+				return ii;
+			return probeFixed<ii + 1>(bbhash, elem, pos);
+		}
+	}
+
+	// section sizes, kinds and order are checked by checkFileLayout
+	void checkSection(const mphf_file_section& s) const
+	{
+		bool ok = false;
+		switch (s.kind)
+		{
+			case MPHF_SECTION_LEVEL_BITS:
+				ok = s.length == (1ULL + s.aux / 64ULL) * sizeof(uint64_t);
+				break;
+			case MPHF_SECTION_LEVEL_RANKS:
+				ok = s.length % sizeof(uint64_t) == 0;
+				break;
+			case MPHF_SECTION_FINAL_KEYS:
+				ok = s.aux == sizeof(final_key_t) && s.length % sizeof(final_key_t) == 0;
+				break;
+			case MPHF_SECTION_FINAL_VALUES:
+				ok = s.length % sizeof(uint64_t) == 0;
+				break;
+			case MPHF_SECTION_FINGERPRINTS:
+				ok = s.aux >= 1 && s.aux <= MPHF_FINGERPRINT_BITS_MAX && s.length == fingerprint_array::nbWords(_nelem, (uint32_t)s.aux) * sizeof(uint64_t);
+				break;
+		}
+		if (!ok)
+			throw std::runtime_error("Corrupt mphf file: bad section " + std::to_string(s.kind) + "/" + std::to_string(s.index));
+	}
+
+	// sorted final keys and values of a v2 file, copied or used in place (aligned mapped sections)
+	void loadFinalHash(const final_key_t* keys, const uint64_t* values, uint64_t nkeys, uint64_t nvalues, bool in_place, bool check_order)
+	{
+		if (nkeys != nvalues)
+			throw std::runtime_error("Corrupt mphf file: final hash keys and values differ in size");
+		if (in_place)
+			_final_hash.view(keys, values, nkeys);
+		else
+			_final_hash.assign(keys, values, nkeys);
+		if (check_order && !_final_hash.sorted())
+			throw std::runtime_error("Corrupt mphf file: final hash keys are not sorted");
+	}
+
+	// mini setup after load/map, recompute size of each level (read from the toc of v2 files with MPHF_FLAG_LEVEL_DOMAINS)
+	void loadedSetup(const std::vector<mphf_file_section>* toc = nullptr)
+	{
+		_gammas.clear();
+		if (_scheduled)
+		{
+			for (uint32_t ii = 0; ii < _nb_levels; ii++)
+			{
+				uint64_t domain = toc ? (*toc)[2 * ii].aux : 0;
+				if (domain == 0 || domain % 64 != 0)
+					throw std::runtime_error("Corrupt mphf file: bad level size " + std::to_string(domain));
+			}
+		}
+		levelReach(_nb_levels);
+		setDomains(_scheduled ? toc : nullptr);
+		syncProbes();
+	}
+
+	// fraction of the keys in a level of gamma * n bits that collide
+	double collisionProbability(double gamma) const
+	{
+		return 1.0 - pow(((gamma * (double)_nelem - 1) / (gamma * (double)_nelem)), _nelem - 1);
+	}
+
+	double levelGamma(uint32_t ii) const
+	{
+		return _gammas.empty() ? _gamma : _gammas[std::min<size_t>(ii, _gammas.size() - 1)];
+	}
+
+	// _reach[ii] : expected fraction of the keys that reach level ii, p^ii for one gamma as in BBHash,
+	// the product of the collision probabilities of the levels before ii for a schedule
+	void levelReach(uint32_t nb_levels)
+	{
+		_proba_collision = collisionProbability(_gamma);
+		_reach.resize(nb_levels);
+		for (uint32_t ii = 0; ii < nb_levels; ii++)
+			_reach[ii] = _gammas.empty() ? pow(_proba_collision, ii) : (ii == 0 ? 1.0 : _reach[ii - 1] * collisionProbability(levelGamma(ii - 1)));
+	}
+
+	// level ii hashes into gamma_ii * n * _reach[ii] bits, or into the bits section sizes of toc
+	void setDomains(const std::vector<mphf_file_section>* toc)
+	{
+		uint64_t previous_idx = 0;
+		_hash_domain = (uint64_t)(ceil(double(_nelem) * _gamma));
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			//_levels[ii] = new level();
+			_levels[ii].idx_begin = previous_idx;
+			uint64_t hash_domain = _gammas.empty() ? _hash_domain : (uint64_t)(ceil(double(_nelem) * levelGamma(ii)));
+			// round size to nearest superior multiple of 64, makes it easier to clear a level
+			uint64_t domain = toc ? (*toc)[2 * ii].aux : (((uint64_t)(hash_domain * _reach[ii]) + 63) / 64) * 64;
+			_levels[ii].setDomain(domain == 0 ? 64 : domain, _reduction);
+			previous_idx += _levels[ii].hash_domain;
+		}
+	}
+
+	// schedule errors are the caller's : std::invalid_argument
+	void checkSchedule(const mphf_level_schedule& schedule) const
+	{
+		for (double gamma : schedule.gammas)
+		{
+			if (!(gamma > 0.0 && gamma < HUGE_VAL))
+				throw std::invalid_argument("Level gammas must be > 0");
+		}
+		if (schedule.max_levels == 1)
+			throw std::invalid_argument("An mphf has at least one level before the final table");
+		if (MaxLevels > 0 && schedule.max_levels != 0 && schedule.max_levels != MaxLevels)
+			throw std::invalid_argument("This mphf is specialised for " + std::to_string(MaxLevels) + " levels");
+	}
+
+	void setup(const mphf_level_schedule& schedule)
+	{
+		// process and building thread in the name : concurrent builds do not share level files
+		uint64_t tid_hash = std::hash<std::thread::id>{}(std::this_thread::get_id());
+		_levelFilePrefix = _tmpdir + "/temp_p" + std::to_string(process_id()) + "_" + std::to_string(tid_hash) + "_level_";
+
+		_cptTotalProcessed.store(0, std::memory_order_relaxed);
+
+		if (_fastmode)
+		{
+			setLevelFastmode.resize(std::min(_percent_elem_loaded_for_fastMode, 1.0f) * (double)_nelem);
+		}
+
+		bufferperThread.resize(_num_thread);
+		_finalKeysPerThread.assign(_num_thread, std::vector<final_key_t>());
+		if (_writeEachLevel)
+		{
+			for (uint32_t ii = 0; ii < _num_thread; ii++)
+			{
+				bufferperThread[ii].resize(NBBUFF);
+			}
+		}
+
+		// one gamma repeated is the BBHash schedule, sized and saved as such
+		_gammas = schedule.gammas;
+		if (!_gammas.empty() && std::all_of(_gammas.begin(), _gammas.end(), [&](double g)
+		                                    { return g == _gammas[0]; }))
+		{
+			_gamma = _gammas[0];
+			_gammas.clear();
+		}
+		else if (!_gammas.empty())
+			_gamma = _gammas[0];
+		_scheduled = !_gammas.empty();
+
+		// the last level is the final table's : it stops at the first one fewer than min_keys keys reach
+		uint32_t max_levels = MaxLevels > 0 ? MaxLevels : (schedule.max_levels > 0 ? schedule.max_levels : MPHF_NB_LEVELS);
+		levelReach(max_levels);
+		_nb_levels = max_levels;
+		for (uint32_t ii = 1; ii < max_levels; ii++)
+		{
+			if (double(_nelem) * _reach[ii] < double(schedule.min_keys))
+			{
+				_nb_levels = ii + 1;
+				break;
+			}
+		}
+		if (MaxLevels > 0 && _nb_levels != MaxLevels)
+			throw std::invalid_argument("min_keys leaves " + std::to_string(_nb_levels) + " levels, this mphf is specialised for " + std::to_string(MaxLevels));
+		_levels.resize(_nb_levels);
+
+		// build levels
+		setDomains(nullptr);
+		syncProbes();
+
+		_fastModeLevel = (int)_nb_levels;
+		for (uint32_t ii = 0; ii < _nb_levels; ii++)
+		{
+			if (_reach[ii] < _percent_elem_loaded_for_fastMode || _percent_elem_loaded_for_fastMode >= 1.0)
+			{
+				_fastModeLevel = ii;
+				break;
+			}
+		}
+		if (_fastModeLevel == (int)_nb_levels) // too few levels for the fraction to fit : no fast mode
+		{
+			_fastmode = false;
+			std::vector<level_entry>().swap(setLevelFastmode);
+		}
+
+		_stats = mphf_build_stats();
+		_stats.levels.resize(_nb_levels);
+		_stats.fast_mode_level = _fastmode ? _fastModeLevel : -1;
+
+		// all the level bitsets, and the collision bitset sized for the largest level (level 0 unless gammas grow)
+		uint64_t largest = 0;
+		for (const level& lv : _levels)
+			largest = std::max(largest, lv.hash_domain);
+		_arena.reset(new level_arena(_levels, largest));
+		_arena->attach(_levels, false);
+	}
+
+	// compute level and returns hash of last level reached
+	uint64_t getLevel(hash_pair_t& bbhash, const elem_t& val, int* res_level, int maxlevel = 100, int minlevel = 0) const
+	// uint64_t getLevel(hash_pair_t & bbhash, elem_t val,int * res_level, int maxlevel = 100, int minlevel =0)
+
+	{
+		int level = 0;
+		uint64_t hash_raw = 0;
+
+		for (int ii = 0; ii < (int)_nb_levels - 1 && ii < maxlevel; ii++)
+		{
+
+			// calc le hash suivant
+			if (ii == 0)
+				hash_raw = _hasher.h0(bbhash, val);
+			else if (ii == 1)
+				hash_raw = _hasher.h1(bbhash, val);
+			else
+			{
+				hash_raw = _hasher.next(bbhash);
+			}
+
+			if (ii >= minlevel && _levels[ii].get(hash_raw)) //
+			// if(  _levels[ii].get(hash_raw) ) //
+
+			{
+				break;
+			}
+
+			level++;
+		}
+
+		*res_level = level;
+		return hash_raw;
+	}
+
+	// OR the threads' private bitsets into the level bitset and _tempBitset :
+	// a bit seen by two threads, or twice by one, is a collision
+	void mergePrivateBits(int i)
+	{
+		if (_privateBits.empty())
+			return;
+		uint64_t nwords = _levels[i].hash_domain / 64;
+		for (uint64_t w = 0; w < nwords; w++)
+		{
+			uint64_t once = 0;
+			uint64_t twice = 0;
+			for (const auto& bits : _privateBits)
+			{
+				twice |= (once & bits[w]) | bits[nwords + w];
+				once |= bits[w];
+			}
+			_levels[i].bitset.set64(w, once);
+			_tempBitset->set64(w, twice);
+		}
+		_privateBits.clear();
+	}
+
+	// file of the keys thread tid saw reach level i
+	std::string levelFileName(int i, uint32_t tid) const
+	{
+		return _levelFilePrefix + std::to_string(i) + "_t" + std::to_string(tid) + ".tmp";
+	}
+
+	std::vector<std::string> levelFileNames(int i) const
+	{
+		std::vector<std::string> names;
+		for (uint32_t ii = 0; ii < _num_thread; ii++)
+			names.push_back(levelFileName(i, ii));
+		return names;
+	}
+
+	void removeLevelFiles(int i)
+	{
+		for (const std::string& fname : levelFileNames(i))
+			std::remove(fname.c_str());
+	}
+
+	// false if a file could not be flushed
+	bool closeLevelFiles()
+	{
+		bool ok = true;
+		for (FILE* f : _levelFiles)
+		{
+			if (f != nullptr && fclose(f) != 0)
+				ok = false;
+		}
+		_levelFiles.clear();
+		return ok;
+	}
+
+	// append the n keys of buff to the level file of thread tid, only that thread writes to it (no lock)
+	void writeLevelFile(uint32_t tid, const std::vector<level_entry>& buff, uint64_t& n)
+	{
+		if (fwrite(buff.data(), sizeof(level_entry), n, _levelFiles[tid]) != n)
+			_levelFileFailed.store(true, std::memory_order_relaxed);
+		_spillBytesWritten.fetch_add(n * sizeof(level_entry), std::memory_order_relaxed);
+		n = 0;
+	}
+
+	// insert into bitarray
+	void insertIntoLevel(uint64_t level_hash, int i, int tid)
+	{
+		//	uint64_t hashl =  level_hash % _levels[i].hash_domain;
+		uint64_t hashl = _levels[i].reduce(level_hash);
+
+		if (!_privateBits.empty())
+		{
+			// seen words then collision words, plain stores : only this thread touches them
+			std::vector<uint64_t>& bits = _privateBits[tid];
+			uint64_t nwords = bits.size() / 2;
+			uint64_t mask = 1ULL << (hashl & 63);
+			bits[nwords + (hashl >> 6)] |= bits[hashl >> 6] & mask;
+			bits[hashl >> 6] |= mask;
+			return;
+		}
+
+		if (_levels[i].bitset.atomic_test_and_set(hashl))
+		{
+			_tempBitset->atomic_test_and_set(hashl);
+		}
+	}
+
+	// loop to insert into level i
+	template <typename Range>
+	void processLevel(Range const& input_range, int i)
+	{
+		// small domain : each thread fills its own bitsets, no atomic traffic on shared words
+		// (last level inserts no bits)
+		uint64_t nwords = _levels[i].hash_domain / 64;
+		if (_num_thread > 1 && i < (int)_nb_levels - 1 && _num_thread * 2 * nwords * sizeof(uint64_t) <= MPHF_PRIVATE_BITS_MAX)
+			_privateBits.assign(_num_thread, std::vector<uint64_t>(2 * nwords, 0));
+		else
+			_privateBits.clear();
+
+		if (_writeEachLevel && i < (int)_nb_levels - 1 && i > 0) // create the level files, one per thread
+		{
+			_levelFileFailed.store(false, std::memory_order_relaxed);
+			_levelFiles.assign(_num_thread, nullptr);
+			for (uint32_t ii = 0; ii < _num_thread; ii++)
+			{
+				std::string fname = levelFileName(i, ii);
+				_levelFiles[ii] = std::fopen(fname.c_str(), "wb");
+				if (_levelFiles[ii] == nullptr)
+				{
+					closeLevelFiles();
+					removeLevelFiles(i);
+					removeLevelFiles(i - 1);
+					throw std::runtime_error("Error creating level file " + fname);
+				}
+				// threads write NBBUFF elems at a time, no point copying through the stdio buffer
+				setvbuf(_levelFiles[ii], NULL, _IONBF, 0);
+			}
+		}
+
+		_cptLevel.store(0, std::memory_order_relaxed);
+		uint64_t processed_before = _cptTotalProcessed.load(std::memory_order_relaxed);
+		_spillBytesWritten.store(0, std::memory_order_relaxed);
+		_chunkCursor.store(0, std::memory_order_relaxed);
+		_idxLevelsetLevelFastmode.store(0, std::memory_order_relaxed);
+		if (_fastmode && i > _fastModeLevel && i < (int)_nb_levels - 1)
+		{
+			// keys of setLevelFastmode not placed by level i-1 all reach level i
+			setLevelFastmodeNext.resize(setLevelFastmode.size() - _nbPlacedPrevLevel);
+		}
+		_nb_living.store(0, std::memory_order_relaxed);
+		// create  threads
+		std::vector<std::thread> tab_threads;
+		tab_threads.reserve(_num_thread);
+		typedef decltype(input_range.begin()) it_type;
+		thread_args<Range, it_type> t_arg; // meme arg pour tous
+		t_arg.boophf = this;
+		t_arg.range = &input_range;
+		t_arg.it_p = std::static_pointer_cast<void>(std::make_shared<it_type>(input_range.begin()));
+		t_arg.until_p = std::static_pointer_cast<void>(std::make_shared<it_type>(input_range.end()));
+
+		t_arg.level = i;
+
+		if (_writeEachLevel && (i > 1))
+		{
+
+			file_binary<level_entry> level_files(levelFileNames(i - 1));
+
+			// each thread holds one block while the reader fills the other two
+			block_reader<level_entry> reader(level_files, _num_thread + 2);
+
+			for (uint32_t ii = 0; ii < _num_thread; ii++)
+			{
+				tab_threads.emplace_back([this, &reader, i]()
+				                         { pthread_processBlocks(reader, i); });
+			}
+
+			// must join here before the block is closed and file_binary is destroyed (and closes the file)
+			for (auto& t : tab_threads)
+			{
+				t.join();
+			}
+
+			if (reader.failed())
+				_levelFileFailed.store(true, std::memory_order_relaxed);
+		}
+
+		else
+		{
+			if (_fastmode && i >= (_fastModeLevel + 1))
+			{
+
+				/* we'd like to do t_arg.it = data_iterator.begin() but types are different;
+				 so, casting to (void*) because of that; and we remember the type in the template */
+				typedef decltype(setLevelFastmode.begin()) fastmode_it_type;
+				t_arg.it_p = std::static_pointer_cast<void>(std::make_shared<fastmode_it_type>(setLevelFastmode.begin()));
+				t_arg.until_p = std::static_pointer_cast<void>(std::make_shared<fastmode_it_type>(setLevelFastmode.end()));
+
+				/* we'd like to do t_arg.it = data_iterator.begin() but types are different;
+				 so, casting to (void*) because of that; and we remember the type in the template */
+
+				for (uint32_t ii = 0; ii < _num_thread; ii++)
+				{
+					// 创建每个线程独立的参数副本，防止竞态
+					thread_args<Range, it_type>* my_arg = new thread_args<Range, it_type>(t_arg);
+					tab_threads.emplace_back([my_arg]()
+					                         {
+							thread_processLevel<elem_t, Hasher_t, MaxLevels, Range, it_type, fastmode_it_type>(my_arg);
+							delete my_arg; });
+				}
+			}
+			else
+			{
+				for (uint32_t ii = 0; ii < _num_thread; ii++)
+				{
+					// 创建每个线程独立的参数副本，防止竞态
+					thread_args<Range, it_type>* my_arg = new thread_args<Range, it_type>(t_arg);
+					tab_threads.emplace_back([my_arg]()
+					                         {
+							thread_processLevel<elem_t, Hasher_t, MaxLevels, Range, it_type>(my_arg);
+							delete my_arg; });
+				}
+			}
+			// joining
+			for (auto& t : tab_threads)
+			{
+				t.join();
+			}
+		}
+		mergePrivateBits(i);
+
+		mphf_level_stats& stats = _stats.levels[i];
+		stats.keys_in = _cptLevel.load(std::memory_order_relaxed);
+		stats.keys_read = _cptTotalProcessed.load(std::memory_order_relaxed) - processed_before;
+		stats.spill_bytes_written = _spillBytesWritten.load(std::memory_order_relaxed);
+		if (_writeEachLevel && i > 1)
+			stats.spill_bytes_read = stats.keys_read * sizeof(level_entry);
+
+		if (_fastmode && i == _fastModeLevel) // shrink to actual number of elements in set
+		{
+			setLevelFastmode.resize(_idxLevelsetLevelFastmode);
+		}
+		else if (_fastmode && i > _fastModeLevel && i < (int)_nb_levels - 1) // level i+1 reads the keys that reached level i
+		{
+			assert(_idxLevelsetLevelFastmode == setLevelFastmodeNext.size());
+			setLevelFastmode.swap(setLevelFastmodeNext);
+		}
+
+		if (_writeEachLevel)
+		{
+			bool failed = !closeLevelFiles() || _levelFileFailed.load(std::memory_order_relaxed);
+
+			if (i > 1) // level i-1 has been read back
+			{
+				removeLevelFiles(i - 1);
+			}
+
+			if (failed)
+			{
+				removeLevelFiles(i);
+				throw std::runtime_error("Error writing or reading level files in " + _tmpdir);
+			}
+		}
+	}
+
+  private:
+	// level ** _levels;
+	std::vector<level> _levels;
+	std::array<level_probe, (MaxLevels > 1 ? MaxLevels - 1 : 1)> _probes; // levels before the final table, MaxLevels > 0 only
+	uint32_t _nb_levels = 0;
+	MultiHasher_t _hasher;
+	bitVector* _tempBitset = nullptr;
+	std::unique_ptr<level_arena> _arena; // level bitsets of builds and v2 loads, see level_arena
+
+	double _gamma;
+	uint64_t _hash_domain;
+	uint64_t _nelem = 0;
+	final_table<final_key_t> _final_hash;
+	fingerprint_array _fingerprints; // optional, see addFingerprints
+	hot_key_table<final_key_t> _hot; // optional, see buildHotCache
+	std::vector<std::vector<final_key_t>> _finalKeysPerThread; // filled by the last level during construction, one per thread
+	std::vector<std::vector<uint64_t>> _privateBits;      // per thread bits of the level being built, empty when it uses the shared bitset
+	progress_reporter _progress;
+	std::atomic<uint32_t> _nb_living{0};
+	uint32_t _num_thread;
+	std::atomic<uint64_t> _chunkCursor{0}; // next elem to hand out, random access inputs
+	double _proba_collision;
+	std::vector<double> _gammas; // uneven level gammas of a build (mphf_level_schedule), empty : _gamma for all levels
+	std::vector<double> _reach;  // expected fraction of the keys reaching each level, see levelReach
+	bool _scheduled = false;     // level sizes do not follow from _gamma (MPHF_FLAG_LEVEL_DOMAINS)
+	uint64_t _lastbitsetrank = 0;
+	std::atomic<uint64_t> _idxLevelsetLevelFastmode;
+	std::atomic<uint64_t> _cptLevel{0};          // keys that reached the level being built
+	std::atomic<uint64_t> _cptTotalProcessed{0}; // keys read by all the levels so far
+	std::atomic<uint64_t> _spillBytesWritten{0}; // to the level files of the level being built
+	mphf_build_stats _stats;                     // see build_stats()
+
+	// fast build mode , requires  that _percent_elem_loaded_for_fastMode %   elems are loaded in ram
+	float _percent_elem_loaded_for_fastMode;
+	bool _fastmode;
+	std::vector<level_entry> setLevelFastmode;     // keys that reached the previous level (from _fastModeLevel on)
+	std::vector<level_entry> setLevelFastmodeNext; // keys that reach the level being built, swapped with setLevelFastmode after it
+	uint64_t _nbPlacedPrevLevel = 0;
+
+	std::vector<std::vector<level_entry>> bufferperThread;
+
+	int _fastModeLevel = 0;
+	bool _withprogress;
+	mphf_reduction _reduction = MPHF_REDUCE_MODULO;
+	std::string _tmpdir = "."; // where writeEach puts its level files
+	bool _built = false;
+	bool _writeEachLevel;
+	std::string _levelFilePrefix;
+	std::vector<FILE*> _levelFiles; // per thread, level being built
+	std::atomic<bool> _levelFileFailed{false};
+	std::shared_ptr<mapped_file> _mapping; // set by map(), keeps the level bitsets valid
+
+  public:
+	std::mutex _mutex;
+};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark threading
+////////////////////////////////////////////////////////////////
+
+// level_it_type : type of the iterator held by targ->it_p (input range, fastmode set or level file)
+template <typename elem_t, typename Hasher_t, uint32_t MaxLevels, typename Range, typename it_type, typename level_it_type>
+void thread_processLevel(thread_args<Range, it_type>* targ)
+{
+	if (targ == nullptr)
+		return;
+
+	auto* obw = static_cast<mphf<elem_t, Hasher_t, MaxLevels>*>(targ->boophf);
+	int level = targ->level;
+
+	std::vector<elem_t> buffer(NBBUFF);
+
+	std::shared_ptr<level_it_type> startit;
+	std::shared_ptr<level_it_type> until_p;
+
+	{
+		std::lock_guard<std::mutex> lock(obw->_mutex);
+		startit = std::static_pointer_cast<level_it_type>(targ->it_p);
+		until_p = std::static_pointer_cast<level_it_type>(targ->until_p);
+	}
+
+	obw->pthread_processLevel(buffer, startit, until_p, level);
+}
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark parallel lookups
+////////////////////////////////////////////////////////////////
+
+// keys taken by a lookup_pool worker at a time ; batches of at most this many keys are looked up by the caller
+#define MPHF_LOOKUP_CHUNK 16384
+
+// persistent threads for the batched lookups of one mphf, each batch is cut in MPHF_LOOKUP_CHUNK keys handed
+// out by an atomic cursor. With numa_replicas on a host of several NUMA nodes (numa_nodes()), the workers are
+// spread over the nodes and pinned to their cpus, and each node gets a copy of the mphf loaded by one of its
+// workers, so that first touch puts its pages on the node : the workers of a node only read its copy.
+// The mphf must outlive the pool and not change while the pool is used ; concurrent batches run one at a time.
+template <typename mphf_t>
+class lookup_pool
+{
+  public:
+	lookup_pool(const mphf_t& m, int num_thread, bool numa_replicas = false) : _mphf(m), _num_thread(std::max(num_thread, 1))
+	{
+		std::vector<std::vector<int>> nodes = numa_nodes();
+		std::string image; // the v2 bytes of m, loaded by each node
+		if (numa_replicas && nodes.size() > 1)
+		{
+			std::ostringstream os;
+			m.save(os, MPHF_FORMAT_V2, false);
+			image = os.str();
+			_replicas.resize(std::min<size_t>(nodes.size(), _num_thread));
+		}
+
+		// the first worker of each node loads its replica, the pool is ready when all the workers are
+		_pending = _num_thread;
+		for (int ii = 0; ii < _num_thread; ii++)
+		{
+			size_t node = _replicas.empty() ? 0 : ii % _replicas.size();
+			const std::vector<int>* cpus = _replicas.empty() ? nullptr : &nodes[node];
+			const std::string* replica_image = (_replicas.empty() || (size_t)ii >= _replicas.size()) ? nullptr : &image;
+			_workers.emplace_back([this, node, cpus, replica_image]()
+			                      { work(node, cpus, replica_image); });
+		}
+		wait();
+		if (_error)
+		{
+			stop();
+			std::rethrow_exception(_error);
+		}
+	}
+
+	~lookup_pool() { stop(); }
+
+	lookup_pool(const lookup_pool&) = delete;
+	lookup_pool& operator=(const lookup_pool&) = delete;
+
+	// same results as mphf_t::lookup(keys, nkeys, out)
+	template <typename elem_t>
+	void lookup(const elem_t* keys, size_t nkeys, uint64_t* out)
+	{
+		std::lock_guard<std::mutex> batch_lock(_batch_mutex);
+		if (nkeys <= MPHF_LOOKUP_CHUNK && _replicas.empty())
+		{
+			_mphf.lookup(keys, nkeys, out);
+			return;
+		}
+		_cursor.store(0, std::memory_order_relaxed);
+		_batch = [keys, nkeys, out, this](const mphf_t& m)
+		{
+			for (;;)
+			{
+				size_t start = _cursor.fetch_add(MPHF_LOOKUP_CHUNK, std::memory_order_relaxed);
+				if (start >= nkeys)
+					break;
+				m.lookup(keys + start, std::min<size_t>(MPHF_LOOKUP_CHUNK, nkeys - start), out + start);
+			}
+		};
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_pending = _num_thread;
+			_generation++;
+		}
+		_wake.notify_all();
+		wait();
+		_batch = nullptr;
+		if (_error)
+		{
+			std::exception_ptr error = _error;
+			_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	int nbThreads() const { return _num_thread; }
+	size_t nbReplicas() const { return _replicas.size(); }
+
+  private:
+	void work(size_t node, const std::vector<int>* cpus, const std::string* image)
+	{
+		if (cpus != nullptr)
+			pin_thread(*cpus);
+		if (image != nullptr)
+		{
+			try
+			{
+				std::unique_ptr<mphf_t> replica(new mphf_t());
+				std::istringstream is(*image);
+				replica->load(is);
+				replica->setHotCache(_mphf.hotCache());
+				_replicas[node] = std::move(replica);
+			}
+			catch (...)
+			{
+				fail(std::current_exception());
+			}
+		}
+		uint64_t seen = 0;
+		done();
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [&]
+				           { return _stop || _generation != seen; });
+				if (_stop)
+					return;
+				seen = _generation;
+			}
+			try
+			{
+				_batch(_replicas.empty() ? _mphf : *_replicas[node]);
+			}
+			catch (...)
+			{
+				fail(std::current_exception());
+			}
+			done();
+		}
+	}
+
+	void fail(std::exception_ptr error)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_error)
+			_error = error;
+	}
+
+	void done()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (--_pending == 0)
+			_finished.notify_all();
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_finished.wait(lock, [&]
+		               { return _pending == 0; });
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_wake.notify_all();
+		for (auto& t : _workers)
+			t.join();
+		_workers.clear();
+	}
+
+	const mphf_t& _mphf;
+	int _num_thread;
+	std::vector<std::unique_ptr<mphf_t>> _replicas; // one per node with numa_replicas, else empty
+	std::vector<std::thread> _workers;
+	std::mutex _batch_mutex; // one batch at a time
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _finished;
+	uint64_t _generation = 0;
+	int _pending = 0;
+	bool _stop = false;
+	std::exception_ptr _error;
+	std::function<void(const mphf_t&)> _batch;
+	std::atomic<size_t> _cursor{0};
+};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark sharded mphf
+////////////////////////////////////////////////////////////////
+
+// default number of keys per shard : level 0 of a shard (gamma 2) and its collision bitset take 512 KiB
+#define MPHF_SHARD_KEYS (1ULL << 20)
+#define MPHF_SHARD_SEED 0x6666666699999999ULL // not one of the XorshiftHashFunctors seeds
+#define MPHF_SHARD_LOOKUP_BLOCK (1 << 16) // keys grouped by shard per block in batched lookups
+
+// keys are bucketed by a hash of their own into nb_shards independent mphf, built concurrently
+// lookup = shard select, lookup in the shard, plus the number of keys of the shards before it
+template <typename elem_t, typename Hasher_t>
+class sharded_mphf
+{
+  public:
+	typedef mphf<elem_t, Hasher_t> shard_t;
+
+	sharded_mphf() : _offsets(1, 0)
+	{
+	}
+
+	// nb_shards = 0 : one shard per MPHF_SHARD_KEYS keys
+	// num_thread shards are built at a time, each on one thread ; shard keys are in ram, so perc_elem_loaded defaults to 1
+	template <typename Range>
+	sharded_mphf(uint64_t n, Range const& input_range, uint32_t nb_shards = 0, int num_thread = 1, double gamma = 2.0, float perc_elem_loaded = 1.0f, mphf_reduction reduction = MPHF_REDUCE_MODULO) : _offsets(1, 0)
+	{
+		if (n == 0)
+			return;
+		if (nb_shards == 0)
+			nb_shards = static_cast<uint32_t>(std::max<uint64_t>(1, (n + MPHF_SHARD_KEYS - 1) / MPHF_SHARD_KEYS));
+		if (num_thread < 1)
+			throw std::invalid_argument("num_thread must be >= 1");
+
+		std::vector<std::vector<elem_t>> keys(nb_shards);
+		for (auto& shard_keys : keys)
+			shard_keys.reserve(n / nb_shards + n / nb_shards / 16 + 16);
+		for (const elem_t& key : input_range)
+			keys[shard_of(key, nb_shards)].push_back(key);
+
+		_shards.resize(nb_shards);
+		std::atomic<uint32_t> next(0);
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		auto build = [&]()
+		{
+			for (uint32_t s; (s = next.fetch_add(1, std::memory_order_relaxed)) < nb_shards;)
+			{
+				try
+				{
+					if (!keys[s].empty())
+						_shards[s].reset(new shard_t(keys[s].size(), keys[s], 1, gamma, false, false, perc_elem_loaded, reduction));
+					std::vector<elem_t>().swap(keys[s]);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(error_mutex);
+					if (!error)
+						error = std::current_exception();
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int t = 1; t < std::min<int>(num_thread, nb_shards); t++)
+			threads.emplace_back(build);
+		build();
+		for (auto& t : threads)
+			t.join();
+		if (error)
+			std::rethrow_exception(error);
+
+		setOffsets();
+	}
+
+	// merge step of a distributed build : shards[s] was built (anywhere) from the keys with shard_of(key, shards.size()) == s,
+	// nullptr for an empty shard
+	explicit sharded_mphf(std::vector<std::unique_ptr<shard_t>> shards) : _shards(std::move(shards))
+	{
+		setOffsets();
+	}
+
+	static uint32_t shard_of(const elem_t& key, uint32_t nb_shards)
+	{
+		static const Hasher_t hasher;
+		return static_cast<uint32_t>(multiply_high64(hasher(key, MPHF_SHARD_SEED), nb_shards));
+	}
+
+	uint64_t lookup(const elem_t& key) const
+	{
+		if (_shards.empty())
+			return ULLONG_MAX;
+		uint32_t s = shard_of(key, nbShards());
+		if (!_shards[s])
+			return ULLONG_MAX;
+		uint64_t idx = _shards[s]->lookup(key);
+		return idx == ULLONG_MAX ? ULLONG_MAX : _offsets[s] + idx;
+	}
+
+	// keys are grouped by shard one block at a time (counting sort on shard_of), each group goes
+	// through the batched lookup of its shard, then the indices are written back with the shard offset
+	void lookup(const elem_t* keys, size_t nkeys, uint64_t* out) const
+	{
+		uint32_t nb = nbShards();
+		if (nb == 0)
+		{
+			std::fill(out, out + nkeys, ULLONG_MAX);
+			return;
+		}
+		size_t block = std::min<size_t>(nkeys, MPHF_SHARD_LOOKUP_BLOCK);
+		std::vector<uint32_t> shard_ids(block);
+		std::vector<uint32_t> order(block); // position in the block of each grouped key
+		std::vector<elem_t> grouped(block);
+		std::vector<uint64_t> found(block);
+		std::vector<size_t> starts(nb + 1);
+		std::vector<size_t> next(nb);
+		for (size_t first = 0; first < nkeys; first += block)
+		{
+			size_t nblock = std::min(block, nkeys - first);
+			std::fill(starts.begin(), starts.end(), 0);
+			for (size_t ii = 0; ii < nblock; ii++)
+			{
+				shard_ids[ii] = shard_of(keys[first + ii], nb);
+				starts[shard_ids[ii] + 1]++;
+			}
+			for (uint32_t s = 0; s < nb; s++)
+			{
+				starts[s + 1] += starts[s];
+				next[s] = starts[s];
+			}
+			for (size_t ii = 0; ii < nblock; ii++)
+			{
+				size_t pos = next[shard_ids[ii]]++;
+				grouped[pos] = keys[first + ii];
+				order[pos] = static_cast<uint32_t>(ii);
+			}
+			for (uint32_t s = 0; s < nb; s++)
+			{
+				size_t len = starts[s + 1] - starts[s];
+				if (len == 0)
+					continue;
+				if (_shards[s])
+					_shards[s]->lookup(grouped.data() + starts[s], len, found.data() + starts[s]);
+				else
+					std::fill(found.begin() + starts[s], found.begin() + starts[s + 1], ULLONG_MAX);
+			}
+			for (size_t pos = 0; pos < nblock; pos++)
+			{
+				uint32_t ii = order[pos];
+				out[first + ii] = found[pos] == ULLONG_MAX ? ULLONG_MAX : _offsets[shard_ids[ii]] + found[pos];
+			}
+		}
+	}
+
+	uint64_t nbKeys() const { return _offsets.back(); }
+
+	uint32_t nbShards() const { return static_cast<uint32_t>(_shards.size()); }
+
+	// nullptr for an empty shard
+	const shard_t* shard(uint32_t s) const { return _shards[s].get(); }
+
+	bool built() const { return !_shards.empty(); }
+
+	// shards plus the offsets table
+	uint64_t totalBitSize()
+	{
+		uint64_t totalsize = _offsets.size() * sizeof(uint64_t) * 8;
+		for (auto& shard : _shards)
+		{
+			if (shard)
+				totalsize += shard->totalBitSize();
+		}
+		return totalsize;
+	}
+
+	void save(std::ostream& os, bool checksum = true) const
+	{
+		// shards are serialized first, their sizes give the positions
+		std::vector<std::string> blobs(_shards.size());
+		std::vector<uint64_t> positions(_shards.size() + 1);
+		uint64_t pos = sizeof(mphf_sharded_header) + 2 * (_shards.size() + 1) * sizeof(uint64_t);
+		for (size_t s = 0; s < _shards.size(); s++)
+		{
+			if (_shards[s])
 			{
-				break;
+				std::ostringstream blob;
+				_shards[s]->save(blob, MPHF_FORMAT_V2, checksum);
+				blobs[s] = blob.str();
+				pos = (pos + MPHF_SECTION_ALIGN - 1) / MPHF_SECTION_ALIGN * MPHF_SECTION_ALIGN;
 			}
+			positions[s] = pos;
+			pos += blobs[s].size();
+		}
+		positions.back() = pos;
+
+		mphf_sharded_header header = {};
+		memcpy(header.magic, mphf_sharded_magic, sizeof(header.magic));
+		header.version = MPHF_SHARDED_VERSION;
+		header.nb_shards = nbShards();
+		header.nelem = nbKeys();
+		header.table_crc = crc32(positions.data(), positions.size() * sizeof(uint64_t), crc32(_offsets.data(), _offsets.size() * sizeof(uint64_t)));
+
+		os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		os.write(reinterpret_cast<char const*>(_offsets.data()), (std::streamsize)(_offsets.size() * sizeof(uint64_t)));
+		os.write(reinterpret_cast<char const*>(positions.data()), (std::streamsize)(positions.size() * sizeof(uint64_t)));
+		pos = sizeof(mphf_sharded_header) + 2 * (_shards.size() + 1) * sizeof(uint64_t);
+		static const char padding[MPHF_SECTION_ALIGN] = {0};
+		for (size_t s = 0; s < _shards.size(); s++)
+		{
+			os.write(padding, (std::streamsize)(positions[s] - pos));
+			os.write(blobs[s].data(), (std::streamsize)blobs[s].size());
+			pos = positions[s] + blobs[s].size();
+		}
+	}
 
-			level++;
+	void load(std::istream& is)
+	{
+		mphf_sharded_header header;
+		is.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!is)
+			throw std::runtime_error("Truncated sharded mphf file");
+		if (memcmp(header.magic, mphf_sharded_magic, sizeof(header.magic)) != 0)
+			throw std::runtime_error("Not a sharded mphf file");
+		if (header.version != MPHF_SHARDED_VERSION)
+			throw std::runtime_error("Unsupported sharded mphf version " + std::to_string(header.version));
+
+		std::vector<uint64_t> offsets(header.nb_shards + 1ULL);
+		std::vector<uint64_t> positions(header.nb_shards + 1ULL);
+		is.read(reinterpret_cast<char*>(offsets.data()), (std::streamsize)(offsets.size() * sizeof(uint64_t)));
+		is.read(reinterpret_cast<char*>(positions.data()), (std::streamsize)(positions.size() * sizeof(uint64_t)));
+		if (!is)
+			throw std::runtime_error("Truncated sharded mphf file");
+		if (crc32(positions.data(), positions.size() * sizeof(uint64_t), crc32(offsets.data(), offsets.size() * sizeof(uint64_t))) != header.table_crc)
+			throw std::runtime_error("Corrupt sharded mphf file: table checksum mismatch");
+
+		std::vector<std::unique_ptr<shard_t>> shards(header.nb_shards);
+		uint64_t pos = sizeof(mphf_sharded_header) + 2 * offsets.size() * sizeof(uint64_t);
+		for (uint32_t s = 0; s < header.nb_shards; s++)
+		{
+			if (positions[s] < pos || positions[s + 1] < positions[s] || offsets[s + 1] < offsets[s])
+				throw std::runtime_error("Corrupt sharded mphf file: shard out of bounds");
+			if (positions[s + 1] == positions[s])
+				continue;
+			is.ignore((std::streamsize)(positions[s] - pos));
+			std::string blob(positions[s + 1] - positions[s], '\0');
+			is.read(&blob[0], (std::streamsize)blob.size());
+			if (!is)
+				throw std::runtime_error("Truncated sharded mphf file");
+			std::istringstream shard_is(blob);
+			shards[s].reset(new shard_t());
+			shards[s]->load(shard_is);
+			if (shards[s]->nbKeys() != offsets[s + 1] - offsets[s])
+				throw std::runtime_error("Corrupt sharded mphf file: shard size mismatch");
+			pos = positions[s + 1];
 		}
+		if (offsets.back() != header.nelem)
+			throw std::runtime_error("Corrupt sharded mphf file: key count mismatch");
+		_shards = std::move(shards);
+		_offsets = std::move(offsets);
+	}
 
-		*res_level = level;
-		return hash_raw;
+  private:
+	void setOffsets()
+	{
+		_offsets.assign(_shards.size() + 1, 0);
+		for (size_t s = 0; s < _shards.size(); s++)
+			_offsets[s + 1] = _offsets[s] + (_shards[s] ? _shards[s]->nbKeys() : 0);
 	}
 
-	// insert into bitarray
-	void insertIntoLevel(uint64_t level_hash, int i)
+	std::vector<std::unique_ptr<shard_t>> _shards;
+	std::vector<uint64_t> _offsets; // _offsets[s] : number of keys in shards 0..s-1, nb_shards + 1 entries
+};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark overlay mphf
+////////////////////////////////////////////////////////////////
+
+// shouldCompact() defaults : deltas probed by a key outside the base, delta keys per base key
+#define MPHF_OVERLAY_MAX_DELTAS 8
+#define MPHF_OVERLAY_MAX_DELTA_FRACTION 0.25
+#define MPHF_OVERLAY_FILTER_BITS 16 // override filter bits per override, ~1/16 of the hits search the override table
+
+// a base mphf plus delta mphf built over keys added later, delta d holds indices [nbKeys() before it, nbKeys() after it)
+// every segment has fingerprints, so a segment rejects keys it was not built from with probability 1 - 2^-bits
+// and lookup = the first segment accepting the key, base first
+// new keys an older segment accepts anyway get their index from a small exact override table
+template <typename elem_t, typename Hasher_t>
+class overlay_mphf
+{
+	typedef typename mphf_final_key<elem_t>::type final_key_t;
+
+  public:
+	typedef mphf<elem_t, Hasher_t> segment_t;
+
+	overlay_mphf() : _offsets(1, 0)
 	{
-		//	uint64_t hashl =  level_hash % _levels[i].hash_domain;
-		uint64_t hashl = fastrange64(level_hash, _levels[i].hash_domain);
+	}
 
-		if (_levels[i].bitset.atomic_test_and_set(hashl))
+	// base over input_range, with fingerprint_bits fingerprints (the deltas get as many)
+	template <typename Range>
+	overlay_mphf(uint64_t n, Range const& input_range, int num_thread = 1, double gamma = 2.0, uint32_t fingerprint_bits = 8, mphf_reduction reduction = MPHF_REDUCE_MODULO) : _offsets(1, 0)
+	{
+		std::unique_ptr<segment_t> base(new segment_t(n, input_range, num_thread, gamma, false, false, 1.0f, reduction));
+		base->addFingerprints(input_range, fingerprint_bits, num_thread);
+		_segments.push_back(std::move(base));
+		setOffsets();
+	}
+
+	// base built elsewhere, throws invalid_argument if it has no fingerprints
+	explicit overlay_mphf(std::unique_ptr<segment_t> base) : _offsets(1, 0)
+	{
+		if (!base || base->fingerprintBits() == 0)
+			throw std::invalid_argument("The base of an overlay mphf needs fingerprints");
+		_segments.push_back(std::move(base));
+		setOffsets();
+	}
+
+	// delta over n keys that are not in the overlay yet, they get indices nbKeys() .. nbKeys() + n - 1
+	// (existing indices do not change). Keys are held in ram for the build and the fingerprints.
+	template <typename Range>
+	void append(uint64_t n, Range const& input_range, int num_thread = 1, double gamma = 2.0)
+	{
+		if (_segments.empty())
+			throw std::invalid_argument("Append to an overlay mphf without a base");
+		if (n == 0)
+			return;
+		std::vector<elem_t> keys;
+		keys.reserve(n);
+		for (const elem_t& key : input_range)
+			keys.push_back(key);
+		if (keys.size() != n)
+			throw std::invalid_argument("Appended key count mismatch");
+
+		std::unique_ptr<segment_t> delta(new segment_t(n, keys, num_thread, gamma, false, false, 1.0f, _segments[0]->reduction()));
+		delta->addFingerprints(keys, _segments[0]->fingerprintBits(), num_thread);
+
+		// new keys accepted by an older segment would resolve there, they move to the override table
+		std::vector<uint64_t> found(n);
+		lookup(keys.data(), keys.size(), found.data());
+		std::vector<std::pair<final_key_t, uint64_t>> entries;
+		for (uint64_t ii = 0; ii < n; ii++)
 		{
-			_tempBitset->atomic_test_and_set(hashl);
+			if (found[ii] != ULLONG_MAX)
+				entries.emplace_back(mphf_final_key<elem_t>::of(keys[ii]), nbKeys() + delta->lookup(keys[ii]));
+		}
+		if (!entries.empty())
+		{
+			for (uint64_t ii = 0; ii < _overrides.size(); ii++)
+				entries.emplace_back(_overrides.keys()[ii], _overrides.values()[ii]);
+			_overrides.build(entries);
+			buildFilter();
 		}
+		_segments.push_back(std::move(delta));
+		setOffsets();
 	}
 
-	// loop to insert into level i
+	// single base mphf over all the keys (input_range holds the n == nbKeys() keys of the overlay, an mphf does not
+	// store them). Const, so lookups can go on while it runs on another thread ; indices differ from this overlay's.
 	template <typename Range>
-	void processLevel(Range const& input_range, int i)
+	overlay_mphf compact(uint64_t n, Range const& input_range, int num_thread = 1, double gamma = 2.0) const
 	{
-		////alloc the bitset for this level
-		_levels[i].bitset = bitVector(_levels[i].hash_domain);
-		;
-
-		// printf("---process level %i   wr %i fast %i ---\n",i,_writeEachLevel,_fastmode);
+		if (n != nbKeys())
+			throw std::invalid_argument("Compaction needs the " + std::to_string(nbKeys()) + " keys of the overlay");
+		return overlay_mphf(n, input_range, num_thread, gamma, fingerprintBits(), reduction());
+	}
 
-		std::string fname_old = "temp_p" + std::to_string(_pid) + "_level_" + std::to_string(i - 2) + ".tmp";
-		std::string fname_curr = "temp_p" + std::to_string(_pid) + "_level_" + std::to_string(i) + ".tmp";
-		std::string fname_prev = "temp_p" + std::to_string(_pid) + "_level_" + std::to_string(i - 1) + ".tmp";
+	// every delta is one more probe for keys outside the base
+	bool shouldCompact(uint32_t max_deltas = MPHF_OVERLAY_MAX_DELTAS, double max_delta_fraction = MPHF_OVERLAY_MAX_DELTA_FRACTION) const
+	{
+		return nbDeltas() > max_deltas || (double)deltaKeys() > max_delta_fraction * (double)baseKeys();
+	}
 
-		if (_writeEachLevel)
+	uint64_t lookup(const elem_t& key) const
+	{
+		for (size_t s = 0; s < _segments.size(); s++)
 		{
-			// file management :
+			uint64_t idx = _segments[s]->lookup(key);
+			if (idx != ULLONG_MAX)
+				return overridden(key, _offsets[s] + idx);
+		}
+		return ULLONG_MAX;
+	}
 
-			if (i > 2) // delete previous file
+	// the base looks up every key, each delta the keys the segments before it rejected
+	void lookup(const elem_t* keys, size_t nkeys, uint64_t* out) const
+	{
+		if (_segments.empty())
+		{
+			std::fill(out, out + nkeys, ULLONG_MAX);
+			return;
+		}
+		_segments[0]->lookup(keys, nkeys, out);
+		std::vector<size_t> missed;
+		for (size_t ii = 0; ii < nkeys; ii++)
+		{
+			if (out[ii] == ULLONG_MAX)
+				missed.push_back(ii);
+		}
+		std::vector<elem_t> pending;
+		std::vector<uint64_t> found;
+		for (size_t s = 1; s < _segments.size() && !missed.empty(); s++)
+		{
+			pending.clear();
+			for (size_t ii : missed)
+				pending.push_back(keys[ii]);
+			found.resize(pending.size());
+			_segments[s]->lookup(pending.data(), pending.size(), found.data());
+			size_t left = 0;
+			for (size_t jj = 0; jj < missed.size(); jj++)
 			{
-				std::remove(fname_old.c_str());
+				if (found[jj] != ULLONG_MAX)
+					out[missed[jj]] = _offsets[s] + found[jj];
+				else
+					missed[left++] = missed[jj];
 			}
-
-			if (i < _nb_levels - 1 && i > 0) // create curr file
+			missed.resize(left);
+		}
+		if (_overrides.size() > 0)
+		{
+			for (size_t ii = 0; ii < nkeys; ii++)
 			{
-				_currlevelFile = std::fopen(fname_curr.c_str(), "w");
+				if (out[ii] != ULLONG_MAX)
+					out[ii] = overridden(keys[ii], out[ii]);
 			}
 		}
+	}
 
-		_cptLevel = 0;
-		_hashidx.store(0, std::memory_order_relaxed);
-		_idxLevelsetLevelFastmode.store(0, std::memory_order_relaxed);
-		_nb_living.store(0, std::memory_order_relaxed);
-		// create  threads
-		std::vector<std::thread> tab_threads;
-		tab_threads.reserve(_num_thread);
-		typedef decltype(input_range.begin()) it_type;
-		thread_args<Range, it_type> t_arg; // meme arg pour tous
-		t_arg.boophf = this;
-		t_arg.range = &input_range;
-		t_arg.it_p = std::static_pointer_cast<void>(std::make_shared<it_type>(input_range.begin()));
-		t_arg.until_p = std::static_pointer_cast<void>(std::make_shared<it_type>(input_range.end()));
+	uint64_t nbKeys() const { return _offsets.back(); }
 
-		t_arg.level = i;
+	uint64_t baseKeys() const { return _offsets.size() > 1 ? _offsets[1] : 0; }
 
-		if (_writeEachLevel && (i > 1))
-		{
+	uint64_t deltaKeys() const { return nbKeys() - baseKeys(); }
 
-			auto data_iterator_level = file_binary<elem_t>(fname_prev);
+	uint32_t nbSegments() const { return static_cast<uint32_t>(_segments.size()); }
 
-			typedef decltype(data_iterator_level.begin()) disklevel_it_type;
+	uint32_t nbDeltas() const { return _segments.empty() ? 0 : nbSegments() - 1; }
 
-			// data_iterator_level.begin();
-			t_arg.it_p = std::static_pointer_cast<void>(std::make_shared<disklevel_it_type>(data_iterator_level.begin()));
-			t_arg.until_p = std::static_pointer_cast<void>(std::make_shared<disklevel_it_type>(data_iterator_level.end()));
+	// 0 is the base
+	const segment_t* segment(uint32_t s) const { return _segments[s].get(); }
 
-			for (uint32_t ii = 0; ii < _num_thread; ii++)
-			{
-				// 创建每个线程独立的参数副本，防止竞态
-				thread_args<Range, it_type>* my_arg = new thread_args<Range, it_type>(t_arg);
-				tab_threads.emplace_back([my_arg]()
-				                         {
-						thread_processLevel<elem_t, Hasher_t, Range, it_type>(my_arg);
-						delete my_arg; });
-			}
+	const final_table<final_key_t>& overrides() const { return _overrides; }
 
-			// must join here before the block is closed and file_binary is destroyed (and closes the file)
-			for (auto& t : tab_threads)
-			{
-				t.join();
-			}
+	uint32_t fingerprintBits() const { return _segments.empty() ? 0 : _segments[0]->fingerprintBits(); }
+
+	mphf_reduction reduction() const { return _segments.empty() ? MPHF_REDUCE_MODULO : _segments[0]->reduction(); }
+
+	bool built() const { return !_segments.empty(); }
+
+	// segments plus the offsets and override tables
+	uint64_t totalBitSize()
+	{
+		uint64_t totalsize = _offsets.size() * sizeof(uint64_t) * 8 + _overrides.bitSize();
+		for (auto& segment : _segments)
+			totalsize += segment->totalBitSize();
+		return totalsize;
+	}
+
+	void save(std::ostream& os, bool checksum = true) const
+	{
+		uint64_t nover = _overrides.size();
+		uint64_t table_end = sizeof(mphf_overlay_header) + 2 * (_segments.size() + 1) * sizeof(uint64_t) + nover * (sizeof(final_key_t) + sizeof(uint64_t));
+		std::vector<std::string> blobs(_segments.size());
+		std::vector<uint64_t> positions(_segments.size() + 1);
+		uint64_t pos = table_end;
+		for (size_t s = 0; s < _segments.size(); s++)
+		{
+			std::ostringstream blob;
+			_segments[s]->save(blob, MPHF_FORMAT_V2, checksum);
+			blobs[s] = blob.str();
+			pos = (pos + MPHF_SECTION_ALIGN - 1) / MPHF_SECTION_ALIGN * MPHF_SECTION_ALIGN;
+			positions[s] = pos;
+			pos += blobs[s].size();
+		}
+		positions.back() = pos;
+
+		mphf_overlay_header header = {};
+		memcpy(header.magic, mphf_overlay_magic, sizeof(header.magic));
+		header.version = MPHF_OVERLAY_VERSION;
+		header.nb_segments = nbSegments();
+		header.nelem = nbKeys();
+		header.nb_overrides = nover;
+		uint32_t crc = crc32(_offsets.data(), _offsets.size() * sizeof(uint64_t));
+		crc = crc32(positions.data(), positions.size() * sizeof(uint64_t), crc);
+		crc = crc32(_overrides.keys(), nover * sizeof(final_key_t), crc);
+		header.table_crc = crc32(_overrides.values(), nover * sizeof(uint64_t), crc);
+
+		os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		os.write(reinterpret_cast<char const*>(_offsets.data()), (std::streamsize)(_offsets.size() * sizeof(uint64_t)));
+		os.write(reinterpret_cast<char const*>(positions.data()), (std::streamsize)(positions.size() * sizeof(uint64_t)));
+		os.write(reinterpret_cast<char const*>(_overrides.keys()), (std::streamsize)(nover * sizeof(final_key_t)));
+		os.write(reinterpret_cast<char const*>(_overrides.values()), (std::streamsize)(nover * sizeof(uint64_t)));
+		pos = table_end;
+		static const char padding[MPHF_SECTION_ALIGN] = {0};
+		for (size_t s = 0; s < _segments.size(); s++)
+		{
+			os.write(padding, (std::streamsize)(positions[s] - pos));
+			os.write(blobs[s].data(), (std::streamsize)blobs[s].size());
+			pos = positions[s] + blobs[s].size();
 		}
+	}
 
-		else
+	void load(std::istream& is)
+	{
+		mphf_overlay_header header;
+		is.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!is)
+			throw std::runtime_error("Truncated overlay mphf file");
+		if (memcmp(header.magic, mphf_overlay_magic, sizeof(header.magic)) != 0)
+			throw std::runtime_error("Not an overlay mphf file");
+		if (header.version != MPHF_OVERLAY_VERSION)
+			throw std::runtime_error("Unsupported overlay mphf version " + std::to_string(header.version));
+		if (header.nb_segments == 0 || header.nb_overrides > header.nelem)
+			throw std::runtime_error("Corrupt overlay mphf file: bad header");
+
+		std::vector<uint64_t> offsets(header.nb_segments + 1ULL);
+		std::vector<uint64_t> positions(header.nb_segments + 1ULL);
+		std::vector<final_key_t> override_keys(header.nb_overrides);
+		std::vector<uint64_t> override_values(header.nb_overrides);
+		is.read(reinterpret_cast<char*>(offsets.data()), (std::streamsize)(offsets.size() * sizeof(uint64_t)));
+		is.read(reinterpret_cast<char*>(positions.data()), (std::streamsize)(positions.size() * sizeof(uint64_t)));
+		is.read(reinterpret_cast<char*>(override_keys.data()), (std::streamsize)(override_keys.size() * sizeof(final_key_t)));
+		is.read(reinterpret_cast<char*>(override_values.data()), (std::streamsize)(override_values.size() * sizeof(uint64_t)));
+		if (!is)
+			throw std::runtime_error("Truncated overlay mphf file");
+		uint32_t crc = crc32(offsets.data(), offsets.size() * sizeof(uint64_t));
+		crc = crc32(positions.data(), positions.size() * sizeof(uint64_t), crc);
+		crc = crc32(override_keys.data(), override_keys.size() * sizeof(final_key_t), crc);
+		if (crc32(override_values.data(), override_values.size() * sizeof(uint64_t), crc) != header.table_crc)
+			throw std::runtime_error("Corrupt overlay mphf file: table checksum mismatch");
+
+		std::vector<std::unique_ptr<segment_t>> segments(header.nb_segments);
+		uint64_t pos = sizeof(mphf_overlay_header) + 2 * offsets.size() * sizeof(uint64_t) + header.nb_overrides * (sizeof(final_key_t) + sizeof(uint64_t));
+		for (uint32_t s = 0; s < header.nb_segments; s++)
 		{
-			if (_fastmode && i >= (_fastModeLevel + 1))
-			{
+			if (positions[s] < pos || positions[s + 1] <= positions[s] || offsets[s + 1] < offsets[s])
+				throw std::runtime_error("Corrupt overlay mphf file: segment out of bounds");
+			is.ignore((std::streamsize)(positions[s] - pos));
+			std::string blob(positions[s + 1] - positions[s], '\0');
+			is.read(&blob[0], (std::streamsize)blob.size());
+			if (!is)
+				throw std::runtime_error("Truncated overlay mphf file");
+			std::istringstream segment_is(blob);
+			segments[s].reset(new segment_t());
+			segments[s]->load(segment_is);
+			if (segments[s]->nbKeys() != offsets[s + 1] - offsets[s])
+				throw std::runtime_error("Corrupt overlay mphf file: segment size mismatch");
+			if (segments[s]->fingerprintBits() == 0)
+				throw std::runtime_error("Corrupt overlay mphf file: segment without fingerprints");
+			pos = positions[s + 1];
+		}
+		if (offsets[0] != 0 || offsets.back() != header.nelem)
+			throw std::runtime_error("Corrupt overlay mphf file: key count mismatch");
+		final_table<final_key_t> overrides;
+		overrides.assign(override_keys.data(), override_values.data(), header.nb_overrides);
+		if (!overrides.sorted())
+			throw std::runtime_error("Corrupt overlay mphf file: override keys are not sorted");
+		_segments = std::move(segments);
+		_offsets = std::move(offsets);
+		_overrides = overrides;
+		buildFilter();
+	}
 
-				/* we'd like to do t_arg.it = data_iterator.begin() but types are different;
-				 so, casting to (void*) because of that; and we remember the type in the template */
-				typedef decltype(setLevelFastmode.begin()) fastmode_it_type;
-				t_arg.it_p = std::static_pointer_cast<void>(std::make_shared<fastmode_it_type>(setLevelFastmode.begin()));
-				t_arg.until_p = std::static_pointer_cast<void>(std::make_shared<fastmode_it_type>(setLevelFastmode.end()));
+  private:
+	void setOffsets()
+	{
+		_offsets.assign(_segments.size() + 1, 0);
+		for (size_t s = 0; s < _segments.size(); s++)
+			_offsets[s + 1] = _offsets[s] + _segments[s]->nbKeys();
+	}
 
-				/* we'd like to do t_arg.it = data_iterator.begin() but types are different;
-				 so, casting to (void*) because of that; and we remember the type in the template */
+	static uint64_t filterHash(const final_key_t& key, uint32_t shift)
+	{
+		return (std::hash<final_key_t>()(key) * 0x9E3779B97F4A7C15ULL) >> shift;
+	}
 
-				for (uint32_t ii = 0; ii < _num_thread; ii++)
-				{
-					// 创建每个线程独立的参数副本，防止竞态
-					thread_args<Range, it_type>* my_arg = new thread_args<Range, it_type>(t_arg);
-					tab_threads.emplace_back([my_arg]()
-					                         {
-							thread_processLevel<elem_t, Hasher_t, Range, it_type>(my_arg);
-							delete my_arg; });
-				}
-			}
-			else
-			{
-				for (uint32_t ii = 0; ii < _num_thread; ii++)
-				{
-					// 创建每个线程独立的参数副本，防止竞态
-					thread_args<Range, it_type>* my_arg = new thread_args<Range, it_type>(t_arg);
-					tab_threads.emplace_back([my_arg]()
-					                         {
-							thread_processLevel<elem_t, Hasher_t, Range, it_type>(my_arg);
-							delete my_arg; });
-				}
-			}
-			// joining
-			for (auto& t : tab_threads)
-			{
-				t.join();
-			}
+	// one bit per hashed override key, every hit tests it (L1 resident) before searching the table
+	void buildFilter()
+	{
+		uint32_t log2 = 6;
+		while ((1ULL << log2) < MPHF_OVERLAY_FILTER_BITS * _overrides.size())
+			log2++;
+		_filter_shift = 64 - log2;
+		_filter.assign((1ULL << log2) / 64, 0);
+		for (uint64_t ii = 0; ii < _overrides.size(); ii++)
+		{
+			uint64_t bit = filterHash(_overrides.keys()[ii], _filter_shift);
+			_filter[bit >> 6] |= 1ULL << (bit & 63);
 		}
-		// printf("\ngoing to level %i  : %llu elems  %.2f %%  expected : %.2f %% \n",i,_cptLevel,100.0* _cptLevel/(float)_nelem,100.0* pow(_proba_collision,i) );
+	}
 
-		// printf("\ncpt total processed %llu \n",_cptTotalProcessed);
-		if (_fastmode && i == _fastModeLevel) // shrink to actual number of elements in set
+	// idx found for key, or its override (only keys some segment accepts are overridden)
+	uint64_t overridden(const elem_t& key, uint64_t idx) const
+	{
+		if (_overrides.size() == 0)
+			return idx;
+		final_key_t fkey = mphf_final_key<elem_t>::of(key);
+		uint64_t bit = filterHash(fkey, _filter_shift);
+		if (!(_filter[bit >> 6] & (1ULL << (bit & 63))))
+			return idx;
+		uint64_t over = _overrides.find(fkey);
+		return over == ULLONG_MAX ? idx : over;
+	}
+
+	std::vector<std::unique_ptr<segment_t>> _segments;
+	std::vector<uint64_t> _offsets; // _offsets[s] : number of keys in segments 0..s-1, nb_segments + 1 entries
+	final_table<final_key_t> _overrides; // new keys an older segment accepts -> their index
+	std::vector<uint64_t> _filter;       // hashed override keys, rebuilt on load
+	uint32_t _filter_shift = 58;
+};
+
+////////////////////////////////////////////////////////////////
+// #pragma mark -
+// #pragma mark static map
+////////////////////////////////////////////////////////////////
+
+// read-only key -> value map : an mphf over the keys (without fingerprints) and one packed slot per mphf index,
+// the value of its key in the low value_bits bits and an optional fingerprint_bits fingerprint above them.
+// A get is the mphf lookup (level 0 for most keys) plus one slot read, which also checks the fingerprint.
+// Keys not in the map get the missing value with probability 1 - 2^-fingerprint_bits, otherwise (and always
+// without fingerprints) some value of the map, unless they reach the final table.
+template <typename elem_t, typename value_t, typename Hasher_t>
+class static_map
+{
+	static_assert(std::is_integral<value_t>::value && std::is_unsigned<value_t>::value, "static_map values are unsigned integers");
+
+  public:
+	typedef mphf<elem_t, Hasher_t> mphf_t;
+
+	static_map() : _mphf(new mphf_t())
+	{
+	}
+
+	// the n distinct keys of input_range, values[ii] the value of its ii-th key, input_range is read twice
+	// (the second pass split among num_thread threads when it is random access). value_bits + fingerprint_bits
+	// is at most 64, throws invalid_argument for other widths, a value that does not fit in value_bits bits
+	// or keys that do not fill n distinct slots (duplicates, the mphf build rejects them first).
+	template <typename Range>
+	static_map(uint64_t n, Range const& input_range, const value_t* values, uint32_t value_bits = 8 * sizeof(value_t), uint32_t fingerprint_bits = 0, int num_thread = 1, double gamma = 2.0, mphf_reduction reduction = MPHF_REDUCE_MODULO)
+	{
+		checkWidths(value_bits, fingerprint_bits);
+		for (uint64_t ii = 0; value_bits < 64 && ii < n; ii++)
 		{
-			// printf("\nresize setLevelFastmode to %lli \n",_idxLevelsetLevelFastmode);
-			setLevelFastmode.resize(_idxLevelsetLevelFastmode);
+			if ((uint64_t)values[ii] >> value_bits)
+				throw std::invalid_argument("Value " + std::to_string((uint64_t)values[ii]) + " does not fit in " + std::to_string(value_bits) + " bits");
 		}
+		_mphf.reset(new mphf_t(n, input_range, num_thread, gamma, false, false, 1.0f, reduction));
+		_value_bits = value_bits;
+		_fingerprint_bits = fingerprint_bits;
+		if (n == 0)
+			return;
 
-		if (_writeEachLevel)
+		std::vector<std::atomic<uint64_t>> words(fingerprint_array::nbWords(n, slotBits()));
+		bitVector seen(n);
+		std::atomic<bool> unknown(false);
+		std::atomic<bool> duplicate(false);
+		typedef decltype(input_range.begin()) it_type;
+		it_type first = input_range.begin();
+		if constexpr (std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<it_type>::iterator_category>::value)
+		{
+			uint64_t nthreads = std::max(1, num_thread);
+			std::vector<std::thread> threads;
+			for (uint64_t t = 1; t < nthreads; t++)
+				threads.emplace_back([&, t]
+				                     { fillSlots(first + n * t / nthreads, first + n * (t + 1) / nthreads, n * (t + 1) / nthreads - n * t / nthreads, values + n * t / nthreads, words.data(), seen, unknown, duplicate); });
+			fillSlots(first, first + n / nthreads, n / nthreads, values, words.data(), seen, unknown, duplicate);
+			for (auto& th : threads)
+				th.join();
+		}
+		else
+		{
+			fillSlots(first, input_range.end(), n, values, words.data(), seen, unknown, duplicate);
+		}
+		if (duplicate.load())
+			throw std::invalid_argument("Duplicate keys: two keys map to the same slot");
+		if (unknown.load())
+			throw std::invalid_argument("Key count mismatch, or keys that the mphf does not map");
+
+		std::vector<uint64_t> packed(words.size());
+		for (size_t ii = 0; ii < words.size(); ii++)
+			packed[ii] = words[ii].load(std::memory_order_relaxed);
+		_slots.assign(std::move(packed), n, slotBits());
+	}
+
+	// true and the value of key, false when the fingerprint rejects key
+	bool find(const elem_t& key, value_t& value) const
+	{
+		uint64_t idx = _mphf->lookup(key);
+		return idx != ULLONG_MAX && accept(key, _slots.get(idx), value);
+	}
+
+	value_t get(const elem_t& key, value_t missing = 0) const
+	{
+		value_t value;
+		return find(key, value) ? value : missing;
+	}
+
+	// batched get : the mphf lookups of NBLOOKUPBATCH keys go together, then their slots are prefetched and read.
+	// found (optional) gets 1 for the keys found, 0 for the others (their value is missing)
+	void get(const elem_t* keys, size_t nkeys, value_t* out, value_t missing = 0, uint8_t* found = nullptr) const
+	{
+		uint64_t idx[NBLOOKUPBATCH];
+		for (size_t start = 0; start < nkeys; start += NBLOOKUPBATCH)
 		{
-			if (i < _nb_levels - 1 && i > 0)
+			size_t nb = std::min<size_t>(NBLOOKUPBATCH, nkeys - start);
+			_mphf->lookup(keys + start, nb, idx);
+			for (size_t jj = 0; jj < nb; jj++)
 			{
-				fflush(_currlevelFile);
-				fclose(_currlevelFile);
+				if (idx[jj] != ULLONG_MAX)
+					_slots.prefetch(idx[jj]);
 			}
-
-			if (i == _nb_levels - 1) // delete last file
+			for (size_t jj = 0; jj < nb; jj++)
 			{
-				std::remove(fname_prev.c_str());
+				value_t value;
+				bool ok = idx[jj] != ULLONG_MAX && accept(keys[start + jj], _slots.get(idx[jj]), value);
+				out[start + jj] = ok ? value : missing;
+				if (found)
+					found[start + jj] = ok ? 1 : 0;
 			}
 		}
 	}
 
-  private:
-	// level ** _levels;
-	std::vector<level> _levels;
-	uint32_t _nb_levels;
-	MultiHasher_t _hasher;
-	bitVector* _tempBitset;
+	uint64_t nbKeys() const { return _mphf->nbKeys(); }
 
-	double _gamma;
-	uint64_t _hash_domain;
-	uint64_t _nelem;
-	std::unordered_map<elem_t, uint64_t, Hasher_t> _final_hash;
-	Progress _progressBar;
-	std::atomic<uint32_t> _nb_living{0};
-	uint32_t _num_thread;
-	std::atomic<uint64_t> _hashidx{0};
-	double _proba_collision;
-	uint64_t _lastbitsetrank;
-	std::atomic<uint64_t> _idxLevelsetLevelFastmode;
-	uint64_t _cptLevel;
-	uint64_t _cptTotalProcessed;
+	uint32_t valueBits() const { return _value_bits; }
 
-	// fast build mode , requires  that _percent_elem_loaded_for_fastMode %   elems are loaded in ram
-	float _percent_elem_loaded_for_fastMode;
-	bool _fastmode;
-	std::vector<elem_t> setLevelFastmode;
-	//	std::vector< elem_t > setLevelFastmode_next; // todo shrinker le set e nram a chaque niveau  ?
+	uint32_t fingerprintBits() const { return _fingerprint_bits; }
 
-	std::vector<std::vector<elem_t>> bufferperThread;
+	bool built() const { return _mphf->built(); }
 
-	int _fastModeLevel;
-	bool _withprogress;
-	bool _built;
-	bool _writeEachLevel;
-	FILE* _currlevelFile;
-	int _pid;
+	bool mapped() const { return _mapping != nullptr; }
 
-  public:
-	std::mutex _mutex;
-};
+	// the mphf of the keys, lookup() gives the slot of a key (its hot key cache speeds up gets too)
+	mphf_t& index() { return *_mphf; }
+	const mphf_t& index() const { return *_mphf; }
 
-////////////////////////////////////////////////////////////////
-// #pragma mark -
-// #pragma mark threading
-////////////////////////////////////////////////////////////////
+	const fingerprint_array& slots() const { return _slots; }
 
-template <typename elem_t, typename Hasher_t, typename Range, typename it_type>
-void thread_processLevel(thread_args<Range, it_type>* targ)
-{
-	if (targ == nullptr)
-		return;
+	// mphf plus slots, about (mphf bits per key + value_bits + fingerprint_bits) per key
+	uint64_t totalBitSize() const { return _mphf->totalBitSize() + _slots.bitSize(); }
 
-	auto* obw = static_cast<mphf<elem_t, Hasher_t>*>(targ->boophf);
-	int level = targ->level;
+	void save(std::ostream& os, bool checksum = true) const
+	{
+		std::ostringstream blob;
+		_mphf->save(blob, MPHF_FORMAT_V2, checksum);
+		std::string image = blob.str();
+
+		mphf_map_header header = {};
+		memcpy(header.magic, mphf_map_magic, sizeof(header.magic));
+		header.version = MPHF_MAP_VERSION;
+		header.value_bits = _value_bits;
+		header.fingerprint_bits = _fingerprint_bits;
+		header.slots_crc = crc32(_slots.words(), _slots.nbWords() * sizeof(uint64_t));
+		header.nelem = nbKeys();
+		header.mphf_offset = sizeof(mphf_map_header);
+		header.mphf_length = image.size();
+		header.slots_offset = (header.mphf_offset + image.size() + MPHF_SECTION_ALIGN - 1) / MPHF_SECTION_ALIGN * MPHF_SECTION_ALIGN;
+
+		static const char padding[MPHF_SECTION_ALIGN] = {0};
+		os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		os.write(image.data(), (std::streamsize)image.size());
+		os.write(padding, (std::streamsize)(header.slots_offset - header.mphf_offset - image.size()));
+		os.write(reinterpret_cast<char const*>(_slots.words()), (std::streamsize)(_slots.nbWords() * sizeof(uint64_t)));
+	}
 
-	std::vector<elem_t> buffer(NBBUFF);
+	void load(std::istream& is)
+	{
+		mphf_map_header header;
+		is.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!is)
+			throw std::runtime_error("Truncated static map file");
+		checkHeader(header);
+
+		is.ignore((std::streamsize)(header.mphf_offset - sizeof(header)));
+		std::string image(header.mphf_length, '\0');
+		is.read(&image[0], (std::streamsize)image.size());
+		if (!is)
+			throw std::runtime_error("Truncated static map file");
+		std::istringstream image_is(image);
+		std::unique_ptr<mphf_t> index(new mphf_t());
+		index->load(image_is);
+		if (index->nbKeys() != header.nelem)
+			throw std::runtime_error("Corrupt static map file: mphf size mismatch");
+
+		is.ignore((std::streamsize)(header.slots_offset - header.mphf_offset - header.mphf_length));
+		std::vector<uint64_t> words(fingerprint_array::nbWords(header.nelem, header.value_bits + header.fingerprint_bits));
+		is.read(reinterpret_cast<char*>(words.data()), (std::streamsize)(words.size() * sizeof(uint64_t)));
+		if (!is)
+			throw std::runtime_error("Truncated static map file");
+		if (crc32(words.data(), words.size() * sizeof(uint64_t)) != header.slots_crc)
+			throw std::runtime_error("Corrupt static map file: slots checksum mismatch");
+
+		_mphf = std::move(index);
+		_slots.assign(std::move(words), header.nelem, header.value_bits + header.fingerprint_bits);
+		_value_bits = header.value_bits;
+		_fingerprint_bits = header.fingerprint_bits;
+		_mapping.reset();
+	}
 
-	std::shared_ptr<it_type> startit;
-	std::shared_ptr<it_type> until_p;
+	// zero-copy load : the mphf sections and the slots are used in place, pages are faulted in by the gets
+	// the slots crc and the mphf section crcs are only checked with verify (it reads the whole file)
+	void map(const std::string& path, bool verify = false)
+	{
+		auto mapping = std::make_shared<mapped_file>(path);
+		mphf_map_header header;
+		if (mapping->size() < sizeof(header))
+			throw std::runtime_error("Truncated static map file " + path);
+		memcpy(&header, mapping->data(), sizeof(header));
+		checkHeader(header);
+		uint64_t nwords = fingerprint_array::nbWords(header.nelem, header.value_bits + header.fingerprint_bits);
+		if (header.slots_offset > mapping->size() || nwords > (mapping->size() - header.slots_offset) / sizeof(uint64_t))
+			throw std::runtime_error("Truncated static map file " + path);
+		const uint64_t* words = reinterpret_cast<const uint64_t*>(mapping->data() + header.slots_offset);
+		if (verify && crc32(words, nwords * sizeof(uint64_t)) != header.slots_crc)
+			throw std::runtime_error("Corrupt static map file: slots checksum mismatch");
+
+		std::unique_ptr<mphf_t> index(new mphf_t());
+		index->map(mapping, header.mphf_offset, header.mphf_length, verify);
+		if (index->nbKeys() != header.nelem)
+			throw std::runtime_error("Corrupt static map file: mphf size mismatch");
+
+		_mphf = std::move(index);
+		_slots.view(words, header.nelem, header.value_bits + header.fingerprint_bits);
+		_value_bits = header.value_bits;
+		_fingerprint_bits = header.fingerprint_bits;
+		_mapping = mapping;
+	}
 
+  private:
+	static void checkWidths(uint32_t value_bits, uint32_t fingerprint_bits)
 	{
-		std::lock_guard<std::mutex> lock(obw->_mutex);
-		startit = std::static_pointer_cast<it_type>(targ->it_p);
-		until_p = std::static_pointer_cast<it_type>(targ->until_p);
+		if (value_bits == 0 || value_bits > 8 * sizeof(value_t))
+			throw std::invalid_argument("Values have 1 to " + std::to_string(8 * sizeof(value_t)) + " bits");
+		if (value_bits + fingerprint_bits > 64)
+			throw std::invalid_argument("Values and fingerprints have at most 64 bits together");
 	}
 
-	obw->pthread_processLevel(buffer, startit, until_p, level);
-}
+	// the mphf must end before the slots, both aligned
+	static void checkHeader(const mphf_map_header& header)
+	{
+		if (memcmp(header.magic, mphf_map_magic, sizeof(header.magic)) != 0)
+			throw std::runtime_error("Not a static map file");
+		if (header.version != MPHF_MAP_VERSION)
+			throw std::runtime_error("Unsupported static map version " + std::to_string(header.version));
+		if (header.value_bits == 0 || header.value_bits > 8 * sizeof(value_t) || header.value_bits + header.fingerprint_bits > 64)
+			throw std::runtime_error("Static map file has " + std::to_string(header.value_bits) + " bit values, this map holds at most " + std::to_string(8 * sizeof(value_t)));
+		if (header.mphf_offset < sizeof(header) || header.mphf_offset % MPHF_SECTION_ALIGN != 0 || header.slots_offset % MPHF_SECTION_ALIGN != 0 || header.mphf_length > header.slots_offset - std::min(header.slots_offset, header.mphf_offset))
+			throw std::runtime_error("Corrupt static map file: bad header");
+	}
+
+	uint32_t slotBits() const { return _value_bits + _fingerprint_bits; }
+
+	uint64_t slotOf(const elem_t& key, value_t value) const
+	{
+		uint64_t slot = (uint64_t)value;
+		if (_fingerprint_bits > 0)
+			slot |= mphf_t::fingerprintOf(key, _fingerprint_bits) << _value_bits;
+		return slot;
+	}
+
+	bool accept(const elem_t& key, uint64_t slot, value_t& value) const
+	{
+		if (_fingerprint_bits > 0 && (slot >> _value_bits) != mphf_t::fingerprintOf(key, _fingerprint_bits))
+			return false;
+		value = (value_t)(slot & (~0ULL >> (64 - _value_bits)));
+		return true;
+	}
+
+	// ORs the slots of the count first keys of [it, until), values[ii] the value of the ii-th one.
+	// seen marks the filled slots : a slot filled twice sets duplicate, n keys in n distinct slots fill them all
+	template <typename Iterator>
+	void fillSlots(Iterator it, Iterator until, uint64_t count, const value_t* values, std::atomic<uint64_t>* words, bitVector& seen, std::atomic<bool>& unknown, std::atomic<bool>& duplicate) const
+	{
+		elem_t keys[NBLOOKUPBATCH];
+		uint64_t idx[NBLOOKUPBATCH];
+		while (count > 0)
+		{
+			size_t nb = 0;
+			for (; nb < NBLOOKUPBATCH && nb < count && it != until; ++it)
+				keys[nb++] = *it;
+			if (nb == 0)
+			{
+				unknown.store(true); // fewer than n keys
+				return;
+			}
+			count -= nb;
+			_mphf->lookup(keys, nb, idx);
+			for (size_t jj = 0; jj < nb; jj++)
+			{
+				if (idx[jj] == ULLONG_MAX || idx[jj] >= _mphf->nbKeys())
+				{
+					unknown.store(true);
+					continue;
+				}
+				if (seen.atomic_test_and_set(idx[jj]))
+				{
+					duplicate.store(true);
+					continue;
+				}
+				fingerprint_array::set(words, idx[jj], slotBits(), slotOf(keys[jj], values[jj]));
+			}
+			values += nb;
+		}
+	}
+
+	std::unique_ptr<mphf_t> _mphf;
+	fingerprint_array _slots; // value | fingerprint << value_bits, by mphf index
+	uint32_t _value_bits = 8 * sizeof(value_t);
+	uint32_t _fingerprint_bits = 0;
+	std::shared_ptr<mapped_file> _mapping; // set by map(), the mphf holds it too
+};
 } // namespace boomphf
\ No newline at end of file
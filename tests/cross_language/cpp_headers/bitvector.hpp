@@ -2,12 +2,33 @@
 #include <atomic>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory.h>
+#include <new>
 #include <ostream>
 #include <stdint.h>
 #include <vector>
 
+// x86 popcount kernels are compiled with target attributes and picked at runtime (see popcount_bits)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BITVECTOR_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define BITVECTOR_MSVC_DISPATCH 1
+#include <intrin.h>
+#endif
+
+// hint the cpu to fetch the cache line holding addr (no-op if unsupported)
+#if defined(__GNUC__) || defined(__clang__)
+#define BITVECTOR_PREFETCH(addr) __builtin_prefetch((const void*)(addr))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define BITVECTOR_PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define BITVECTOR_PREFETCH(addr) ((void)(addr))
+#endif
+
 inline uint32_t popcount_32(uint32_t x)
 {
 	uint32_t m1 = 0x55555555;
@@ -22,12 +43,197 @@ inline uint32_t popcount_32(uint32_t x)
 
 inline uint64_t popcount_64(uint64_t x)
 {
+#if defined(__POPCNT__) || ((defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__))
+	// the compiler emits popcnt / cnt directly
+	return __builtin_popcountll(x);
+#else
 	uint32_t low = x & 0xffffffff;
 	uint32_t high = (x >> 32LL) & 0xffffffff;
 
 	return (popcount_32(low) + popcount_32(high));
+#endif
+}
+
+// #pragma mark popcount kernels
+
+// number of bits set among the first nbits bits of words (little-endian bit order, as rank() counts them)
+// words need not be aligned, the partial last word is masked
+typedef uint64_t (*popcount_bits_t)(const uint64_t* words, uint64_t nbits);
+
+inline uint64_t tail_mask(uint64_t nbits)
+{
+	return (uint64_t(1) << (nbits & 63)) - 1;
+}
+
+inline uint64_t popcount_bits_generic(const uint64_t* words, uint64_t nbits)
+{
+	uint64_t r = 0;
+	uint64_t nfull = nbits / 64;
+	uint64_t w;
+	for (uint64_t ii = 0; ii < nfull; ii++)
+	{
+		memcpy(&w, words + ii, sizeof(w));
+		r += popcount_64(w);
+	}
+	if (nbits & 63)
+	{
+		memcpy(&w, words + nfull, sizeof(w));
+		r += popcount_64(w & tail_mask(nbits));
+	}
+	return r;
+}
+
+#if defined(BITVECTOR_X86_DISPATCH)
+__attribute__((target("popcnt"))) inline uint64_t popcount_bits_popcnt(const uint64_t* words, uint64_t nbits)
+{
+	uint64_t r = 0;
+	uint64_t nfull = nbits / 64;
+	uint64_t w;
+	for (uint64_t ii = 0; ii < nfull; ii++)
+	{
+		memcpy(&w, words + ii, sizeof(w));
+		r += (uint64_t)__builtin_popcountll(w);
+	}
+	if (nbits & 63)
+	{
+		memcpy(&w, words + nfull, sizeof(w));
+		r += (uint64_t)__builtin_popcountll(w & tail_mask(nbits));
+	}
+	return r;
+}
+
+// nibble lookup with pshufb (Mula), 4 words per step, popcnt for the rest
+__attribute__((target("avx2,popcnt"))) inline uint64_t popcount_bits_avx2(const uint64_t* words, uint64_t nbits)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t nfull = nbits / 64;
+	uint64_t ii = 0;
+	for (; ii + 4 <= nfull; ii += 4)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + ii));
+		__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+		__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	}
+	uint64_t r = (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1) +
+	             (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3);
+	return r + popcount_bits_popcnt(words + ii, nbits - ii * 64);
+}
+
+// vpopcntq : a whole rank block (8 words) is one masked load, the partial word is masked in register
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) inline uint64_t popcount_bits_avx512(const uint64_t* words, uint64_t nbits)
+{
+	__m512i acc = _mm512_setzero_si512();
+	uint64_t nwords = (nbits + 63) / 64;
+	uint64_t ii = 0;
+	for (; ii + 8 <= nwords; ii += 8)
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(words + ii)));
+	if (ii < nwords)
+	{
+		__mmask8 m = (__mmask8)((1u << (nwords - ii)) - 1);
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(m, words + ii)));
+	}
+	// reduce through memory : gcc's _mm512_reduce_add_epi64 trips -Wuninitialized
+	alignas(64) uint64_t lanes[8];
+	_mm512_store_si512(lanes, acc);
+	uint64_t r = 0;
+	for (int jj = 0; jj < 8; jj++)
+		r += lanes[jj];
+	if (nbits & 63)
+	{
+		// remove the bits above nbits in the last word
+		uint64_t w;
+		memcpy(&w, words + nbits / 64, sizeof(w));
+		r -= (uint64_t)__builtin_popcountll(w & ~tail_mask(nbits));
+	}
+	return r;
+}
+#elif defined(BITVECTOR_MSVC_DISPATCH)
+inline uint64_t popcount_bits_popcnt(const uint64_t* words, uint64_t nbits)
+{
+	uint64_t r = 0;
+	uint64_t nfull = nbits / 64;
+	uint64_t w;
+	for (uint64_t ii = 0; ii < nfull; ii++)
+	{
+		memcpy(&w, words + ii, sizeof(w));
+		r += __popcnt64(w);
+	}
+	if (nbits & 63)
+	{
+		memcpy(&w, words + nfull, sizeof(w));
+		r += __popcnt64(w & tail_mask(nbits));
+	}
+	return r;
+}
+#endif
+
+// kernel by name ("generic", "popcnt", "avx2", "avx512"), nullptr if this build or cpu lacks it
+inline popcount_bits_t popcount_kernel(const char* name)
+{
+	if (strcmp(name, "generic") == 0)
+		return popcount_bits_generic;
+#if defined(BITVECTOR_X86_DISPATCH)
+	__builtin_cpu_init();
+	if (strcmp(name, "popcnt") == 0 && __builtin_cpu_supports("popcnt"))
+		return popcount_bits_popcnt;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		return popcount_bits_avx2;
+	if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("popcnt"))
+		return popcount_bits_avx512;
+#elif defined(BITVECTOR_MSVC_DISPATCH)
+	if (strcmp(name, "popcnt") == 0)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		if (info[2] & (1 << 23))
+			return popcount_bits_popcnt;
+	}
+#endif
+	return nullptr;
+}
+
+// kernel used by bitVector, chosen once : BBHASH_POPCOUNT=<name> forces one (benchmarks, tests),
+// else vpopcntq, then popcnt (for rank's <= 8 words it beats the avx2 lookup, which only pays off on long runs)
+inline const char* popcount_kernel_name()
+{
+	static const char* const name = []
+	{
+		const char* forced = getenv("BBHASH_POPCOUNT");
+		if (forced != nullptr && popcount_kernel(forced) != nullptr)
+			return forced;
+		for (const char* n : {"avx512", "popcnt"})
+			if (popcount_kernel(n) != nullptr)
+				return n;
+		return "generic";
+	}();
+	return name;
+}
+
+inline uint64_t popcount_bits(const uint64_t* words, uint64_t nbits)
+{
+	static const popcount_bits_t kernel = popcount_kernel(popcount_kernel_name());
+	return kernel(words, nbits);
+}
+
+// unaligned-safe 64-bit load, mapped files do not guarantee 8-byte alignment
+inline uint64_t load_word(const uint64_t* p)
+{
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
 }
 
+// in-memory layout of a ranked bitVector (files always hold the flat one)
+enum rank_layout
+{
+	RANK_LAYOUT_FLAT = 0,        // bits, and one rank sample per 512 bits in a separate array
+	RANK_LAYOUT_INTERLEAVED = 1, // 64-byte lines : rank before the line, then 448 bits ; rank() reads one cache line
+};
+
 class bitVector
 {
 
@@ -37,25 +243,19 @@ class bitVector
 	{
 		_nchar = (1ULL + n / 64ULL);
 		_bitArray = new std::atomic<uint64_t>[_nchar]();
+		_words = reinterpret_cast<const uint64_t*>(_bitArray);
 	}
 
 	~bitVector()
 	{
-		if (_bitArray != nullptr)
-			delete[] _bitArray;
+		free_bits();
+		free_lines();
 	}
 
 	// copy constructor
 	bitVector(bitVector const& r)
 	{
-		_size = r._size;
-		_nchar = r._nchar;
-		_ranks = r._ranks;
-		_bitArray = new std::atomic<uint64_t>[_nchar];
-		for (size_t i = 0; i < _nchar; ++i)
-		{
-			_bitArray[i].store(r._bitArray[i].load(std::memory_order_relaxed));
-		}
+		*this = r;
 	}
 
 	// Copy assignment operator
@@ -67,12 +267,36 @@ class bitVector
 			_nchar = r._nchar;
 			_ranks = r._ranks;
 
-			if (_bitArray != nullptr)
-				delete[] _bitArray;
-			_bitArray = new std::atomic<uint64_t>[_nchar];
-			for (size_t i = 0; i < _nchar; ++i)
+			free_bits();
+			free_lines();
+
+			if (r.interleaved())
+			{
+				_words = nullptr;
+				_rankSamples = nullptr;
+				_nranks = 0;
+				alloc_lines(r._nlines);
+				memcpy(_lines, r._lines, _nlines * _nb_words_per_line * sizeof(uint64_t));
+			}
+			else if (r.is_mapped())
 			{
-				_bitArray[i].store(r._bitArray[i].load(std::memory_order_relaxed));
+				// a mapped vector only copies the view
+				_words = r._words;
+				_rankSamples = r._rankSamples;
+				_nranks = r._nranks;
+			}
+			else
+			{
+				// copies of an attached vector own their bits and ranks
+				_bitArray = new std::atomic<uint64_t>[_nchar];
+				for (size_t i = 0; i < _nchar; ++i)
+				{
+					_bitArray[i].store(r._bitArray[i].load(std::memory_order_relaxed));
+				}
+				_words = reinterpret_cast<const uint64_t*>(_bitArray);
+				if (r.attached())
+					_ranks.assign(r._rankSamples, r._rankSamples + r._nranks);
+				sync_ranks();
 			}
 		}
 		return *this;
@@ -84,14 +308,31 @@ class bitVector
 		// printf("bitVector move assignment \n");
 		if (&r != this)
 		{
-			if (_bitArray != nullptr)
-				delete[] _bitArray;
+			free_bits();
+			free_lines();
 
+			bool mapped = r.is_mapped();
 			_size = std::move(r._size);
 			_nchar = std::move(r._nchar);
 			_ranks = std::move(r._ranks);
 			_bitArray = r._bitArray;
+			_attached = r._attached;
+			_rankStorage = r._rankStorage;
+			_words = r._words;
+			_rankSamples = r._rankSamples;
+			_nranks = r._nranks;
+			_lines = r._lines;
+			_nlines = r._nlines;
+			if (!mapped && !_attached && _lines == nullptr)
+				sync_ranks();
+			r._lines = nullptr;
+			r._nlines = 0;
 			r._bitArray = nullptr;
+			r._attached = false;
+			r._rankStorage = nullptr;
+			r._words = nullptr;
+			r._rankSamples = nullptr;
+			r._nranks = 0;
 		}
 		return *this;
 	}
@@ -105,8 +346,10 @@ class bitVector
 	{
 		// printf("bitvector resize from  %llu bits to %llu \n",_size,newsize);
 		_nchar = (1ULL + newsize / 64ULL);
-		delete[] _bitArray;
+		free_bits();
+		free_lines();
 		_bitArray = new std::atomic<uint64_t>[_nchar]();
+		_words = reinterpret_cast<const uint64_t*>(_bitArray);
 		_size = newsize;
 	}
 
@@ -115,27 +358,99 @@ class bitVector
 		return _size;
 	}
 
-	uint64_t bitSize() const { return (_nchar * 64ULL + _ranks.capacity() * 64ULL); }
+	// true if the bits and ranks point into external memory (see map())
+	bool is_mapped() const { return _words != nullptr && _bitArray == nullptr; }
+
+	// true if the bits and ranks are written into external memory (see attach())
+	bool attached() const { return _attached; }
+
+	// rank samples build_ranks() computes for a vector of size bits
+	static uint64_t nbRankSamples(uint64_t size)
+	{
+		const uint64_t words_per_sample = _nb_bits_per_rank_sample / 64;
+		return (1ULL + size / 64ULL + words_per_sample - 1) / words_per_sample;
+	}
+
+	uint64_t bitSize() const
+	{
+		if (interleaved())
+			return _nlines * _nb_words_per_line * 64ULL;
+		return (_nchar * 64ULL + (is_mapped() || attached() ? _nranks : _ranks.capacity()) * 64ULL);
+	}
+
+	// part of bitSize() spent on ranks (and line padding), the rest holds the bits
+	uint64_t rankBitSize() const { return bitSize() - _nchar * 64ULL; }
+
+	// #pragma mark rank layout
+
+	rank_layout layout() const { return interleaved() ? RANK_LAYOUT_INTERLEAVED : RANK_LAYOUT_FLAT; }
+
+	bool interleaved() const { return _lines != nullptr; }
+
+	// switch a ranked vector to the interleaved layout, the flat bits and ranks (or the mapped views) are released
+	// the vector is read-only afterwards : get / rank / save
+	void interleave()
+	{
+		if (interleaved())
+			return;
+		assert(_words != nullptr && _nranks > 0);
+		bitVector lines;
+		lines._size = _size;
+		lines._nchar = _nchar;
+		lines.alloc_lines((_nchar + _nb_data_words_per_line - 1) / _nb_data_words_per_line);
+		memset(lines._lines, 0, lines._nlines * _nb_words_per_line * sizeof(uint64_t));
+		for (uint64_t ll = 0; ll < lines._nlines; ll++)
+		{
+			uint64_t first = ll * _nb_data_words_per_line;
+			uint64_t* line = lines._lines + ll * _nb_words_per_line;
+			line[0] = rank(first * 64);
+			memcpy(line + 1, _words + first, std::min<uint64_t>(_nb_data_words_per_line, _nchar - first) * sizeof(uint64_t));
+		}
+		*this = std::move(lines);
+	}
+
+	// flat copy of this vector, with the same ranks
+	bitVector flattened() const
+	{
+		bitVector flat(_size);
+		for (uint64_t ii = 0; ii < _nchar; ii++)
+			flat._bitArray[ii].store(get64(ii), std::memory_order_relaxed);
+		flat.build_ranks(interleaved() ? _lines[0] : load_word(_rankSamples));
+		return flat;
+	}
+
+	void setLayout(rank_layout layout)
+	{
+		if (layout == RANK_LAYOUT_INTERLEAVED)
+			interleave();
+		else if (interleaved())
+			*this = flattened();
+	}
 
 	// clear whole array
 	void clear()
 	{
+		assert(!is_mapped() && !interleaved());
 		for (size_t i = 0; i < _nchar; ++i)
 			_bitArray[i].store(0, std::memory_order_relaxed);
 	}
 
 	// clear collisions in interval, only works with start and size multiple of 64
-	void clearCollisions(uint64_t start, size_t size, bitVector* cc)
+	// returns the number of positions cleared (bits set in cc)
+	uint64_t clearCollisions(uint64_t start, size_t size, bitVector* cc)
 	{
 		assert((start & 63) == 0);
 		assert((size & 63) == 0);
+		assert(!is_mapped() && !interleaved());
 		uint64_t ids = (start / 64ULL);
+		uint64_t ncleared = popcount_bits(cc->_words, size);
 		for (uint64_t ii = 0; ii < (size / 64ULL); ii++)
 		{
 			_bitArray[ids + ii] = _bitArray[ids + ii] & (~(cc->get64(ii)));
 		}
 
 		cc->clear();
+		return ncleared;
 	}
 
 	// clear interval, only works with start and size multiple of 64
@@ -143,6 +458,7 @@ class bitVector
 	{
 		assert((start & 63) == 0);
 		assert((size & 63) == 0);
+		assert(!is_mapped());
 		// memset(_bitArray + (start/64ULL),0,(size/64ULL)*sizeof(uint64_t));
 		for (uint64_t ii = 0; ii < (size / 64ULL); ii++)
 		{
@@ -154,41 +470,45 @@ class bitVector
 	void print() const
 	{
 		std::cout << "bit array of size " << _size << " : " << std::endl;
-		for (auto ii = 0; ii < _size; ii++)
+		for (uint64_t ii = 0; ii < _size; ii++)
 		{
 			if (ii % 10 == 0)
 				std::cout << " (" << ii << ") ";
-			auto val = (_bitArray[ii >> 6] >> (ii & 63)) & 1;
+			auto val = get(ii);
 			std::cout << val;
 		}
 		std::cout << std::endl;
 
-		std::cout << "rank array : size " << _ranks.size() << std::endl;
-		for (auto ii = 0; ii < _ranks.size(); ii++)
+		std::cout << "rank array : size " << _nranks << std::endl;
+		for (uint64_t ii = 0; ii < _nranks; ii++)
 		{
-			std::cout << ii << " :  " << _ranks[ii] << " , ";
+			std::cout << ii << " :  " << load_word(_rankSamples + ii) << " , ";
 		}
 		std::cout << std::endl;
 	}
 
 	// return value at pos
+	// (read path goes through _words : only used on levels that are no longer written to)
 	uint64_t operator[](uint64_t pos) const
 	{
 		// unsigned char * _bitArray8 = (unsigned char *) _bitArray;
 		// return (_bitArray8[pos >> 3ULL] >> (pos & 7 ) ) & 1;
 
-		return (_bitArray[pos >> 6].load(std::memory_order_relaxed) >> (pos & 63)) & 1;
+		if (interleaved())
+		{
+			uint64_t line = pos / _nb_bits_per_line;
+			uint64_t bit = pos - line * _nb_bits_per_line;
+			return (_lines[line * _nb_words_per_line + 1 + (bit >> 6)] >> (bit & 63)) & 1;
+		}
+		return (load_word(_words + (pos >> 6)) >> (pos & 63)) & 1;
 	}
 
 	// atomically   return old val and set to 1
+	// relaxed : build threads only need the bit itself, they are joined before anyone reads the bitset
 	inline uint64_t atomic_test_and_set(uint64_t pos)
 	{
 		uint64_t mask = 1ULL << (pos & 63);
-		std::atomic<uint64_t>* word = reinterpret_cast<std::atomic<uint64_t>*>(_bitArray + (pos >> 6));
-		uint64_t oldval = word->load(std::memory_order_seq_cst);
-		while (!word->compare_exchange_weak(oldval, oldval | mask, std::memory_order_seq_cst))
-		{
-		}
+		uint64_t oldval = _bitArray[pos >> 6].fetch_or(mask, std::memory_order_relaxed);
 		return (oldval >> (pos & 63)) & 1;
 	}
 
@@ -199,7 +519,26 @@ class bitVector
 
 	uint64_t get64(uint64_t cell64) const
 	{
-		return _bitArray[cell64].load(std::memory_order_relaxed);
+		if (interleaved())
+			return _lines[(cell64 / _nb_data_words_per_line) * _nb_words_per_line + 1 + cell64 % _nb_data_words_per_line];
+		return load_word(_words + cell64);
+	}
+
+	// prefetch the word holding bit pos, for batched get()
+	void prefetch(uint64_t pos) const
+	{
+		if (interleaved())
+			BITVECTOR_PREFETCH(_lines + (pos / _nb_bits_per_line) * _nb_words_per_line);
+		else
+			BITVECTOR_PREFETCH(_words + (pos >> 6));
+	}
+
+	// prefetch the rank sample used by rank(pos), for batched rank()
+	// (interleaved : the line fetched by prefetch(pos) already holds it)
+	void prefetch_rank(uint64_t pos) const
+	{
+		if (!interleaved())
+			BITVECTOR_PREFETCH(_rankSamples + pos / _nb_bits_per_rank_sample);
 	}
 
 	// set bit pos to 1
@@ -208,6 +547,13 @@ class bitVector
 		_bitArray[pos >> 6].fetch_or(1ULL << (pos & 63), std::memory_order_relaxed);
 	}
 
+	// overwrite word cell64 (not thread safe against concurrent set of the same word)
+	void set64(uint64_t cell64, uint64_t val)
+	{
+		assert(!is_mapped() && !interleaved());
+		_bitArray[cell64].store(val, std::memory_order_relaxed);
+	}
+
 	// set bit pos to 0
 	void reset(uint64_t pos)
 	{
@@ -218,45 +564,53 @@ class bitVector
 	//  add offset to  all ranks  computed
 	uint64_t build_ranks(uint64_t offset = 0)
 	{
-		_ranks.reserve(2 + _size / _nb_bits_per_rank_sample);
+		assert(!is_mapped() && (!attached() || _rankStorage != nullptr));
+		if (!attached())
+			_ranks.resize(nbRankSamples(_size));
+		uint64_t* samples = attached() ? _rankStorage : _ranks.data();
 
+		// one kernel call per rank sample block
+		const uint64_t words_per_sample = _nb_bits_per_rank_sample / 64;
 		uint64_t curent_rank = offset;
-		for (size_t ii = 0; ii < _nchar; ii++)
+		for (size_t ii = 0; ii < _nchar; ii += words_per_sample)
 		{
-			if (((ii * 64) % _nb_bits_per_rank_sample) == 0)
-			{
-				_ranks.push_back(curent_rank);
-			}
-			curent_rank += popcount_64(_bitArray[ii]);
+			samples[ii / words_per_sample] = curent_rank;
+			curent_rank += popcount_bits(_words + ii, 64 * std::min<uint64_t>(words_per_sample, _nchar - ii));
 		}
+		if (attached())
+			_nranks = nbRankSamples(_size);
+		else
+			sync_ranks();
 
 		return curent_rank;
 	}
 
 	uint64_t rank(uint64_t pos) const
 	{
-		uint64_t word_idx = pos / 64ULL;
-		uint64_t word_offset = pos % 64;
-		uint64_t block = pos / _nb_bits_per_rank_sample;
-		uint64_t r = _ranks[block];
-		for (uint64_t w = block * _nb_bits_per_rank_sample / 64; w < word_idx; ++w)
+		if (interleaved())
 		{
-			r += popcount_64(_bitArray[w]);
+			uint64_t line = pos / _nb_bits_per_line;
+			const uint64_t* p = _lines + line * _nb_words_per_line;
+			return p[0] + popcount_bits(p + 1, pos - line * _nb_bits_per_line);
 		}
-		uint64_t mask = (uint64_t(1) << word_offset) - 1;
-		r += popcount_64(_bitArray[word_idx] & mask);
-
-		return r;
+		uint64_t block = pos / _nb_bits_per_rank_sample;
+		uint64_t start = block * _nb_bits_per_rank_sample;
+		return load_word(_rankSamples + block) + popcount_bits(_words + start / 64, pos - start);
 	}
 
 	void save(std::ostream& os) const
 	{
+		if (interleaved())
+		{
+			flattened().save(os);
+			return;
+		}
 		os.write(reinterpret_cast<char const*>(&_size), sizeof(_size));
 		os.write(reinterpret_cast<char const*>(&_nchar), sizeof(_nchar));
-		os.write(reinterpret_cast<char const*>(_bitArray), (std::streamsize)(sizeof(uint64_t) * _nchar));
-		uint64_t sizer = _ranks.size();
+		os.write(reinterpret_cast<char const*>(_words), (std::streamsize)(sizeof(uint64_t) * _nchar));
+		uint64_t sizer = _nranks;
 		os.write(reinterpret_cast<char const*>(&sizer), sizeof(uint64_t));
-		os.write(reinterpret_cast<char const*>(_ranks.data()), (std::streamsize)(sizeof(_ranks[0]) * _ranks.size()));
+		os.write(reinterpret_cast<char const*>(_rankSamples), (std::streamsize)(sizeof(uint64_t) * _nranks));
 	}
 
 	void load(std::istream& is)
@@ -270,15 +624,141 @@ class bitVector
 		is.read(reinterpret_cast<char*>(&sizer), sizeof(uint64_t));
 		_ranks.resize(sizer);
 		is.read(reinterpret_cast<char*>(_ranks.data()), (std::streamsize)(sizeof(_ranks[0]) * _ranks.size()));
+		sync_ranks();
+	}
+
+	// zero-copy alternative to load() : point into a record laid out by save(), e.g. in a mmap'd file
+	// the memory must outlive this bitVector (and its copies)
+	// returns the end of the record, or nullptr if it does not fit before end
+	const char* map(const char* data, const char* end)
+	{
+		uint64_t header[2];
+		if (end - data < (std::ptrdiff_t)sizeof(header))
+			return nullptr;
+		memcpy(header, data, sizeof(header));
+		data += sizeof(header);
+		if (header[1] != 1ULL + header[0] / 64ULL || (uint64_t)(end - data) / sizeof(uint64_t) < header[1] + 1)
+			return nullptr;
+		const uint64_t* words = reinterpret_cast<const uint64_t*>(data);
+		data += header[1] * sizeof(uint64_t);
+
+		uint64_t sizer;
+		memcpy(&sizer, data, sizeof(sizer));
+		data += sizeof(sizer);
+		if ((uint64_t)(end - data) / sizeof(uint64_t) < sizer)
+			return nullptr;
+
+		view(header[0], words, reinterpret_cast<const uint64_t*>(data), sizer);
+		return data + sizer * sizeof(uint64_t);
+	}
+
+	// point at external words (1 + size / 64 of them) and rank samples, e.g. sections of a mapped v2 file
+	// the memory must outlive this bitVector (and its copies)
+	void view(uint64_t size, const uint64_t* words, const uint64_t* rank_samples, uint64_t nranks)
+	{
+		free_bits();
+		free_lines();
+		std::vector<uint64_t>().swap(_ranks);
+
+		_size = size;
+		_nchar = 1ULL + size / 64ULL;
+		_words = words;
+		_rankSamples = rank_samples;
+		_nranks = nranks;
+	}
+
+	// read-write vector of size bits over external zeroed words (1 + size / 64 of them) and room for
+	// nbRankSamples(size) rank samples (nullptr : never ranked), e.g. a level arena ; nranks of them are
+	// already computed (loads)
+	// the memory must outlive this bitVector, its copies own their storage
+	void attach(uint64_t size, uint64_t* words, uint64_t* rank_samples, uint64_t nranks = 0)
+	{
+		free_bits();
+		free_lines();
+		std::vector<uint64_t>().swap(_ranks);
+
+		_size = size;
+		_nchar = 1ULL + size / 64ULL;
+		_bitArray = reinterpret_cast<std::atomic<uint64_t>*>(words);
+		_words = words;
+		_attached = true;
+		_rankStorage = rank_samples;
+		_rankSamples = rank_samples;
+		_nranks = nranks;
+	}
+
+	// raw arrays, for section based serialization (v2 files), flat layout only
+	const uint64_t* words() const { return _words; }
+	uint64_t nchar() const { return _nchar; }
+	const uint64_t* rankSamples() const { return _rankSamples; }
+	uint64_t nbRankSamples() const { return _nranks; }
+
+	// read the words of a size bits vector, as written from words()
+	void loadWords(std::istream& is, uint64_t size)
+	{
+		this->resize(size);
+		is.read(reinterpret_cast<char*>(_bitArray), (std::streamsize)(sizeof(uint64_t) * _nchar));
+	}
+
+	// read nranks rank samples, as written from rankSamples()
+	void loadRanks(std::istream& is, uint64_t nranks)
+	{
+		_ranks.resize(nranks);
+		is.read(reinterpret_cast<char*>(_ranks.data()), (std::streamsize)(sizeof(uint64_t) * nranks));
+		sync_ranks();
 	}
 
   protected:
-	std::atomic<uint64_t>* _bitArray = nullptr;
+	// point the rank view at the owned rank samples
+	void sync_ranks()
+	{
+		_rankSamples = _ranks.data();
+		_nranks = _ranks.size();
+	}
+
+	// release the owned bits, attached ones are left alone
+	void free_bits()
+	{
+		if (_bitArray != nullptr && !_attached)
+			delete[] _bitArray;
+		_bitArray = nullptr;
+		_attached = false;
+		_rankStorage = nullptr;
+	}
+
+	void alloc_lines(uint64_t nlines)
+	{
+		_lines = static_cast<uint64_t*>(::operator new[](nlines * _nb_words_per_line * sizeof(uint64_t), std::align_val_t(64)));
+		_nlines = nlines;
+	}
+
+	void free_lines()
+	{
+		if (_lines != nullptr)
+			::operator delete[](_lines, std::align_val_t(64));
+		_lines = nullptr;
+		_nlines = 0;
+	}
+
+	std::atomic<uint64_t>* _bitArray = nullptr; // owned storage (or attached), nullptr when mapped
+	bool _attached = false;                    // _bitArray is external memory (attach())
+	uint64_t* _rankStorage = nullptr;          // attached room for the rank samples, may be nullptr (no ranks)
+	const uint64_t* _words = nullptr;          // read view : _bitArray, or mapped memory
 	uint64_t _size = 0;
-	uint64_t _nchar;
+	uint64_t _nchar = 0;
 
 	// epsilon =  64 / _nb_bits_per_rank_sample   bits
 	// additional size for rank is epsilon * _size
 	static const uint64_t _nb_bits_per_rank_sample = 512; // 512 seems ok
 	std::vector<uint64_t> _ranks;
+	const uint64_t* _rankSamples = nullptr; // read view : _ranks.data(), or mapped memory
+	uint64_t _nranks = 0;
+
+	// interleaved layout : _nlines cache lines of 8 words, rank before the line then 7 words of bits
+	// overhead is 64 / 448 bits per bit (vs 64 / 512 flat)
+	static constexpr uint64_t _nb_words_per_line = 8;
+	static constexpr uint64_t _nb_data_words_per_line = 7;
+	static constexpr uint64_t _nb_bits_per_line = 448;
+	uint64_t* _lines = nullptr; // owned, 64-byte aligned, nullptr when flat
+	uint64_t _nlines = 0;
 };
\ No newline at end of file
@@ -9,26 +9,406 @@
 #include <windows.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
 #include <vector>
 
-template <typename T>
-inline void write_with_file_lock(FILE* file, const std::vector<T>& buffer, size_t count)
+// id of the calling process, names the temporary files of a build
+inline unsigned long process_id()
 {
 #ifdef _WIN32
-	OVERLAPPED ol = {0};
-	HANDLE fileHandle = (HANDLE)_get_osfhandle(_fileno(file));
-	LockFileEx(fileHandle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ol);
+	return (unsigned long)GetCurrentProcessId();
+#else
+	return (unsigned long)getpid();
+#endif
+}
+
+// read-only memory mapping of a whole file, unmapped on destruction
+class mapped_file
+{
+  public:
+	explicit mapped_file(const std::string& path)
+	{
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE)
+			throw std::invalid_argument("Error opening " + path);
+		LARGE_INTEGER fsize;
+		if (!GetFileSizeEx(_file, &fsize))
+		{
+			close();
+			throw std::invalid_argument("Error opening " + path);
+		}
+		_size = (size_t)fsize.QuadPart;
+		if (_size == 0)
+			return;
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping != NULL)
+			_data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (_data == nullptr)
+		{
+			close();
+			throw std::invalid_argument("Error mapping " + path);
+		}
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::invalid_argument("Error opening " + path);
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::invalid_argument("Error opening " + path);
+		}
+		_size = (size_t)st.st_size;
+		if (_size > 0)
+		{
+			void* p = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+			{
+				::close(fd);
+				throw std::invalid_argument("Error mapping " + path);
+			}
+			_data = (const char*)p;
+		}
+		// the mapping stays valid once the descriptor is closed
+		::close(fd);
+#endif
+	}
+
+	~mapped_file()
+	{
+		close();
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	const char* data() const { return _data; }
+	size_t size() const { return _size; }
+
+  private:
+	void close()
+	{
+#ifdef _WIN32
+		if (_data != nullptr)
+			UnmapViewOfFile(_data);
+		if (_mapping != NULL)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+		_mapping = NULL;
+		_file = INVALID_HANDLE_VALUE;
+#else
+		if (_data != nullptr)
+			munmap((void*)_data, _size);
+#endif
+		_data = nullptr;
+	}
+
+	const char* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = NULL;
+#endif
+};
+
+// zeroed read-write memory from the system, page aligned, released on destruction
+// large blocks start on a huge page boundary and are advised for transparent huge pages (Linux)
+#define ANON_HUGE_PAGE (2ULL << 20)
+
+class anonymous_memory
+{
+  public:
+	explicit anonymous_memory(size_t size) : _size(size)
+	{
+		if (_size == 0)
+			return;
+#ifdef _WIN32
+		_data = (char*)VirtualAlloc(NULL, _size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (_data == nullptr)
+			throw std::bad_alloc();
+#else
+		size_t extra = _size >= ANON_HUGE_PAGE ? ANON_HUGE_PAGE : 0;
+		void* p = mmap(NULL, _size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc();
+		char* base = (char*)p;
+		if (extra > 0)
+		{
+			// trim to a huge page aligned block
+			char* aligned = (char*)(((uintptr_t)base + ANON_HUGE_PAGE - 1) & ~(uintptr_t)(ANON_HUGE_PAGE - 1));
+			if (aligned > base)
+				munmap(base, aligned - base);
+			if (aligned + _size < base + _size + extra)
+				munmap(aligned + page_round(_size), (base + _size + extra) - (aligned + page_round(_size)));
+			base = aligned;
+#ifdef MADV_HUGEPAGE
+			madvise(base, page_round(_size), MADV_HUGEPAGE);
+#endif
+		}
+		_data = base;
+#endif
+	}
+
+	~anonymous_memory()
+	{
+		if (_data == nullptr)
+			return;
+#ifdef _WIN32
+		VirtualFree(_data, 0, MEM_RELEASE);
+#else
+		munmap(_data, page_round(_size));
+#endif
+	}
+
+	anonymous_memory(const anonymous_memory&) = delete;
+	anonymous_memory& operator=(const anonymous_memory&) = delete;
+
+	char* data() const { return _data; }
+	size_t size() const { return _size; }
+
+	// give the pages past the first size bytes back to the system, the block does not move
+	void shrink(size_t size)
+	{
+		size_t keep = page_round(size);
+		if (_data == nullptr || keep >= page_round(_size))
+			return;
+#ifdef _WIN32
+		VirtualFree(_data + keep, page_round(_size) - keep, MEM_DECOMMIT);
+#else
+		munmap(_data + keep, page_round(_size) - keep);
+#endif
+		_size = size;
+	}
+
+  private:
+	static size_t page_round(size_t size)
+	{
+		static const size_t page = system_page_size();
+		return (size + page - 1) / page * page;
+	}
+
+	static size_t system_page_size()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return (size_t)info.dwPageSize;
+#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+	char* _data = nullptr;
+	size_t _size = 0;
+};
+
+// file read or written at explicit offsets (pread / pwrite), threads can share one without a common position
+// open and I/O failures throw std::system_error with the errno (GetLastError on Windows)
+class positional_file
+{
+  public:
+	// write : created, or truncated if it exists
+	positional_file(const std::string& path, bool write) : _path(path)
+	{
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), write ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL, write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE)
+			fail("Error opening ");
+#else
+		_fd = write ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+		if (_fd < 0)
+			fail("Error opening ");
+#endif
+	}
+
+	~positional_file()
+	{
+#ifdef _WIN32
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+#else
+		if (_fd >= 0)
+			::close(_fd);
+#endif
+	}
+
+	positional_file(const positional_file&) = delete;
+	positional_file& operator=(const positional_file&) = delete;
+
+	uint64_t size() const
+	{
+#ifdef _WIN32
+		LARGE_INTEGER fsize;
+		if (!GetFileSizeEx(_file, &fsize))
+			fail("Error reading ");
+		return (uint64_t)fsize.QuadPart;
+#else
+		struct stat st;
+		if (fstat(_fd, &st) != 0)
+			fail("Error reading ");
+		return (uint64_t)st.st_size;
+#endif
+	}
+
+	// extend (zero filled) or cut the file to size bytes
+	void resize(uint64_t size) const
+	{
+#ifdef _WIN32
+		FILE_END_OF_FILE_INFO end;
+		end.EndOfFile.QuadPart = (LONGLONG)size;
+		if (!SetFileInformationByHandle(_file, FileEndOfFileInfo, &end, sizeof(end)))
+			fail("Error writing ");
+#else
+		if (ftruncate(_fd, (off_t)size) != 0)
+			fail("Error writing ");
+#endif
+	}
 
-	fwrite(buffer.data(), sizeof(T), count, file);
+	// all length bytes at offset, a short read (the file ended) throws std::runtime_error
+	void read(void* data, uint64_t length, uint64_t offset) const
+	{
+		char* p = static_cast<char*>(data);
+		while (length > 0)
+		{
+			uint64_t done = transfer(p, length, offset, false);
+			if (done == 0)
+				throw std::runtime_error("Truncated file " + _path);
+			p += done;
+			length -= done;
+			offset += done;
+		}
+	}
 
-	UnlockFileEx(fileHandle, 0, MAXDWORD, MAXDWORD, &ol);
+	void write(const void* data, uint64_t length, uint64_t offset) const
+	{
+		const char* p = static_cast<const char*>(data);
+		while (length > 0)
+		{
+			uint64_t done = transfer(const_cast<char*>(p), length, offset, true);
+			if (done == 0)
+				throw std::runtime_error("Error writing " + _path);
+			p += done;
+			length -= done;
+			offset += done;
+		}
+	}
+
+  private:
+	// one pread / pwrite (at most 1 GiB), bytes transferred
+	uint64_t transfer(char* p, uint64_t length, uint64_t offset, bool write) const
+	{
+		uint64_t len = length < (1ULL << 30) ? length : (1ULL << 30);
+#ifdef _WIN32
+		OVERLAPPED at = {};
+		at.Offset = (DWORD)offset;
+		at.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD done = 0;
+		BOOL ok = write ? WriteFile(_file, p, (DWORD)len, &done, &at) : ReadFile(_file, p, (DWORD)len, &done, &at);
+		if (!ok && GetLastError() != ERROR_HANDLE_EOF)
+			fail(write ? "Error writing " : "Error reading ");
+		return done;
+#else
+		for (;;)
+		{
+			ssize_t done = write ? pwrite(_fd, p, (size_t)len, (off_t)offset) : pread(_fd, p, (size_t)len, (off_t)offset);
+			if (done >= 0)
+				return (uint64_t)done;
+			if (errno != EINTR)
+				fail(write ? "Error writing " : "Error reading ");
+		}
+#endif
+	}
+
+	[[noreturn]] void fail(const char* what) const
+	{
+#ifdef _WIN32
+		throw std::system_error((int)GetLastError(), std::system_category(), what + _path);
+#else
+		throw std::system_error(errno, std::generic_category(), what + _path);
+#endif
+	}
+
+	std::string _path;
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+#else
+	int _fd = -1;
+#endif
+};
+
+// cpus of each NUMA node, from /sys/devices/system/node (Linux) ; one node without cpus elsewhere
+// BBHASH_NUMA_NODES=k forces k nodes without cpus (replicas on a single node host, for tests)
+inline std::vector<std::vector<int>> numa_nodes()
+{
+	const char* forced = getenv("BBHASH_NUMA_NODES");
+	if (forced != nullptr && atoi(forced) > 0)
+		return std::vector<std::vector<int>>(atoi(forced));
+
+	std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+	for (int node = 0; node < 1024; node++)
+	{
+		std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+		FILE* f = fopen(path.c_str(), "r");
+		if (f == nullptr)
+			continue; // node ids may have holes
+		char line[4096] = {0};
+		bool read = fgets(line, sizeof(line), f) != nullptr;
+		fclose(f);
+		// "0-3,8-11"
+		std::vector<int> cpus;
+		for (char* p = line; read && *p >= '0' && *p <= '9';)
+		{
+			int first = (int)strtol(p, &p, 10);
+			int last = *p == '-' ? (int)strtol(p + 1, &p, 10) : first;
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+			if (*p == ',')
+				p++;
+		}
+		if (!cpus.empty())
+			nodes.push_back(cpus);
+	}
+#endif
+	if (nodes.empty())
+		nodes.resize(1);
+	return nodes;
+}
+
+// run the calling thread on cpus only (Linux), false if it could not be pinned or cpus is empty
+inline bool pin_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+	if (cpus.empty())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+	{
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
 #else
-	flockfile(file);
-	fwrite(buffer.data(), sizeof(T), count, file);
-	funlockfile(file);
+	(void)cpus;
+	return false;
 #endif
 }
@@ -1,169 +1,143 @@
 ﻿#pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
-#include <string>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 
-///// progress bar
-class Progress
+// one sample of a build's progress, see progress_reporter
+struct progress_info
+{
+	uint64_t done = 0;     // keys read by the levels so far
+	uint64_t total = 0;    // keys the levels are expected to read (estimated from the level sizes)
+	int level = 0;         // level being built
+	double seconds = 0;    // since the start of the build
+	bool finished = false; // last sample, done == total
+};
+
+typedef std::function<void(const progress_info&)> progress_callback;
+
+// build threads add to their own relaxed counter (one cache line each) and never lock, format or print ;
+// a reporter thread sums the counters every interval and calls the callback (only from this thread,
+// the sample of finish() excepted)
+class progress_reporter
 {
   public:
-	int timer_mode{0};
-	std::chrono::steady_clock::time_point start_time{};
-	double heure_actuelle{0.0};
-	std::string message;
-
-	uint64_t done{0};
-	uint64_t todo{0};
-	int subdiv{1000}; // progress printed every 1/subdiv of total to do
-	double partial{0.0};
-	int _nthreads{1};
-	std::vector<double> partial_threaded;
-	std::vector<uint64_t> done_threaded;
-
-	double steps{0.0}; // steps = todo/subidv
+	progress_reporter() = default;
+	progress_reporter(const progress_reporter&) = delete;
+	progress_reporter& operator=(const progress_reporter&) = delete;
 
-	Progress() = default;
-
-	void init(uint64_t ntasks, const char* msg, int nthreads = 1)
+	~progress_reporter()
 	{
-		_nthreads = nthreads;
-		message = std::string(msg);
-		start_time = std::chrono::steady_clock::now();
-
-		todo = ntasks;
-		done = 0;
-		partial = 0;
+		halt();
+	}
 
-		partial_threaded.assign(static_cast<size_t>(_nthreads), 0.0);
-		done_threaded.assign(static_cast<size_t>(_nthreads), 0);
+	void start(uint64_t total, uint32_t nthreads, progress_callback callback, double interval_seconds = 1.0)
+	{
+		halt();
+		_counters = std::vector<counter>(nthreads);
+		_total = total;
+		_level.store(0, std::memory_order_relaxed);
+		_callback = std::move(callback);
+		_interval = std::chrono::duration<double>(interval_seconds > 0 ? interval_seconds : 1.0);
+		_start = std::chrono::steady_clock::now();
+		_stopping = false;
+		_thread = std::thread([this]()
+		                      { run(); });
+	}
 
-		subdiv = 1000;
-		steps = (subdiv > 0) ? (static_cast<double>(todo) / static_cast<double>(subdiv)) : 1.0;
+	bool active() const { return _thread.joinable(); }
 
-		if (!timer_mode)
-		{
-			std::fprintf(stderr, "[");
-			std::fflush(stderr);
-		}
+	// one writer per counter : a relaxed load and store, no locked instruction
+	void add(uint32_t tid, uint64_t n)
+	{
+		std::atomic<uint64_t>& value = _counters[tid].value;
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
 	}
 
+	void setLevel(int level) { _level.store(level, std::memory_order_relaxed); }
+
+	// stops the reporter, then one last sample with done == total
 	void finish()
 	{
-		set(todo);
-		if (timer_mode)
-			std::fprintf(stderr, "\n");
-		else
-			std::fprintf(stderr, "]\n");
-
-		std::fflush(stderr);
-		todo = 0;
-		done = 0;
-		partial = 0;
+		if (!active())
+			return;
+		halt();
+		progress_info info = sample();
+		info.done = info.total = std::max(info.done, info.total);
+		info.finished = true;
+		_callback(info);
+		_callback = nullptr;
 	}
-	void finish_threaded() // called by only one of the threads
+
+  private:
+	struct alignas(64) counter
 	{
-		done = 0;
-		partial = 0;
-		for (int ii = 0; ii < _nthreads; ii++)
-			done += done_threaded[ii];
-		for (int ii = 0; ii < _nthreads; ii++)
-			partial += partial_threaded[ii];
-
-		finish();
-	}
-	void inc(uint64_t ntasks_done)
+		std::atomic<uint64_t> value{0};
+	};
+
+	progress_info sample() const
 	{
-		done += ntasks_done;
-		partial += ntasks_done;
+		progress_info info;
+		for (const counter& c : _counters)
+			info.done += c.value.load(std::memory_order_relaxed);
+		info.total = _total;
+		info.level = _level.load(std::memory_order_relaxed);
+		info.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+		return info;
+	}
 
-		while (partial >= steps && steps > 0.0)
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (!_cv.wait_for(lock, _interval, [this]()
+		                     { return _stopping; }))
 		{
-			if (timer_mode)
-			{
-				auto now = std::chrono::steady_clock::now();
-				std::chrono::duration<double> elapsed = now - start_time;
-				double seconds_elapsed = elapsed.count();
-
-				double speed = (seconds_elapsed > 0.0) ? (static_cast<double>(done) / seconds_elapsed) : 0.0;
-				double rem = 0.0;
-				if (speed > 0.0)
-				{
-					if (todo > done)
-						rem = static_cast<double>(todo - done) / speed;
-					else
-						rem = 0.0;
-				}
-				else
-				{
-					rem = 0.0;
-				}
-				if (done > todo)
-					rem = 0;
-				int min_e = static_cast<int>(seconds_elapsed / 60);
-				double sec_e = seconds_elapsed - min_e * 60;
-				int min_r = static_cast<int>(rem / 60);
-				double sec_r = rem - min_r * 60;
-
-				std::fprintf(stderr, "%c[%s]  %-5.3g%%   elapsed: %3i min %-2.0f sec   remaining: %3i min %-2.0f sec", 13,
-				             message.c_str(),
-				             100 * (static_cast<double>(done) / todo),
-				             min_e, sec_e, min_r, sec_r);
-			}
-			else
-			{
-				std::fprintf(stderr, "-");
-				std::fflush(stderr);
-			}
-			partial -= steps;
+			lock.unlock();
+			_callback(sample());
+			lock.lock();
 		}
 	}
 
-	void inc(uint64_t ntasks_done, int tid) // threads collaborate to this same progress bar
+	// joins the reporter thread without a last sample (build aborted)
+	void halt()
 	{
-		if (tid < 0 || tid >= _nthreads)
+		if (!_thread.joinable())
 			return;
-		partial_threaded[tid] += ntasks_done;
-		done_threaded[tid] += ntasks_done;
-		while (partial_threaded[tid] >= steps && steps > 0.0)
 		{
-			if (timer_mode)
-			{
-				auto now = std::chrono::steady_clock::now();
-				double elapsed_sec = std::chrono::duration_cast<std::chrono::duration<double>>(now - start_time).count();
-
-				uint64_t total_done = 0;
-				for (int ii = 0; ii < _nthreads; ++ii)
-					total_done += done_threaded[ii];
-
-				double speed = (elapsed_sec > 0.0) ? (static_cast<double>(total_done) / elapsed_sec) : 0.0;
-				double remaining_sec = (speed > 0.0 && todo > total_done) ? (static_cast<double>(todo - total_done) / speed) : 0.0;
-
-				int min_e = static_cast<int>(elapsed_sec / 60);
-				double sec_e = elapsed_sec - min_e * 60;
-				int min_r = static_cast<int>(remaining_sec / 60);
-				double sec_r = remaining_sec - min_r * 60;
-
-				std::fprintf(stderr, "%c[%s]  %-5.3g%%   elapsed: %3i min %-2.0f sec   remaining: %3i min %-2.0f sec", 13,
-				             message.c_str(),
-				             100 * (static_cast<double>(total_done) / todo),
-				             min_e, sec_e, min_r, sec_r);
-			}
-			else
-			{
-				std::fprintf(stderr, "-");
-				std::fflush(stderr);
-			}
-			partial_threaded[tid] -= steps;
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
 		}
+		_cv.notify_one();
+		_thread.join();
 	}
 
-	void set(uint64_t ntasks_done)
-	{
-		if (ntasks_done > done)
-			inc(ntasks_done - done);
-	}
-	// include timer, to print ETA ?
-};
\ No newline at end of file
+	std::vector<counter> _counters;
+	uint64_t _total = 0;
+	std::atomic<int> _level{0};
+	progress_callback _callback;
+	std::chrono::duration<double> _interval{1.0};
+	std::chrono::steady_clock::time_point _start{};
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	bool _stopping = false;
+};
+
+// callback of mphf(..., progress = true) : percentage, elapsed and remaining time on one stderr line
+inline void console_progress(const progress_info& info)
+{
+	double fraction = info.total > 0 ? std::min(1.0, double(info.done) / info.total) : 1.0;
+	double remaining = fraction > 0 ? info.seconds * (1.0 - fraction) / fraction : 0.0;
+	int min_e = static_cast<int>(info.seconds / 60);
+	int min_r = static_cast<int>(remaining / 60);
+	std::fprintf(stderr, "%c[Building BooPHF]  %-5.3g%%   level %2i   elapsed: %3i min %-2.0f sec   remaining: %3i min %-2.0f sec%s", 13,
+	             100 * fraction, info.level, min_e, info.seconds - min_e * 60, min_r, remaining - min_r * 60, info.finished ? "\n" : "");
+	std::fflush(stderr);
+}
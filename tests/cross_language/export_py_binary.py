@@ -4,6 +4,7 @@
 Reads test keys from test_keys.csv, builds MPHF, and exports:
 1. Binary MPHF file (test_data_py.mphf)
 2. Hash results CSV (test_data_py_hashes.csv) - for comparison with C++
+3. One v2 MPHF file and hash results CSV per hasher (test_data_py_<hasher>.mphf / _hashes.csv)
 """
 
 import sys
@@ -14,6 +15,7 @@ import csv
 sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 
 from pybbhash.boophf import mphf
+from pybbhash.hashfunctors import HASHERS
 
 
 def load_test_keys(csv_file):
@@ -42,12 +44,16 @@ def main():
     print(f"\nBuilding Python MPHF...")
     
     # Build MPHF with gamma=2.0 (same as C++ default)
-    mph = mphf(n=len(test_keys), input_range=test_keys, gamma=2.0)
+    # (force the pure-Python port: the native backend is the C++ code under test)
+    mph = mphf(n=len(test_keys), input_range=test_keys, gamma=2.0, backend="python")
     
     # Save binary file into out/
     binary_file = os.path.join('out', 'test_data_py.mphf')
     mph.save(binary_file)
     print(f"[OK] Saved binary to: {binary_file}")
+    binary_file_v2 = os.path.join('out', 'test_data_py_v2.mphf')
+    mph.save(binary_file_v2, version=2)
+    print(f"[OK] Saved v2 binary to: {binary_file_v2}")
 
     # Save test keys and their hash values to CSV for comparison with C++ (into out/)
     hash_csv_file = os.path.join('out', 'test_data_py_hashes.csv')
@@ -59,6 +65,20 @@ def main():
             writer.writerow([key, hash_val])
     
     print(f"[OK] Saved hash results to: {hash_csv_file}")
+
+    # v2 files record the hasher id, the C++ side loads each one with the matching SingleHasher_t
+    # (key128 hashes string keys, Test 12 builds those on the C++ side)
+    hashers = [hasher for hasher in HASHERS if hasher != "key128"]
+    for hasher in hashers:
+        hashed = mph if hasher == "hash64" else mphf(n=len(test_keys), input_range=test_keys, gamma=2.0,
+                                                      backend="python", hasher=hasher)
+        hashed.save(os.path.join('out', f'test_data_py_{hasher}.mphf'), version=2)
+        with open(os.path.join('out', f'test_data_py_{hasher}_hashes.csv'), 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(['key', 'hash_value'])
+            for key in test_keys:
+                writer.writerow([key, hashed.lookup(key)])
+    print(f"[OK] Saved per-hasher binaries and hash results: {', '.join(hashers)}")
     
     # Print some statistics
     print(f"\nMPHF Statistics:")
@@ -1,8 +1,10 @@
 ﻿#include "cpp_headers/BooPHF.h"
 #include <algorithm>
 #include <cstdint>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <map>
 #include <set>
 #include <sstream>
@@ -98,6 +100,16 @@ bool test_cpp_build_and_export()
 	os.close();
 	std::cout << " Saved binary to: test_data_cpp.mphf\n";
 
+	std::ofstream os_v2("out/test_data_cpp_v2.mphf", std::ios::binary);
+	if (!os_v2)
+	{
+		std::cerr << " Failed to create output file\n";
+		return false;
+	}
+	bphf.save(os_v2, MPHF_FORMAT_V2);
+	os_v2.close();
+	std::cout << " Saved v2 binary to: test_data_cpp_v2.mphf\n";
+
 	// Save hash results to CSV
 	std::ofstream csv("out/test_data_cpp_hashes.csv");
 	if (!csv)
@@ -114,6 +126,32 @@ bool test_cpp_build_and_export()
 	csv.close();
 	std::cout << " Saved hash results to: test_data_cpp_hashes.csv\n";
 
+	// the interleaved rank layout answers the same and saves the same bytes
+	boophf_t interleaved;
+	std::ifstream is_flat("out/test_data_cpp.mphf", std::ios::binary);
+	interleaved.load(is_flat);
+	interleaved.setRankLayout(RANK_LAYOUT_INTERLEAVED);
+	std::vector<uint64_t> expected(keys.size()), batched(keys.size());
+	bphf.lookup(keys.data(), keys.size(), expected.data());
+	interleaved.lookup(keys.data(), keys.size(), batched.data());
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		if (interleaved.lookup(keys[i]) != expected[i] || batched[i] != expected[i])
+		{
+			std::cerr << " Interleaved lookup mismatch for key " << keys[i] << "\n";
+			return false;
+		}
+	}
+	std::ostringstream flat_bytes, interleaved_bytes;
+	bphf.save(flat_bytes, MPHF_FORMAT_V2);
+	interleaved.save(interleaved_bytes, MPHF_FORMAT_V2);
+	if (flat_bytes.str() != interleaved_bytes.str())
+	{
+		std::cerr << " Interleaved layout saved a different file\n";
+		return false;
+	}
+	std::cout << " Interleaved rank layout matches flat lookups and file\n";
+
 	// Sample lookups
 	std::cout << "\nSample lookups:\n";
 	for (size_t i : { size_t(0), keys.size() / 2, keys.size() - 1 })
@@ -236,6 +274,59 @@ bool test_load_python_binary()
 		return false;
 	}
 
+	// Batched lookup must agree with the per-key lookup
+	std::vector<uint64_t> batched(keys.size());
+	bphf.lookup(keys.data(), keys.size(), batched.data());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		if (batched[i] != bphf.lookup(keys[i]))
+		{
+			std::cerr << " Batched lookup mismatch for key " << keys[i] << ": "
+			          << batched[i] << " != " << bphf.lookup(keys[i]) << "\n";
+			return false;
+		}
+	}
+	std::cout << " Batched lookup matches per-key lookup\n";
+
+	// Memory-mapped open must agree with the stream load
+	boophf_t mapped;
+	mapped.map("out/test_data_py.mphf");
+	for (uint64_t key : keys)
+	{
+		if (mapped.lookup(key) != bphf.lookup(key))
+		{
+			std::cerr << " Mapped lookup mismatch for key " << key << ": "
+			          << mapped.lookup(key) << " != " << bphf.lookup(key) << "\n";
+			return false;
+		}
+	}
+	std::cout << " Mapped lookup matches loaded lookup\n";
+
+	// The v2 file of the same MPHF, streamed and mapped with checksums
+	std::ifstream is_v2("out/test_data_py_v2.mphf", std::ios::binary);
+	boophf_t loaded_v2;
+	boophf_t mapped_v2;
+	try
+	{
+		loaded_v2.load(is_v2);
+		mapped_v2.map("out/test_data_py_v2.mphf", true);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << " Failed to read Python v2 binary: " << e.what() << "\n";
+		return false;
+	}
+	for (uint64_t key : keys)
+	{
+		if (loaded_v2.lookup(key) != bphf.lookup(key) || mapped_v2.lookup(key) != bphf.lookup(key))
+		{
+			std::cerr << " v2 lookup mismatch for key " << key << ": " << loaded_v2.lookup(key) << " / "
+			          << mapped_v2.lookup(key) << " != " << bphf.lookup(key) << "\n";
+			return false;
+		}
+	}
+	std::cout << " v2 load and map match v1 lookup\n";
+
 	std::cout << " All " << keys.size() << " keys can be looked up\n";
 	std::cout << " All hash values in valid range [0, " << keys.size() - 1 << "]\n";
 	std::cout << " Lookup results match Python assignments exactly\n";
@@ -330,32 +421,1585 @@ bool test_compare_hash_values()
 	return true;
 }
 
-int main()
+// Test 4: every popcount kernel available on this cpu agrees with the generic one
+bool test_popcount_kernels()
 {
-	std::cout << "===========================================================\n";
-	std::cout << "   Cross-Language Binary Compatibility Test (C++ Side)   \n";
-	std::cout << "===========================================================\n";
+	std::cout << "\n=== Test 4: Popcount Kernels ===\n";
+	std::cout << " Selected kernel: " << popcount_kernel_name() << "\n";
 
-	bool all_passed = true;
+	// random words, read at every bit length and from an unaligned start
+	std::vector<uint64_t> words(40);
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (auto& w : words)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		w = x;
+	}
+	std::vector<char> shifted(words.size() * 8 + 1);
+	memcpy(shifted.data() + 1, words.data(), words.size() * 8);
+	const uint64_t* unaligned = reinterpret_cast<const uint64_t*>(shifted.data() + 1);
 
-	// Test 1: Build C++ MPHF and export
-	if (!test_cpp_build_and_export())
+	for (const char* name : {"generic", "popcnt", "avx2", "avx512"})
 	{
-		std::cerr << "\n Test 1 failed\n";
-		all_passed = false;
+		popcount_bits_t kernel = popcount_kernel(name);
+		if (kernel == nullptr)
+		{
+			std::cout << " " << name << ": not supported, skipped\n";
+			continue;
+		}
+		for (uint64_t nbits = 0; nbits <= 64 * 32; nbits++)
+		{
+			uint64_t expected = popcount_bits_generic(words.data(), nbits);
+			if (kernel(words.data(), nbits) != expected || kernel(unaligned, nbits) != expected)
+			{
+				std::cerr << " " << name << " mismatch at " << nbits << " bits\n";
+				return false;
+			}
+		}
+		std::cout << " " << name << ": matches generic\n";
 	}
+	return true;
+}
 
-	// Test 2: Load Python binary
-	if (!test_load_python_binary())
+// Test 5: level hash reduction, the precomputed modulo is exact and multiply-high files round-trip
+bool test_range_reduction()
+{
+	std::cout << "\n=== Test 5: Range Reduction ===\n";
+
+	uint64_t x = 0x2545F4914F6CDD1DULL;
+	auto next = [&x]()
 	{
-		std::cerr << "\n Test 2 failed\n";
-		all_passed = false;
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		return x;
+	};
+	std::vector<uint64_t> domains = {64, 128, 192, 1ULL << 32, (1ULL << 32) + 64, 1ULL << 63, ~0ULL - 63, ~0ULL};
+	for (int ii = 0; ii < 200; ii++)
+		domains.push_back((next() >> (ii % 60)) | 64);
+	for (uint64_t p : domains)
+	{
+		boomphf::range_reducer modulo, multiply;
+		modulo.init(p, boomphf::MPHF_REDUCE_MODULO);
+		multiply.init(p, boomphf::MPHF_REDUCE_MULTIPLY);
+		for (uint64_t word : std::initializer_list<uint64_t>{0, 1, p - 1, p, p + 1, ~0ULL, next(), next(), next(), next()})
+		{
+#if defined(__SIZEOF_INT128__)
+			uint64_t high = (uint64_t)(((unsigned __int128)word * p) >> 64);
+#else
+			uint64_t high = multiply(word);
+#endif
+			if (modulo(word) != word % p || multiply(word) != high)
+			{
+				std::cerr << " Reduction mismatch for " << word << " in [0, " << p << ")\n";
+				return false;
+			}
+		}
 	}
+	std::cout << " Precomputed modulo and multiply-high match on " << domains.size() << " domains\n";
 
-	// Test 3: Compare hash values
-	if (!test_compare_hash_values())
+	auto keys = load_test_keys("out/test_keys.csv");
+	boophf_t bphf(keys.size(), keys, 1, 2.0, false, false, 0.03f, boomphf::MPHF_REDUCE_MULTIPLY);
+	std::ostringstream v1_bytes, v2_bytes;
+	try
 	{
-		std::cerr << "\n Test 3 failed\n";
+		bphf.save(v1_bytes);
+		std::cerr << " v1 save of a multiply-high mphf should throw\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+	bphf.save(v2_bytes, MPHF_FORMAT_V2);
+	std::istringstream is(v2_bytes.str());
+	boophf_t loaded;
+	loaded.load(is);
+	if (loaded.reduction() != boomphf::MPHF_REDUCE_MULTIPLY)
+	{
+		std::cerr << " Reduction mode not restored from the v2 header\n";
+		return false;
+	}
+	std::set<uint64_t> seen;
+	for (uint64_t key : keys)
+	{
+		uint64_t h = loaded.lookup(key);
+		if (h != bphf.lookup(key) || h >= keys.size() || !seen.insert(h).second)
+		{
+			std::cerr << " Multiply-high lookup mismatch for key " << key << "\n";
+			return false;
+		}
+	}
+	std::cout << " Multiply-high mphf is minimal perfect and round-trips through v2\n";
+	return true;
+}
+
+// true if bphf maps keys one-to-one onto [0, keys.size())
+static bool is_minimal_perfect(const boophf_t& bphf, const std::vector<uint64_t>& keys)
+{
+	std::vector<bool> seen(keys.size());
+	for (uint64_t key : keys)
+	{
+		uint64_t h = bphf.lookup(key);
+		if (h >= keys.size() || seen[h])
+			return false;
+		seen[h] = true;
+	}
+	return true;
+}
+
+// distinct pseudo-random keys (xorshift64 has period 2^64 - 1)
+static std::vector<uint64_t> xorshift_keys(size_t n)
+{
+	std::vector<uint64_t> keys(n);
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (auto& k : keys)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		k = x;
+	}
+	return keys;
+}
+
+// Test 6: multi-threaded builds, lock-free chunks for random access inputs, locked copies for forward-only ones,
+// per-thread private level bitsets (the levels of 200000 keys fit in MPHF_PRIVATE_BITS_MAX)
+bool test_threaded_build()
+{
+	std::cout << "\n=== Test 6: Threaded Build ===\n";
+
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	std::list<uint64_t> forward_keys(keys.begin(), keys.end());
+
+	// one thread walks the input in order whatever the iterator : same mphf
+	boophf_t from_vector(keys.size(), keys, 1, 1.0, false, false);
+	boophf_t from_list(keys.size(), forward_keys, 1, 1.0, false, false);
+	for (uint64_t key : keys)
+	{
+		if (from_vector.lookup(key) != from_list.lookup(key))
+		{
+			std::cerr << " Single-threaded vector and list builds differ\n";
+			return false;
+		}
+	}
+
+	for (int nthreads : {2, 8, 16})
+	{
+		boophf_t chunked(keys.size(), keys, nthreads, 1.0, false, false);
+		boophf_t locked(keys.size(), forward_keys, nthreads, 1.0, false, false);
+		if (!is_minimal_perfect(chunked, keys) || !is_minimal_perfect(locked, keys))
+		{
+			std::cerr << " " << nthreads << "-thread build is not minimal perfect\n";
+			return false;
+		}
+		// level bits do not depend on the thread interleaving, only final level indices do
+		for (uint64_t key : keys)
+		{
+			uint64_t idx = from_vector.lookup(key);
+			if (idx < from_vector.lastBitsetRank() && (chunked.lookup(key) != idx || locked.lookup(key) != idx))
+			{
+				std::cerr << " " << nthreads << "-thread build has different level bits\n";
+				return false;
+			}
+		}
+	}
+	// both copies of a repeated key fall through every level, the final table would leave an index unused
+	std::vector<uint64_t> repeated(keys);
+	repeated.push_back(keys[0]);
+	try
+	{
+		boophf_t dup(repeated.size(), repeated, 4, 1.0, false, false);
+		std::cerr << " A repeated key was accepted\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+	std::cout << " Vector (chunked) and list (locked) builds are minimal perfect on 1 to 16 threads, same level bits\n";
+	return true;
+}
+
+// Test 7: writeEach builds spill the keys of each level to per-thread files in tmp_dir and read them back
+bool test_write_each_build()
+{
+	std::cout << "\n=== Test 7: Level Files Build ===\n";
+
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	std::filesystem::path tmp_dir = std::filesystem::temp_directory_path() / ("bbhash_level_files_" + std::to_string(process_id()));
+	std::filesystem::create_directories(tmp_dir);
+
+	bool ok = true;
+	boophf_t in_ram(keys.size(), keys, 1, 1.0, false, false, 0.0);
+	for (int nthreads : {1, 4})
+	{
+		boophf_t spilled(keys.size(), keys, nthreads, 1.0, true, false, 0.0, boomphf::MPHF_REDUCE_MODULO, tmp_dir.string());
+		if (!is_minimal_perfect(spilled, keys))
+		{
+			std::cerr << " " << nthreads << "-thread writeEach build is not minimal perfect\n";
+			ok = false;
+		}
+		// one thread reads its level files in input order : same mphf as in ram
+		for (uint64_t key : keys)
+		{
+			uint64_t idx = in_ram.lookup(key);
+			if ((nthreads == 1 || idx < in_ram.lastBitsetRank()) && spilled.lookup(key) != idx)
+			{
+				std::cerr << " " << nthreads << "-thread writeEach build differs from the in-ram build\n";
+				ok = false;
+				break;
+			}
+		}
+		if (!std::filesystem::is_empty(tmp_dir))
+		{
+			std::cerr << " Level files left in " << tmp_dir << "\n";
+			ok = false;
+		}
+	}
+
+	// block_reader hands out the files back to back, in order, whatever their sizes
+	std::vector<std::string> names;
+	std::vector<uint64_t> written;
+	for (size_t size : {size_t(0), size_t(BFILE_BUFFSIZE + 5), size_t(7)})
+	{
+		names.push_back((tmp_dir / ("blocks_" + std::to_string(names.size()))).string());
+		std::vector<uint64_t> part(keys.begin() + written.size(), keys.begin() + written.size() + size);
+		FILE* f = fopen(names.back().c_str(), "wb");
+		if (f == nullptr)
+		{
+			std::cerr << " Cannot create " << names.back() << "\n";
+			std::filesystem::remove_all(tmp_dir);
+			return false;
+		}
+		if (!part.empty())
+			fwrite(part.data(), sizeof(uint64_t), part.size(), f);
+		fclose(f);
+		written.insert(written.end(), part.begin(), part.end());
+	}
+	std::vector<uint64_t> read_back;
+	{
+		boomphf::file_binary<uint64_t> files(names);
+		boomphf::block_reader<uint64_t> reader(files, 2);
+		boomphf::block_reader<uint64_t>::block b;
+		while (reader.next(b))
+		{
+			read_back.insert(read_back.end(), b.data, b.data + b.size);
+			reader.release(b);
+		}
+	}
+	if (read_back != written)
+	{
+		std::cerr << " block_reader read " << read_back.size() << " elems instead of " << written.size() << "\n";
+		ok = false;
+	}
+	std::filesystem::remove_all(tmp_dir);
+
+	try
+	{
+		boophf_t missing(keys.size(), keys, 1, 1.0, true, false, 0.0, boomphf::MPHF_REDUCE_MODULO, (tmp_dir / "missing").string());
+		std::cerr << " Build into a missing tmp_dir did not throw\n";
+		ok = false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+
+	if (ok)
+		std::cout << " writeEach builds on 1 and 4 threads match the in-ram build and remove their level files\n";
+	return ok;
+}
+
+// Test 8: fast mode keeps the keys left by each level in ram, from _fastModeLevel (or level 0 with perc_elem_loaded = 1)
+bool test_fast_mode_build()
+{
+	std::cout << "\n=== Test 8: Fast Mode Build ===\n";
+
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	boophf_t rescan(keys.size(), keys, 1, 1.0, false, false, 0.0);
+	for (float perc : {0.03f, 0.5f, 1.0f})
+	{
+		boophf_t fast(keys.size(), keys, 1, 1.0, false, false, perc);
+		for (uint64_t key : keys)
+		{
+			if (fast.lookup(key) != rescan.lookup(key))
+			{
+				std::cerr << " perc_elem_loaded " << perc << " build differs from the build without fast mode\n";
+				return false;
+			}
+		}
+	}
+	boophf_t threaded(keys.size(), keys, 4, 1.0, false, false, 1.0);
+	if (!is_minimal_perfect(threaded, keys))
+	{
+		std::cerr << " 4-thread fast mode build is not minimal perfect\n";
+		return false;
+	}
+	std::cout << " Fast mode builds match the build without fast mode\n";
+	return true;
+}
+
+// Test 9: sharded builds, one mphf per shard built concurrently, merged shards, sharded container files
+bool test_sharded_build()
+{
+	std::cout << "\n=== Test 9: Sharded Build ===\n";
+	typedef boomphf::sharded_mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>> sharded_t;
+
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	const uint32_t nb_shards = 7;
+	sharded_t one(keys.size(), keys, nb_shards, 1, 1.0);
+	sharded_t four(keys.size(), keys, nb_shards, 4, 1.0);
+	std::vector<bool> seen(keys.size());
+	for (uint64_t key : keys)
+	{
+		uint64_t h = one.lookup(key);
+		if (h >= keys.size() || seen[h] || four.lookup(key) != h)
+		{
+			std::cerr << " Sharded builds are not minimal perfect or depend on the number of threads\n";
+			return false;
+		}
+		seen[h] = true;
+	}
+
+	// distributed build : shards built on their own from the keys routed by shard_of, then merged
+	std::vector<std::vector<uint64_t>> routed(nb_shards);
+	for (uint64_t key : keys)
+		routed[sharded_t::shard_of(key, nb_shards)].push_back(key);
+	std::vector<std::unique_ptr<sharded_t::shard_t>> shards;
+	for (const auto& shard_keys : routed)
+		shards.emplace_back(new sharded_t::shard_t(shard_keys.size(), shard_keys, 1, 1.0, false, false, 1.0));
+	sharded_t merged(std::move(shards));
+
+	// batched lookup groups the keys by shard : same answers as the single key lookup, misses included
+	std::vector<uint64_t> probe(keys.begin(), keys.begin() + 1000);
+	std::vector<uint64_t> misses = xorshift_keys(keys.size() + 1000); // same sequence, past the keys
+	probe.insert(probe.end(), misses.begin() + keys.size(), misses.end());
+	std::vector<uint64_t> batched(probe.size());
+	one.lookup(probe.data(), probe.size(), batched.data());
+	for (size_t ii = 0; ii < probe.size(); ii++)
+	{
+		if (batched[ii] != one.lookup(probe[ii]))
+		{
+			std::cerr << " Batched sharded lookup differs from the single key lookup\n";
+			return false;
+		}
+	}
+
+	std::stringstream file;
+	one.save(file);
+	sharded_t loaded;
+	loaded.load(file);
+	std::vector<uint64_t> out(keys.size());
+	loaded.lookup(keys.data(), keys.size(), out.data());
+	for (size_t ii = 0; ii < keys.size(); ii++)
+	{
+		if (out[ii] != one.lookup(keys[ii]) || merged.lookup(keys[ii]) != out[ii])
+		{
+			std::cerr << " Merged or loaded sharded mphf differs from the build\n";
+			return false;
+		}
+	}
+	if (loaded.nbKeys() != keys.size() || loaded.nbShards() != nb_shards)
+	{
+		std::cerr << " Loaded sharded mphf has wrong sizes\n";
+		return false;
+	}
+
+	std::string corrupt = file.str();
+	corrupt[sizeof(boomphf::mphf_sharded_header) + 8] ^= 1;
+	std::istringstream corrupt_is(corrupt);
+	try
+	{
+		sharded_t bad;
+		bad.load(corrupt_is);
+		std::cerr << " Corrupt offsets table was not detected\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	std::cout << " Sharded builds on 1 and 4 threads, merged and reloaded shards agree\n";
+	return true;
+}
+
+// Test 10: mphf specialised on its level count, the unrolled lookup agrees with the generic one
+bool test_fixed_levels()
+{
+	std::cout << "\n=== Test 10: Fixed Level Count ===\n";
+	typedef boomphf::mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>, MPHF_NB_LEVELS> fixed_t;
+	typedef boomphf::mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>, 4> short_t;
+
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	boophf_t generic(keys.size(), keys, 1, 1.0, false, false);
+	fixed_t fixed(keys.size(), keys, 1, 1.0, false, false);
+	for (uint64_t key : keys)
+	{
+		if (fixed.lookup(key) != generic.lookup(key))
+		{
+			std::cerr << " Specialised build or lookup differs from the generic mphf\n";
+			return false;
+		}
+	}
+
+	// files of the default mphf load in the MPHF_NB_LEVELS one, not in a 4 level one
+	std::stringstream file;
+	generic.save(file, MPHF_FORMAT_V2);
+	fixed_t loaded;
+	loaded.load(file);
+	for (uint64_t key : {keys[0], keys[1000], keys.back()})
+	{
+		if (loaded.lookup(key) != generic.lookup(key))
+		{
+			std::cerr << " Specialised mphf loaded from a file differs\n";
+			return false;
+		}
+	}
+	std::istringstream again(file.str());
+	try
+	{
+		short_t wrong;
+		wrong.load(again);
+		std::cerr << " A 25 level file loaded into a 4 level mphf\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+
+	// 4 levels : more keys in the final table, still minimal perfect
+	short_t shallow(keys.size(), keys, 2, 1.0, false, false);
+	std::vector<bool> seen(keys.size());
+	for (uint64_t key : keys)
+	{
+		uint64_t h = shallow.lookup(key);
+		if (h >= keys.size() || seen[h])
+		{
+			std::cerr << " 4 level mphf is not minimal perfect\n";
+			return false;
+		}
+		seen[h] = true;
+	}
+	std::cout << " Unrolled lookups match the generic mphf, level counts are checked on load\n";
+	return true;
+}
+
+// one hasher of Test 11 : the Python build recorded with its id loads and agrees with the Python lookups,
+// a C++ build is minimal perfect, the file is rejected by an mphf of another hasher
+template <typename Hasher_t, typename Other_t>
+static bool check_hasher(const std::string& name)
+{
+	typedef boomphf::mphf<uint64_t, Hasher_t> hashed_t;
+	auto py_hashes = load_hashes_from_csv("out/test_data_py_" + name + "_hashes.csv");
+	std::ifstream is("out/test_data_py_" + name + ".mphf", std::ios::binary);
+	if (py_hashes.empty() || !is)
+	{
+		std::cerr << " Missing Python " << name << " export\n";
+		return false;
+	}
+	hashed_t loaded;
+	loaded.load(is);
+	for (const auto& [key, py_hash] : py_hashes)
+	{
+		if (loaded.lookup(key) != py_hash)
+		{
+			std::cerr << " " << name << ": key " << key << " -> C++ " << loaded.lookup(key) << ", Python " << py_hash << "\n";
+			return false;
+		}
+	}
+
+	std::vector<uint64_t> keys = xorshift_keys(100000);
+	hashed_t built(keys.size(), keys, 1, 2.0, false, false);
+	std::vector<bool> seen(keys.size());
+	for (uint64_t key : keys)
+	{
+		uint64_t h = built.lookup(key);
+		if (h >= keys.size() || seen[h])
+		{
+			std::cerr << " " << name << " mphf is not minimal perfect\n";
+			return false;
+		}
+		seen[h] = true;
+	}
+
+	std::stringstream file;
+	built.save(file, MPHF_FORMAT_V2);
+	try
+	{
+		boomphf::mphf<uint64_t, Other_t> wrong;
+		wrong.load(file);
+		std::cerr << " A " << name << " file loaded into an mphf of another hasher\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	std::cout << " " << name << ": " << py_hashes.size() << " Python lookups match, hasher id checked on load\n";
+	return true;
+}
+
+// Test 11: pluggable single hashers, ids recorded in v2 files
+bool test_hashers()
+{
+	std::cout << "\n=== Test 11: Hashers ===\n";
+	// the crc32 instruction and the table agree
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (int ii = 0; ii < 1000; ii++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		if (boomphf::crc32c_u64((uint32_t)ii * 0x01000193u, x) != boomphf::crc32c_u64_generic((uint32_t)ii * 0x01000193u, x))
+		{
+			std::cerr << " crc32c kernels differ\n";
+			return false;
+		}
+	}
+
+	try
+	{
+		boophf_t plain(3, std::vector<uint64_t>{1, 2, 3}, 1, 2.0, false, false);
+		std::stringstream v1;
+		plain.save(v1);
+		boomphf::mphf<uint64_t, boomphf::WyMixHashFunctor<uint64_t>> wy(3, std::vector<uint64_t>{1, 2, 3}, 1, 2.0, false, false);
+		wy.save(v1);
+		std::cerr << " A wymix mphf was saved as v1\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+
+	return check_hasher<boomphf::SingleHashFunctor<uint64_t>, boomphf::Crc32cHashFunctor<uint64_t>>("hash64") &&
+	       check_hasher<boomphf::WyMixHashFunctor<uint64_t>, boomphf::SingleHashFunctor<uint64_t>>("wymix") &&
+	       check_hasher<boomphf::Crc32cHashFunctor<uint64_t>, boomphf::WyMixHashFunctor<uint64_t>>("crc32c");
+}
+
+// minimal perfect over string keys hashed to 128 bits
+template <typename string_mphf_t>
+static bool is_minimal_perfect_128(const string_mphf_t& bphf, const std::vector<boomphf::hash_pair_t>& keys)
+{
+	std::vector<bool> seen(keys.size());
+	for (const auto& key : keys)
+	{
+		uint64_t h = bphf.lookup(key);
+		if (h >= keys.size() || seen[h])
+			return false;
+		seen[h] = true;
+	}
+	return true;
+}
+
+// Test 12: string keys, hashed once with murmur3_128, fingerprints in the final table
+bool test_string_keys()
+{
+	std::cout << "\n=== Test 12: String Keys ===\n";
+	// SMHasher verification value of MurmurHash3_x64_128
+	std::vector<uint8_t> data(256), digests;
+	for (int ii = 0; ii < 256; ii++)
+	{
+		data[ii] = (uint8_t)ii;
+		boomphf::hash_pair_t h = boomphf::murmur3_128(data.data(), ii, 256 - ii);
+		digests.insert(digests.end(), (const uint8_t*)h.data(), (const uint8_t*)h.data() + 16);
+	}
+	if ((uint32_t)boomphf::murmur3_128(digests.data(), digests.size())[0] != 0x6384BA69)
+	{
+		std::cerr << " murmur3_128 differs from the reference\n";
+		return false;
+	}
+
+	typedef boomphf::mphf<boomphf::hash_pair_t, boomphf::Key128HashFunctor> string_mphf_t;
+	typedef boomphf::mphf<boomphf::hash_pair_t, boomphf::Key128HashFunctor, 4> shallow_t;
+	std::vector<boomphf::hash_pair_t> keys;
+	for (uint64_t key : xorshift_keys(100000))
+	{
+		std::string s = "https://example.org/" + std::to_string(key);
+		keys.push_back(boomphf::murmur3_128(s.data(), s.size()));
+	}
+	string_mphf_t built(keys.size(), keys, 2, 2.0, false, false);
+	shallow_t shallow(keys.size(), keys, 2, 1.0, false, false);
+	if (!is_minimal_perfect_128(built, keys) || !is_minimal_perfect_128(shallow, keys) || shallow.finalHash().size() == 0)
+	{
+		std::cerr << " String mphf is not minimal perfect\n";
+		return false;
+	}
+
+	std::stringstream file;
+	built.save(file, MPHF_FORMAT_V2);
+	string_mphf_t loaded;
+	loaded.load(file);
+	for (size_t ii = 0; ii < keys.size(); ii += 997)
+	{
+		if (loaded.lookup(keys[ii]) != built.lookup(keys[ii]))
+		{
+			std::cerr << " String mphf loaded from a file differs\n";
+			return false;
+		}
+	}
+
+	// duplicate keys reach the final table with the same fingerprint
+	keys.push_back(keys[12345]);
+	try
+	{
+		shallow_t dup(keys.size(), keys, 2, 1.0, false, false);
+		std::cerr << " Duplicate string keys were not detected\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	std::cout << " murmur3_128 matches the reference, " << shallow.finalHash().size() << " final fingerprints, duplicates rejected\n";
+	return true;
+}
+
+// Test 13: fingerprints reject keys not in the set, members keep their index
+bool test_fingerprints()
+{
+	std::cout << "\n=== Test 13: Fingerprints ===\n";
+	std::vector<uint64_t> all = xorshift_keys(200000);
+	std::vector<uint64_t> keys(all.begin(), all.begin() + 100000);
+	std::vector<uint64_t> foreign(all.begin() + 100000, all.end());
+	boophf_t plain(keys.size(), keys, 1, 2.0, false, false);
+	boophf_t checked(keys.size(), keys, 1, 2.0, false, false);
+	checked.addFingerprints(keys, 12, 4);
+	for (uint64_t key : keys)
+	{
+		if (checked.lookup(key) != plain.lookup(key))
+		{
+			std::cerr << " A key of the set lost its index\n";
+			return false;
+		}
+	}
+
+	std::vector<uint64_t> out(foreign.size());
+	checked.lookup(foreign.data(), foreign.size(), out.data());
+	uint64_t accepted = 0;
+	for (size_t ii = 0; ii < foreign.size(); ii++)
+	{
+		if (out[ii] != checked.lookup(foreign[ii]))
+		{
+			std::cerr << " Batched and single lookups differ\n";
+			return false;
+		}
+		accepted += out[ii] != ULLONG_MAX;
+	}
+	// 2^-12 of 100000 keys : ~24 expected
+	if (accepted > 60)
+	{
+		std::cerr << " " << accepted << " keys not in the set passed 12-bit fingerprints\n";
+		return false;
+	}
+
+	std::stringstream file;
+	checked.save(file, MPHF_FORMAT_V2);
+	boophf_t loaded;
+	loaded.load(file);
+	if (loaded.fingerprintBits() != 12)
+	{
+		std::cerr << " Fingerprints were not loaded\n";
+		return false;
+	}
+	for (size_t ii = 0; ii < foreign.size(); ii += 13)
+	{
+		if (loaded.lookup(foreign[ii]) != out[ii] || loaded.lookup(keys[ii]) != plain.lookup(keys[ii]))
+		{
+			std::cerr << " Loaded fingerprints differ\n";
+			return false;
+		}
+	}
+
+	try
+	{
+		std::stringstream v1;
+		checked.save(v1);
+		std::cerr << " Fingerprints were saved as v1\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+	try
+	{
+		plain.addFingerprints(keys, 33);
+		std::cerr << " 33-bit fingerprints were accepted\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+	std::cout << " " << accepted << " of " << foreign.size() << " keys not in the set pass 12-bit fingerprints, v2 round trip\n";
+	return true;
+}
+
+// keys flow from level to level, the counters do not depend on the thread count or on where the keys are kept
+static bool check_build_stats(const boomphf::mphf_build_stats& stats, uint64_t n, const char* name)
+{
+	uint64_t placed = 0;
+	uint64_t keys_in = n;
+	for (size_t ii = 0; ii < stats.levels.size(); ii++)
+	{
+		const boomphf::mphf_level_stats& ls = stats.levels[ii];
+		if (ls.keys_in != keys_in || ls.keys_placed > ls.keys_in || ls.collisions > ls.keys_in || ls.bitset_bytes <= ls.rank_bytes)
+		{
+			std::cerr << " " << name << ": inconsistent counters at level " << ii << "\n";
+			return false;
+		}
+		keys_in -= ls.keys_placed;
+		placed += ls.keys_placed;
+	}
+	if (placed != n || stats.levels.back().keys_placed != stats.final_keys || stats.levels[0].keys_read != n)
+	{
+		std::cerr << " " << name << ": " << placed << " keys placed of " << n << "\n";
+		return false;
+	}
+	return true;
+}
+
+// Test 14: build_stats() counters account for every key level by level, in fast-mode and writeEach builds and after a load
+bool test_build_stats()
+{
+	std::cout << "\n=== Test 14: Build stats ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	boophf_t fast(keys.size(), keys, 1, 2.0, false, false);
+	boophf_t spilled(keys.size(), keys, 4, 2.0, true, false);
+	boomphf::mphf_build_stats fs = fast.build_stats();
+	boomphf::mphf_build_stats ss = spilled.build_stats();
+	if (!check_build_stats(fs, keys.size(), "fast mode") || !check_build_stats(ss, keys.size(), "writeEach"))
+		return false;
+	if (fs.fast_mode_level < 0 || ss.fast_mode_level != -1 || fs.total_bits != fast.totalBitSize())
+	{
+		std::cerr << " Wrong fast mode level or total bits\n";
+		return false;
+	}
+
+	uint64_t spill = 0;
+	for (size_t ii = 0; ii < fs.levels.size(); ii++)
+	{
+		if (fs.levels[ii].keys_in != ss.levels[ii].keys_in || fs.levels[ii].collisions != ss.levels[ii].collisions)
+		{
+			std::cerr << " Builds of the same keys differ at level " << ii << "\n";
+			return false;
+		}
+		// level ii > 1 reads back the file level ii - 1 wrote
+		if (ii > 1 && ss.levels[ii].spill_bytes_read != ss.levels[ii - 1].spill_bytes_written)
+		{
+			std::cerr << " Level " << ii << " read " << ss.levels[ii].spill_bytes_read << " spilled bytes, "
+			          << ss.levels[ii - 1].spill_bytes_written << " were written\n";
+			return false;
+		}
+		spill += ss.levels[ii].spill_bytes_written;
+		if (fs.levels[ii].spill_bytes_written != 0)
+		{
+			std::cerr << " A fast mode build spilled keys\n";
+			return false;
+		}
+	}
+	if (spill == 0)
+	{
+		std::cerr << " The writeEach build spilled nothing\n";
+		return false;
+	}
+
+	std::stringstream file;
+	fast.save(file, MPHF_FORMAT_V2);
+	boophf_t loaded;
+	loaded.load(file);
+	boomphf::mphf_build_stats ls = loaded.build_stats();
+	if (ls.levels[0].keys_in != 0 || ls.fast_mode_level != -1 || ls.levels[0].bitset_bytes == 0 || ls.total_bits != loaded.totalBitSize() || ls.final_keys != fs.final_keys)
+	{
+		std::cerr << " Loaded stats differ\n";
+		return false;
+	}
+	std::cout << " level 0: " << fs.levels[0].keys_placed << " of " << fs.levels[0].keys_in << " keys placed, " << fs.levels[0].collisions
+	          << " collisions; " << spill << " bytes spilled by writeEach\n";
+	return true;
+}
+
+// Test 15: progress callbacks, the samples never go backwards and the last one is finished at the expected total
+bool test_progress_callback()
+{
+	std::cout << "\n=== Test 15: Progress Callback ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(500000);
+	for (bool writeEach : {false, true})
+	{
+		std::vector<progress_info> samples;
+		boophf_t bphf(keys.size(), keys, 4, 2.0, writeEach, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".",
+		              [&](const progress_info& info)
+		              { samples.push_back(info); },
+		              0.001);
+		uint64_t keys_read = 0;
+		for (const auto& ls : bphf.build_stats().levels)
+			keys_read += ls.keys_read;
+		// the estimate comes from the level sizes, the keys read from the build
+		uint64_t total = samples.front().total;
+		if (total < keys_read * 0.95 || total > keys_read * 1.05)
+		{
+			std::cerr << " Expected " << total << " keys read, the build read " << keys_read << "\n";
+			return false;
+		}
+		for (size_t ii = 1; ii < samples.size(); ii++)
+		{
+			if (samples[ii].done < samples[ii - 1].done || samples[ii].level < samples[ii - 1].level || samples[ii - 1].finished)
+			{
+				std::cerr << " Progress samples go backwards\n";
+				return false;
+			}
+		}
+		if (!samples.back().finished || samples.back().done != samples.back().total)
+		{
+			std::cerr << " No final progress sample\n";
+			return false;
+		}
+		std::cout << " " << (writeEach ? "writeEach" : "fast mode") << ": " << samples.size() << " samples, " << total << " keys expected, "
+		          << keys_read << " read\n";
+	}
+	return true;
+}
+
+// Test 16: level bitsets and ranks in one arena, v2 levels written and read in one call
+bool test_level_arena()
+{
+	std::cout << "\n=== Test 16: Level arena ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(300000);
+	boophf_t bphf(keys.size(), keys, 4, 2.0, false, false);
+	std::stringstream direct;
+	bphf.save(direct, MPHF_FORMAT_V2);
+
+	// interleaving moves the levels out of the arena, they are then saved section by section
+	bphf.setRankLayout(RANK_LAYOUT_INTERLEAVED);
+	bool left = !bphf.arenaBacked();
+	bphf.setRankLayout(RANK_LAYOUT_FLAT);
+	std::stringstream by_section;
+	bphf.save(by_section, MPHF_FORMAT_V2);
+	if (!left || by_section.str() != direct.str())
+	{
+		std::cerr << " The arena write differs from the section writes\n";
+		return false;
+	}
+
+	boophf_t loaded;
+	direct.seekg(0);
+	loaded.load(direct);
+	std::stringstream again;
+	loaded.save(again, MPHF_FORMAT_V2);
+	if (!loaded.arenaBacked() || again.str() != direct.str() || !is_minimal_perfect(loaded, keys))
+	{
+		std::cerr << " The v2 load did not read back the arena\n";
+		return false;
+	}
+
+	// the built and the loaded vectors hold the same rank samples
+	boomphf::mphf_build_stats bs = boophf_t(keys.size(), keys, 1, 2.0, false, false).build_stats();
+	boomphf::mphf_build_stats ls = loaded.build_stats();
+	uint64_t level_bytes = 0;
+	for (size_t ii = 0; ii < bs.levels.size(); ii++)
+	{
+		level_bytes += bs.levels[ii].bitset_bytes;
+		if (bs.levels[ii].bitset_bytes != ls.levels[ii].bitset_bytes || bs.levels[ii].rank_bytes != ls.levels[ii].rank_bytes)
+		{
+			std::cerr << " Level " << ii << " takes " << bs.levels[ii].bitset_bytes << " bytes built, " << ls.levels[ii].bitset_bytes << " loaded\n";
+			return false;
+		}
+	}
+
+	std::stringstream v1;
+	bphf.save(v1);
+	boophf_t from_v1;
+	from_v1.load(v1);
+	std::stringstream v1_to_v2;
+	from_v1.save(v1_to_v2, MPHF_FORMAT_V2);
+	if (from_v1.arenaBacked() || v1_to_v2.str() != direct.str())
+	{
+		std::cerr << " v1 loads changed\n";
+		return false;
+	}
+	std::cout << " " << level_bytes << " bytes of levels written and read in one call\n";
+	return true;
+}
+
+// Test 17: overlay mphf, deltas over new keys with overrides, container file round trip, compaction
+bool test_overlay()
+{
+	std::cout << "\n=== Test 17: Overlay mphf ===\n";
+	typedef boomphf::overlay_mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>> overlay_t;
+
+	// 4-bit fingerprints : 1 in 16 new keys is accepted by an older segment and needs an override
+	std::vector<uint64_t> all = xorshift_keys(230000);
+	std::vector<uint64_t> keys(all.begin(), all.begin() + 200000);
+	overlay_t overlay(keys.size(), keys, 2, 2.0, 4);
+	for (size_t d = 0; d < 3; d++)
+	{
+		std::vector<uint64_t> delta(all.begin() + 200000 + 10000 * d, all.begin() + 210000 + 10000 * d);
+		overlay.append(delta.size(), delta, 2);
+		keys.insert(keys.end(), delta.begin(), delta.end());
+	}
+	if (overlay.nbKeys() != all.size() || overlay.nbDeltas() != 3 || overlay.overrides().size() == 0)
+	{
+		std::cerr << " Overlay has " << overlay.nbKeys() << " keys in " << overlay.nbSegments() << " segments, " << overlay.overrides().size() << " override\n";
+		return false;
+	}
+
+	std::vector<bool> seen(all.size());
+	std::vector<uint64_t> out(all.size());
+	overlay.lookup(all.data(), all.size(), out.data());
+	for (size_t ii = 0; ii < all.size(); ii++)
+	{
+		uint64_t h = overlay.lookup(all[ii]);
+		if (h >= all.size() || seen[h] || out[ii] != h || (ii < 200000 && h != overlay.segment(0)->lookup(all[ii])))
+		{
+			std::cerr << " Overlay is not minimal perfect or moved base indice\n";
+			return false;
+		}
+		seen[h] = true;
+	}
+
+	std::stringstream file;
+	overlay.save(file);
+	overlay_t loaded;
+	loaded.load(file);
+	for (size_t ii = 0; ii < all.size(); ii++)
+	{
+		if (loaded.lookup(all[ii]) != out[ii])
+		{
+			std::cerr << " Loaded overlay differs from the buil\n";
+			return false;
+		}
+	}
+	std::string corrupt = file.str();
+	corrupt[sizeof(boomphf::mphf_overlay_header) + 8 * 2 * 5] ^= 1; // first override key
+	std::istringstream corrupt_is(corrupt);
+	try
+	{
+		overlay_t bad;
+		bad.load(corrupt_is);
+		std::cerr << " Corrupt override table was not detected\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+
+	overlay_t compacted = overlay.compact(keys.size(), keys, 2);
+	std::fill(seen.begin(), seen.end(), false);
+	for (uint64_t key : all)
+	{
+		uint64_t h = compacted.lookup(key);
+		if (h >= all.size() || seen[h])
+		{
+			std::cerr << " Compacted overlay is not minimal perfect\n";
+			return false;
+		}
+		seen[h] = true;
+	}
+	if (compacted.nbDeltas() != 0 || compacted.overrides().size() != 0 || compacted.fingerprintBits() != 4 || !overlay.shouldCompact(2) || compacted.shouldCompact())
+	{
+		std::cerr << " Compaction left deltas or overrides\n";
+		return false;
+	}
+	std::cout << " 3 deltas over 200000 base keys, " << overlay.overrides().size() << " overrides, compacted to one segment\n";
+	return true;
+}
+
+// Test 18: positional save / load on 1 and 4 threads write and read the stream bytes
+bool test_positional_io()
+{
+	std::cout << "\n=== Test 18: Positional save/load ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(300000);
+	boophf_t bphf(keys.size(), keys, 4, 2.0, false, false);
+	auto file_bytes = [](const std::string& path)
+	{
+		std::ifstream is(path, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+	};
+
+	// the positional writes produce the stream bytes, flat or interleaved levels, on any number of threads
+	for (uint32_t version : {MPHF_FORMAT_V1, MPHF_FORMAT_V2})
+	{
+		std::ostringstream direct;
+		bphf.save(direct, version);
+		for (int layout : {RANK_LAYOUT_FLAT, RANK_LAYOUT_INTERLEAVED})
+		{
+			bphf.setRankLayout((rank_layout)layout);
+			for (int threads : {1, 4})
+			{
+				bphf.save("out/test_positional.mphf", version, true, threads);
+				if (file_bytes("out/test_positional.mphf") != direct.str())
+				{
+					std::cerr << " v" << version << " positional save on " << threads << " threads differs from save(os)\n";
+					return false;
+				}
+				boophf_t loaded;
+				loaded.load("out/test_positional.mphf", threads);
+				std::ostringstream again;
+				loaded.save(again, version);
+				if (!loaded.arenaBacked() || again.str() != direct.str() || !is_minimal_perfect(loaded, keys))
+				{
+					std::cerr << " v" << version << " positional load on " << threads << " threads differs from load(is)\n";
+					return false;
+				}
+			}
+		}
+		bphf.setRankLayout(RANK_LAYOUT_FLAT);
+
+		// truncated files are reported, not loaded
+		std::string bytes = direct.str();
+		std::ofstream os("out/test_positional.mphf", std::ios::binary);
+		os.write(bytes.data(), (std::streamsize)(bytes.size() - 8));
+		os.close();
+		boophf_t truncated;
+		bool thrown = false;
+		try
+		{
+			truncated.load("out/test_positional.mphf", 4);
+		}
+		catch (const std::runtime_error&)
+		{
+			thrown = true;
+		}
+		if (!thrown)
+		{
+			std::cerr << " A truncated v" << version << " file loaded\n";
+			return false;
+		}
+	}
+
+	// v2 files with fingerprints
+	bphf.addFingerprints(keys, 8);
+	std::ostringstream direct;
+	bphf.save(direct, MPHF_FORMAT_V2);
+	bphf.save("out/test_positional.mphf", MPHF_FORMAT_V2, true, 4);
+	boophf_t loaded;
+	loaded.load("out/test_positional.mphf", 4);
+	std::ostringstream again;
+	loaded.save(again, MPHF_FORMAT_V2);
+	if (file_bytes("out/test_positional.mphf") != direct.str() || again.str() != direct.str() || loaded.fingerprintBits() != 8)
+	{
+		std::cerr << " Fingerprints did not round trip through positional I/O\n";
+		return false;
+	}
+	std::cout << " " << direct.str().size() << " bytes written and read in " << (MPHF_IO_CHUNK >> 20) << " MiB chunks\n";
+	return true;
+}
+
+// Test 19: lookups on a persistent lookup_pool, with and without NUMA replicas, match the batched lookup
+bool test_lookup_pool()
+{
+	std::cout << "\n=== Test 19: Lookup pool ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(300000);
+	boophf_t bphf(keys.size(), keys, 2, 2.0, false, false);
+	// keys and keys + 1 (mostly misses), several chunks per worker
+	std::vector<uint64_t> queries(keys);
+	for (uint64_t key : keys)
+		queries.push_back(key + 1);
+	std::vector<uint64_t> expected(queries.size());
+	bphf.lookup(queries.data(), queries.size(), expected.data());
+
+	// two fake nodes : each gets a replica loaded by one of its workers
+#ifdef _WIN32
+	_putenv_s("BBHASH_NUMA_NODES", "2");
+#else
+	setenv("BBHASH_NUMA_NODES", "2", 1);
+#endif
+	for (bool numa : {false, true})
+	{
+		for (int threads : {1, 4})
+		{
+			boomphf::lookup_pool<boophf_t> pool(bphf, threads, numa);
+			if (pool.nbThreads() != threads || pool.nbReplicas() != (size_t)(numa ? std::min(2, threads) : 0))
+			{
+				std::cerr << " Pool of " << threads << " threads has " << pool.nbReplicas() << " replicas\n";
+				return false;
+			}
+			for (int batch = 0; batch < 3; batch++)
+			{
+				std::vector<uint64_t> out(queries.size(), 0);
+				pool.lookup(queries.data(), queries.size(), out.data());
+				if (out != expected)
+				{
+					std::cerr << " Pool lookups on " << threads << " threads (replicas " << numa << ") differ\n";
+					return false;
+				}
+			}
+			// small batches are looked up by the caller
+			uint64_t out = 0;
+			pool.lookup(queries.data(), 1, &out);
+			if (out != expected[0])
+				return false;
+		}
+	}
+#ifdef _WIN32
+	_putenv_s("BBHASH_NUMA_NODES", "");
+#else
+	unsetenv("BBHASH_NUMA_NODES");
+#endif
+	std::cout << " " << queries.size() << " keys looked up in " << MPHF_LOOKUP_CHUNK << "-key chunks by persistent workers, replicas agree\n";
+	return true;
+}
+
+// hot key cache over a skewed sample : same lookups, the hottest deep keys cached, file round trip
+template <typename mphf_t>
+static bool check_hot_cache(const char* name)
+{
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	mphf_t bphf(keys.size(), keys, 2, 2.0, false, false);
+	std::vector<uint64_t> queries(keys);
+	for (uint64_t key : keys)
+		queries.push_back(key + 1);
+	std::vector<uint64_t> expected(queries.size());
+	bphf.lookup(queries.data(), queries.size(), expected.data());
+
+	// every key and miss once, the first 5000 keys 8 times more
+	std::vector<uint64_t> sample(queries);
+	for (int rep = 0; rep < 8; rep++)
+		sample.insert(sample.end(), keys.begin(), keys.begin() + 5000);
+	bphf.buildHotCache(sample.data(), sample.size(), 1024);
+	const auto& hot = bphf.hotCache();
+	if (hot.size() != 1024 || hot.filled() == 0 || hot.minLevel() != MPHF_HOT_MIN_LEVEL)
+	{
+		std::cerr << " " << name << ": hot key cache of " << hot.size() << " slots has " << hot.filled() << " keys\n";
+		return false;
+	}
+	// about 750 of the hot keys are deep, they take half the slots or more
+	std::set<uint64_t> hot_indices(expected.begin(), expected.begin() + 5000);
+	size_t nb_hot = 0;
+	for (const auto& s : hot.slots())
+		nb_hot += s.index != ULLONG_MAX && hot_indices.count(s.index);
+	if (nb_hot * 2 < hot.filled())
+	{
+		std::cerr << " " << name << ": " << nb_hot << " of " << hot.filled() << " cached keys are hot\n";
+		return false;
+	}
+
+	std::vector<uint64_t> out(queries.size());
+	bphf.lookup(queries.data(), queries.size(), out.data());
+	for (size_t ii = 0; ii < queries.size(); ii++)
+	{
+		if (out[ii] != expected[ii] || bphf.lookup(queries[ii]) != expected[ii])
+		{
+			std::cerr << " " << name << ": lookup of query " << ii << " changed with the hot key cache\n";
+			return false;
+		}
+	}
+
+	// the file loads into a copy of the mphf, not into another one ; corruption is reported
+	std::stringstream file;
+	bphf.saveHotCache(file);
+	std::stringstream image;
+	bphf.save(image, MPHF_FORMAT_V2);
+	mphf_t loaded;
+	loaded.load(image);
+	std::istringstream is(file.str());
+	if (!loaded.loadHotCache(is) || loaded.hotCache().filled() != hot.filled())
+		return false;
+	loaded.lookup(queries.data(), queries.size(), out.data());
+	if (out != expected)
+		return false;
+	std::vector<uint64_t> other_keys(keys.begin() + 1, keys.end());
+	mphf_t other(other_keys.size(), other_keys, 1, 2.0, false, false);
+	std::istringstream other_is(file.str());
+	if (other.loadHotCache(other_is) || !other.hotCache().empty())
+		return false;
+	std::string corrupt = file.str();
+	corrupt[sizeof(boomphf::mphf_hot_header) + 8] ^= 1;
+	std::istringstream corrupt_is(corrupt);
+	try
+	{
+		loaded.loadHotCache(corrupt_is);
+		std::cerr << " " << name << ": corrupt hot key cache loaded\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	std::cout << " " << name << ": " << hot.filled() << " of " << hot.size() << " slots filled, " << nb_hot << " with hot keys\n";
+	return true;
+}
+
+// Test 20: hot key cache over a skewed sample, for the generic mphf and the 4-level specialisation
+bool test_hot_key_cache()
+{
+	std::cout << "\n=== Test 20: Hot key cache ===\n";
+	typedef boomphf::mphf<uint64_t, boomphf::SingleHashFunctor<uint64_t>, 4> short_t;
+	return check_hot_cache<boophf_t>("25 levels") && check_hot_cache<short_t>("4 levels");
+}
+
+// Test 21: static map, packed values and fingerprints in one slot, file round trip, duplicate keys rejected
+bool test_static_map()
+{
+	std::cout << "\n=== Test 21: Static map ===\n";
+	typedef boomphf::static_map<uint64_t, uint32_t, boomphf::SingleHashFunctor<uint64_t>> map_t;
+
+	// 10-bit values and 8-bit fingerprints in 18-bit slots
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	std::vector<uint32_t> values(keys.size());
+	for (size_t ii = 0; ii < keys.size(); ii++)
+		values[ii] = (uint32_t)(keys[ii] % 1000);
+	map_t map(keys.size(), keys, values.data(), 10, 8, 2);
+	if (map.nbKeys() != keys.size() || map.slots().bits() != 18 || map.index().fingerprintBits() != 0)
+		return false;
+
+	std::vector<uint64_t> queries(keys);
+	for (uint64_t key : keys)
+		queries.push_back(key + 1);
+	std::vector<uint32_t> out(queries.size());
+	std::vector<uint8_t> found(queries.size());
+	map.get(queries.data(), queries.size(), out.data(), 1234, found.data());
+	size_t false_hits = 0;
+	for (size_t ii = 0; ii < queries.size(); ii++)
+	{
+		uint32_t value;
+		bool hit = map.find(queries[ii], value);
+		if (ii < keys.size() && (!hit || value != values[ii] || out[ii] != values[ii] || !found[ii]))
+		{
+			std::cerr << " Key " << ii << " maps to " << out[ii] << " instead of " << values[ii] << "\n";
+			return false;
+		}
+		if (ii >= keys.size())
+		{
+			if (hit != (found[ii] == 1) || (!hit && out[ii] != 1234) || map.get(queries[ii], 1234) != out[ii])
+				return false;
+			false_hits += hit;
+		}
+	}
+	// 1 in 256 expected
+	if (false_hits * 100 > keys.size())
+	{
+		std::cerr << " " << false_hits << " keys not in the map were found\n";
+		return false;
+	}
+
+	{
+		std::ofstream os("out/static_map.bbm", std::ios::binary);
+		map.save(os);
+	}
+	map_t loaded, mapped;
+	std::ifstream is("out/static_map.bbm", std::ios::binary);
+	loaded.load(is);
+	mapped.map("out/static_map.bbm", true);
+	std::vector<uint32_t> out_loaded(queries.size()), out_mapped(queries.size());
+	loaded.get(queries.data(), queries.size(), out_loaded.data(), 1234);
+	mapped.get(queries.data(), queries.size(), out_mapped.data(), 1234);
+	if (out_loaded != out || out_mapped != out || !mapped.mapped() || mapped.valueBits() != 10 || mapped.fingerprintBits() != 8)
+	{
+		std::cerr << " Loaded or mapped static map differs from the built one\n";
+		return false;
+	}
+
+	std::stringstream file;
+	map.save(file);
+	std::string corrupt = file.str();
+	corrupt[corrupt.size() - 8] ^= 1; // last slot word
+	std::istringstream corrupt_is(corrupt);
+	try
+	{
+		map_t bad;
+		bad.load(corrupt_is);
+		std::cerr << " Corrupt slots were not detected\n";
+		return false;
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	try
+	{
+		map_t narrow(keys.size(), keys, values.data(), 9);
+		std::cerr << " A 10-bit value was packed in 9 bits\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+	// a repeated key is rejected instead of ORing both values into one slot
+	for (int num_thread : {1, 2})
+	{
+		std::vector<uint64_t> twice(100);
+		for (size_t ii = 0; ii < twice.size(); ii++)
+			twice[ii] = keys[ii];
+		twice.insert(twice.end(), twice.begin(), twice.end());
+		std::vector<uint32_t> indices(twice.size());
+		for (size_t ii = 0; ii < indices.size(); ii++)
+			indices[ii] = (uint32_t)ii;
+		try
+		{
+			map_t dup(twice.size(), twice, indices.data(), 8, 0, num_thread);
+			std::cerr << " Duplicate keys were accepted\n";
+			return false;
+		}
+		catch (const std::invalid_argument&)
+		{
+		}
+	}
+	std::cout << " " << keys.size() << " keys, " << (double)map.totalBitSize() / keys.size() << " bits/key, " << false_hits << " false hits in " << keys.size() << " misses\n";
+	return true;
+}
+
+// Test 22: per-level gamma schedule and early level termination, v1 files when nothing is scheduled
+bool test_level_schedule()
+{
+	std::cout << "\n=== Test 22: Level schedule ===\n";
+	std::vector<uint64_t> keys = xorshift_keys(200000);
+	boophf_t plain(keys.size(), keys, 1, 2.0, false, false);
+
+	// one gamma repeated is the default schedule : same levels, same v1 file
+	boomphf::mphf_level_schedule repeated;
+	repeated.gammas = {2.0, 2.0};
+	boophf_t same(keys.size(), keys, 1, 7.0, false, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".", nullptr, 1.0, repeated);
+	std::stringstream plain_file, same_file;
+	plain.save(plain_file);
+	same.save(same_file);
+	if (same.scheduled() || same.gamma() != 2.0 || plain_file.str() != same_file.str())
+	{
+		std::cerr << " A repeated gamma changed the mphf\n";
+		return false;
+	}
+
+	// one gamma and early termination : fewer levels, still a v1 file
+	boomphf::mphf_level_schedule stop;
+	stop.min_keys = 1000;
+	boophf_t short_build(keys.size(), keys, 1, 2.0, false, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".", nullptr, 1.0, stop);
+	std::stringstream short_file;
+	short_build.save(short_file);
+	boophf_t short_loaded;
+	short_loaded.load(short_file);
+	if (short_build.scheduled() || short_build.nbLevels() >= plain.nbLevels() || !is_minimal_perfect(short_build, keys) || !is_minimal_perfect(short_loaded, keys))
+	{
+		std::cerr << " Early termination left " << short_build.nbLevels() << " levels\n";
+		return false;
+	}
+	for (uint32_t ii = 0; ii + 1 < short_build.nbLevels(); ii++)
+	{
+		if (short_build.levelDomain(ii) != plain.levelDomain(ii) || short_loaded.levelDomain(ii) != plain.levelDomain(ii))
+			return false;
+	}
+
+	// a gamma of 3 for level 0 and 1.5 after it, at most 8 levels
+	boomphf::mphf_level_schedule uneven;
+	uneven.gammas = {3.0, 1.5};
+	uneven.min_keys = 100;
+	uneven.max_levels = 8;
+	boophf_t scheduled(keys.size(), keys, 2, 2.0, false, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".", nullptr, 1.0, uneven);
+	if (!scheduled.scheduled() || scheduled.gamma() != 3.0 || scheduled.nbLevels() > 8 || !is_minimal_perfect(scheduled, keys) ||
+	    !check_build_stats(scheduled.build_stats(), keys.size(), "scheduled"))
+		return false;
+	if (scheduled.levelDomain(0) < 3 * keys.size() || scheduled.levelDomain(1) > plain.levelDomain(1))
+	{
+		std::cerr << " Level sizes do not follow the gammas\n";
+		return false;
+	}
+	try
+	{
+		std::stringstream v1;
+		scheduled.save(v1);
+		std::cerr << " A scheduled mphf was saved as v1\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+
+	// v2 files record the level sizes
+	{
+		std::ofstream os("out/scheduled.mphf", std::ios::binary);
+		scheduled.save(os, MPHF_FORMAT_V2);
+	}
+	boophf_t from_stream, from_file, mapped;
+	std::ifstream is("out/scheduled.mphf", std::ios::binary);
+	from_stream.load(is);
+	from_file.load("out/scheduled.mphf", 2);
+	mapped.map("out/scheduled.mphf", true);
+	for (const boophf_t* m : {&from_stream, &from_file, &mapped})
+	{
+		if (!m->scheduled() || m->nbLevels() != scheduled.nbLevels())
+			return false;
+		for (uint32_t ii = 0; ii < m->nbLevels(); ii++)
+		{
+			if (m->levelDomain(ii) != scheduled.levelDomain(ii))
+				return false;
+		}
+		for (uint64_t key : keys)
+		{
+			if (m->lookup(key) != scheduled.lookup(key))
+			{
+				std::cerr << " Reloaded scheduled mphf differs for key " << key << "\n";
+				return false;
+			}
+		}
+	}
+
+	boomphf::mphf_level_schedule bad;
+	bad.gammas = {2.0, 0.0};
+	try
+	{
+		boophf_t rejected(keys.size(), keys, 1, 2.0, false, false, 0.03f, boomphf::MPHF_REDUCE_MODULO, ".", nullptr, 1.0, bad);
+		std::cerr << " A zero gamma was accepted\n";
+		return false;
+	}
+	catch (const std::invalid_argument&)
+	{
+	}
+
+	std::cout << " " << keys.size() << " keys : " << plain.nbLevels() << " levels " << (double)plain.totalBitSize() / keys.size() << " bits/key, min_keys " << short_build.nbLevels() << " levels, gammas 3 / 1.5 " << scheduled.nbLevels() << " levels " << (double)scheduled.totalBitSize() / keys.size() << " bits/key\n";
+	return true;
+}
+
+int main()
+{
+	std::cout << "===========================================================\n";
+	std::cout << "   Cross-Language Binary Compatibility Test (C++ Side)   \n";
+	std::cout << "===========================================================\n";
+
+	bool all_passed = true;
+
+	// Test 1: Build C++ MPHF and export
+	if (!test_cpp_build_and_export())
+	{
+		std::cerr << "\n Test 1 failed\n";
+		all_passed = false;
+	}
+
+	// Test 2: Load Python binary
+	if (!test_load_python_binary())
+	{
+		std::cerr << "\n Test 2 failed\n";
+		all_passed = false;
+	}
+
+	// Test 3: Compare hash values
+	if (!test_compare_hash_values())
+	{
+		std::cerr << "\n Test 3 failed\n";
+		all_passed = false;
+	}
+
+	// Test 4: popcount kernels
+	if (!test_popcount_kernels())
+	{
+		std::cerr << "\n Test 4 failed\n";
+		all_passed = false;
+	}
+
+	// Test 5: range reduction
+	if (!test_range_reduction())
+	{
+		std::cerr << "\n Test 5 failed\n";
+		all_passed = false;
+	}
+
+	// Test 6: threaded build
+	if (!test_threaded_build())
+	{
+		std::cerr << "\n Test 6 failed\n";
+		all_passed = false;
+	}
+
+	// Test 7: writeEach build
+	if (!test_write_each_build())
+	{
+		std::cerr << "\n Test 7 failed\n";
+		all_passed = false;
+	}
+
+	// Test 8: fast mode build
+	if (!test_fast_mode_build())
+	{
+		std::cerr << "\n Test 8 failed\n";
+		all_passed = false;
+	}
+
+	// Test 9: sharded build
+	if (!test_sharded_build())
+	{
+		std::cerr << "\n Test 9 failed\n";
+		all_passed = false;
+	}
+
+	// Test 10: fixed level count
+	if (!test_fixed_levels())
+	{
+		std::cerr << "\n Test 10 failed\n";
+		all_passed = false;
+	}
+
+	// Test 11: hashers
+	if (!test_hashers())
+	{
+		std::cerr << "\n Test 11 failed\n";
+		all_passed = false;
+	}
+
+	// Test 12: string keys
+	if (!test_string_keys())
+	{
+		std::cerr << "\n Test 12 failed\n";
+		all_passed = false;
+	}
+
+	// Test 13: fingerprints
+	if (!test_fingerprints())
+	{
+		std::cerr << "\n Test 13 failed\n";
+		all_passed = false;
+	}
+
+	// Test 14: build stats
+	if (!test_build_stats())
+	{
+		std::cerr << "\n Test 14 failed\n";
+		all_passed = false;
+	}
+
+	// Test 15: progress callback
+	if (!test_progress_callback())
+	{
+		std::cerr << "\n Test 15 failed\n";
+		all_passed = false;
+	}
+
+	// Test 16: level arena
+	if (!test_level_arena())
+	{
+		std::cerr << "\n Test 16 failed\n";
+		all_passed = false;
+	}
+
+	// Test 17: overlay
+	if (!test_overlay())
+	{
+		std::cerr << "\n Test 17 failed\n";
+		all_passed = false;
+	}
+
+	// Test 18: positional save/load
+	if (!test_positional_io())
+	{
+		std::cerr << "\n Test 18 failed\n";
+		all_passed = false;
+	}
+
+	// Test 19: lookup pool
+	if (!test_lookup_pool())
+	{
+		std::cerr << "\n Test 19 failed\n";
+		all_passed = false;
+	}
+
+	// Test 20: hot key cache
+	if (!test_hot_key_cache())
+	{
+		std::cerr << "\n Test 20 failed\n";
+		all_passed = false;
+	}
+
+	// Test 21: static map
+	if (!test_static_map())
+	{
+		std::cerr << "\n Test 21 failed\n";
+		all_passed = false;
+	}
+
+	// Test 22: level schedule
+	if (!test_level_schedule())
+	{
+		std::cerr << "\n Test 22 failed\n";
 		all_passed = false;
 	}
 
@@ -4,7 +4,8 @@
 This script:
 1. Loads test keys from test_keys.csv
 2. Loads C++ MPHF binary (test_data_cpp.mphf)
-3. Verifies binary compatibility (all keys can be looked up)
+3. Verifies binary compatibility (all keys can be looked up), and that the
+   v2 file (test_data_cpp_v2.mphf) gives the same lookups
 4. Compares hash values with C++ results (optional observation)
 """
 
@@ -60,7 +61,7 @@ def main():
         print(f"  Please run C++ test first: ./test_compatibility")
         return 1
 
-    mph = mphf.load(binary_file)
+    mph = mphf.load(binary_file, backend="python")
     print(f"[OK] Loaded MPHF from C++ binary")
     
     # Verify MPHF properties
@@ -93,6 +94,15 @@ def main():
         return 1
     
     print(f"\n[OK] C++ output can be loaded in Python.")
+
+    # The v2 file of the same MPHF must give identical lookups, streamed or mapped
+    binary_file_v2 = os.path.join('out', 'test_data_cpp_v2.mphf')
+    for opener in (mphf.load, mphf.mmap):
+        mph_v2 = opener(binary_file_v2, backend="python")
+        if any(mph_v2.lookup(key) != mph.lookup(key) for key in test_keys):
+            print(f"✗ {opener.__name__} of the C++ v2 binary differs from v1")
+            return 1
+    print(f"[OK] C++ v2 output matches v1 (load and mmap).")
     
     # Optional: Compare with C++ hash values (from out/)
     hash_csv_file = os.path.join('out', 'test_data_cpp_hashes.csv')
@@ -3,9 +3,12 @@ import os
 import random
 import tempfile
 import unittest
+from array import array
 
 sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
-from pybbhash.boophf import mphf
+from pybbhash.bitvector import bitvector
+from pybbhash.boophf import (ULLONG_MAX, _final_key, _key128, mphf, mphf_builder, overlay_mphf, packed_keys, sharded_mphf,
+                             static_map)
 
 
 class TestBase(unittest.TestCase):
@@ -76,6 +79,28 @@ class TestBase(unittest.TestCase):
             self.assertGreaterEqual(idx, 0, f"Lookup for {k} returned negative {idx}")
         print(f"  ✓ All lookups non-negative")
 
+    def test_lookup_many(self):
+        """lookup_many over a uint64 buffer matches per-key lookup."""
+        keys = array("Q", self.keys)
+        out = self.m.lookup_many(keys)
+        self.assertEqual(list(out), [self.m.lookup(k) for k in self.keys])
+
+        # preallocated output buffer, memoryview input
+        prealloc = array("Q", bytes(8 * len(keys)))
+        res = self.m.lookup_many(memoryview(keys), prealloc)
+        self.assertIs(res, prealloc)
+        self.assertEqual(list(prealloc), list(out))
+
+        with self.assertRaises(ValueError):
+            self.m.lookup_many(keys, array("Q", [0]))
+        with self.assertRaises(TypeError):
+            self.m.lookup_many(array("I", [1, 2, 3]))
+
+    def test_lookup_many_unbuilt(self):
+        """Unbuilt mphf marks every key unknown (ULLONG_MAX)."""
+        out = mphf().lookup_many(array("Q", [1, 2, 3]))
+        self.assertEqual(list(out), [(1 << 64) - 1] * 3)
+
     def test_save_load(self):
         """Test save/load: loaded mph should pass all base tests."""
         print(f"\nSaving mphf to {self.save_path}...")
@@ -109,6 +134,356 @@ class TestBase(unittest.TestCase):
         # validate loaded mph passes complete mapping test
         self._validate_mphf_complete_mapping(loaded, self.keys, "LOADED")
 
+    def _all_in_final_table(self, keys):
+        """Pure-Python mphf whose levels are empty, so every key is found in the final table."""
+        mph = mphf(len(keys), keys, gamma=1.5, backend="python")
+        for lv in mph._levels:
+            lv.bitset = bitvector(lv.hash_domain)
+            lv.bitset.build_ranks()
+        mph._lastbitsetrank = 0
+        rng = random.Random(3)
+        mph._set_final_table((k, i) for i, k in enumerate(rng.sample(keys, len(keys))))
+        return mph
+
+    def test_final_table(self):
+        """Keys past the last level are found in the sorted final arrays."""
+        mph = self._all_in_final_table(self.keys)
+        self.assertEqual(list(mph._final_keys), sorted(self.keys))
+        self._validate_mphf_complete_mapping(mph, self.keys, "FINAL TABLE")
+        absent = set(range(0, self.M + 2)) - set(self.keys)
+        self.assertTrue(all(mph.lookup(k) == -1 for k in absent))
+
+        for version in (1, 2):
+            mph.save(self.save_path, version=version)
+            for opener in (mphf.load, mphf.mmap):
+                loaded = opener(self.save_path, backend="python")
+                self.assertEqual([loaded.lookup(k) for k in self.keys], [mph.lookup(k) for k in self.keys])
+        # a repeated key would leave an index unused
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys) + 1, self.keys + self.keys[:1], backend="python")
+
+    def test_mmap(self):
+        """mmap() opens a saved file in place and matches load()."""
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        py.save(self.save_path)
+        mapped = mphf.mmap(self.save_path, backend="python")
+        self.assertEqual([py.lookup(k) for k in self.keys], [mapped.lookup(k) for k in self.keys])
+        self.assertEqual(list(py.lookup_many(array("Q", self.keys))), list(mapped.lookup_many(array("Q", self.keys))))
+        self.assertEqual(mapped._final_hash, py._final_hash)
+        self._validate_mphf_complete_mapping(mapped, self.keys, "MAPPED")
+
+        # a mapped mphf can be saved again
+        copy_path = os.path.join(self.tmpdir.name, "copy.mphf")
+        mapped.save(copy_path)
+        with open(self.save_path, "rb") as a, open(copy_path, "rb") as b:
+            self.assertEqual(a.read(), b.read())
+
+    def test_rank_layout(self):
+        """The interleaved layout answers like the flat one, costs a few percent and saves the same file."""
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        expected = [py.lookup(k) for k in self.keys + [k + 1 for k in self.keys[:50]]]
+        flat_bits = py.totalBitSize()
+        py.save(self.save_path)
+
+        py.set_rank_layout("interleaved")
+        self.assertEqual(py.rank_layout, "interleaved")
+        self.assertEqual([py.lookup(k) for k in self.keys + [k + 1 for k in self.keys[:50]]], expected)
+        print(f"\n[rank layout] flat={flat_bits} interleaved={py.totalBitSize()} bits")
+        self.assertGreater(py.totalBitSize(), flat_bits)
+        for version in (1, 2):
+            copy_path = os.path.join(self.tmpdir.name, f"interleaved_v{version}.mphf")
+            py.save(copy_path, version=version)
+            back = mphf.load(copy_path, backend="python")
+            self.assertEqual(back.rank_layout, "flat")
+            self.assertEqual([back.lookup(k) for k in self.keys], expected[: len(self.keys)])
+        with open(self.save_path, "rb") as a, open(os.path.join(self.tmpdir.name, "interleaved_v1.mphf"), "rb") as b:
+            self.assertEqual(a.read(), b.read())
+
+        mapped = mphf.mmap(self.save_path, backend="python")
+        mapped.set_rank_layout("interleaved")
+        self.assertEqual([mapped.lookup(k) for k in self.keys], expected[: len(self.keys)])
+        py.set_rank_layout("flat")
+        self.assertEqual(py.totalBitSize(), flat_bits)
+        with self.assertRaises(ValueError):
+            py.set_rank_layout("poppy")
+
+    def test_multiply_reduction(self):
+        """reduction="multiply" builds a complete mphf that only v2 files record."""
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python", reduction="multiply")
+        self._validate_mphf_complete_mapping(py, self.keys, "MULTIPLY")
+        expected = [py.lookup(k) for k in self.keys]
+        self.assertNotEqual(expected, [mphf(len(self.keys), self.keys, gamma=1.5, backend="python").lookup(k) for k in self.keys])
+
+        with self.assertRaises(ValueError):
+            py.save(self.save_path)
+        py.save(self.save_path, version=2)
+        for opener in (mphf.load, mphf.mmap):
+            back = opener(self.save_path, backend="python")
+            self.assertEqual(back._reduction, "multiply")
+            self.assertEqual([back.lookup(k) for k in self.keys], expected)
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, backend="python", reduction="lemire")
+
+    def test_hashers(self):
+        """Every registered hasher builds a complete mphf, v2 files record it and v1 files refuse it."""
+        for hasher in ("wymix", "crc32c"):
+            py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python", hasher=hasher)
+            self._validate_mphf_complete_mapping(py, self.keys, hasher.upper())
+            with self.assertRaises(ValueError):
+                py.save(self.save_path)
+            py.save(self.save_path, version=2)
+            for opener in (mphf.load, mphf.mmap):
+                back = opener(self.save_path, backend="python")
+                self.assertEqual(back._hasher_name, hasher)
+                self.assertEqual([back.lookup(k) for k in self.keys], [py.lookup(k) for k in self.keys])
+
+        # an unknown hasher id in the header is rejected
+        with open(self.save_path, "r+b") as f:
+            f.seek(16)
+            f.write(b"\x07")
+        with self.assertRaises(ValueError):
+            mphf.load(self.save_path, backend="python")
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, backend="python", hasher="xxh3")
+
+    def test_string_keys(self):
+        """str / bytes keys are hashed once to 128 bits, the final table holds their fingerprints."""
+        words = [f"word-{k}" for k in self.keys] + ["\u00e9t\u00e9", ""]
+        mph = mphf(len(words), words, gamma=1.5, backend="python")
+        self.assertEqual(mph._hasher_name, "key128")
+        self._validate_mphf_complete_mapping(mph, words, "STRINGS")
+        self.assertEqual(mph.lookup("\u00e9t\u00e9"), mph.lookup("\u00e9t\u00e9".encode("utf-8")))
+        expected = [mph.lookup(w) for w in words]
+        self.assertEqual(list(mph.lookup_many(words)), expected)
+        self.assertEqual(list(mph.lookup_many(packed_keys.from_keys(words))), expected)
+
+        # levels emptied: every key is found by its fingerprint in the final table
+        final = mphf(len(words), words, gamma=1.5, backend="python")
+        for lv in final._levels:
+            lv.bitset = bitvector(lv.hash_domain)
+            lv.bitset.build_ranks()
+        final._lastbitsetrank = 0
+        final._set_final_table((_final_key(_key128(w.encode("utf-8"))), i) for i, w in enumerate(words))
+        self.assertEqual([final.lookup(w) for w in words], list(range(len(words))))
+        self.assertEqual(final.lookup("absent"), -1)
+
+        with self.assertRaises(ValueError):
+            mph.save(self.save_path)
+        mph.save(self.save_path, version=2)
+        for opener in (mphf.load, mphf.mmap):
+            back = opener(self.save_path, backend="python")
+            self.assertEqual(back._hasher_name, "key128")
+            self.assertEqual([back.lookup(w) for w in words], expected)
+
+        with self.assertRaises(ValueError):
+            mphf(len(words) + 1, words + [words[3]], backend="python")  # duplicate key
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, backend="python", hasher="key128")
+        with self.assertRaises(ValueError):
+            list(packed_keys(array("Q", [0, 4, 2]), b"abcd"))
+
+    def test_fingerprints(self):
+        """fingerprint_bits rejects keys not in the set, v2 files keep the fingerprints."""
+        absent = [k for k in range(self.M, 3 * self.M)]
+        plain = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        mph = mphf(len(self.keys), iter(self.keys), gamma=1.5, backend="python", fingerprint_bits=10)
+        self.assertEqual(mph.fingerprint_bits, 10)
+        self.assertEqual([mph.lookup(k) for k in self.keys], [plain.lookup(k) for k in self.keys])
+        # 2**-10 of 20000 keys: ~20 expected
+        self.assertLess(sum(mph.lookup(k) >= 0 for k in absent), 60)
+        self.assertEqual(list(mph.lookup_many(array("Q", absent[:500]))),
+                         [ULLONG_MAX if mph.lookup(k) < 0 else mph.lookup(k) for k in absent[:500]])
+
+        with self.assertRaises(ValueError):
+            mph.save(self.save_path)
+        mph.save(self.save_path, version=2)
+        for opener in (mphf.load, mphf.mmap):
+            back = opener(self.save_path, backend="python")
+            self.assertEqual(back.fingerprint_bits, 10)
+            self.assertEqual([back.lookup(k) for k in absent[:2000]], [mph.lookup(k) for k in absent[:2000]])
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, backend="python", fingerprint_bits=33)
+
+    def test_build_stats(self):
+        """build_stats() follows the keys through the levels, a loaded mphf only has the sizes."""
+        mph = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        stats = mph.build_stats()
+        self.assertEqual(len(stats["levels"]), 25)
+        keys_in = len(self.keys)
+        for lv in stats["levels"]:
+            self.assertEqual(lv["keys_in"], keys_in)
+            self.assertLessEqual(lv["collisions"], lv["keys_in"])
+            keys_in -= lv["keys_placed"]
+        self.assertEqual(keys_in, 0)
+        self.assertEqual(stats["levels"][0]["keys_read"], len(self.keys))
+        self.assertEqual(stats["levels"][-1]["keys_placed"], stats["final_keys"])
+        self.assertEqual(stats["total_bits"], mph.totalBitSize())
+
+        mph.save(self.save_path, version=2)
+        loaded = mphf.load(self.save_path, backend="python").build_stats()
+        self.assertEqual(loaded["levels"][0]["keys_in"], 0)
+        self.assertEqual(loaded["final_keys"], stats["final_keys"])
+        self.assertEqual([lv["bitset_bytes"] for lv in loaded["levels"]], [lv["bitset_bytes"] for lv in stats["levels"]])
+
+    def test_progress_callback(self):
+        """progress callables get monotonic samples, the last one finished, the estimate close to the keys read."""
+        keys = random.sample(range(1, 1 << 40), 20000)
+        samples = []
+        mph = mphf(len(keys), keys, backend="python", progress=samples.append, progress_interval=1e-6)
+        self.assertGreater(len(samples), 2)
+        self.assertTrue(samples[-1]["finished"])
+        self.assertEqual(samples[-1]["done"], samples[-1]["total"])
+        self.assertFalse(any(s["finished"] for s in samples[:-1]))
+        for prev, cur in zip(samples, samples[1:]):
+            self.assertLessEqual(prev["done"], cur["done"])
+            self.assertLessEqual(prev["level"], cur["level"])
+        keys_read = sum(lv["keys_read"] for lv in mph.build_stats()["levels"])
+        self.assertLess(abs(samples[0]["total"] - keys_read), 0.05 * keys_read)
+        with self.assertRaises(ValueError):
+            mphf(len(keys), keys, backend="python", progress=True, progress_interval=0)
+
+    def test_streaming_builder(self):
+        """Generators and mphf_builder batches are read once and give the same mphf as a list."""
+        expected = [mphf(len(self.keys), self.keys, gamma=1.5, backend="python").lookup(k) for k in self.keys]
+        from_gen = mphf(len(self.keys), (k for k in self.keys), gamma=1.5, backend="python")
+        self.assertEqual([from_gen.lookup(k) for k in self.keys], expected)
+
+        for spool in ("memory", "disk"):
+            builder = mphf_builder(gamma=1.5, backend="python", spool=spool, tmp_dir=self.tmpdir.name)
+            builder.add_batch(array("Q", self.keys[:50]))
+            builder.add_batch(k for k in self.keys[50:])
+            self.assertEqual(len(builder), len(self.keys))
+            built = builder.finalize()
+            self.assertEqual([built.lookup(k) for k in self.keys], expected)
+            self.assertEqual(os.listdir(self.tmpdir.name), [])
+            with self.assertRaises(ValueError):
+                builder.add_batch([1])
+        with self.assertRaises(ValueError):
+            mphf_builder(spool="tape")
+
+    def test_sharded(self):
+        """Sharded builds are minimal perfect, survive save/load and equal a merge of separately built shards."""
+        sharded = sharded_mphf(len(self.keys), self.keys, nb_shards=3, gamma=1.5, backend="python")
+        self.assertEqual(sharded.nb_shards, 3)
+        self._validate_mphf_complete_mapping(sharded, self.keys, "SHARDED")
+
+        sharded.save(self.save_path)
+        loaded = sharded_mphf.load(self.save_path, backend="python")
+        self.assertEqual([loaded.lookup(k) for k in self.keys], [sharded.lookup(k) for k in self.keys])
+        self.assertEqual(loaded.nbKeys(), len(self.keys))
+
+        # distributed build: route, build and save each shard on its own, merge the files
+        paths = []
+        for s in range(3):
+            shard_keys = [k for k in self.keys if sharded_mphf.shard_of(k, 3) == s]
+            paths.append(os.path.join(self.tmpdir.name, f"shard{s}.mphf"))
+            mphf(len(shard_keys), shard_keys, gamma=1.5, backend="python").save(paths[-1], version=2)
+        merged_path = os.path.join(self.tmpdir.name, "merged.mphf")
+        sharded_mphf.merge(paths, merged_path)
+        merged = sharded_mphf.load(merged_path, backend="python")
+        self.assertEqual([merged.lookup(k) for k in self.keys], [sharded.lookup(k) for k in self.keys])
+
+        with open(self.save_path, "r+b") as f:
+            f.seek(64)
+            f.write(b"\xff")
+        with self.assertRaises(ValueError):
+            sharded_mphf.load(self.save_path, backend="python")
+
+    def test_overlay(self):
+        """Deltas keep the base indices and extend the mapping, the file reloads, compaction gives one segment."""
+        overlay = overlay_mphf(150, self.keys[:150], gamma=1.5, fingerprint_bits=4, backend="python")
+        base = [overlay.lookup(k) for k in self.keys[:150]]
+        overlay.append(30, self.keys[150:180])
+        overlay.append(20, self.keys[180:])
+        self.assertEqual(overlay.nb_segments, 3)
+        self.assertEqual(overlay.nbKeys(), len(self.keys))
+        self.assertEqual([overlay.lookup(k) for k in self.keys[:150]], base)
+        self.assertEqual(sorted(overlay.lookup(k) for k in self.keys[150:]), list(range(150, 200)))
+        self.assertEqual(list(overlay.lookup_many(array("Q", self.keys))), [overlay.lookup(k) for k in self.keys])
+        self.assertTrue(overlay.should_compact(max_deltas=1))
+
+        overlay.save(self.save_path)
+        loaded = overlay_mphf.load(self.save_path, backend="python")
+        self.assertEqual([loaded.lookup(k) for k in self.keys], [overlay.lookup(k) for k in self.keys])
+        self.assertEqual(loaded.nb_overrides, overlay.nb_overrides)
+
+        compacted = overlay.compact_async(len(self.keys), self.keys).result()
+        self.assertEqual((compacted.nb_segments, compacted.nb_overrides, compacted.fingerprint_bits), (1, 0, 4))
+        self._validate_mphf_complete_mapping(compacted, self.keys, "OVERLAY")
+        with self.assertRaises(ValueError):
+            overlay.compact(150, self.keys[:150])
+
+        with open(self.save_path, "r+b") as f:
+            f.seek(64)
+            f.write(b"\xff")
+        with self.assertRaises(ValueError):
+            overlay_mphf.load(self.save_path, backend="python")
+
+    def test_mmap_truncated(self):
+        self.m.save(self.save_path)
+        with open(self.save_path, "rb") as f:
+            data = f.read()
+        with open(self.save_path, "wb") as f:
+            f.write(data[: len(data) // 2])
+        with self.assertRaises(ValueError):
+            mphf.mmap(self.save_path, backend="python")
+
+    def test_parallel_save_load(self):
+        """Chunked positional save/load writes and reads the sequential bytes."""
+        self.m.set_rank_layout("interleaved")
+        for version in (1, 2):
+            self.m.save(self.save_path, version=version)
+            with open(self.save_path, "rb") as f:
+                expected = f.read()
+            self.m.save(self.save_path, version=version, num_thread=4)
+            with open(self.save_path, "rb") as f:
+                self.assertEqual(f.read(), expected)
+            loaded = mphf.load(self.save_path, backend="python", num_thread=4)
+            self._validate_mphf_complete_mapping(loaded, self.keys)
+            self.assertEqual(loaded._final_hash, self.m._final_hash)
+
+    def test_hot_key_cache(self):
+        """A hot key cache keeps the lookups and is saved next to the mphf file."""
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        expected = [py.lookup(k) for k in self.keys]
+        py.build_hot_cache(self.keys + self.keys[:200] * 3, slots=512)
+        self.assertGreater(py.hot_cache_stats()["filled"], 0)
+        self.assertEqual([py.lookup(k) for k in self.keys], expected)
+        py.save(self.save_path)
+        loaded = mphf.load(self.save_path, backend="python")
+        self.assertEqual(loaded.hot_cache_stats(), py.hot_cache_stats())
+        self._validate_mphf_complete_mapping(loaded, self.keys)
+
+    def test_static_map(self):
+        """A static map returns the value of each key, whole 64-bit values too, and mmaps its file."""
+        values = [(k * 0x9E3779B97F4A7C15) & ULLONG_MAX for k in self.keys]
+        sm = static_map(len(self.keys), self.keys, values, fingerprint_bits=0, backend="python")
+        self.assertEqual(sm.value_bits, 64)
+        self.assertEqual([sm[k] for k in self.keys], values)
+        sm.save(self.save_path)
+        mapped = static_map.mmap(self.save_path, backend="python", verify=True)
+        self.assertEqual(list(mapped.get_many(array("Q", self.keys))), values)
+        with self.assertRaises(ValueError):
+            static_map(2, [1, 2], [1, 2], value_bits=60, fingerprint_bits=8, backend="python")
+        with self.assertRaises(ValueError):
+            static_map(3, [5, 5, 6], [1, 2, 4], value_bits=4, backend="python")
+
+    def test_level_schedule(self):
+        """A gamma schedule sizes each level from its own gamma, min_level_keys sends the tail to the final table."""
+        m = mphf(len(self.keys), self.keys, gamma_schedule=[3.0, 1.0], min_level_keys=10, max_levels=6, backend="python")
+        self.assertLessEqual(m._nb_levels, 6)
+        self.assertGreaterEqual(m.level_domains[0], 3 * len(self.keys))
+        self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+        self.assertEqual(sum(l["keys_placed"] for l in m.build_stats()["levels"]), len(self.keys))
+        m.save(self.save_path, version=2)
+        loaded = mphf.load(self.save_path, backend="python")
+        self.assertEqual(loaded.level_domains, m.level_domains)
+        self.assertEqual([loaded.lookup(k) for k in self.keys], [m.lookup(k) for k in self.keys])
+        with self.assertRaises(ValueError):
+            m.save(self.save_path)
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, max_levels=1, backend="python")
+
     def test_save_stats(self):
         """Test metadata consistency after save/load."""
         print(f"\nTesting metadata consistency...")
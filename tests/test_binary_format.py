@@ -9,7 +9,9 @@ sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 import unittest
 import tempfile
 import struct
-from pybbhash.boophf import mphf
+import zlib
+from pybbhash import fileformat
+from pybbhash.boophf import mphf, native_available
 
 
 class TestBinaryFormat(unittest.TestCase):
@@ -95,5 +97,136 @@ class TestBinaryFormat(unittest.TestCase):
                 os.unlink(temp_path)
 
 
+class TestBinaryFormatV2(unittest.TestCase):
+    """v2 layout: magic, table of contents, aligned and checksummed sections."""
+
+    def setUp(self):
+        self.keys = list(range(1000, 3000, 3))
+        self.mph = mphf(n=len(self.keys), input_range=self.keys, gamma=1.0, backend="python")
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.v1_path = os.path.join(self.tmpdir.name, "v1.mphf")
+        self.v2_path = os.path.join(self.tmpdir.name, "v2.mphf")
+        self.mph.save(self.v1_path)
+        self.mph.save(self.v2_path, version=2)
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def _lookups(self, mph):
+        return [mph.lookup(k) for k in self.keys]
+
+    def test_v2_structure(self):
+        with open(self.v2_path, "rb") as f:
+            data = f.read()
+        magic, version, flags, hasher_id, nb_levels, gamma, nelem, lastbitsetrank, nb_sections, toc_crc = \
+            fileformat.HEADER.unpack_from(data, 0)
+        print(f"\n[v2 Format Check] {nb_sections} sections, file size {len(data)} bytes")
+        self.assertEqual(magic, b"\x89BBH\r\n\x1a\n")
+        self.assertEqual(version, 2)
+        self.assertEqual(flags, fileformat.FLAG_CRC32)
+        self.assertEqual(hasher_id, fileformat.HASHER_XORSHIFT)
+        self.assertEqual((nb_levels, gamma, nelem), (25, 1.0, len(self.keys)))
+        self.assertEqual(lastbitsetrank, self.mph._lastbitsetrank)
+        self.assertEqual(nb_sections, 2 * nb_levels + 2)
+
+        toc = data[64:64 + 40 * nb_sections]
+        self.assertEqual(zlib.crc32(toc), toc_crc)
+        for ii, (kind, index, offset, length, aux, crc) in enumerate(fileformat.SECTION.iter_unpack(toc)):
+            self.assertEqual(offset % 64, 0, "sections are 64-byte aligned")
+            self.assertEqual(zlib.crc32(data[offset:offset + length]), crc)
+            if ii < 2 * nb_levels:
+                self.assertEqual((kind, index), (fileformat.SECTION_LEVEL_BITS if ii % 2 == 0 else fileformat.SECTION_LEVEL_RANKS, ii // 2))
+        # final keys are stored sorted
+        keys_offset = fileformat.SECTION.unpack_from(toc, 40 * (nb_sections - 2))[2]
+        keys = struct.unpack_from(f"<{len(self.mph._final_hash)}Q", data, keys_offset)
+        self.assertEqual(list(keys), sorted(self.mph._final_hash))
+
+    def test_v1_v2_roundtrips(self):
+        expected = self._lookups(self.mph)
+        for path in (self.v1_path, self.v2_path):
+            for opener in (mphf.load, mphf.mmap):
+                loaded = opener(path, backend="python")
+                self.assertEqual(self._lookups(loaded), expected, f"{opener.__name__}({os.path.basename(path)})")
+                self.assertEqual(loaded._final_hash, self.mph._final_hash)
+
+        # v2 -> v1 -> v2 rewrites identical files
+        again_v1 = os.path.join(self.tmpdir.name, "again_v1.mphf")
+        again_v2 = os.path.join(self.tmpdir.name, "again_v2.mphf")
+        mphf.load(self.v2_path, backend="python").save(again_v1)
+        mphf.load(again_v1, backend="python").save(again_v2, version=2)
+        with open(self.v2_path, "rb") as a, open(again_v2, "rb") as b:
+            self.assertEqual(a.read(), b.read())
+
+    def test_v2_without_checksum(self):
+        path = os.path.join(self.tmpdir.name, "nocrc.mphf")
+        self.mph.save(path, version=2, checksum=False)
+        with open(path, "rb") as f:
+            self.assertEqual(fileformat.HEADER.unpack_from(f.read(64), 0)[2], 0)
+        self.assertEqual(self._lookups(mphf.load(path, backend="python")), self._lookups(self.mph))
+
+    def test_v2_corruption_detected(self):
+        with open(self.v2_path, "rb") as f:
+            data = bytearray(f.read())
+        # flip a bit inside the level 0 bitset
+        offset = fileformat.SECTION.unpack_from(data, 64)[2]
+        data[offset] ^= 1
+        with open(self.v2_path, "wb") as f:
+            f.write(data)
+        with self.assertRaises(ValueError):
+            mphf.load(self.v2_path, backend="python")
+        # mmap only checks sections when asked to
+        mphf.mmap(self.v2_path, backend="python")
+        with self.assertRaises(ValueError):
+            mphf.mmap(self.v2_path, backend="python", verify=True)
+
+        with open(self.v2_path, "wb") as f:
+            f.write(data[: len(data) // 2])
+        for opener in (mphf.load, mphf.mmap):
+            with self.assertRaises(ValueError):
+                opener(self.v2_path, backend="python")
+
+    def test_v2_reduction_flag(self):
+        """The reduction mode is a header flag; flags this version does not know are rejected."""
+        mult = mphf(n=len(self.keys), input_range=self.keys, gamma=1.0, backend="python", reduction="multiply")
+        mult.save(self.v2_path, version=2)
+        with open(self.v2_path, "rb") as f:
+            data = bytearray(f.read())
+        self.assertEqual(fileformat.HEADER.unpack_from(data, 0)[2], fileformat.FLAG_CRC32 | fileformat.FLAG_MULTIPLY_HIGH)
+
+        struct.pack_into("<I", data, 12, fileformat.FLAG_CRC32 | 0x100)
+        with open(self.v2_path, "wb") as f:
+            f.write(data)
+        backends = ("python", "native") if native_available() else ("python",)
+        for backend in backends:
+            for opener in (mphf.load, mphf.mmap):
+                with self.assertRaises(ValueError):
+                    opener(self.v2_path, backend=backend)
+
+    def test_unsupported_version(self):
+        with self.assertRaises(ValueError):
+            self.mph.save(self.v2_path, version=3)
+
+    @unittest.skipUnless(native_available(), "native backend not built")
+    def test_v2_native_interop(self):
+        expected = self._lookups(self.mph)
+        for opener in (mphf.load, mphf.mmap):
+            self.assertEqual(self._lookups(opener(self.v2_path, backend="native")), expected)
+
+        native_path = os.path.join(self.tmpdir.name, "native_v2.mphf")
+        nat = mphf.load(self.v1_path, backend="native")
+        nat.save(native_path, version=2)
+        with open(self.v2_path, "rb") as a, open(native_path, "rb") as b:
+            self.assertEqual(a.read(), b.read(), "both backends write the same v2 bytes")
+
+        with open(native_path, "r+b") as f:
+            offset = fileformat.SECTION.unpack_from(f.read(104), 64)[2]
+            f.seek(offset)
+            f.write(b"\xff")
+        with self.assertRaises(ValueError):
+            mphf.load(native_path, backend="native")
+        with self.assertRaises(ValueError):
+            mphf.mmap(native_path, backend="native", verify=True)
+
+
 if __name__ == "__main__":
     unittest.main()
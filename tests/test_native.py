@@ -0,0 +1,636 @@
+﻿"""Test the optional native (C++) backend against the pure-Python port."""
+
+import sys
+import os
+
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import random
+import tempfile
+import threading
+import unittest
+from array import array
+from pybbhash.bitvector import bitvector
+from pybbhash.boophf import (ULLONG_MAX, mphf, mphf_builder, native_available, overlay_mphf, packed_keys, sharded_mphf,
+                             static_map)
+
+
+@unittest.skipUnless(native_available(), "native backend not built")
+class TestNative(unittest.TestCase):
+    def setUp(self):
+        random.seed(7)
+        self.keys = random.sample(range(1, 1 << 40), 2000)
+        self.tmpdir = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        self.tmpdir.cleanup()
+
+    def test_default_backend_is_native(self):
+        m = mphf(len(self.keys), self.keys, gamma=2.0)
+        self.assertIsNotNone(m._native)
+        self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+
+    def test_matches_pure_python(self):
+        """Single-threaded native and pure-Python builds assign identical indices."""
+        for gamma in (1.0, 2.0):
+            py = mphf(len(self.keys), self.keys, gamma=gamma, backend="python")
+            nat = mphf(len(self.keys), self.keys, gamma=gamma, backend="native")
+            print(f"\n[gamma={gamma}] final hash: python={len(py._final_hash)} native={len(nat._final_hash)}")
+            self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+            self.assertEqual(py._lastbitsetrank, nat._lastbitsetrank)
+            self.assertEqual(py._final_hash, nat._final_hash)
+
+    def test_lookup_many_matches_pure_python(self):
+        foreign = [k + 1 for k in self.keys[:50]]
+        keys = array("Q", self.keys + foreign)
+        py = mphf(len(self.keys), self.keys, gamma=1.0, backend="python")
+        nat = mphf(len(self.keys), self.keys, gamma=1.0, backend="native")
+        self.assertEqual(list(py.lookup_many(keys)), list(nat.lookup_many(keys)))
+        # signed int64 buffers are accepted too
+        self.assertEqual(list(nat.lookup_many(array("q", self.keys))), [nat.lookup(k) for k in self.keys])
+
+    def test_generator_input(self):
+        m = mphf(len(self.keys), (k for k in self.keys), backend="native")
+        self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+
+    def test_file_interop(self):
+        """Files written by one backend load in the other."""
+        path = os.path.join(self.tmpdir.name, "interop.mphf")
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        py.save(path)
+        nat = mphf.load(path, backend="native")
+        self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+
+        nat.save(path)
+        back = mphf.load(path, backend="python")
+        self.assertEqual([py.lookup(k) for k in self.keys], [back.lookup(k) for k in self.keys])
+        self.assertEqual(back._nb_levels, nat._nb_levels)
+        self.assertEqual(back._lastbitsetrank, nat._lastbitsetrank)
+
+    def test_mmap(self):
+        path = os.path.join(self.tmpdir.name, "mapped.mphf")
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        py.save(path)
+        nat = mphf.mmap(path, backend="native")
+        self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+        self.assertEqual(list(py.lookup_many(array("Q", self.keys))), list(nat.lookup_many(array("Q", self.keys))))
+        self.assertEqual(py._final_hash, nat._final_hash)
+
+        with open(path, "rb") as f:
+            data = f.read()
+        with open(path, "wb") as f:
+            f.write(data[: len(data) // 2])
+        with self.assertRaises(ValueError):
+            mphf.mmap(path, backend="native")
+        with self.assertRaises(OSError):
+            mphf.mmap(os.path.join(self.tmpdir.name, "missing.mphf"), backend="native")
+
+    def test_final_table_interop(self):
+        """The C++ sorted final table (interpolation search) agrees with the Python one."""
+        # a dense cluster next to spread keys, interpolation has to fall back to bisection
+        keys = self.keys[:1000] + list(range(1 << 62, (1 << 62) + 1000))
+        mph = mphf(len(keys), keys, gamma=1.0, backend="python")
+        for lv in mph._levels:
+            lv.bitset = bitvector(lv.hash_domain)
+            lv.bitset.build_ranks()
+        mph._lastbitsetrank = 0
+        mph._set_final_table((k, i) for i, k in enumerate(keys))
+
+        probes = keys + [k + 1 for k in self.keys[:200]] + [(1 << 62) + 1000, 0, 1, (1 << 64) - 1]
+        expected = [mph.lookup(k) for k in probes]
+        path = os.path.join(self.tmpdir.name, "final.mphf")
+        for version in (1, 2):
+            mph.save(path, version=version)
+            for opener in (mphf.load, mphf.mmap):
+                nat = opener(path, backend="native")
+                self.assertEqual([nat.lookup(k) for k in probes], expected)
+                self.assertEqual([ULLONG_MAX if v < 0 else v for v in expected], list(nat.lookup_many(array("Q", probes))))
+        for num_thread in (1, 4):
+            with self.assertRaises(ValueError):
+                mphf(len(self.keys) + 1, self.keys + self.keys[:1], num_thread=num_thread, backend="native")
+
+    def test_rank_layout(self):
+        """The native interleaved layout matches the flat lookups and the pure-Python sizes."""
+        path = os.path.join(self.tmpdir.name, "layout.mphf")
+        py = mphf(len(self.keys), self.keys, gamma=1.5, backend="python")
+        nat = mphf(len(self.keys), self.keys, gamma=1.5, backend="native")
+        probes = array("Q", self.keys + [k + 1 for k in self.keys[:50]])
+        expected = list(nat.lookup_many(probes))
+        nat.save(path, version=2)
+
+        for m in (py, nat):
+            m.set_rank_layout("interleaved")
+            self.assertEqual(m.rank_layout, "interleaved")
+        self.assertEqual(list(nat.lookup_many(probes)), expected)
+        self.assertEqual([nat.lookup(k) for k in self.keys], [py.lookup(k) for k in self.keys])
+        self.assertEqual(nat.totalBitSize(), py.totalBitSize())
+
+        copy_path = os.path.join(self.tmpdir.name, "layout_copy.mphf")
+        nat.save(copy_path, version=2)
+        with open(path, "rb") as a, open(copy_path, "rb") as b:
+            self.assertEqual(a.read(), b.read())
+
+        mapped = mphf.mmap(path, backend="native", verify=True)
+        mapped.set_rank_layout("interleaved")
+        self.assertEqual(list(mapped.lookup_many(probes)), expected)
+
+        # switching layouts waits for the lookups running without the GIL
+        results = []
+        stop = threading.Event()
+
+        def reader():
+            while not stop.is_set():
+                results.append(list(nat.lookup_many(probes)) == expected)
+
+        readers = [threading.Thread(target=reader) for _ in range(2)]
+        for th in readers:
+            th.start()
+        try:
+            for layout in ("flat", "interleaved") * 10:
+                nat.set_rank_layout(layout)
+        finally:
+            stop.set()
+            for th in readers:
+                th.join()
+        self.assertTrue(results and all(results))
+        with self.assertRaises(ValueError):
+            nat.set_rank_layout("poppy")
+
+    def test_multiply_reduction(self):
+        """Native and pure-Python multiply-high builds agree and read each other's v2 files."""
+        path = os.path.join(self.tmpdir.name, "multiply.mphf")
+        py = mphf(len(self.keys), self.keys, gamma=1.0, backend="python", reduction="multiply")
+        nat = mphf(len(self.keys), self.keys, gamma=1.0, backend="native", reduction="multiply")
+        self.assertEqual(nat._reduction, "multiply")
+        self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+        self.assertEqual(py._final_hash, nat._final_hash)
+
+        with self.assertRaises(ValueError):
+            nat.save(path)
+        nat.save(path, version=2)
+        for opener in (mphf.load, mphf.mmap):
+            for backend in ("python", "native"):
+                back = opener(path, backend=backend)
+                self.assertEqual(back._reduction, "multiply")
+                self.assertEqual([back.lookup(k) for k in self.keys], [py.lookup(k) for k in self.keys])
+
+        # modulo files written before the flag existed keep using modulo
+        nat_mod = mphf(len(self.keys), self.keys, gamma=1.0, backend="native")
+        nat_mod.save(path, version=2)
+        self.assertEqual(mphf.load(path, backend="native")._reduction, "modulo")
+
+    def test_hashers(self):
+        """Native and pure-Python builds agree for every hasher and read each other's v2 files."""
+        path = os.path.join(self.tmpdir.name, "hasher.mphf")
+        for hasher in ("hash64", "wymix", "crc32c"):
+            py = mphf(len(self.keys), self.keys, gamma=1.0, backend="python", hasher=hasher)
+            nat = mphf(len(self.keys), self.keys, gamma=1.0, backend="native", hasher=hasher)
+            self.assertEqual(nat._hasher_name, hasher)
+            self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+            self.assertEqual(py._final_hash, nat._final_hash)
+
+            nat.save(path, version=2)
+            for opener in (mphf.load, mphf.mmap):
+                for backend in ("python", "native"):
+                    back = opener(path, backend=backend)
+                    self.assertEqual(back._hasher_name, hasher)
+                    self.assertEqual([back.lookup(k) for k in self.keys], [py.lookup(k) for k in self.keys])
+        with self.assertRaises(ValueError):
+            nat.save(path)
+        builder = mphf_builder(backend="native", spool="disk", tmp_dir=self.tmpdir.name, hasher="wymix")
+        builder.add_batch(array("Q", self.keys))
+        self.assertEqual(builder.finalize()._hasher_name, "wymix")
+
+    def test_string_keys(self):
+        """Native string builds match the pure-Python ones, packed lookups and v2 files included."""
+        words = [f"https://example.org/{k}" for k in self.keys[:1500]] + [bytes([0, 255, k & 0xFF]) for k in range(50)]
+        packed = packed_keys.from_keys(words)
+        py = mphf(len(words), words, gamma=1.0, backend="python")
+        for num_thread in (1, 4):
+            nat = mphf(len(packed), packed, gamma=1.0, num_thread=num_thread, backend="native")
+            self.assertEqual(nat._hasher_name, "key128")
+            self.assertEqual([nat.lookup(w) for w in words], [py.lookup(w) for w in words])
+            self.assertEqual(py._final_hash, nat._final_hash)
+        expected = array("Q", [py.lookup(w) for w in words])
+        self.assertEqual(nat.lookup_many(packed), expected)
+        self.assertEqual(nat.lookup_many(words), expected)
+
+        path = os.path.join(self.tmpdir.name, "strings.mphf")
+        for saved in (py, nat):
+            saved.save(path, version=2)
+            for opener in (mphf.load, mphf.mmap):
+                for backend in ("python", "native"):
+                    back = opener(path, backend=backend)
+                    self.assertEqual(back.lookup_many(packed), expected)
+
+        with self.assertRaises(TypeError):
+            nat._native.lookup_many(array("Q", self.keys), array("Q", bytes(8 * len(self.keys))))
+        integers = mphf(len(self.keys), self.keys, backend="native")
+        with self.assertRaises(TypeError):
+            integers._native.lookup_packed(packed.offsets, packed.data, array("Q", bytes(8 * len(packed))))
+        with self.assertRaises(ValueError):
+            mphf(len(words) + 1, words + [words[7]], backend="native")  # duplicate key
+        with self.assertRaises(ValueError):
+            mphf(2, packed_keys(array("Q", [0, 9, 3]), b"abcd"), backend="native")
+
+    def test_fingerprints(self):
+        """Native fingerprints match the pure-Python ones and read each other's v2 files."""
+        absent = random.sample(range(1 << 40, 1 << 41), 5000)
+        py = mphf(len(self.keys), self.keys, gamma=1.0, backend="python", fingerprint_bits=9)
+        for num_thread in (1, 4):
+            nat = mphf(len(self.keys), self.keys, gamma=1.0, num_thread=num_thread, backend="native", fingerprint_bits=9)
+            self.assertEqual(nat.fingerprint_bits, 9)
+            self.assertEqual([nat.lookup(k) for k in self.keys + absent], [py.lookup(k) for k in self.keys + absent])
+        expected = nat.lookup_many(array("Q", absent))
+        self.assertEqual(list(expected), [ULLONG_MAX if py.lookup(k) < 0 else py.lookup(k) for k in absent])
+
+        path = os.path.join(self.tmpdir.name, "fingerprints.mphf")
+        for saved in (py, nat):
+            saved.save(path, version=2)
+            for opener in (mphf.load, mphf.mmap):
+                for backend in ("python", "native"):
+                    self.assertEqual(opener(path, backend=backend).lookup_many(array("Q", absent)), expected)
+        with self.assertRaises(ValueError):
+            nat.save(path)
+
+        builder = mphf_builder(gamma=1.0, backend="native", spool="disk", tmp_dir=self.tmpdir.name, fingerprint_bits=9)
+        builder.add_batch(array("Q", self.keys))
+        self.assertEqual(builder.finalize().lookup_many(array("Q", absent)), expected)
+        words = [f"w{k}" for k in self.keys[:500]]
+        strings = mphf(len(words), words, backend="native", fingerprint_bits=9)
+        self.assertEqual([strings.lookup(w) for w in words], [mphf(len(words), words, backend="python").lookup(w) for w in words])
+        self.assertLess(sum(strings.lookup(f"x{k}") >= 0 for k in absent), 40)
+
+    def test_build_stats(self):
+        """Native build counters match the pure-Python ones, writeEach reads back what it spilled."""
+        counters = ("keys_in", "keys_placed", "collisions")  # keys_read differs, the Python port scans the keys left
+        py = mphf(len(self.keys), self.keys, perc_elem_loaded=0, backend="python").build_stats()
+        nat = mphf(len(self.keys), self.keys, perc_elem_loaded=0, backend="native").build_stats()
+        self.assertEqual([[lv[c] for c in counters] for lv in nat["levels"]],
+                         [[lv[c] for c in counters] for lv in py["levels"]])
+        self.assertEqual((nat["fast_mode_level"], nat["final_keys"]), (py["fast_mode_level"], py["final_keys"]))
+
+        spilled = mphf(len(self.keys), self.keys, num_thread=4, writeEach=True, backend="native",
+                       tmp_dir=self.tmpdir.name).build_stats()
+        levels = spilled["levels"]
+        self.assertEqual([lv["keys_in"] for lv in levels], [lv["keys_in"] for lv in nat["levels"]])
+        self.assertGreater(levels[1]["spill_bytes_written"], 0)
+        for ii in range(2, len(levels)):
+            self.assertEqual(levels[ii]["spill_bytes_read"], levels[ii - 1]["spill_bytes_written"])
+
+    def test_progress_callback(self):
+        """Native builds call progress from the reporter thread, exceptions in the callback do not stop the build."""
+        keys = random.sample(range(1, 1 << 40), 200000)
+        for writeEach in (False, True):
+            samples = []
+            m = mphf(len(keys), keys, num_thread=4, writeEach=writeEach, tmp_dir=self.tmpdir.name, backend="native",
+                     progress=samples.append, progress_interval=1e-3)
+            self.assertTrue(samples[-1]["finished"])
+            self.assertEqual(samples[-1]["done"], samples[-1]["total"])
+            self.assertEqual(sorted(s["done"] for s in samples), [s["done"] for s in samples])
+            keys_read = sum(lv["keys_read"] for lv in m.build_stats()["levels"])
+            self.assertLess(abs(samples[0]["total"] - keys_read), 0.05 * keys_read)
+
+        def failing(info):
+            raise RuntimeError("progress")
+        old_hook, sys.unraisablehook = sys.unraisablehook, lambda unraisable: None
+        try:
+            m = mphf(len(self.keys), self.keys, backend="native", progress=failing)
+        finally:
+            sys.unraisablehook = old_hook
+        self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+
+        builder = mphf_builder(backend="native", spool="disk", tmp_dir=self.tmpdir.name, progress=samples.append)
+        builder.add_batch(self.keys)
+        samples.clear()
+        builder.finalize()
+        self.assertTrue(samples[-1]["finished"])
+
+    def test_multithreaded_build(self):
+        m = mphf(len(self.keys), self.keys, num_thread=4, backend="native")
+        self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+
+    def test_write_each(self):
+        """writeEach builds spill levels to tmp_dir, remove the files and match the in-memory build."""
+        spill = os.path.join(self.tmpdir.name, "spill")
+        os.mkdir(spill)
+        in_ram = mphf(len(self.keys), self.keys, perc_elem_loaded=0.0, backend="native")
+        for num_thread in (1, 4):
+            m = mphf(len(self.keys), self.keys, num_thread=num_thread, writeEach=True, tmp_dir=spill, backend="native")
+            self.assertEqual(sorted(m.lookup(k) for k in self.keys), list(range(len(self.keys))))
+            self.assertEqual(os.listdir(spill), [])
+        m = mphf(len(self.keys), self.keys, writeEach=True, tmp_dir=spill, backend="native")
+        self.assertEqual([m.lookup(k) for k in self.keys], [in_ram.lookup(k) for k in self.keys])
+        with self.assertRaises(OSError):
+            mphf(len(self.keys), self.keys, writeEach=True, tmp_dir=os.path.join(spill, "missing"), backend="native")
+
+    def test_streaming_builder(self):
+        """Native mphf_builder builds match the list build, disk spools leave no file behind."""
+        expected = mphf(len(self.keys), self.keys, perc_elem_loaded=0.0, backend="native")
+        for spool in ("memory", "disk"):
+            builder = mphf_builder(backend="native", spool=spool, tmp_dir=self.tmpdir.name)
+            for start in range(0, len(self.keys), 300):
+                builder.add_batch(array("Q", self.keys[start:start + 300]))
+            m = builder.finalize()
+            self.assertEqual([m.lookup(k) for k in self.keys], [expected.lookup(k) for k in self.keys])
+            self.assertEqual(os.listdir(self.tmpdir.name), [])
+        self.assertFalse(mphf_builder(backend="native").finalize()._built)
+
+    def test_sharded(self):
+        """Native sharded builds match the pure-Python ones whatever the thread count, files load in both."""
+        from pybbhash import _native
+        self.assertEqual([_native.sharded_mphf.shard_of(k, 7) for k in self.keys[:200]],
+                         [sharded_mphf.shard_of(k, 7) for k in self.keys[:200]])
+        py = sharded_mphf(len(self.keys), self.keys, nb_shards=7, gamma=1.5, backend="python")
+        expected = [py.lookup(k) for k in self.keys]
+        self.assertEqual(sorted(expected), list(range(len(self.keys))))
+        for num_thread in (1, 4):
+            nat = sharded_mphf(len(self.keys), self.keys, nb_shards=7, num_thread=num_thread, gamma=1.5, backend="native")
+            self.assertEqual([nat.lookup(k) for k in self.keys], expected)
+        self.assertEqual(list(nat.lookup_many(array("Q", self.keys))), list(py.lookup_many(array("Q", self.keys))))
+        self.assertEqual(nat.nb_shards, 7)
+        self.assertEqual(nat.nbKeys(), len(self.keys))
+
+        path = os.path.join(self.tmpdir.name, "sharded.mphf")
+        for writer, backend in ((py, "native"), (nat, "python")):
+            writer.save(path)
+            back = sharded_mphf.load(path, backend=backend)
+            self.assertEqual([back.lookup(k) for k in self.keys], expected)
+        with open(path, "rb") as f:
+            data = f.read()
+        with open(path, "wb") as f:
+            f.write(data[: len(data) // 2])
+        with self.assertRaises(ValueError):
+            sharded_mphf.load(path, backend="native")
+        self.assertEqual(sharded_mphf().lookup(42), -1)
+
+    def test_overlay(self):
+        """Native overlays match the pure-Python ones after appends, files load in both, compaction runs in the background."""
+        overlays = []
+        for backend in ("python", "native"):
+            overlay = overlay_mphf(1500, self.keys[:1500], fingerprint_bits=3, backend=backend)
+            overlay.append(300, self.keys[1500:1800])
+            overlay.append(200, self.keys[1800:], num_thread=2)
+            overlays.append(overlay)
+        py, nat = overlays
+        expected = [py.lookup(k) for k in self.keys]
+        self.assertEqual(sorted(expected), list(range(len(self.keys))))
+        self.assertEqual([nat.lookup(k) for k in self.keys], expected)
+        self.assertEqual(list(nat.lookup_many(array("Q", self.keys))), expected)
+        self.assertEqual((nat.nb_segments, nat.nb_overrides, nat.base_keys), (py.nb_segments, py.nb_overrides, 1500))
+        self.assertGreater(nat.nb_overrides, 0)
+
+        path = os.path.join(self.tmpdir.name, "overlay.mphf")
+        for writer, backend in ((py, "native"), (nat, "python")):
+            writer.save(path)
+            back = overlay_mphf.load(path, backend=backend)
+            self.assertEqual([back.lookup(k) for k in self.keys], expected)
+
+        future = nat.compact_async(len(self.keys), self.keys, num_thread=2)
+        self.assertEqual(nat.lookup(self.keys[-1]), expected[-1])
+        compacted = future.result()
+        self.assertEqual(compacted.nb_segments, 1)
+        self.assertEqual(sorted(compacted.lookup(k) for k in self.keys), list(range(len(self.keys))))
+        self.assertFalse(compacted.should_compact())
+        with self.assertRaises(ValueError):
+            nat.compact(10, self.keys[:10])
+        self.assertEqual(overlay_mphf().lookup(42), -1)
+
+        # appends from one thread while others look up the keys already in
+        grown = overlay_mphf(1500, self.keys[:1500], backend="native")
+        probes = array("Q", self.keys[:1500])
+        before = list(grown.lookup_many(probes))
+        known = set(self.keys)
+        fresh = [k for k in range(1 << 40, (1 << 40) + 2000) if k not in known]
+        results = []
+        stop = threading.Event()
+
+        def reader():
+            while not stop.is_set():
+                results.append(list(grown.lookup_many(probes)) == before)
+
+        readers = [threading.Thread(target=reader) for _ in range(2)]
+        for th in readers:
+            th.start()
+        try:
+            for start in range(0, len(fresh), 200):
+                grown.append(len(fresh[start:start + 200]), fresh[start:start + 200])
+        finally:
+            stop.set()
+            for th in readers:
+                th.join()
+        self.assertTrue(results and all(results))
+        self.assertEqual(sorted(grown.lookup_many(array("Q", self.keys[:1500] + fresh))), list(range(1500 + len(fresh))))
+
+    def test_parallel_save_load(self):
+        path = os.path.join(self.tmpdir.name, "parallel.mphf")
+        nat = mphf(len(self.keys), self.keys, num_thread=2, backend="native")
+        for version in (1, 2):
+            nat.save(path, version=version)
+            with open(path, "rb") as f:
+                expected = f.read()
+            nat.save(path, version=version, num_thread=4)
+            with open(path, "rb") as f:
+                self.assertEqual(f.read(), expected)
+            loaded = mphf.load(path, backend="native", num_thread=4)
+            self.assertEqual(list(loaded.lookup_many(array("Q", self.keys))), list(nat.lookup_many(array("Q", self.keys))))
+            py = mphf.load(path, backend="python", num_thread=4)
+            self.assertEqual(py._final_hash, nat._final_hash)
+
+            with open(path, "wb") as f:
+                f.write(expected[:-8])
+            with self.assertRaises(ValueError):
+                mphf.load(path, backend="native", num_thread=4)
+        with self.assertRaises(OSError):
+            mphf.load(os.path.join(self.tmpdir.name, "missing.mphf"), backend="native", num_thread=4)
+        with self.assertRaises(OSError):
+            nat.save(os.path.join(self.tmpdir.name, "missing", "out.mphf"), num_thread=4)
+
+    def test_parallel_lookup_many(self):
+        queries = array("Q", self.keys * 20 + [k + 1 for k in self.keys])
+        for fingerprint_bits in (0, 8):
+            nat = mphf(len(self.keys), self.keys, num_thread=2, backend="native", fingerprint_bits=fingerprint_bits)
+            expected = list(nat.lookup_many(queries, num_thread=1))
+            for num_thread in (2, 4, 4, 1):
+                self.assertEqual(list(nat.lookup_many(queries, num_thread=num_thread)), expected)
+            self.assertEqual(list(nat.lookup_many(queries)), expected)  # the constructor's num_thread
+            # two forced NUMA nodes, each with a replica
+            os.environ["BBHASH_NUMA_NODES"] = "2"
+            try:
+                self.assertEqual(list(nat.lookup_many(queries, num_thread=4, numa_replicas=True)), expected)
+            finally:
+                del os.environ["BBHASH_NUMA_NODES"]
+        py = mphf(len(self.keys), self.keys, num_thread=4, backend="python")
+        self.assertEqual(list(py.lookup_many(queries[:2000], num_thread=4)), list(py.lookup_many(queries[:2000], num_thread=1)))
+
+    def test_hot_key_cache(self):
+        """Both backends cache the same deep keys, write the same .hot file and keep their lookups."""
+        queries = array("Q", self.keys + [k + 1 for k in self.keys])
+        sample = array("Q", list(queries) + self.keys[:500] * 4)
+        py_path = os.path.join(self.tmpdir.name, "hot_py.mphf")
+        nat_path = os.path.join(self.tmpdir.name, "hot_nat.mphf")
+        py = mphf(len(self.keys), self.keys, gamma=1.0, backend="python")
+        nat = mphf(len(self.keys), self.keys, gamma=1.0, backend="native")
+        expected = list(nat.lookup_many(queries))
+        py.build_hot_cache(sample, slots=256)
+        nat.build_hot_cache(sample, slots=256)
+        stats = nat.hot_cache_stats()
+        self.assertEqual(py.hot_cache_stats(), stats)
+        self.assertEqual(stats["slots"], 256)
+        self.assertGreater(stats["filled"], 0)
+        self.assertEqual(list(nat.lookup_many(queries)), expected)
+        self.assertEqual(list(py.lookup_many(queries)), expected)
+
+        py.save(py_path)
+        nat.save(nat_path, version=2)
+        with open(py_path + ".hot", "rb") as f, open(nat_path + ".hot", "rb") as g:
+            self.assertEqual(f.read(), g.read())
+        for backend in ("native", "python"):
+            for path in (py_path, nat_path):
+                loaded = mphf.load(path, backend=backend)
+                self.assertEqual(loaded.hot_cache_stats(), stats)
+                self.assertEqual(list(loaded.lookup_many(queries)), expected)
+            self.assertEqual(mphf.mmap(nat_path, backend=backend).hot_cache_stats(), stats)
+
+        # a raw access log gives the same cache ; a cache of another mphf is ignored, a corrupt one rejected
+        log_path = os.path.join(self.tmpdir.name, "access.log")
+        with open(log_path, "wb") as f:
+            f.write(sample.tobytes())
+        nat.build_hot_cache(log_path, slots=256)
+        self.assertEqual(nat.hot_cache_stats(), stats)
+        other_path = os.path.join(self.tmpdir.name, "other.mphf")
+        mphf(len(self.keys) - 1, self.keys[1:], gamma=1.0).save(other_path)
+        with open(nat_path + ".hot", "rb") as f:
+            image = f.read()
+        with open(other_path + ".hot", "wb") as f:
+            f.write(image)
+        for backend in ("native", "python"):
+            self.assertEqual(mphf.load(other_path, backend=backend).hot_cache_stats()["slots"], 0)
+        with open(nat_path + ".hot", "wb") as f:
+            f.write(image[:100] + bytes([image[100] ^ 1]) + image[101:])
+        for backend in ("native", "python"):
+            with self.assertRaises(ValueError):
+                mphf.load(nat_path, backend=backend)
+
+        # saving without a cache removes the stale file
+        nat.clear_hot_cache()
+        self.assertEqual(nat.hot_cache_stats()["slots"], 0)
+        nat.save(nat_path, version=2)
+        self.assertFalse(os.path.exists(nat_path + ".hot"))
+        with self.assertRaises(ValueError):
+            nat.build_hot_cache(sample, slots=100)
+        with self.assertRaises(ValueError):
+            py.build_hot_cache(sample, slots=100)
+
+        strings = [f"key-{k}" for k in self.keys]
+        string_sample = strings + strings[:300] * 4
+        py_s = mphf(len(strings), strings, gamma=1.0, backend="python")
+        nat_s = mphf(len(strings), strings, gamma=1.0, backend="native")
+        py_s.build_hot_cache(string_sample, slots=256)
+        nat_s.build_hot_cache(packed_keys.from_keys(string_sample), slots=256)
+        self.assertEqual(py_s.hot_cache_stats(), nat_s.hot_cache_stats())
+        self.assertEqual(list(nat_s.lookup_many(strings)), list(py_s.lookup_many(strings)))
+        self.assertEqual(sorted(nat_s.lookup_many(strings)), list(range(len(strings))))
+
+        # lookups run without the GIL while another thread rebuilds and clears the cache
+        results = []
+        stop = threading.Event()
+
+        def reader():
+            while not stop.is_set():
+                results.append(list(nat.lookup_many(queries)) == expected)
+
+        readers = [threading.Thread(target=reader) for _ in range(2)]
+        for th in readers:
+            th.start()
+        try:
+            for _ in range(20):
+                nat.build_hot_cache(sample, slots=256)
+                nat.clear_hot_cache()
+        finally:
+            stop.set()
+            for th in readers:
+                th.join()
+        self.assertTrue(results and all(results))
+
+    def test_static_map(self):
+        """Native and pure-Python static maps agree, files load and map in both, fingerprints reject other keys."""
+        values = [k % 1000 for k in self.keys]
+        misses = [k + 1 for k in self.keys]
+        maps = [static_map(len(self.keys), self.keys, values, fingerprint_bits=8, backend=backend)
+                for backend in ("python", "native")]
+        py, nat = maps
+        self.assertEqual((nat.value_bits, nat.fingerprint_bits, len(nat)), (10, 8, len(self.keys)))
+        self.assertEqual([nat[k] for k in self.keys], values)
+        self.assertEqual([py[k] for k in self.keys], values)
+        self.assertEqual(list(nat.get_many(array("Q", self.keys))), values)
+        found = nat.get_many(array("Q", misses), default=ULLONG_MAX)
+        self.assertEqual(list(py.get_many(array("Q", misses), default=ULLONG_MAX)), list(found))
+        self.assertLess(sum(v != ULLONG_MAX for v in found), len(misses) // 50)  # 1 in 256 expected
+        self.assertEqual([m in nat for m in misses], [v != ULLONG_MAX for v in found])
+
+        path = os.path.join(self.tmpdir.name, "map.bbm")
+        for writer in maps:
+            writer.save(path)
+            for backend in ("python", "native"):
+                for back in (static_map.load(path, backend=backend), static_map.mmap(path, backend=backend, verify=True)):
+                    self.assertEqual(list(back.get_many(array("Q", self.keys))), values)
+                    self.assertEqual(list(back.get_many(array("Q", misses), default=ULLONG_MAX)), list(found))
+        self.assertEqual(maps[0].totalBitSize(), nat.totalBitSize())
+
+        with open(path, "r+b") as f:
+            f.seek(-1, os.SEEK_END)
+            last = f.read(1)
+            f.seek(-1, os.SEEK_END)
+            f.write(bytes([last[0] ^ 1]))
+        for backend in ("python", "native"):
+            with self.assertRaises(ValueError):
+                static_map.load(path, backend=backend)
+        with self.assertRaises(ValueError):
+            static_map(3, [1, 2, 3], [1, 2, 8], value_bits=3, backend="native")
+        for backend in ("python", "native"):
+            with self.assertRaises(ValueError):
+                static_map(3, [5, 5, 6], [1, 2, 4], value_bits=4, backend=backend)
+            with self.assertRaises(ValueError):
+                static_map(200, list(range(100)) * 2, list(range(200)), value_bits=8, backend=backend)
+        with self.assertRaises(KeyError):
+            static_map()[42]
+
+    def test_level_schedule(self):
+        """Native and pure-Python builds share the scheduled level sizes, v2 files record them, early termination."""
+        builds = [mphf(len(self.keys), self.keys, gamma_schedule=[3.0, 1.5], min_level_keys=20, backend=backend)
+                  for backend in ("python", "native")]
+        py, nat = builds
+        self.assertEqual(py.level_domains, nat.level_domains)
+        self.assertEqual(nat._gamma, 3.0)
+        self.assertLess(nat._nb_levels, 25)
+        self.assertEqual(sorted(nat.lookup(k) for k in self.keys), list(range(len(self.keys))))
+        self.assertEqual([py.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+
+        path = os.path.join(self.tmpdir.name, "scheduled.mphf")
+        for writer in builds:
+            with self.assertRaises(ValueError):
+                writer.save(path)
+            writer.save(path, version=2)
+            for backend in ("python", "native"):
+                for back in (mphf.load(path, backend=backend), mphf.mmap(path, backend=backend, verify=True)):
+                    self.assertEqual(back.level_domains, nat.level_domains)
+                    self.assertEqual([back.lookup(k) for k in self.keys], [nat.lookup(k) for k in self.keys])
+
+        # one gamma (repeated or not) with early termination keeps the BBHash level sizes and the v1 format
+        short = [mphf(len(self.keys), self.keys, gamma_schedule=[2.0, 2.0], min_level_keys=20, backend=backend)
+                 for backend in ("python", "native")]
+        full = mphf(len(self.keys), self.keys, backend="native")
+        self.assertEqual(short[0].level_domains, short[1].level_domains)
+        self.assertEqual(short[1].level_domains[:-1], full.level_domains[:len(short[1].level_domains) - 1])
+        short[1].save(path)
+        self.assertEqual([mphf.load(path, backend="python").lookup(k) for k in self.keys], [short[1].lookup(k) for k in self.keys])
+        with self.assertRaises(ValueError):
+            mphf(len(self.keys), self.keys, gamma_schedule=[2.0, -1.0], backend="native")
+
+    def test_unbuilt_lookup(self):
+        self.assertEqual(mphf().lookup(42), -1)
+
+
+if __name__ == "__main__":
+    unittest.main()